@@ -0,0 +1,236 @@
+#!/usr/bin/perl -w
+
+# Converts access logs written with "log_format ... encoding=binary"
+# to JSON, one object per line.
+#
+# usage: binlog2json.pl [file ...]
+#        zcat access.log.gz | binlog2json.pl
+#
+# Records of formats whose schema was not seen are printed with
+# positional field names, "1", "2", and so on.  Records of unknown
+# types are skipped; on damaged data the input is scanned for the
+# next record which can be parsed.
+
+use warnings;
+use strict;
+
+use constant CHUNK => 65536;
+use constant MAX_RECORD => 1 << 24;
+
+my %schemas;
+
+my ($fh, $name, $buf, $eof, $offset);
+my ($data, $pos, $len);
+
+binmode STDOUT;
+
+if (@ARGV) {
+	for my $file (@ARGV) {
+		open($fh, '<:raw', $file) or die "cannot open $file: $!\n";
+		convert($file);
+		close $fh;
+	}
+
+} else {
+	$fh = \*STDIN;
+	binmode $fh;
+	convert('stdin');
+}
+
+
+sub convert {
+	($name, $buf, $eof, $offset) = (shift, '', 0, 0);
+
+	my $damaged = 0;
+
+	while (fill(1)) {
+		if (!fill(5)) {
+			warn "$name: truncated record at offset $offset\n";
+			last;
+		}
+
+		# a type letter and the length in 4 bytes, padded with
+		# continuation bits
+
+		my ($type, @b) = unpack('aC4', $buf);
+
+		if ($type !~ /^[A-Z]$/
+		    || $b[0] < 0x80 || $b[1] < 0x80 || $b[2] < 0x80 || $b[3] >= 0x80)
+		{
+			$damaged = damaged($damaged);
+			next;
+		}
+
+		my $hlen = 5;
+		my $rlen = ($b[0] & 0x7f) | ($b[1] & 0x7f) << 7
+		           | ($b[2] & 0x7f) << 14 | $b[3] << 21;
+
+		if ($rlen > MAX_RECORD || !fill($hlen + $rlen)) {
+
+			# truncated, or the length is damaged
+
+			$damaged = damaged($damaged);
+			next;
+		}
+
+		if ($type ne 'S' && $type ne 'R') {
+
+			if ($damaged) {
+				$damaged = damaged($damaged);
+				next;
+			}
+
+			# a record of a type from a later version
+
+			consume($hlen + $rlen);
+			next;
+		}
+
+		($data, $pos, $len) = (substr($buf, $hlen, $rlen), 0, $rlen);
+
+		my $out = eval { $type eq 'S' ? schema() : record() };
+
+		if (!defined $out || $pos != $len) {
+			$damaged = damaged($damaged);
+			next;
+		}
+
+		$damaged = 0;
+
+		consume($hlen + $rlen);
+
+		print $out if length $out;
+	}
+}
+
+
+sub fill {
+	my $need = shift;
+
+	while (length $buf < $need && !$eof) {
+		my $n = read($fh, $buf, CHUNK, length $buf);
+
+		die "$name: read failed: $!\n" unless defined $n;
+
+		$eof = 1 if $n == 0;
+	}
+
+	return length $buf >= $need;
+}
+
+sub consume {
+	my $n = shift;
+
+	substr($buf, 0, $n, '');
+	$offset += $n;
+}
+
+sub damaged {
+	my $damaged = shift;
+
+	warn "$name: skipping damaged data at offset $offset\n" unless $damaged;
+
+	consume(1);
+
+	return 1;
+}
+
+
+sub schema {
+	my $id = id();
+	my $name = string();
+	my @fields = map { string() } 1 .. varint();
+
+	$schemas{$id} = { name => $name, fields => \@fields };
+
+	return '';
+}
+
+sub record {
+	my $schema = $schemas{id()};
+	my @out;
+
+	push @out, '"format":' . quote($schema ? $schema->{name} : '');
+
+	my $n = varint();
+
+	for my $i (0 .. $n - 1) {
+		my $name = $schema && defined $schema->{fields}[$i]
+		           ? $schema->{fields}[$i] : $i + 1;
+
+		push @out, quote($name) . ':' . field();
+	}
+
+	return '{' . join(',', @out) . "}\n";
+}
+
+sub id {
+	die "truncated record\n" if $pos + 4 > $len;
+
+	my $id = unpack('N', substr($data, $pos, 4));
+	$pos += 4;
+
+	return $id;
+}
+
+sub varint {
+	my ($n, $shift) = (0, 0);
+
+	while (1) {
+		die "truncated record\n" if $pos >= $len;
+
+		my $b = ord substr($data, $pos++, 1);
+
+		$n += ($b & 0x7f) * 2 ** $shift;
+		$shift += 7;
+
+		return $n if $b < 0x80;
+		die "invalid varint\n" if $shift > 63;
+	}
+}
+
+sub string {
+	my $n = varint();
+
+	die "truncated record\n" if $pos + $n > $len;
+
+	my $s = substr($data, $pos, $n);
+	$pos += $n;
+
+	return $s;
+}
+
+sub field {
+	die "truncated record\n" if $pos >= $len;
+
+	my $type = ord substr($data, $pos++, 1);
+
+	return 'null' if $type == 0;
+	return quote(string()) if $type == 1;
+	return varint() if $type == 2;
+	return sprintf('%.3f', varint() / 1000) if $type == 3 || $type == 4;
+
+	die "unknown field type $type\n";
+}
+
+sub quote {
+	my $s = shift;
+
+	# valid UTF-8 is passed through, other bytes are escaped
+
+	$s =~ s{
+		( [\xc2-\xdf][\x80-\xbf]
+		| \xe0[\xa0-\xbf][\x80-\xbf]
+		| [\xe1-\xec\xee\xef][\x80-\xbf]{2}
+		| \xed[\x80-\x9f][\x80-\xbf]
+		| \xf0[\x90-\xbf][\x80-\xbf]{2}
+		| [\xf1-\xf3][\x80-\xbf]{3}
+		| \xf4[\x80-\x8f][\x80-\xbf]{2} )
+		| (["\\])
+		| ([\x00-\x1f\x7f-\xff])
+	}{
+		defined $1 ? $1 : defined $2 ? "\\$2" : sprintf('\\u%04x', ord $3)
+	}gex;
+
+	return '"' . $s . '"';
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/perl -w
+
+# Measures recoding speed of the charset filter.
+#
+# usage: charsetbench.pl /path/to/nginx [megabytes [requests [port]]]
+#
+# A mostly ASCII document with a Cyrillic letter every 64 bytes is
+# recoded from koi8-r to utf-8 and from utf-8 to windows-1251 by nginx
+# started in a temporary directory, with the maps from the conf
+# directory.  The time of the requests and the MD5 of the response
+# bodies are printed, so results of different builds can be compared.
+
+use warnings;
+use strict;
+
+use FindBin;
+use File::Temp qw/ tempdir /;
+use IO::Socket::INET;
+use Digest::MD5 qw/ md5_hex /;
+use Time::HiRes qw/ time sleep /;
+
+my $nginx = shift or die "usage: $0 nginx [megabytes [requests [port]]]\n";
+my $size = (shift || 8) * 1024 * 1024;
+my $requests = shift || 20;
+my $port = shift || 8099;
+
+my $conf = "$FindBin::Bin/../conf";
+my $dir = tempdir('charsetbench-XXXXXX', TMPDIR => 1, CLEANUP => 1);
+
+mkdir "$dir/$_" or die "mkdir $dir/$_: $!\n" for qw/ logs koi utf /;
+
+document("$dir/koi/index.html", "\xc1");
+document("$dir/utf/index.html", "\xd0\xb0");
+
+open(my $fh, '>', "$dir/nginx.conf") or die "cannot create nginx.conf: $!\n";
+
+print $fh <<"EOF";
+daemon on;
+master_process off;
+pid $dir/nginx.pid;
+error_log $dir/logs/error.log;
+
+events {
+}
+
+http {
+    access_log off;
+
+    include $conf/koi-utf;
+    include $conf/win-utf;
+
+    server {
+        listen 127.0.0.1:$port;
+        root $dir;
+
+        location /koi/ {
+            charset utf-8;
+            source_charset koi8-r;
+        }
+
+        location /utf/ {
+            charset windows-1251;
+            source_charset utf-8;
+        }
+    }
+}
+EOF
+
+close $fh;
+
+system($nginx, '-p', "$dir/", '-c', "$dir/nginx.conf") == 0
+	or die "cannot start $nginx\n";
+
+sleep 0.5;
+
+run('koi8-r to utf-8', '/koi/');
+run('utf-8 to windows-1251', '/utf/');
+
+open($fh, '<', "$dir/nginx.pid") or die "cannot open nginx.pid: $!\n";
+kill 'TERM', <$fh> + 0;
+close $fh;
+
+sleep 0.5;
+
+
+sub document {
+	my ($file, $letter) = @_;
+
+	my $line = 'The quick brown fox jumps over the lazy dog ' . $letter;
+	$line .= ' ' x (63 - length $line) . "\n";
+
+	open(my $fh, '>:raw', $file) or die "cannot create $file: $!\n";
+	print $fh $line x ($size / 64);
+	close $fh;
+}
+
+sub run {
+	my ($name, $uri) = @_;
+
+	my $body = request($uri);
+	my $start = time;
+
+	for (1 .. $requests) {
+		request($uri) eq $body or die "$name: response differs\n";
+	}
+
+	printf("%s: %d requests of %dM in %.2fs, md5 %s\n",
+		$name, $requests, $size / 1024 / 1024, time - $start,
+		md5_hex($body));
+}
+
+sub request {
+	my $uri = shift;
+
+	my $s = IO::Socket::INET->new("127.0.0.1:$port")
+		or die "cannot connect to 127.0.0.1:$port: $!\n";
+
+	binmode $s;
+	print $s "GET $uri HTTP/1.0\r\nHost: localhost\r\n\r\n";
+
+	local $/;
+	my $r = <$s> // '';
+
+	$r =~ s/^.*?\r\n\r\n//s or die "invalid response to $uri\n";
+
+	return $r;
+}
@@ -951,6 +951,7 @@ ngx_conf_open_file(ngx_cycle_t *cycle, ngx_str_t *name)
         file->name = *name;
     }
 
+    file->generation = 0;
     file->flush = NULL;
     file->data = NULL;
 
@@ -1262,6 +1262,8 @@ ngx_close_connection(ngx_connection_t *c)
         return;
     }
 
+    ngx_probe2(connection_close, c->number, c->fd);
+
     if (c->read->timer_set) {
         ngx_del_timer(c->read);
     }
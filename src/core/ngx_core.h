@@ -60,6 +60,7 @@ typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 #include <ngx_parse.h>
 #include <ngx_parse_time.h>
 #include <ngx_log.h>
+#include <ngx_probe.h>
 #include <ngx_alloc.h>
 #include <ngx_palloc.h>
 #include <ngx_buf.h>
@@ -1288,6 +1288,7 @@ ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
         }
 
         file[i].fd = fd;
+        file[i].generation++;
     }
 
     (void) ngx_log_redirect_stderr(cycle);
@@ -10,6 +10,15 @@
 
 
 static ngx_int_t ngx_test_full_name(ngx_str_t *name);
+#if (NGX_HAVE_O_TMPFILE)
+static ngx_uint_t ngx_fd_names_available(ngx_log_t *log);
+static ngx_int_t ngx_ext_link_file(ngx_file_t *file, ngx_str_t *to,
+    ngx_ext_rename_file_t *ext);
+#endif
+#if (NGX_HAVE_FICLONE || NGX_HAVE_COPY_FILE_RANGE)
+static ngx_int_t ngx_copy_file_kernel(ngx_fd_t fd, u_char *from, ngx_fd_t nfd,
+    u_char *to, off_t size, ngx_log_t *log);
+#endif
 
 
 static ngx_atomic_t   temp_number = 0;
@@ -189,6 +198,16 @@ ngx_create_temp_file(ngx_file_t *file, ngx_path_t *path, ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
+#if (NGX_HAVE_O_TMPFILE)
+
+    /* persistent unnamed files are linked by their /proc/self/fd names */
+
+    if (persistent && file->unnamed && !ngx_fd_names_available(file->log)) {
+        file->unnamed = 0;
+    }
+
+#endif
+
     for ( ;; ) {
         (void) ngx_sprintf(p, "%010uD%Z", n);
 
@@ -199,14 +218,46 @@ ngx_create_temp_file(ngx_file_t *file, ngx_path_t *path, ngx_pool_t *pool,
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
                        "hashed path: %s", file->name.data);
 
+#if (NGX_HAVE_O_TMPFILE)
+
+        /*
+         * non-persistent files, as well as persistent ones the caller
+         * is able to link with ngx_ext_rename_temp_file(), are created
+         * without a name, so they never appear in the directory
+         */
+
+        if (!persistent || file->unnamed) {
+            file->fd = ngx_open_unnamed_tempfile(file->name.data, access);
+
+            if (file->fd == NGX_INVALID_FILE
+                && (ngx_errno == NGX_EOPNOTSUPP || ngx_errno == NGX_EISDIR))
+            {
+                /* not supported by the file system */
+
+                file->unnamed = 0;
+                file->fd = ngx_open_tempfile(file->name.data, persistent,
+                                             access);
+
+            } else {
+                file->unnamed = 1;
+            }
+
+        } else {
+            file->fd = ngx_open_tempfile(file->name.data, persistent, access);
+        }
+
+#else
+        file->unnamed = 0;
         file->fd = ngx_open_tempfile(file->name.data, persistent, access);
+#endif
 
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
-                       "temp fd:%d", file->fd);
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, file->log, 0,
+                       "temp fd:%d unnamed:%d", file->fd, file->unnamed);
 
         if (file->fd != NGX_INVALID_FILE) {
 
-            cln->handler = clean ? ngx_pool_delete_file : ngx_pool_cleanup_file;
+            cln->handler = (clean && !file->unnamed) ? ngx_pool_delete_file
+                                                     : ngx_pool_cleanup_file;
             clnf = cln->data;
 
             clnf->fd = file->fd;
@@ -791,6 +842,166 @@ failed:
 }
 
 
+ngx_int_t
+ngx_ext_rename_temp_file(ngx_temp_file_t *tf, ngx_str_t *to,
+    ngx_ext_rename_file_t *ext)
+{
+#if (NGX_HAVE_O_TMPFILE)
+
+    if (tf->file.unnamed) {
+        return ngx_ext_link_file(&tf->file, to, ext);
+    }
+
+#endif
+
+    return ngx_ext_rename_file(&tf->file.name, to, ext);
+}
+
+
+#if (NGX_HAVE_O_TMPFILE)
+
+static ngx_uint_t
+ngx_fd_names_available(ngx_log_t *log)
+{
+    ngx_file_info_t  fi;
+
+    static ngx_int_t  available = -1;
+
+    /* /proc is usually missing in a chroot */
+
+    if (available == -1) {
+        available = (ngx_file_info("/proc/self/fd", &fi) != NGX_FILE_ERROR);
+
+        if (!available) {
+            ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+                          ngx_file_info_n " \"/proc/self/fd\" failed, "
+                          "unnamed temporary files are not used");
+        }
+    }
+
+    return available;
+}
+
+
+static ngx_int_t
+ngx_ext_link_file(ngx_file_t *file, ngx_str_t *to, ngx_ext_rename_file_t *ext)
+{
+    u_char           *name;
+    ngx_err_t         err;
+    ngx_int_t         rc;
+    ngx_copy_file_t   cf;
+    u_char            from[NGX_FD_NAME_LEN];
+
+    /* an unnamed file is only accessible by its descriptor */
+
+    (void) ngx_fd_name(from, file->fd);
+
+    if (ext->access) {
+        if (ngx_change_file_access(from, ext->access) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                          ngx_change_file_access_n " \"%s\" failed",
+                          file->name.data);
+            return NGX_ERROR;
+        }
+    }
+
+    if (ext->time != -1) {
+        if (ngx_set_file_time(from, file->fd, ext->time) != NGX_OK) {
+            ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                          ngx_set_file_time_n " \"%s\" failed",
+                          file->name.data);
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_link_file(from, to->data) != NGX_FILE_ERROR) {
+        return NGX_OK;
+    }
+
+    err = ngx_errno;
+
+    if (err == NGX_ENOPATH && ext->create_path) {
+
+        err = ngx_create_full_path(to->data, ngx_dir_access(ext->path_access));
+
+        if (err) {
+            ngx_log_error(NGX_LOG_CRIT, ext->log, err,
+                          ngx_create_dir_n " \"%s\" failed", to->data);
+            return NGX_ERROR;
+        }
+
+        if (ngx_link_file(from, to->data) != NGX_FILE_ERROR) {
+            return NGX_OK;
+        }
+
+        err = ngx_errno;
+    }
+
+    if (err != NGX_EEXIST_FILE && err != NGX_EXDEV) {
+        ngx_log_error(NGX_LOG_CRIT, ext->log, err,
+                      ngx_link_file_n " \"%s\" to \"%s\" failed",
+                      file->name.data, to->data);
+        return NGX_ERROR;
+    }
+
+    /*
+     * an existing file is replaced atomically with rename(),
+     * and a file on another file system is copied first
+     */
+
+    name = ngx_alloc(to->len + 1 + 10 + 1, ext->log);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_sprintf(name, "%*s.%010uD%Z", to->len, to->data,
+                       (uint32_t) ngx_next_temp_number(0));
+
+    if (err == NGX_EEXIST_FILE) {
+        rc = NGX_OK;
+
+        if (ngx_link_file(from, name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                          ngx_link_file_n " \"%s\" to \"%s\" failed",
+                          file->name.data, name);
+            rc = NGX_ERROR;
+        }
+
+    } else {
+        cf.size = -1;
+        cf.buf_size = 0;
+        cf.access = ext->access;
+        cf.time = ext->time;
+        cf.log = ext->log;
+
+        rc = ngx_copy_file(from, name, &cf);
+    }
+
+    if (rc == NGX_OK) {
+
+        if (ngx_rename_file(name, to->data) != NGX_FILE_ERROR) {
+            ngx_free(name);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      name, to->data);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    ngx_free(name);
+
+    return NGX_ERROR;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_copy_file(u_char *from, u_char *to, ngx_copy_file_t *cf)
 {
@@ -834,23 +1045,42 @@ ngx_copy_file(u_char *from, u_char *to, ngx_copy_file_t *cf)
         time = (cf->time != -1) ? cf->time : ngx_file_mtime(&fi);
     }
 
-    len = cf->buf_size ? cf->buf_size : 65536;
+    nfd = ngx_open_file(to, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, access);
 
-    if ((off_t) len > size) {
-        len = (size_t) size;
+    if (nfd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, cf->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", to);
+        goto failed;
     }
 
-    buf = ngx_alloc(len, cf->log);
-    if (buf == NULL) {
+#if (NGX_HAVE_FICLONE || NGX_HAVE_COPY_FILE_RANGE)
+
+    switch (ngx_copy_file_kernel(fd, from, nfd, to, size, cf->log)) {
+
+    case NGX_OK:
+        size = 0;
+        break;
+
+    case NGX_DECLINED:
+        break;
+
+    default: /* NGX_ERROR */
         goto failed;
     }
 
-    nfd = ngx_open_file(to, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, access);
+#endif
 
-    if (nfd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_CRIT, cf->log, ngx_errno,
-                      ngx_open_file_n " \"%s\" failed", to);
-        goto failed;
+    len = cf->buf_size ? cf->buf_size : 65536;
+
+    if ((off_t) len > size) {
+        len = (size_t) size;
+    }
+
+    if (len) {
+        buf = ngx_alloc(len, cf->log);
+        if (buf == NULL) {
+            goto failed;
+        }
     }
 
     while (size > 0) {
@@ -924,6 +1154,92 @@ failed:
 }
 
 
+#if (NGX_HAVE_FICLONE || NGX_HAVE_COPY_FILE_RANGE)
+
+static ngx_int_t
+ngx_copy_file_kernel(ngx_fd_t fd, u_char *from, ngx_fd_t nfd, u_char *to,
+    off_t size, ngx_log_t *log)
+{
+#if (NGX_HAVE_COPY_FILE_RANGE)
+    off_t      copied;
+    ssize_t    n;
+    ngx_err_t  err;
+#endif
+
+#if (NGX_HAVE_FICLONE)
+
+    /*
+     * a clone shares data blocks with the source file until either
+     * is modified, cf->size is expected to be the size of the whole file
+     */
+
+    if (ngx_clone_file(fd, nfd) != -1) {
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "file \"%s\" cloned to \"%s\"", from, to);
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, ngx_errno,
+                   ngx_clone_file_n " \"%s\" failed", to);
+
+#endif
+
+#if (NGX_HAVE_COPY_FILE_RANGE)
+
+    /* data are copied within the kernel, or by the file system itself */
+
+    copied = 0;
+
+    while (size > 0) {
+
+        n = ngx_copy_file_range(fd, nfd,
+                                (size_t) ngx_min(size, NGX_MAX_INT32_VALUE));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (copied == 0
+                && (err == NGX_EXDEV || err == NGX_ENOSYS
+                    || err == NGX_EINVAL || err == NGX_EOPNOTSUPP))
+            {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, err,
+                               ngx_copy_file_range_n " \"%s\" failed", to);
+                return NGX_DECLINED;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, log, err,
+                          ngx_copy_file_range_n " \"%s\" to \"%s\" failed",
+                          from, to);
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          ngx_copy_file_range_n " has copied only %O of %O "
+                          "from %s", copied, copied + size, from);
+            return NGX_ERROR;
+        }
+
+        copied += n;
+        size -= n;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                   "file \"%s\" copied to \"%s\" in kernel: %O",
+                   from, to, copied);
+
+    return NGX_OK;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+#endif
+
+
 /*
  * ctx->init_handler() - see ctx->alloc
  * ctx->file_handler() - file handler
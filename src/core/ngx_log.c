@@ -651,6 +651,12 @@ ngx_log_set_log(ngx_conf_t *cf, ngx_log_t **head)
             return NGX_CONF_ERROR;
         }
 
+        if (peer->start) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "error logs to syslog cannot be buffered");
+            return NGX_CONF_ERROR;
+        }
+
         new_log->writer = ngx_syslog_writer;
         new_log->wdata = peer;
 
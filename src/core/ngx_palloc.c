@@ -32,6 +32,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 
     size = size - sizeof(ngx_pool_t);
     p->max = (size < NGX_MAX_ALLOC_FROM_POOL) ? size : NGX_MAX_ALLOC_FROM_POOL;
+    p->allocated = 0;
 
     p->current = p;
     p->chain = NULL;
@@ -113,6 +114,7 @@ ngx_reset_pool(ngx_pool_t *pool)
         p->d.failed = 0;
     }
 
+    pool->allocated = 0;
     pool->current = pool;
     pool->chain = NULL;
     pool->large = NULL;
@@ -122,6 +124,8 @@ ngx_reset_pool(ngx_pool_t *pool)
 void *
 ngx_palloc(ngx_pool_t *pool, size_t size)
 {
+    pool->allocated += size;
+
 #if !(NGX_DEBUG_PALLOC)
     if (size <= pool->max) {
         return ngx_palloc_small(pool, size, 1);
@@ -135,6 +139,8 @@ ngx_palloc(ngx_pool_t *pool, size_t size)
 void *
 ngx_pnalloc(ngx_pool_t *pool, size_t size)
 {
+    pool->allocated += size;
+
 #if !(NGX_DEBUG_PALLOC)
     if (size <= pool->max) {
         return ngx_palloc_small(pool, size, 0);
@@ -255,6 +261,8 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     void              *p;
     ngx_pool_large_t  *large;
 
+    pool->allocated += size;
+
     p = ngx_memalign(alignment, size, pool->log);
     if (p == NULL) {
         return NULL;
@@ -0,0 +1,54 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_PROBE_H_INCLUDED_
+#define _NGX_PROBE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * USDT probes of the "nginx" provider, e.g. for bpftrace:
+ *
+ *     usdt:/path/to/nginx:nginx:http_request_finish { ... }
+ *
+ * a probe is a single nop instruction until a tracer attaches to it,
+ * so arguments should be limited to values which are at hand
+ */
+
+#if (NGX_HAVE_USDT)
+
+#include <sys/sdt.h>
+
+#define ngx_probe0(name)                                                      \
+    DTRACE_PROBE(nginx, name)
+
+#define ngx_probe1(name, arg1)                                                \
+    DTRACE_PROBE1(nginx, name, arg1)
+
+#define ngx_probe2(name, arg1, arg2)                                          \
+    DTRACE_PROBE2(nginx, name, arg1, arg2)
+
+#define ngx_probe3(name, arg1, arg2, arg3)                                    \
+    DTRACE_PROBE3(nginx, name, arg1, arg2, arg3)
+
+#define ngx_probe4(name, arg1, arg2, arg3, arg4)                              \
+    DTRACE_PROBE4(nginx, name, arg1, arg2, arg3, arg4)
+
+#else /* !NGX_HAVE_USDT */
+
+#define ngx_probe0(name)
+#define ngx_probe1(name, arg1)
+#define ngx_probe2(name, arg1, arg2)
+#define ngx_probe3(name, arg1, arg2, arg3)
+#define ngx_probe4(name, arg1, arg2, arg3, arg4)
+
+#endif
+
+
+#endif /* _NGX_PROBE_H_INCLUDED_ */
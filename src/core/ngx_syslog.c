@@ -14,9 +14,18 @@
     + (NGX_MAXHOSTNAMELEN - 1) + 1 /* space */                                \
     + 32 /* tag */ + 2 /* colon, space */
 
+#define NGX_SYSLOG_BATCH  64
+
 
 static char *ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer);
 static ngx_int_t ngx_syslog_init_peer(ngx_syslog_peer_t *peer);
+static ssize_t ngx_syslog_send_buf(ngx_syslog_peer_t *peer, u_char *buf,
+    size_t len);
+static ngx_int_t ngx_syslog_send_batch(ngx_syslog_peer_t *peer);
+static void ngx_syslog_flush(ngx_syslog_peer_t *peer);
+static void ngx_syslog_sent(ngx_syslog_peer_t *peer, size_t size);
+static void ngx_syslog_flush_handler(ngx_event_t *ev);
+static void ngx_syslog_close(ngx_syslog_peer_t *peer);
 static void ngx_syslog_cleanup(void *data);
 static u_char *ngx_syslog_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
@@ -67,6 +76,32 @@ ngx_syslog_process_conf(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
         ngx_str_set(&peer->tag, "nginx");
     }
 
+    if (peer->start) {
+        if (peer->flush == 0) {
+            peer->flush = 1000;
+        }
+
+        peer->lens = ngx_palloc(cf->pool, NGX_SYSLOG_BATCH * sizeof(size_t));
+        if (peer->lens == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+        if (peer->event == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->event->handler = ngx_syslog_flush_handler;
+        peer->event->data = peer;
+        peer->event->log = &cf->cycle->new_log;
+        peer->event->cancelable = 1;
+
+    } else if (peer->flush) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "syslog \"flush\" requires \"buffer\"");
+        return NGX_CONF_ERROR;
+    }
+
     peer->hostname = &cf->cycle->hostname;
     peer->logp = &cf->cycle->new_log;
 
@@ -94,9 +129,11 @@ ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
 {
     u_char      *p, *comma, c;
     size_t       len;
-    ngx_str_t   *value;
+    ssize_t      size;
+    ngx_str_t   *value, s;
     ngx_url_t    u;
     ngx_uint_t   i;
+    ngx_msec_t   flush;
 
     value = cf->args->elts;
 
@@ -212,6 +249,57 @@ ngx_syslog_parse_args(ngx_conf_t *cf, ngx_syslog_peer_t *peer)
             peer->tag.data = p + 4;
             peer->tag.len = len - 4;
 
+        } else if (ngx_strncmp(p, "buffer=", 7) == 0) {
+
+            if (peer->start != NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate syslog \"buffer\"");
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = len - 7;
+            s.data = p + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid syslog buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            peer->start = ngx_palloc(cf->pool, size);
+            if (peer->start == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            peer->pos = peer->start;
+            peer->last = peer->start + size;
+
+        } else if (ngx_strncmp(p, "flush=", 6) == 0) {
+
+            if (peer->flush != 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate syslog \"flush\"");
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = len - 6;
+            s.data = p + 6;
+
+            flush = ngx_parse_time(&s, 0);
+
+            if (flush == (ngx_msec_t) NGX_ERROR || flush == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid syslog flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            peer->flush = flush;
+
+        } else if (len == 3 && ngx_strncmp(p, "tcp", 3) == 0) {
+            peer->tcp = 1;
+
         } else if (len == 10 && ngx_strncmp(p, "nohostname", 10) == 0) {
             peer->nohostname = 1;
 
@@ -288,6 +376,8 @@ ngx_syslog_writer(ngx_log_t *log, ngx_uint_t level, u_char *buf,
 ssize_t
 ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
 {
+    u_char  *p, prefix[NGX_SIZE_T_LEN + 1];
+    size_t   size;
     ssize_t  n;
 
     if (peer->log.handler == NULL) {
@@ -297,40 +387,348 @@ ngx_syslog_send(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
         peer->log.action = "logging to syslog";
     }
 
+    if (peer->start) {
+
+        /* octet counting framing, RFC 6587 */
+        size = peer->tcp ? NGX_SIZE_T_LEN + 1 + len : len;
+
+        if (size > (size_t) (peer->last - peer->pos)
+            || (!peer->tcp && peer->nmsgs == NGX_SYSLOG_BATCH))
+        {
+            ngx_syslog_flush(peer);
+        }
+
+        if (size <= (size_t) (peer->last - peer->pos)
+            && (peer->tcp || peer->nmsgs < NGX_SYSLOG_BATCH))
+        {
+            if (peer->pos == peer->start) {
+                ngx_add_timer(peer->event, peer->flush);
+            }
+
+            p = peer->pos;
+
+            if (peer->tcp) {
+                p = ngx_sprintf(p, "%uz ", len);
+            }
+
+            p = ngx_cpymem(p, buf, len);
+
+            if (!peer->tcp) {
+                peer->lens[peer->nmsgs] = len;
+            }
+
+            peer->nmsgs++;
+            peer->pos = p;
+
+            return len;
+        }
+
+        if (peer->pos != peer->start
+            || size <= (size_t) (peer->last - peer->start))
+        {
+            /* the connection is stalled */
+            peer->dropped++;
+            return len;
+        }
+
+        /* the message is larger than the buffer, send it as is */
+    }
+
     if (peer->conn.fd == (ngx_socket_t) -1) {
         if (ngx_syslog_init_peer(peer) != NGX_OK) {
             return NGX_ERROR;
         }
     }
 
-    if (ngx_send) {
-        n = ngx_send(&peer->conn, buf, len);
+    if (peer->tcp) {
+        size = ngx_sprintf(prefix, "%uz ", len) - prefix;
+
+        n = ngx_syslog_send_buf(peer, prefix, size);
+
+        if (n == (ssize_t) size) {
+            n = ngx_syslog_send_buf(peer, buf, len);
+
+            if (n != NGX_ERROR && n != (ssize_t) len) {
+                /* the framing is broken, reconnect */
+                ngx_syslog_close(peer);
+            }
+
+        } else if (n > 0) {
+            ngx_syslog_close(peer);
+            n = 0;
+        }
 
     } else {
-        /* event module has not yet set ngx_io */
-        n = ngx_os_io.send(&peer->conn, buf, len);
+        n = ngx_syslog_send_buf(peer, buf, len);
+    }
+
+    if (n == NGX_AGAIN) {
+        n = 0;
     }
 
     if (n == NGX_ERROR) {
+        ngx_syslog_close(peer);
+    }
+
+    return n;
+}
+
+
+static ssize_t
+ngx_syslog_send_buf(ngx_syslog_peer_t *peer, u_char *buf, size_t len)
+{
+    if (ngx_send) {
+        return ngx_send(&peer->conn, buf, len);
+    }
+
+    /* event module has not yet set ngx_io */
+    return ngx_os_io.send(&peer->conn, buf, len);
+}
+
+
+static ngx_int_t
+ngx_syslog_send_batch(ngx_syslog_peer_t *peer)
+{
+    u_char          *p;
+    ngx_uint_t       i;
 
-        if (ngx_close_socket(peer->conn.fd) == -1) {
-            ngx_log_error(NGX_LOG_ALERT, &peer->log, ngx_socket_errno,
-                          ngx_close_socket_n " failed");
+#if (NGX_HAVE_SENDMMSG)
+    int              n;
+    ngx_err_t        err;
+    ngx_uint_t       refused;
+    struct iovec     iovs[NGX_SYSLOG_BATCH];
+    struct mmsghdr   msgs[NGX_SYSLOG_BATCH];
+
+    p = peer->start;
+
+    for (i = 0; i < peer->nmsgs; i++) {
+        iovs[i].iov_base = p;
+        iovs[i].iov_len = peer->lens[i];
+
+        ngx_memzero(&msgs[i], sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        p += peer->lens[i];
+    }
+
+    i = 0;
+    refused = 0;
+
+    while (i < peer->nmsgs) {
+        n = sendmmsg(peer->conn.fd, &msgs[i], peer->nmsgs - i, 0);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, &peer->log, 0,
+                       "sendmmsg: %d of %ui", n, peer->nmsgs - i);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_ECONNREFUSED && !refused) {
+
+                /*
+                 * the error may be left from one of the previous batches,
+                 * the server may be up again
+                 */
+
+                refused = 1;
+                continue;
+            }
+
+            (void) ngx_connection_error(&peer->conn, err, "sendmmsg() failed");
+
+            peer->dropped += peer->nmsgs - i;
+            return NGX_ERROR;
         }
 
-        peer->conn.fd = (ngx_socket_t) -1;
+        i += n;
     }
 
-    return n;
+#else
+    ssize_t          n;
+
+    p = peer->start;
+
+    for (i = 0; i < peer->nmsgs; i++) {
+        n = ngx_syslog_send_buf(peer, p, peer->lens[i]);
+
+        if (n == NGX_ERROR) {
+            peer->dropped += peer->nmsgs - i;
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            peer->dropped++;
+        }
+
+        p += peer->lens[i];
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_syslog_flush(ngx_syslog_peer_t *peer)
+{
+    u_char   c;
+    size_t   size;
+    ssize_t  n;
+
+    if (peer->event->timer_set) {
+        ngx_del_timer(peer->event);
+    }
+
+    if (peer->pos == peer->start) {
+        goto done;
+    }
+
+    if (peer->tcp && peer->conn.fd != (ngx_socket_t) -1) {
+
+        /* a write to a connection closed by the server succeeds once */
+
+        n = recv(peer->conn.fd, (char *) &c, 1, MSG_PEEK);
+
+        if (n == 0 || (n == -1 && ngx_socket_errno != NGX_EAGAIN)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_CORE, &peer->log, 0,
+                           "syslog connection is closed");
+
+            ngx_syslog_close(peer);
+        }
+    }
+
+    if (peer->conn.fd == (ngx_socket_t) -1) {
+        if (ngx_syslog_init_peer(peer) != NGX_OK) {
+            peer->dropped += peer->nmsgs;
+            goto reset;
+        }
+    }
+
+    if (!peer->tcp) {
+        if (ngx_syslog_send_batch(peer) == NGX_ERROR) {
+            ngx_syslog_close(peer);
+        }
+
+        goto reset;
+    }
+
+    size = peer->pos - peer->start;
+
+    n = ngx_syslog_send_buf(peer, peer->start, size);
+
+    if (n == NGX_ERROR) {
+        ngx_syslog_close(peer);
+        peer->dropped += peer->nmsgs;
+        goto reset;
+    }
+
+    if (n == NGX_AGAIN) {
+        n = 0;
+    }
+
+    if ((size_t) n < size) {
+
+        /* keep the rest until the socket becomes writable */
+
+        ngx_syslog_sent(peer, n);
+
+        ngx_add_timer(peer->event, peer->flush);
+
+        goto done;
+    }
+
+reset:
+
+    peer->pos = peer->start;
+    peer->nmsgs = 0;
+    peer->partial = 0;
+
+done:
+
+    if (peer->dropped) {
+        ngx_log_error(NGX_LOG_WARN, &peer->log, 0,
+                      "%ui messages to syslog were dropped", peer->dropped);
+        peer->dropped = 0;
+    }
+}
+
+
+static void
+ngx_syslog_sent(ngx_syslog_peer_t *peer, size_t size)
+{
+    u_char  *p, *last;
+    size_t   len;
+
+    p = peer->start;
+    last = peer->start + size;
+
+    if (peer->partial) {
+        len = ngx_min(peer->partial, size);
+
+        p += len;
+        peer->partial -= len;
+
+        if (peer->partial == 0) {
+            peer->nmsgs--;
+        }
+    }
+
+    /* frames are prefixed with the message length and a space */
+
+    while (p < last) {
+
+        for (len = 0; *p != ' '; p++) {
+            len = len * 10 + (*p - '0');
+        }
+
+        p += 1 + len;
+
+        if (p > last) {
+            peer->partial = p - last;
+            break;
+        }
+
+        peer->nmsgs--;
+    }
+
+    peer->pos = ngx_movemem(peer->start, last, peer->pos - last);
+}
+
+
+static void
+ngx_syslog_flush_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "syslog flush");
+
+    ngx_syslog_flush(ev->data);
 }
 
 
 static ngx_int_t
 ngx_syslog_init_peer(ngx_syslog_peer_t *peer)
 {
+    ngx_err_t     err;
     ngx_socket_t  fd;
 
-    fd = ngx_socket(peer->server.sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (peer->tcp) {
+
+        /* do not try to reconnect more often than once a second */
+
+        if (peer->connect_time == ngx_time()) {
+            return NGX_ERROR;
+        }
+
+        peer->connect_time = ngx_time();
+    }
+
+    fd = ngx_socket(peer->server.sockaddr->sa_family,
+                    peer->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
     if (fd == (ngx_socket_t) -1) {
         ngx_log_error(NGX_LOG_ALERT, &peer->log, ngx_socket_errno,
                       ngx_socket_n " failed");
@@ -344,15 +742,20 @@ ngx_syslog_init_peer(ngx_syslog_peer_t *peer)
     }
 
     if (connect(fd, peer->server.sockaddr, peer->server.socklen) == -1) {
-        ngx_log_error(NGX_LOG_ALERT, &peer->log, ngx_socket_errno,
-                      "connect() failed");
-        goto failed;
+        err = ngx_socket_errno;
+
+        if (!peer->tcp || err != NGX_EINPROGRESS) {
+            ngx_log_error(NGX_LOG_ALERT, &peer->log, err, "connect() failed");
+            goto failed;
+        }
+
+        /* sends fail with EAGAIN until the connection is established */
     }
 
     peer->conn.fd = fd;
     peer->conn.log = &peer->log;
 
-    /* UDP sockets are always ready to write */
+    /* UDP sockets are always ready to write, TCP ones are just tried */
     peer->conn.write->ready = 1;
 
     return NGX_OK;
@@ -369,13 +772,8 @@ failed:
 
 
 static void
-ngx_syslog_cleanup(void *data)
+ngx_syslog_close(ngx_syslog_peer_t *peer)
 {
-    ngx_syslog_peer_t  *peer = data;
-
-    /* prevents further use of this peer */
-    peer->busy = 1;
-
     if (peer->conn.fd == (ngx_socket_t) -1) {
         return;
     }
@@ -384,6 +782,36 @@ ngx_syslog_cleanup(void *data)
         ngx_log_error(NGX_LOG_ALERT, &peer->log, ngx_socket_errno,
                       ngx_close_socket_n " failed");
     }
+
+    peer->conn.fd = (ngx_socket_t) -1;
+
+    if (peer->partial) {
+
+        /* the rest of a frame cannot be sent over another connection */
+
+        peer->pos = ngx_movemem(peer->start, peer->start + peer->partial,
+                                peer->pos - peer->start - peer->partial);
+
+        peer->partial = 0;
+        peer->nmsgs--;
+        peer->dropped++;
+    }
+}
+
+
+static void
+ngx_syslog_cleanup(void *data)
+{
+    ngx_syslog_peer_t  *peer = data;
+
+    if (peer->start && peer->pos != peer->start) {
+        ngx_syslog_flush(peer);
+    }
+
+    /* prevents further use of this peer */
+    peer->busy = 1;
+
+    ngx_syslog_close(peer);
 }
 
 
@@ -21,8 +21,25 @@ typedef struct {
     ngx_log_t          log;
     ngx_log_t         *logp;
 
+    u_char            *start;
+    u_char            *pos;
+    u_char            *last;
+
+    size_t            *lens;
+    ngx_uint_t         nmsgs;
+
+    /* the rest of a frame partially sent over the connection */
+    size_t             partial;
+    ngx_uint_t         dropped;
+
+    ngx_msec_t         flush;
+    ngx_event_t       *event;
+
+    time_t             connect_time;
+
     unsigned           busy:1;
     unsigned           nohostname:1;
+    unsigned           tcp:1;
 } ngx_syslog_peer_t;
 
 
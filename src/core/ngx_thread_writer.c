@@ -0,0 +1,365 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_writer.h>
+
+
+typedef struct {
+    ngx_thread_writer_t  *writer;
+    u_char               *start;
+    size_t                len;
+    ngx_fd_t              fd;
+    ssize_t               n;
+    ngx_err_t             err;
+    ngx_thread_task_t    *next;
+} ngx_thread_writer_ctx_t;
+
+
+static ngx_thread_task_t *ngx_thread_writer_task(ngx_thread_writer_t *tw);
+static void ngx_thread_writer_next(ngx_thread_writer_t *tw, ngx_log_t *log);
+static void ngx_thread_writer_handler(void *data, ngx_log_t *log);
+static void ngx_thread_writer_event_handler(ngx_event_t *ev);
+static void ngx_thread_writer_done(ngx_thread_writer_t *tw,
+    ngx_thread_task_t *task, ngx_log_t *log);
+static void ngx_thread_writer_error(ngx_thread_writer_t *tw, ssize_t n,
+    ngx_err_t err, size_t len, ngx_log_t *log);
+
+
+ngx_thread_writer_t *
+ngx_thread_writer_create(ngx_conf_t *cf, ngx_open_file_t *file,
+    ngx_thread_pool_t *tp, size_t size, ngx_uint_t n)
+{
+    ngx_thread_task_t    *task;
+    ngx_thread_writer_t  *tw;
+
+    tw = ngx_pcalloc(cf->pool, sizeof(ngx_thread_writer_t));
+    if (tw == NULL) {
+        return NULL;
+    }
+
+    tw->file = file;
+    tw->thread_pool = tp;
+    tw->pool = cf->pool;
+    tw->log = &cf->cycle->new_log;
+    tw->size = size;
+
+    while (n--) {
+        task = ngx_thread_writer_task(tw);
+        if (task == NULL) {
+            return NULL;
+        }
+
+        task->next = tw->free;
+        tw->free = task;
+    }
+
+    return tw;
+}
+
+
+static ngx_thread_task_t *
+ngx_thread_writer_task(ngx_thread_writer_t *tw)
+{
+    ngx_thread_task_t        *task;
+    ngx_thread_writer_ctx_t  *ctx;
+
+    task = ngx_thread_task_alloc(tw->pool, sizeof(ngx_thread_writer_ctx_t));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    ctx = task->ctx;
+
+    ctx->writer = tw;
+    ctx->start = ngx_pnalloc(tw->pool, tw->size);
+    if (ctx->start == NULL) {
+        return NULL;
+    }
+
+    task->handler = ngx_thread_writer_handler;
+    task->event.handler = ngx_thread_writer_event_handler;
+    task->event.data = task;
+    task->event.log = tw->log;
+
+    return task;
+}
+
+
+/*
+ * the buffer is handed over to be written in a thread, and a free buffer
+ * of the same size is returned in "next"; if all buffers are busy,
+ * another one is allocated if "queue" is set, or NGX_BUSY is returned
+ */
+
+ngx_int_t
+ngx_thread_writer_post(ngx_thread_writer_t *tw, u_char *buf, size_t len,
+    u_char **next, ngx_uint_t queue, ngx_log_t *log)
+{
+    ssize_t                   n;
+    ngx_fd_t                  fd;
+    ngx_thread_task_t        *task;
+    ngx_thread_writer_ctx_t  *ctx;
+
+    task = tw->free;
+
+    if (task == NULL) {
+
+        if (!queue) {
+            return NGX_BUSY;
+        }
+
+        /* buffers are added as needed, and are reused afterwards */
+
+        task = ngx_thread_writer_task(tw);
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                       "thread writer buffer added: \"%s\"",
+                       tw->file->name.data);
+
+    } else {
+        tw->free = task->next;
+    }
+
+    /*
+     * the descriptor is duplicated as the file may be reopened
+     * or closed while the buffer is being written
+     */
+
+    fd = dup(tw->file->fd);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "dup() \"%s\" failed", tw->file->name.data);
+
+        task->next = tw->free;
+        tw->free = task;
+
+        if (!ngx_thread_writer_idle(tw)) {
+            return NGX_ERROR;
+        }
+
+        /* nothing is being written, so the order is kept */
+
+        n = tw->write(tw->file->fd, buf, len, tw->data, log);
+
+        if (n != (ssize_t) len) {
+            ngx_thread_writer_error(tw, n, (n == -1) ? ngx_errno : 0, len,
+                                    log);
+        }
+
+        *next = buf;
+
+        return NGX_OK;
+    }
+
+    ctx = task->ctx;
+
+    *next = ctx->start;
+
+    ctx->start = buf;
+    ctx->len = len;
+    ctx->fd = fd;
+    ctx->next = NULL;
+
+    if (tw->queue) {
+        ((ngx_thread_writer_ctx_t *) tw->tail->ctx)->next = task;
+
+    } else {
+        tw->queue = task;
+    }
+
+    tw->tail = task;
+
+    ngx_thread_writer_next(tw, log);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_writer_next(ngx_thread_writer_t *tw, ngx_log_t *log)
+{
+    ngx_thread_task_t        *task;
+    ngx_thread_writer_ctx_t  *ctx;
+
+    /* the buffers are written one by one to keep the lines in order */
+
+    while (tw->queue && !tw->busy) {
+
+        task = tw->queue;
+
+        if (ngx_thread_task_post(tw->thread_pool, task) == NGX_OK) {
+            tw->busy = 1;
+            return;
+        }
+
+        /* the thread pool queue is full, the buffer is written here */
+
+        ctx = task->ctx;
+        tw->queue = ctx->next;
+
+        ngx_thread_writer_handler(ctx, log);
+        ngx_thread_writer_done(tw, task, log);
+    }
+}
+
+
+static void
+ngx_thread_writer_handler(void *data, ngx_log_t *log)
+{
+    ngx_thread_writer_ctx_t *ctx = data;
+
+    ngx_thread_writer_t  *tw;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "thread writer handler: %uz", ctx->len);
+
+    tw = ctx->writer;
+
+    ctx->n = tw->write(ctx->fd, ctx->start, ctx->len, tw->data, log);
+    ctx->err = (ctx->n == -1) ? ngx_errno : 0;
+}
+
+
+static void
+ngx_thread_writer_event_handler(ngx_event_t *ev)
+{
+    time_t                    now;
+    ngx_thread_task_t        *task;
+    ngx_thread_writer_t      *tw;
+    ngx_thread_writer_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+    tw = ctx->writer;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                   "thread writer done: %z", ctx->n);
+
+    /* the task written is the first one in the queue */
+
+    tw->queue = ctx->next;
+    tw->busy = 0;
+
+    ngx_thread_writer_done(tw, task, ev->log);
+
+    now = ngx_time();
+
+    if (tw->dropped && now - tw->drop_log_time > 59) {
+        ngx_thread_writer_dropped(tw, ev->log);
+        tw->drop_log_time = now;
+    }
+
+    ngx_thread_writer_next(tw, ev->log);
+}
+
+
+static void
+ngx_thread_writer_done(ngx_thread_writer_t *tw, ngx_thread_task_t *task,
+    ngx_log_t *log)
+{
+    ngx_thread_writer_ctx_t  *ctx;
+
+    ctx = task->ctx;
+
+    if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", tw->file->name.data);
+    }
+
+    task->next = tw->free;
+    tw->free = task;
+
+    if (ctx->n != (ssize_t) ctx->len) {
+        ngx_thread_writer_error(tw, ctx->n, ctx->err, ctx->len, log);
+    }
+}
+
+
+static void
+ngx_thread_writer_error(ngx_thread_writer_t *tw, ssize_t n, ngx_err_t err,
+    size_t len, ngx_log_t *log)
+{
+    time_t  now;
+
+    /* errors are logged once a minute */
+
+    now = ngx_time();
+
+    if (now - tw->error_log_time < 60) {
+        return;
+    }
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, err,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      tw->file->name.data);
+
+    } else {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      tw->file->name.data, n, len);
+    }
+
+    tw->error_log_time = now;
+}
+
+
+void
+ngx_thread_writer_exit(ngx_thread_writer_t *tw, ngx_log_t *log)
+{
+    ngx_thread_task_t        *task, *next;
+    ngx_thread_writer_ctx_t  *ctx;
+
+    /*
+     * called once the thread pools are destroyed: the buffer posted
+     * to a thread is written by then, though its completion event
+     * is never handled, and the buffers queued are written here
+     */
+
+    task = tw->queue;
+    tw->queue = NULL;
+
+    if (task && tw->busy) {
+        ctx = task->ctx;
+        next = ctx->next;
+
+        ngx_thread_writer_done(tw, task, log);
+
+        task = next;
+        tw->busy = 0;
+    }
+
+    while (task) {
+        ctx = task->ctx;
+        next = ctx->next;
+
+        ngx_thread_writer_handler(ctx, log);
+        ngx_thread_writer_done(tw, task, log);
+
+        task = next;
+    }
+
+    if (tw->dropped) {
+        ngx_thread_writer_dropped(tw, log);
+    }
+}
+
+
+void
+ngx_thread_writer_dropped(ngx_thread_writer_t *tw, ngx_log_t *log)
+{
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "%ui lines to \"%s\" were dropped, writing is too slow",
+                  tw->dropped, tw->file->name.data);
+
+    tw->dropped = 0;
+}
@@ -0,0 +1,56 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_THREAD_WRITER_H_INCLUDED_
+#define _NGX_THREAD_WRITER_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+typedef struct ngx_thread_writer_s  ngx_thread_writer_t;
+
+typedef ssize_t (*ngx_thread_writer_write_pt)(ngx_fd_t fd, u_char *buf,
+    size_t len, void *data, ngx_log_t *log);
+
+
+struct ngx_thread_writer_s {
+    ngx_open_file_t              *file;
+    ngx_thread_pool_t            *thread_pool;
+    ngx_pool_t                   *pool;
+    ngx_log_t                    *log;
+    size_t                        size;
+
+    ngx_thread_writer_write_pt    write;
+    void                         *data;
+
+    ngx_thread_task_t            *free;
+    ngx_thread_task_t            *queue;
+    ngx_thread_task_t            *tail;
+
+    ngx_uint_t                    dropped;
+    time_t                        drop_log_time;
+    time_t                        error_log_time;
+
+    unsigned                      busy:1;
+};
+
+
+#define ngx_thread_writer_idle(tw)  ((tw)->queue == NULL)
+
+
+ngx_thread_writer_t *ngx_thread_writer_create(ngx_conf_t *cf,
+    ngx_open_file_t *file, ngx_thread_pool_t *tp, size_t size,
+    ngx_uint_t n);
+ngx_int_t ngx_thread_writer_post(ngx_thread_writer_t *tw, u_char *buf,
+    size_t len, u_char **next, ngx_uint_t queue, ngx_log_t *log);
+void ngx_thread_writer_exit(ngx_thread_writer_t *tw, ngx_log_t *log);
+void ngx_thread_writer_dropped(ngx_thread_writer_t *tw, ngx_log_t *log);
+
+
+#endif /* _NGX_THREAD_WRITER_H_INCLUDED_ */
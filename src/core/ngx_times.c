@@ -213,6 +213,57 @@ ngx_monotonic_time(time_t sec, ngx_uint_t msec)
 }
 
 
+uint64_t
+ngx_monotonic_usec(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    /* not CLOCK_MONOTONIC_FAST, its resolution is too low */
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+#endif
+}
+
+
+uint64_t
+ngx_thread_cpu_nsec(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC && defined CLOCK_THREAD_CPUTIME_ID)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+#elif !(NGX_WIN32)
+    struct rusage    ru;
+
+    /* the process CPU time, with the resolution of the scheduler tick */
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1) {
+        return 0;
+    }
+
+    return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000
+           + ((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+
+#else
+    return 0;
+#endif
+}
+
+
 #if !(NGX_WIN32)
 
 void
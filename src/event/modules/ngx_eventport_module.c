@@ -568,7 +568,7 @@ ngx_eventport_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
                     ngx_post_event(rev, queue);
 
                 } else {
-                    rev->handler(rev);
+                    ngx_event_call(rev);
 
                     if (ev->closed || ev->instance != instance) {
                         continue;
@@ -599,7 +599,7 @@ ngx_eventport_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
                     ngx_post_event(wev, &ngx_posted_events);
 
                 } else {
-                    wev->handler(wev);
+                    ngx_event_call(wev);
                 }
             }
 
@@ -607,7 +607,7 @@ ngx_eventport_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
 
         case PORT_SOURCE_USER:
 
-            ev->handler(ev);
+            ngx_event_call(ev);
 
             continue;
 
@@ -155,6 +155,24 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+#if (NGX_THREADS)
+
+    { ngx_string("stall_threshold"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(ngx_event_conf_t, stall_threshold),
+      NULL },
+
+    { ngx_string("stall_backtrace"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, stall_backtrace),
+      NULL },
+
+#endif
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -695,6 +713,20 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         break;
     }
 
+#if (NGX_THREADS)
+
+    if (ecf->stall_threshold
+        && (ngx_process == NGX_PROCESS_WORKER
+            || ngx_process == NGX_PROCESS_SINGLE)
+        && ngx_event_watchdog_init(cycle, ecf->stall_threshold,
+                                   ecf->stall_backtrace)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#endif
+
 #if !(NGX_WIN32)
 
     if (ngx_timer_resolution && !(ngx_event_flags & NGX_USE_TIMER_EVENT)) {
@@ -1271,6 +1303,11 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
     ecf->name = (void *) NGX_CONF_UNSET;
 
+#if (NGX_THREADS)
+    ecf->stall_threshold = NGX_CONF_UNSET_MSEC;
+    ecf->stall_backtrace = NGX_CONF_UNSET;
+#endif
+
 #if (NGX_DEBUG)
 
     if (ngx_array_init(&ecf->debug_connection, cycle->pool, 4,
@@ -1369,5 +1406,10 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
 
+#if (NGX_THREADS)
+    ngx_conf_init_msec_value(ecf->stall_threshold, 0);
+    ngx_conf_init_value(ecf->stall_backtrace, 0);
+#endif
+
     return NGX_CONF_OK;
 }
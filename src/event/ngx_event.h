@@ -437,6 +437,11 @@ typedef struct {
 
     u_char       *name;
 
+#if (NGX_THREADS)
+    ngx_msec_t    stall_threshold;
+    ngx_flag_t    stall_backtrace;
+#endif
+
 #if (NGX_DEBUG)
     ngx_array_t   debug_connection;
 #endif
@@ -525,6 +530,12 @@ ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
 #include <ngx_event_posted.h>
 #include <ngx_event_udp.h>
 
+#if (NGX_THREADS)
+#include <ngx_event_watchdog.h>
+#else
+#define ngx_event_call(ev)  (ev)->handler(ev)
+#endif
+
 #if (NGX_WIN32)
 #include <ngx_iocp_module.h>
 #endif
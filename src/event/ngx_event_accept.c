@@ -310,6 +310,8 @@ ngx_event_accept(ngx_event_t *ev)
         log->data = NULL;
         log->handler = NULL;
 
+        ngx_probe3(connection_accept, c->number, c->fd, c->sockaddr);
+
         ls->handler(c);
 
         if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
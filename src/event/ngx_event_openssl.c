@@ -1659,6 +1659,9 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 
     c->ssl = sc;
 
+    ngx_probe2(ssl_handshake_start, c->number,
+               (flags & NGX_SSL_CLIENT) ? 1 : 0);
+
     return NGX_OK;
 }
 
@@ -1783,6 +1786,8 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
         c->ssl->handshaked = 1;
 
+        ngx_probe2(ssl_handshake_done, c->number, 1);
+
         return NGX_OK;
     }
 
@@ -1824,6 +1829,8 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
+    ngx_probe2(ssl_handshake_done, c->number, 0);
+
     c->ssl->no_wait_shutdown = 1;
     c->ssl->no_send_shutdown = 1;
     c->read->eof = 1;
@@ -1928,6 +1935,8 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
 
         c->ssl->handshaked = 1;
 
+        ngx_probe2(ssl_handshake_done, c->number, 1);
+
         return NGX_OK;
     }
 
@@ -1971,6 +1980,8 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
 
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
+    ngx_probe2(ssl_handshake_done, c->number, 0);
+
     c->ssl->no_wait_shutdown = 1;
     c->ssl->no_send_shutdown = 1;
     c->read->eof = 1;
@@ -1105,6 +1105,7 @@ done:
 
     if (c->ssl->in_ocsp) {
         c->ssl->handshaked = 1;
+        ngx_probe2(ssl_handshake_done, c->number, 1);
         c->ssl->handler(c);
     }
 }
@@ -1149,6 +1150,7 @@ done:
 
     if (c->ssl->in_ocsp) {
         c->ssl->handshaked = 1;
+        ngx_probe2(ssl_handshake_done, c->number, 1);
         c->ssl->handler(c);
     }
 }
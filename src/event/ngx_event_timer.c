@@ -91,7 +91,9 @@ ngx_event_expire_timers(void)
 
         ev->timedout = 1;
 
-        ev->handler(ev);
+        ngx_probe2(timer_expire, ev, ev->data);
+
+        ngx_event_call(ev);
     }
 }
 
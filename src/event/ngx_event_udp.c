@@ -181,7 +181,7 @@ ngx_event_recvmsg(ngx_event_t *ev)
             rev->ready = 1;
             rev->active = 0;
 
-            rev->handler(rev);
+            ngx_event_call(rev);
 
             if (c->udp) {
                 c->udp->buffer = NULL;
@@ -336,6 +336,8 @@ ngx_event_recvmsg(ngx_event_t *ev)
         log->data = NULL;
         log->handler = NULL;
 
+        ngx_probe3(connection_accept, c->number, c->fd, c->sockaddr);
+
         ls->handler(c);
 
     next:
@@ -0,0 +1,394 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#if (NGX_HAVE_BACKTRACE)
+#include <execinfo.h>
+#endif
+
+
+/*
+ * The worker process arms a heartbeat timer, and a watchdog thread
+ * checks that the timer is not late by more than the threshold.
+ * Otherwise the event loop is considered stalled: the watchdog copies
+ * the description of the handler being called, which the main thread
+ * publishes before each call, and, optionally, signals the main thread
+ * to capture its stack.  The report is logged by the heartbeat handler
+ * as soon as the event loop is running again.
+ */
+
+
+#define NGX_EVENT_WATCHDOG_FRAMES  64
+#define NGX_EVENT_WATCHDOG_LAGS    16
+#define NGX_EVENT_WATCHDOG_SIGNAL  SIGURG
+
+
+typedef struct {
+    ngx_msec_t             threshold;
+    ngx_msec_t             interval;
+    ngx_flag_t             backtrace;
+
+    pthread_t              main;
+    ngx_event_t            heartbeat;
+
+    /* monotonic time of the next heartbeat, in microseconds */
+    volatile uint64_t      due;
+
+    /* set by the watchdog thread and cleared by the heartbeat handler */
+    volatile ngx_uint_t    stalled;
+
+    ngx_event_current_t    current;
+
+    void                  *frames[NGX_EVENT_WATCHDOG_FRAMES];
+    volatile int           nframes;
+
+    /* heartbeat lags: 0 ms, 1 ms, 2-3 ms, 4-7 ms, and so on */
+    uint64_t               lags[NGX_EVENT_WATCHDOG_LAGS];
+} ngx_event_watchdog_t;
+
+
+static void *ngx_event_watchdog_cycle(void *data);
+static void ngx_event_watchdog_capture(ngx_event_watchdog_t *wd);
+static void ngx_event_watchdog_heartbeat(ngx_event_t *ev);
+static void ngx_event_watchdog_report(ngx_event_watchdog_t *wd,
+    ngx_msec_t lag);
+#if (NGX_HAVE_BACKTRACE)
+static void ngx_event_watchdog_signal_handler(int signo);
+#endif
+
+
+static ngx_event_watchdog_t  ngx_event_watchdog;
+
+ngx_uint_t                          ngx_event_watchdog_enabled;
+ngx_event_current_t                 ngx_event_current;
+volatile ngx_atomic_uint_t          ngx_event_current_seq;
+
+
+ngx_int_t
+ngx_event_watchdog_init(ngx_cycle_t *cycle, ngx_msec_t threshold,
+    ngx_flag_t stack)
+{
+    int                    err;
+    pthread_t              tid;
+    pthread_attr_t         attr;
+    ngx_event_watchdog_t  *wd;
+
+    wd = &ngx_event_watchdog;
+
+    wd->threshold = threshold;
+    wd->interval = ngx_max(threshold / 2, 1);
+    wd->main = pthread_self();
+
+#if (NGX_HAVE_BACKTRACE)
+
+    if (stack) {
+        struct sigaction  sa;
+
+        /* the first call may allocate memory, so it is done here */
+
+        (void) backtrace(wd->frames, NGX_EVENT_WATCHDOG_FRAMES);
+
+        ngx_memzero(&sa, sizeof(struct sigaction));
+        sa.sa_handler = ngx_event_watchdog_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(NGX_EVENT_WATCHDOG_SIGNAL, &sa, NULL) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "sigaction(SIGURG) failed");
+            return NGX_ERROR;
+        }
+
+        wd->backtrace = 1;
+    }
+
+#else
+
+    if (stack) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"stall_backtrace\" is not supported "
+                      "on this platform, ignored");
+    }
+
+#endif
+
+    wd->heartbeat.handler = ngx_event_watchdog_heartbeat;
+    wd->heartbeat.data = wd;
+    wd->heartbeat.log = cycle->log;
+    wd->heartbeat.cancelable = 1;
+
+    wd->due = ngx_monotonic_usec() + wd->interval * 1000;
+
+    ngx_add_timer(&wd->heartbeat, wd->interval);
+
+    err = pthread_attr_init(&attr);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_attr_init() failed");
+        return NGX_ERROR;
+    }
+
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_attr_setdetachstate() failed");
+        return NGX_ERROR;
+    }
+
+    err = pthread_create(&tid, &attr, ngx_event_watchdog_cycle, wd);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_create() failed");
+        return NGX_ERROR;
+    }
+
+    (void) pthread_attr_destroy(&attr);
+
+    ngx_event_watchdog_enabled = 1;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_event_watchdog_cycle(void *data)
+{
+    ngx_event_watchdog_t *wd = data;
+
+    sigset_t    set;
+    uint64_t    now;
+    ngx_msec_t  delay;
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        return NULL;
+    }
+
+    delay = ngx_max(wd->threshold / 4, 1);
+
+    for ( ;; ) {
+        ngx_msleep(delay);
+
+        if (wd->stalled) {
+            continue;
+        }
+
+        now = ngx_monotonic_usec();
+
+        if (now < wd->due + wd->threshold * 1000) {
+            continue;
+        }
+
+        ngx_event_watchdog_capture(wd);
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_event_watchdog_capture(ngx_event_watchdog_t *wd)
+{
+    ngx_uint_t                     n;
+    ngx_atomic_uint_t              seq;
+    volatile ngx_event_current_t  *cur;
+
+    /*
+     * the main thread may still be running, so only the published copy
+     * is read, again if it was being changed at the same time
+     */
+
+    cur = &ngx_event_current;
+
+    for (n = 0; n < 100; n++) {
+        seq = ngx_event_current_seq;
+
+        ngx_memory_barrier();
+
+        wd->current.handler = cur->handler;
+        wd->current.action = cur->action;
+        wd->current.index = cur->index;
+        wd->current.number = cur->number;
+
+        ngx_memory_barrier();
+
+        if ((seq & 1) == 0 && seq == ngx_event_current_seq) {
+            break;
+        }
+    }
+
+    if (n == 100) {
+        ngx_memzero(&wd->current, sizeof(ngx_event_current_t));
+    }
+
+    wd->nframes = 0;
+
+    ngx_memory_barrier();
+
+#if (NGX_HAVE_BACKTRACE)
+
+    if (wd->backtrace) {
+        (void) pthread_kill(wd->main, NGX_EVENT_WATCHDOG_SIGNAL);
+    }
+
+#endif
+
+    wd->stalled = 1;
+}
+
+
+#if (NGX_HAVE_BACKTRACE)
+
+static void
+ngx_event_watchdog_signal_handler(int signo)
+{
+    ngx_event_watchdog_t  *wd;
+
+    wd = &ngx_event_watchdog;
+
+    if (wd->nframes == 0) {
+        wd->nframes = backtrace(wd->frames, NGX_EVENT_WATCHDOG_FRAMES);
+    }
+}
+
+#endif
+
+
+static void
+ngx_event_watchdog_heartbeat(ngx_event_t *ev)
+{
+    ngx_event_watchdog_t *wd = ev->data;
+
+    uint64_t    now;
+    ngx_uint_t  i;
+    ngx_msec_t  lag;
+
+    now = ngx_monotonic_usec();
+
+    lag = (now > wd->due) ? (ngx_msec_t) ((now - wd->due) / 1000) : 0;
+
+    for (i = 0; lag >> i && i < NGX_EVENT_WATCHDOG_LAGS - 1; i++) {
+        /* void */
+    }
+
+    wd->lags[i]++;
+
+    if (wd->stalled) {
+        ngx_memory_barrier();
+        ngx_event_watchdog_report(wd, lag);
+    }
+
+    wd->due = now + wd->interval * 1000;
+
+    ngx_memory_barrier();
+
+    wd->stalled = 0;
+
+    ngx_add_timer(ev, wd->interval);
+}
+
+
+static void
+ngx_event_watchdog_report(ngx_event_watchdog_t *wd, ngx_msec_t lag)
+{
+    u_char                *p, *last;
+    ngx_uint_t             i;
+    ngx_connection_t      *c;
+    ngx_event_current_t   *cur;
+    u_char                 buf[NGX_MAX_ERROR_STR];
+#if (NGX_HAVE_BACKTRACE)
+    int                    n;
+    char                 **symbols;
+#endif
+
+    cur = &wd->current;
+
+    last = buf + sizeof(buf);
+
+    p = ngx_slprintf(buf, last, "event loop stalled for %M ms", lag);
+
+    if (cur->handler) {
+        p = ngx_slprintf(p, last, ", event handler %p",
+                         (void *) cur->handler);
+
+#if (NGX_HAVE_BACKTRACE)
+
+        symbols = backtrace_symbols((void **) &cur->handler, 1);
+
+        if (symbols) {
+            p = ngx_slprintf(p, last, " (%s)", symbols[0]);
+            free(symbols);
+        }
+
+#endif
+    }
+
+    if (cur->number) {
+        p = ngx_slprintf(p, last, ", connection *%uA", cur->number);
+
+        /* the connection is only looked at if it is still the same */
+
+        c = ngx_cycle->connections + cur->index - 1;
+
+        if (c->fd != (ngx_socket_t) -1
+            && c->number == cur->number
+            && c->addr_text.len)
+        {
+            p = ngx_slprintf(p, last, ", client: %V", &c->addr_text);
+        }
+
+        if (cur->action) {
+            p = ngx_slprintf(p, last, ", while %s", cur->action);
+        }
+    }
+
+    p = ngx_slprintf(p, last, ", event loop lags:");
+
+    for (i = 0; i < NGX_EVENT_WATCHDOG_LAGS; i++) {
+        if (wd->lags[i]) {
+            p = ngx_slprintf(p, last, " %s%uA ms: %uL",
+                             (i == NGX_EVENT_WATCHDOG_LAGS - 1) ? ">=" : "",
+                             i ? (ngx_atomic_uint_t) 1 << (i - 1) : 0,
+                             wd->lags[i]);
+        }
+    }
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "%*s", p - buf, buf);
+
+#if (NGX_HAVE_BACKTRACE)
+
+    n = wd->nframes;
+
+    if (n == 0) {
+        return;
+    }
+
+    symbols = backtrace_symbols(wd->frames, n);
+
+    if (symbols == NULL) {
+        return;
+    }
+
+    /* the first frames are the signal handler */
+
+    for (i = 1; i < (ngx_uint_t) n; i++) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "stall backtrace #%ui %s", i - 1, symbols[i]);
+    }
+
+    free(symbols);
+
+#endif
+}
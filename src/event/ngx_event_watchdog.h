@@ -0,0 +1,94 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_WATCHDOG_H_INCLUDED_
+#define _NGX_EVENT_WATCHDOG_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * a copy of what the event loop is calling, published for the watchdog
+ * thread, which must not dereference anything owned by the main thread
+ */
+
+typedef struct {
+    ngx_event_handler_pt         handler;
+    char                        *action;
+    ngx_uint_t                   index;    /* connection index + 1, or 0 */
+    ngx_atomic_uint_t            number;
+} ngx_event_current_t;
+
+
+ngx_int_t ngx_event_watchdog_init(ngx_cycle_t *cycle, ngx_msec_t threshold,
+    ngx_flag_t stack);
+
+
+extern ngx_uint_t                    ngx_event_watchdog_enabled;
+extern ngx_event_current_t           ngx_event_current;
+extern volatile ngx_atomic_uint_t    ngx_event_current_seq;
+
+
+static ngx_inline void
+ngx_event_set_current(ngx_event_current_t *cur)
+{
+    /* the sequence is odd while the copy is being changed */
+
+    ngx_event_current_seq++;
+    ngx_memory_barrier();
+
+    ngx_event_current = *cur;
+
+    ngx_memory_barrier();
+    ngx_event_current_seq++;
+}
+
+
+static ngx_inline void
+ngx_event_call(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_event_current_t   cur, prev;
+
+    if (!ngx_event_watchdog_enabled) {
+        ev->handler(ev);
+        return;
+    }
+
+    cur.handler = ev->handler;
+    cur.action = NULL;
+    cur.index = 0;
+    cur.number = 0;
+
+    c = ev->data;
+
+    if (c >= ngx_cycle->connections
+        && c < ngx_cycle->connections + ngx_cycle->connection_n
+        && c->fd != (ngx_socket_t) -1)
+    {
+        cur.index = c - ngx_cycle->connections + 1;
+        cur.number = c->number;
+
+        /* log actions are string literals */
+        cur.action = c->log ? c->log->action : NULL;
+    }
+
+    /* handlers may be called from handlers, so the previous copy is kept */
+
+    prev = ngx_event_current;
+
+    ngx_event_set_current(&cur);
+
+    ev->handler(ev);
+
+    ngx_event_set_current(&prev);
+}
+
+
+#endif /* _NGX_EVENT_WATCHDOG_H_INCLUDED_ */
@@ -8,19 +8,65 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 
-#if 0
+#define NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN  16
+
 
 typedef struct {
-    ngx_buf_t     *buf;
-    size_t         size;
-    ngx_pool_t    *pool;
-    size_t         alloc_size;
-    ngx_chain_t  **last_out;
-} ngx_http_autoindex_ctx_t;
+    ngx_rbtree_t                   rbtree;
+    ngx_rbtree_node_t              sentinel;
+    ngx_queue_t                    queue;
+} ngx_http_autoindex_cache_shctx_t;
 
-#endif
+
+typedef struct {
+    ngx_http_autoindex_cache_shctx_t  *sh;
+    ngx_slab_pool_t               *shpool;
+    size_t                         max_entry_size;
+} ngx_http_autoindex_cache_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t              node;
+    ngx_queue_t                    queue;
+    u_char                         key[NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN
+                                       - sizeof(ngx_rbtree_key_t)];
+    ngx_file_uniq_t                uniq;
+    time_t                         mtime;
+    size_t                         len;
+    u_char                         data[1];
+} ngx_http_autoindex_cache_node_t;
+
+
+typedef struct {
+    ngx_http_request_t            *request;
+
+    ngx_dir_t                      dir;
+    ngx_str_t                      path;
+    u_char                        *filename;
+    u_char                        *last;
+    size_t                         allocated;
+
+    ngx_uint_t                     format;
+    ngx_str_t                      callback;
+
+    ngx_uint_t                     part;
+    ngx_uint_t                     page;
+    ngx_uint_t                     skip;
+    ngx_uint_t                     count;
+
+    ngx_buf_t                     *buf;
+
+    ngx_file_uniq_t                uniq;
+    time_t                         mtime;
+    u_char                         key[NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN];
+
+    unsigned                       opened:1;
+    unsigned                       more:1;
+    unsigned                       cache:1;
+} ngx_http_autoindex_ctx_t;
 
 
 typedef struct {
@@ -38,10 +84,13 @@ typedef struct {
 
 
 typedef struct {
-    ngx_flag_t     enable;
-    ngx_uint_t     format;
-    ngx_flag_t     localtime;
-    ngx_flag_t     exact_size;
+    ngx_flag_t        enable;
+    ngx_uint_t        format;
+    ngx_flag_t        localtime;
+    ngx_flag_t        exact_size;
+    ngx_flag_t        sort;
+    ngx_int_t         page_size;
+    ngx_shm_zone_t   *cache;
 } ngx_http_autoindex_loc_conf_t;
 
 
@@ -54,25 +103,55 @@ typedef struct {
 
 #define NGX_HTTP_AUTOINDEX_NAME_LEN     50
 
+#define NGX_HTTP_AUTOINDEX_BATCH        1024
+
+#define NGX_HTTP_AUTOINDEX_FIRST        0x01
+#define NGX_HTTP_AUTOINDEX_LAST         0x02
+
 
+static ngx_int_t ngx_http_autoindex_read(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx, ngx_array_t *entries, ngx_uint_t limit);
+static ngx_int_t ngx_http_autoindex_stream(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx);
+static void ngx_http_autoindex_stream_handler(ngx_http_request_t *r);
+static ngx_buf_t *ngx_http_autoindex_render(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx, ngx_array_t *entries);
 static ngx_buf_t *ngx_http_autoindex_html(ngx_http_request_t *r,
-    ngx_array_t *entries);
+    ngx_http_autoindex_ctx_t *ctx, ngx_array_t *entries);
 static ngx_buf_t *ngx_http_autoindex_json(ngx_http_request_t *r,
-    ngx_array_t *entries, ngx_str_t *callback);
+    ngx_http_autoindex_ctx_t *ctx, ngx_array_t *entries);
 static ngx_int_t ngx_http_autoindex_jsonp_callback(ngx_http_request_t *r,
     ngx_str_t *callback);
 static ngx_buf_t *ngx_http_autoindex_xml(ngx_http_request_t *r,
-    ngx_array_t *entries);
+    ngx_http_autoindex_ctx_t *ctx, ngx_array_t *entries);
 
 static int ngx_libc_cdecl ngx_http_autoindex_cmp_entries(const void *one,
     const void *two);
+static void ngx_http_autoindex_cleanup(void *data);
+static void ngx_http_autoindex_close_dir(ngx_http_autoindex_ctx_t *ctx);
 static ngx_int_t ngx_http_autoindex_error(ngx_http_request_t *r,
-    ngx_dir_t *dir, ngx_str_t *name);
+    ngx_http_autoindex_ctx_t *ctx);
+
+static ngx_buf_t *ngx_http_autoindex_cache_lookup(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx);
+static void ngx_http_autoindex_cache_store(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx, ngx_buf_t *b);
+static ngx_http_autoindex_cache_node_t *ngx_http_autoindex_cache_find(
+    ngx_http_autoindex_cache_t *cache, u_char *key);
+static void ngx_http_autoindex_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_autoindex_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
 
 static ngx_int_t ngx_http_autoindex_init(ngx_conf_t *cf);
 static void *ngx_http_autoindex_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_autoindex_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
+static char *ngx_http_autoindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_autoindex_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_conf_enum_t  ngx_http_autoindex_format[] = {
@@ -114,6 +193,34 @@ static ngx_command_t  ngx_http_autoindex_commands[] = {
       offsetof(ngx_http_autoindex_loc_conf_t, exact_size),
       NULL },
 
+    { ngx_string("autoindex_sort"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_autoindex_loc_conf_t, sort),
+      NULL },
+
+    { ngx_string("autoindex_page_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_autoindex_loc_conf_t, page_size),
+      NULL },
+
+    { ngx_string("autoindex_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_autoindex_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("autoindex_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_autoindex_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -152,18 +259,17 @@ ngx_module_t  ngx_http_autoindex_module = {
 static ngx_int_t
 ngx_http_autoindex_handler(ngx_http_request_t *r)
 {
-    u_char                         *last, *filename;
-    size_t                          len, allocated, root;
+    u_char                         *last;
+    size_t                          root;
     ngx_err_t                       err;
     ngx_buf_t                      *b;
-    ngx_int_t                       rc;
-    ngx_str_t                       path, callback;
-    ngx_dir_t                       dir;
-    ngx_uint_t                      level, format;
-    ngx_pool_t                     *pool;
+    ngx_int_t                       rc, n;
+    ngx_str_t                       path, value;
+    ngx_uint_t                      level, limit, size;
     ngx_chain_t                     out;
     ngx_array_t                     entries;
-    ngx_http_autoindex_entry_t     *entry;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_autoindex_ctx_t       *ctx;
     ngx_http_autoindex_loc_conf_t  *alcf;
 
     if (r->uri.data[r->uri.len - 1] != '/') {
@@ -192,7 +298,14 @@ ngx_http_autoindex_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    allocated = path.len;
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_autoindex_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->request = r;
+
+    ctx->allocated = path.len;
     path.len = last - path.data;
     if (path.len > 1) {
         path.len--;
@@ -202,19 +315,36 @@ ngx_http_autoindex_handler(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http autoindex: \"%s\"", path.data);
 
-    format = alcf->format;
+    ctx->format = alcf->format;
 
-    if (format == NGX_HTTP_AUTOINDEX_JSONP) {
-        if (ngx_http_autoindex_jsonp_callback(r, &callback) != NGX_OK) {
+    if (ctx->format == NGX_HTTP_AUTOINDEX_JSONP) {
+        if (ngx_http_autoindex_jsonp_callback(r, &ctx->callback) != NGX_OK) {
             return NGX_HTTP_BAD_REQUEST;
         }
 
-        if (callback.len == 0) {
-            format = NGX_HTTP_AUTOINDEX_JSON;
+        if (ctx->callback.len == 0) {
+            ctx->format = NGX_HTTP_AUTOINDEX_JSON;
+        }
+    }
+
+    if (alcf->page_size) {
+        ctx->page = 1;
+
+        if (ngx_http_arg(r, (u_char *) "page", 4, &value) == NGX_OK) {
+            n = ngx_atoi(value.data, value.len);
+
+            if (n > 0) {
+                ctx->page = n;
+            }
         }
     }
 
-    if (ngx_open_dir(&path, &dir) == NGX_ERROR) {
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_open_dir(&path, &ctx->dir) == NGX_ERROR) {
         err = ngx_errno;
 
         if (err == NGX_ENOENT
@@ -239,25 +369,15 @@ ngx_http_autoindex_handler(ngx_http_request_t *r)
         return rc;
     }
 
-#if (NGX_SUPPRESS_WARN)
-
-    /* MSVC thinks 'entries' may be used without having been initialized */
-    ngx_memzero(&entries, sizeof(ngx_array_t));
-
-#endif
+    ctx->path = path;
+    ctx->opened = 1;
 
-    /* TODO: pool should be temporary pool */
-    pool = r->pool;
-
-    if (ngx_array_init(&entries, pool, 40, sizeof(ngx_http_autoindex_entry_t))
-        != NGX_OK)
-    {
-        return ngx_http_autoindex_error(r, &dir, &path);
-    }
+    cln->handler = ngx_http_autoindex_cleanup;
+    cln->data = ctx;
 
     r->headers_out.status = NGX_HTTP_OK;
 
-    switch (format) {
+    switch (ctx->format) {
 
     case NGX_HTTP_AUTOINDEX_JSON:
         ngx_str_set(&r->headers_out.content_type, "application/json");
@@ -283,61 +403,198 @@ ngx_http_autoindex_handler(ngx_http_request_t *r)
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        if (ngx_close_dir(&dir) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                          ngx_close_dir_n " \"%V\" failed", &path);
+        ngx_http_autoindex_close_dir(ctx);
+        return rc;
+    }
+
+    ctx->part = NGX_HTTP_AUTOINDEX_FIRST;
+
+    if (alcf->cache && (alcf->sort || alcf->page_size)) {
+        b = ngx_http_autoindex_cache_lookup(r, ctx);
+
+        if (b) {
+            ngx_http_autoindex_close_dir(ctx);
+            goto send;
+        }
+    }
+
+    ctx->filename = path.data;
+    ctx->filename[path.len] = '/';
+    ctx->last = last;
+
+    if (!alcf->sort && alcf->page_size == 0) {
+
+        /* the listing is sent in parts as the directory is read */
+
+        ngx_http_set_ctx(r, ctx, ngx_http_autoindex_module);
+
+        rc = ngx_http_autoindex_stream(r, ctx);
+
+        if (rc == NGX_AGAIN) {
+            r->main->count++;
+            r->write_event_handler = ngx_http_autoindex_stream_handler;
+            return NGX_DONE;
         }
 
         return rc;
     }
 
-    filename = path.data;
-    filename[path.len] = '/';
+#if (NGX_SUPPRESS_WARN)
+
+    /* MSVC thinks 'entries' may be used without having been initialized */
+    ngx_memzero(&entries, sizeof(ngx_array_t));
+
+#endif
+
+    if (ngx_array_init(&entries, r->pool, 40,
+                       sizeof(ngx_http_autoindex_entry_t))
+        != NGX_OK)
+    {
+        return ngx_http_autoindex_error(r, ctx);
+    }
+
+    size = alcf->page_size;
+    limit = 0;
+
+    if (size && !alcf->sort) {
+
+        /* unsorted pages are cut from the directory stream as is */
+
+        if (ctx->page - 1 > (NGX_MAX_UINT32_VALUE - 1) / size) {
+            ctx->skip = NGX_MAX_UINT32_VALUE;
+
+        } else {
+            ctx->skip = (ctx->page - 1) * size;
+        }
+
+        limit = size + 1;
+    }
+
+    if (ngx_http_autoindex_read(r, ctx, &entries, limit) == NGX_ERROR) {
+        return ngx_http_autoindex_error(r, ctx);
+    }
+
+    ngx_http_autoindex_close_dir(ctx);
+
+    if (alcf->sort && entries.nelts > 1) {
+        ngx_qsort(entries.elts, (size_t) entries.nelts,
+                  sizeof(ngx_http_autoindex_entry_t),
+                  ngx_http_autoindex_cmp_entries);
+    }
+
+    if (size) {
+
+        if (alcf->sort) {
+            if (ctx->page - 1 >= (entries.nelts + size - 1) / size) {
+                entries.nelts = 0;
+
+            } else {
+                entries.elts = (ngx_http_autoindex_entry_t *) entries.elts
+                               + (ctx->page - 1) * size;
+                entries.nelts -= (ctx->page - 1) * size;
+            }
+        }
+
+        if (entries.nelts > size) {
+            entries.nelts = size;
+            ctx->more = 1;
+        }
+    }
+
+    ctx->part |= NGX_HTTP_AUTOINDEX_LAST;
+
+    b = ngx_http_autoindex_render(r, ctx, &entries);
+
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->cache) {
+        ngx_http_autoindex_cache_store(r, ctx, b);
+    }
+
+send:
+
+    if (r == r->main) {
+        b->last_buf = 1;
+    }
+
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_autoindex_read(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx,
+    ngx_array_t *entries, ngx_uint_t limit)
+{
+    u_char                      *filename;
+    size_t                       len;
+    ngx_err_t                    err;
+    ngx_dir_t                   *dir;
+    ngx_http_autoindex_entry_t  *entry;
+
+    dir = &ctx->dir;
+
+    while (limit == 0 || entries->nelts < limit) {
 
-    for ( ;; ) {
         ngx_set_errno(0);
 
-        if (ngx_read_dir(&dir) == NGX_ERROR) {
+        if (ngx_read_dir(dir) == NGX_ERROR) {
             err = ngx_errno;
 
             if (err != NGX_ENOMOREFILES) {
                 ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                              ngx_read_dir_n " \"%V\" failed", &path);
-                return ngx_http_autoindex_error(r, &dir, &path);
+                              ngx_read_dir_n " \"%V\" failed", &ctx->path);
+                return NGX_ERROR;
             }
 
-            break;
+            return NGX_DONE;
         }
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http autoindex file: \"%s\"", ngx_de_name(&dir));
+                       "http autoindex file: \"%s\"", ngx_de_name(dir));
 
-        len = ngx_de_namelen(&dir);
+        len = ngx_de_namelen(dir);
 
-        if (ngx_de_name(&dir)[0] == '.') {
+        if (ngx_de_name(dir)[0] == '.') {
             continue;
         }
 
-        if (!dir.valid_info) {
+        if (ctx->skip) {
+            ctx->skip--;
+            continue;
+        }
+
+        if (!dir->valid_info) {
 
             /* 1 byte for '/' and 1 byte for terminating '\0' */
 
-            if (path.len + 1 + len + 1 > allocated) {
-                allocated = path.len + 1 + len + 1
-                                     + NGX_HTTP_AUTOINDEX_PREALLOCATE;
+            if (ctx->path.len + 1 + len + 1 > ctx->allocated) {
+                ctx->allocated = ctx->path.len + 1 + len + 1
+                                          + NGX_HTTP_AUTOINDEX_PREALLOCATE;
 
-                filename = ngx_pnalloc(pool, allocated);
+                filename = ngx_pnalloc(r->pool, ctx->allocated);
                 if (filename == NULL) {
-                    return ngx_http_autoindex_error(r, &dir, &path);
+                    return NGX_ERROR;
                 }
 
-                last = ngx_cpystrn(filename, path.data, path.len + 1);
-                *last++ = '/';
+                ctx->last = ngx_cpystrn(filename, ctx->path.data,
+                                        ctx->path.len + 1);
+                *ctx->last++ = '/';
+
+                ctx->filename = filename;
             }
 
-            ngx_cpystrn(last, ngx_de_name(&dir), len + 1);
+            filename = ctx->filename;
 
-            if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
+            ngx_cpystrn(ctx->last, ngx_de_name(dir), len + 1);
+
+            if (ngx_de_info(filename, dir) == NGX_FILE_ERROR) {
                 err = ngx_errno;
 
                 if (err != NGX_ENOENT && err != NGX_ELOOP) {
@@ -348,89 +605,237 @@ ngx_http_autoindex_handler(ngx_http_request_t *r)
                         continue;
                     }
 
-                    return ngx_http_autoindex_error(r, &dir, &path);
+                    return NGX_ERROR;
                 }
 
-                if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
+                if (ngx_de_link_info(filename, dir) == NGX_FILE_ERROR) {
                     ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
                                   ngx_de_link_info_n " \"%s\" failed",
                                   filename);
-                    return ngx_http_autoindex_error(r, &dir, &path);
+                    return NGX_ERROR;
                 }
             }
         }
 
-        entry = ngx_array_push(&entries);
+        entry = ngx_array_push(entries);
         if (entry == NULL) {
-            return ngx_http_autoindex_error(r, &dir, &path);
+            return NGX_ERROR;
         }
 
         entry->name.len = len;
 
-        entry->name.data = ngx_pnalloc(pool, len + 1);
+        entry->name.data = ngx_pnalloc(entries->pool, len + 1);
         if (entry->name.data == NULL) {
-            return ngx_http_autoindex_error(r, &dir, &path);
+            return NGX_ERROR;
         }
 
-        ngx_cpystrn(entry->name.data, ngx_de_name(&dir), len + 1);
+        ngx_cpystrn(entry->name.data, ngx_de_name(dir), len + 1);
 
-        entry->dir = ngx_de_is_dir(&dir);
-        entry->file = ngx_de_is_file(&dir);
-        entry->mtime = ngx_de_mtime(&dir);
-        entry->size = ngx_de_size(&dir);
+        entry->dir = ngx_de_is_dir(dir);
+        entry->file = ngx_de_is_file(dir);
+        entry->mtime = ngx_de_mtime(dir);
+        entry->size = ngx_de_size(dir);
     }
 
-    if (ngx_close_dir(&dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_dir_n " \"%V\" failed", &path);
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_autoindex_stream(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx)
+{
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_pool_t                *pool;
+    ngx_chain_t                out;
+    ngx_array_t                entries;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+
+    for ( ;; ) {
+
+        if (r->buffered || r->postponed || (r == r->main && c->buffered)) {
+
+            clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
+
+            if (!c->write->delayed) {
+                ngx_add_timer(c->write, clcf->send_timeout);
+            }
+
+            if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        /* the previous part is sent, its buffer can be reused */
+
+        if (ctx->buf) {
+            ngx_pfree(r->pool, ctx->buf->start);
+            ctx->buf = NULL;
+        }
+
+        if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+            return NGX_OK;
+        }
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, c->log);
+        if (pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_array_init(&entries, pool, 64,
+                           sizeof(ngx_http_autoindex_entry_t))
+            != NGX_OK)
+        {
+            ngx_destroy_pool(pool);
+            return NGX_ERROR;
+        }
+
+        rc = ngx_http_autoindex_read(r, ctx, &entries,
+                                     NGX_HTTP_AUTOINDEX_BATCH);
+
+        if (rc == NGX_ERROR) {
+            ngx_destroy_pool(pool);
+            ngx_http_autoindex_close_dir(ctx);
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DONE) {
+            ngx_http_autoindex_close_dir(ctx);
+            ctx->part |= NGX_HTTP_AUTOINDEX_LAST;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http autoindex part: %ui entries, last:%ui",
+                       entries.nelts,
+                       (ngx_uint_t) (rc == NGX_DONE));
+
+        b = ngx_http_autoindex_render(r, ctx, &entries);
+
+        ngx_destroy_pool(pool);
+
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->part &= ~NGX_HTTP_AUTOINDEX_FIRST;
+        ctx->buf = b;
+
+        if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+            if (r == r->main) {
+                b->last_buf = 1;
+            }
+
+            b->last_in_chain = 1;
+
+        } else {
+            b->flush = 1;
+        }
+
+        out.buf = b;
+        out.next = NULL;
+
+        if (ngx_http_output_filter(r, &out) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
     }
+}
 
-    if (entries.nelts > 1) {
-        ngx_qsort(entries.elts, (size_t) entries.nelts,
-                  sizeof(ngx_http_autoindex_entry_t),
-                  ngx_http_autoindex_cmp_entries);
+
+static void
+ngx_http_autoindex_stream_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_autoindex_ctx_t  *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http autoindex stream handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    switch (format) {
+    if (wev->delayed || r->aio) {
+        clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_autoindex_module);
+
+    rc = ngx_http_autoindex_stream(r, ctx);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ngx_http_finalize_request(r, rc);
+}
 
-    case NGX_HTTP_AUTOINDEX_JSON:
-        b = ngx_http_autoindex_json(r, &entries, NULL);
-        break;
 
+static ngx_buf_t *
+ngx_http_autoindex_render(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx,
+    ngx_array_t *entries)
+{
+    ngx_buf_t  *b;
+
+    switch (ctx->format) {
+
+    case NGX_HTTP_AUTOINDEX_JSON:
     case NGX_HTTP_AUTOINDEX_JSONP:
-        b = ngx_http_autoindex_json(r, &entries, &callback);
+        b = ngx_http_autoindex_json(r, ctx, entries);
         break;
 
     case NGX_HTTP_AUTOINDEX_XML:
-        b = ngx_http_autoindex_xml(r, &entries);
+        b = ngx_http_autoindex_xml(r, ctx, entries);
         break;
 
     default: /* NGX_HTTP_AUTOINDEX_HTML */
-        b = ngx_http_autoindex_html(r, &entries);
+        b = ngx_http_autoindex_html(r, ctx, entries);
         break;
     }
 
-    if (b == NULL) {
-        return NGX_ERROR;
+    if (b) {
+        ctx->count += entries->nelts;
     }
 
-    /* TODO: free temporary pool */
-
-    if (r == r->main) {
-        b->last_buf = 1;
-    }
-
-    b->last_in_chain = 1;
-
-    out.buf = b;
-    out.next = NULL;
-
-    return ngx_http_output_filter(r, &out);
+    return b;
 }
 
 
 static ngx_buf_t *
-ngx_http_autoindex_html(ngx_http_request_t *r, ngx_array_t *entries)
+ngx_http_autoindex_html(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx,
+    ngx_array_t *entries)
 {
     u_char                         *last, scale;
     off_t                           length;
@@ -474,14 +879,27 @@ ngx_http_autoindex_html(ngx_http_request_t *r, ngx_array_t *entries)
 
     escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
 
-    len = sizeof(title) - 1
-          + r->uri.len + escape_html
-          + sizeof(header) - 1
-          + r->uri.len + escape_html
-          + sizeof("</h1>") - 1
-          + sizeof("<hr><pre><a href=\"../\">../</a>" CRLF) - 1
-          + sizeof("</pre><hr>") - 1
-          + sizeof(tail) - 1;
+    len = 0;
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
+        len += sizeof(title) - 1
+               + r->uri.len + escape_html
+               + sizeof(header) - 1
+               + r->uri.len + escape_html
+               + sizeof("</h1>") - 1
+               + sizeof("<hr><pre><a href=\"../\">../</a>" CRLF) - 1;
+    }
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+        len += sizeof("</pre><hr>") - 1
+               + sizeof(tail) - 1;
+
+        if (ctx->page > 1 || ctx->more) {
+            len += sizeof("<pre><a href=\"?page=\">&lt; previous</a> "
+                          "<a href=\"?page=\">next &gt;</a></pre><hr>") - 1
+                   + 2 * NGX_INT_T_LEN;
+        }
+    }
 
     entry = entries->elts;
     for (i = 0; i < entries->nelts; i++) {
@@ -523,23 +941,28 @@ ngx_http_autoindex_html(ngx_http_request_t *r, ngx_array_t *entries)
         return NULL;
     }
 
-    b->last = ngx_cpymem(b->last, title, sizeof(title) - 1);
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
+        b->last = ngx_cpymem(b->last, title, sizeof(title) - 1);
 
-    if (escape_html) {
-        b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
-        b->last = ngx_cpymem(b->last, header, sizeof(header) - 1);
-        b->last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
+        if (escape_html) {
+            b->last = (u_char *) ngx_escape_html(b->last, r->uri.data,
+                                                 r->uri.len);
+            b->last = ngx_cpymem(b->last, header, sizeof(header) - 1);
+            b->last = (u_char *) ngx_escape_html(b->last, r->uri.data,
+                                                 r->uri.len);
 
-    } else {
-        b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
-        b->last = ngx_cpymem(b->last, header, sizeof(header) - 1);
-        b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
-    }
+        } else {
+            b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
+            b->last = ngx_cpymem(b->last, header, sizeof(header) - 1);
+            b->last = ngx_cpymem(b->last, r->uri.data, r->uri.len);
+        }
 
-    b->last = ngx_cpymem(b->last, "</h1>", sizeof("</h1>") - 1);
+        b->last = ngx_cpymem(b->last, "</h1>", sizeof("</h1>") - 1);
 
-    b->last = ngx_cpymem(b->last, "<hr><pre><a href=\"../\">../</a>" CRLF,
-                         sizeof("<hr><pre><a href=\"../\">../</a>" CRLF) - 1);
+        b->last = ngx_cpymem(b->last, "<hr><pre><a href=\"../\">../</a>" CRLF,
+                             sizeof("<hr><pre><a href=\"../\">../</a>" CRLF)
+                             - 1);
+    }
 
     alcf = ngx_http_get_module_loc_conf(r, ngx_http_autoindex_module);
     tp = ngx_timeofday();
@@ -691,8 +1114,34 @@ ngx_http_autoindex_html(ngx_http_request_t *r, ngx_array_t *entries)
         *b->last++ = LF;
     }
 
+    if (!(ctx->part & NGX_HTTP_AUTOINDEX_LAST)) {
+        return b;
+    }
+
     b->last = ngx_cpymem(b->last, "</pre><hr>", sizeof("</pre><hr>") - 1);
 
+    if (ctx->page > 1 || ctx->more) {
+        b->last = ngx_cpymem(b->last, "<pre>", sizeof("<pre>") - 1);
+
+        if (ctx->page > 1) {
+            b->last = ngx_sprintf(b->last,
+                                  "<a href=\"?page=%ui\">&lt; previous</a>",
+                                  ctx->page - 1);
+        }
+
+        if (ctx->more) {
+            if (ctx->page > 1) {
+                *b->last++ = ' ';
+            }
+
+            b->last = ngx_sprintf(b->last,
+                                  "<a href=\"?page=%ui\">next &gt;</a>",
+                                  ctx->page + 1);
+        }
+
+        b->last = ngx_cpymem(b->last, "</pre><hr>", sizeof("</pre><hr>") - 1);
+    }
+
     b->last = ngx_cpymem(b->last, tail, sizeof(tail) - 1);
 
     return b;
@@ -700,18 +1149,38 @@ ngx_http_autoindex_html(ngx_http_request_t *r, ngx_array_t *entries)
 
 
 static ngx_buf_t *
-ngx_http_autoindex_json(ngx_http_request_t *r, ngx_array_t *entries,
-    ngx_str_t *callback)
+ngx_http_autoindex_json(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx,
+    ngx_array_t *entries)
 {
     size_t                       len, entry_len;
     ngx_buf_t                   *b;
+    ngx_str_t                   *callback;
     ngx_uint_t                   i;
     ngx_http_autoindex_entry_t  *entry;
 
-    len = sizeof("[" CRLF CRLF "]") - 1;
+    if (ctx->format == NGX_HTTP_AUTOINDEX_JSONP) {
+        callback = &ctx->callback;
 
-    if (callback) {
-        len += sizeof("/* callback */" CRLF "();") - 1 + callback->len;
+    } else {
+        callback = NULL;
+    }
+
+    len = 0;
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
+        len += sizeof("[") - 1;
+
+        if (callback) {
+            len += sizeof("/* callback */" CRLF "(") - 1 + callback->len;
+        }
+    }
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+        len += sizeof(CRLF "]") - 1;
+
+        if (callback) {
+            len += sizeof(");") - 1;
+        }
     }
 
     entry = entries->elts;
@@ -742,18 +1211,28 @@ ngx_http_autoindex_json(ngx_http_request_t *r, ngx_array_t *entries,
         return NULL;
     }
 
-    if (callback) {
-        b->last = ngx_cpymem(b->last, "/* callback */" CRLF,
-                             sizeof("/* callback */" CRLF) - 1);
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
 
-        b->last = ngx_cpymem(b->last, callback->data, callback->len);
+        if (callback) {
+            b->last = ngx_cpymem(b->last, "/* callback */" CRLF,
+                                 sizeof("/* callback */" CRLF) - 1);
 
-        *b->last++ = '(';
-    }
+            b->last = ngx_cpymem(b->last, callback->data, callback->len);
 
-    *b->last++ = '[';
+            *b->last++ = '(';
+        }
+
+        *b->last++ = '[';
+    }
 
     for (i = 0; i < entries->nelts; i++) {
+
+        /* entries of the previous parts need a comma too */
+
+        if (i > 0 || ctx->count > 0) {
+            *b->last++ = ',';
+        }
+
         b->last = ngx_cpymem(b->last, CRLF "{ \"name\":\"",
                              sizeof(CRLF "{ \"name\":\"") - 1);
 
@@ -792,17 +1271,15 @@ ngx_http_autoindex_json(ngx_http_request_t *r, ngx_array_t *entries,
             *b->last++ = '"';
         }
 
-        b->last = ngx_cpymem(b->last, " },", sizeof(" },") - 1);
-    }
-
-    if (i > 0) {
-        b->last--;  /* strip last comma */
+        b->last = ngx_cpymem(b->last, " }", sizeof(" }") - 1);
     }
 
-    b->last = ngx_cpymem(b->last, CRLF "]", sizeof(CRLF "]") - 1);
+    if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+        b->last = ngx_cpymem(b->last, CRLF "]", sizeof(CRLF "]") - 1);
 
-    if (callback) {
-        *b->last++ = ')'; *b->last++ = ';';
+        if (callback) {
+            *b->last++ = ')'; *b->last++ = ';';
+        }
     }
 
     return b;
@@ -851,7 +1328,8 @@ ngx_http_autoindex_jsonp_callback(ngx_http_request_t *r, ngx_str_t *callback)
 
 
 static ngx_buf_t *
-ngx_http_autoindex_xml(ngx_http_request_t *r, ngx_array_t *entries)
+ngx_http_autoindex_xml(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx,
+    ngx_array_t *entries)
 {
     size_t                          len, entry_len;
     ngx_tm_t                        tm;
@@ -863,7 +1341,15 @@ ngx_http_autoindex_xml(ngx_http_request_t *r, ngx_array_t *entries)
     static u_char  head[] = "<?xml version=\"1.0\"?>" CRLF "<list>" CRLF;
     static u_char  tail[] = "</list>" CRLF;
 
-    len = sizeof(head) - 1 + sizeof(tail) - 1;
+    len = 0;
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
+        len += sizeof(head) - 1;
+    }
+
+    if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+        len += sizeof(tail) - 1;
+    }
 
     entry = entries->elts;
 
@@ -891,7 +1377,9 @@ ngx_http_autoindex_xml(ngx_http_request_t *r, ngx_array_t *entries)
         return NULL;
     }
 
-    b->last = ngx_cpymem(b->last, head, sizeof(head) - 1);
+    if (ctx->part & NGX_HTTP_AUTOINDEX_FIRST) {
+        b->last = ngx_cpymem(b->last, head, sizeof(head) - 1);
+    }
 
     for (i = 0; i < entries->nelts; i++) {
         *b->last++ = '<';
@@ -942,7 +1430,9 @@ ngx_http_autoindex_xml(ngx_http_request_t *r, ngx_array_t *entries)
         *b->last++ = CR; *b->last++ = LF;
     }
 
-    b->last = ngx_cpymem(b->last, tail, sizeof(tail) - 1);
+    if (ctx->part & NGX_HTTP_AUTOINDEX_LAST) {
+        b->last = ngx_cpymem(b->last, tail, sizeof(tail) - 1);
+    }
 
     return b;
 }
@@ -968,53 +1458,359 @@ ngx_http_autoindex_cmp_entries(const void *one, const void *two)
 }
 
 
-#if 0
+static void
+ngx_http_autoindex_cleanup(void *data)
+{
+    ngx_http_autoindex_ctx_t  *ctx = data;
+
+    ngx_http_autoindex_close_dir(ctx);
+}
+
+
+static void
+ngx_http_autoindex_close_dir(ngx_http_autoindex_ctx_t *ctx)
+{
+    if (!ctx->opened) {
+        return;
+    }
+
+    ctx->opened = 0;
+
+    if (ngx_close_dir(&ctx->dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &ctx->path);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_autoindex_error(ngx_http_request_t *r, ngx_http_autoindex_ctx_t *ctx)
+{
+    ngx_http_autoindex_close_dir(ctx);
+
+    return r->header_sent ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
 
 static ngx_buf_t *
-ngx_http_autoindex_alloc(ngx_http_autoindex_ctx_t *ctx, size_t size)
+ngx_http_autoindex_cache_lookup(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx)
 {
-    ngx_chain_t  *cl;
+    u_char                           *p;
+    u_char                            buf[8 * (NGX_INT_T_LEN + 1)];
+    ngx_buf_t                        *b;
+    ngx_md5_t                         md5;
+    ngx_time_t                       *tp;
+    ngx_file_info_t                   fi;
+    ngx_http_autoindex_cache_t       *cache;
+    ngx_http_autoindex_loc_conf_t    *alcf;
+    ngx_http_autoindex_cache_node_t  *node;
 
-    if (ctx->buf) {
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_autoindex_module);
 
-        if ((size_t) (ctx->buf->end - ctx->buf->last) >= size) {
-            return ctx->buf;
-        }
+    cache = alcf->cache->data;
 
-        ctx->size += ctx->buf->last - ctx->buf->pos;
+    if (ngx_file_info(ctx->path.data, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_file_info_n " \"%V\" failed", &ctx->path);
+        return NULL;
     }
 
-    ctx->buf = ngx_create_temp_buf(ctx->pool, ctx->alloc_size);
-    if (ctx->buf == NULL) {
+    ctx->uniq = ngx_file_uniq(&fi);
+    ctx->mtime = ngx_file_mtime(&fi);
+
+    /* the listing depends on the directory, URI, and output settings */
+
+    tp = ngx_timeofday();
+
+    p = ngx_sprintf(buf, " %ui %ui %i %i %i %i %i %V",
+                    ctx->format, ctx->page, alcf->page_size, alcf->sort,
+                    alcf->localtime, alcf->exact_size,
+                    alcf->localtime ? tp->gmtoff : 0,
+                    &r->headers_out.charset);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, ctx->path.data, ctx->path.len + 1);
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+    ngx_md5_update(&md5, buf, p - buf);
+    ngx_md5_update(&md5, ctx->callback.data, ctx->callback.len);
+    ngx_md5_final(ctx->key, &md5);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_autoindex_cache_find(cache, ctx->key);
+
+    if (node == NULL
+        || node->uniq != ctx->uniq
+        || node->mtime != ctx->mtime)
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http autoindex cache %s",
+                       node ? "expired" : "miss");
+
+        /*
+         * a directory modified within the current second may change
+         * again without its mtime being updated
+         */
+
+        if (ctx->mtime < ngx_time()) {
+            ctx->cache = 1;
+        }
+
         return NULL;
     }
 
-    cl = ngx_alloc_chain_link(ctx->pool);
-    if (cl == NULL) {
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    b = ngx_create_temp_buf(r->pool, node->len);
+    if (b == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
         return NULL;
     }
 
-    cl->buf = ctx->buf;
-    cl->next = NULL;
+    b->last = ngx_cpymem(b->last, node->data, node->len);
 
-    *ctx->last_out = cl;
-    ctx->last_out = &cl->next;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    return ctx->buf;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http autoindex cache hit: %uz",
+                   (size_t) (b->last - b->pos));
+
+    return b;
 }
 
-#endif
+
+static void
+ngx_http_autoindex_cache_store(ngx_http_request_t *r,
+    ngx_http_autoindex_ctx_t *ctx, ngx_buf_t *b)
+{
+    size_t                            len;
+    ngx_queue_t                      *q;
+    ngx_http_autoindex_cache_t       *cache;
+    ngx_http_autoindex_loc_conf_t    *alcf;
+    ngx_http_autoindex_cache_node_t  *node, *old;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_autoindex_module);
+
+    cache = alcf->cache->data;
+
+    len = b->last - b->pos;
+
+    if (len > cache->max_entry_size) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    old = ngx_http_autoindex_cache_find(cache, ctx->key);
+
+    if (old) {
+
+        if (old->uniq == ctx->uniq && old->mtime == ctx->mtime) {
+            goto done;
+        }
+
+        /* the directory was changed since the entry was stored */
+
+        ngx_queue_remove(&old->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool,
+                               offsetof(ngx_http_autoindex_cache_node_t, data)
+                               + len);
+        if (node) {
+            break;
+        }
+
+        /* free the least recently used entries */
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "could not allocate autoindex cache entry "
+                          "of %uz bytes", len);
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        old = ngx_queue_data(q, ngx_http_autoindex_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, ctx->key,
+               sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &ctx->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->uniq = ctx->uniq;
+    node->mtime = ctx->mtime;
+    node->len = len;
+
+    ngx_memcpy(node->data, b->pos, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http autoindex cache store: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_http_autoindex_cache_node_t *
+ngx_http_autoindex_cache_find(ngx_http_autoindex_cache_t *cache, u_char *key)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_key_t                  node_key;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_http_autoindex_cache_node_t  *acn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        acn = (ngx_http_autoindex_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], acn->key,
+                        NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN
+                        - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return acn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_autoindex_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_http_autoindex_cache_node_t   *acn, *acnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            acn = (ngx_http_autoindex_cache_node_t *) node;
+            acnt = (ngx_http_autoindex_cache_node_t *) temp;
+
+            p = (ngx_memcmp(acn->key, acnt->key,
+                            NGX_HTTP_AUTOINDEX_CACHE_KEY_LEN
+                            - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
 
 static ngx_int_t
-ngx_http_autoindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+ngx_http_autoindex_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    if (ngx_close_dir(dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_dir_n " \"%V\" failed", name);
+    ngx_http_autoindex_cache_t  *ocache = data;
+
+    size_t                       len;
+    ngx_http_autoindex_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
     }
 
-    return r->header_sent ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_autoindex_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_autoindex_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in autoindex cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in autoindex cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
 }
 
 
@@ -1032,6 +1828,9 @@ ngx_http_autoindex_create_loc_conf(ngx_conf_t *cf)
     conf->format = NGX_CONF_UNSET_UINT;
     conf->localtime = NGX_CONF_UNSET;
     conf->exact_size = NGX_CONF_UNSET;
+    conf->sort = NGX_CONF_UNSET;
+    conf->page_size = NGX_CONF_UNSET;
+    conf->cache = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -1048,6 +1847,151 @@ ngx_http_autoindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               NGX_HTTP_AUTOINDEX_HTML);
     ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
     ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
+    ngx_conf_merge_value(conf->sort, prev->sort, 1);
+    ngx_conf_merge_value(conf->page_size, prev->page_size, 0);
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
+    if (conf->page_size < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"autoindex_page_size\" value");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_autoindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                      *p;
+    ssize_t                      size;
+    ngx_str_t                   *value, name, s;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_http_autoindex_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_autoindex_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->max_entry_size = 1024 * 1024;
+
+    size = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_entry_size=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            cache->max_entry_size = ngx_parse_size(&s);
+
+            if (cache->max_entry_size == (size_t) NGX_ERROR
+                || cache->max_entry_size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_entry_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_autoindex_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_autoindex_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_autoindex_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_autoindex_loc_conf_t *alcf = conf;
+
+    ngx_str_t  *value;
+
+    if (alcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    alcf->cache = ngx_shared_memory_add(cf, &value[1], 0,
+                                        &ngx_http_autoindex_module);
+    if (alcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -19,6 +19,9 @@
 
 #define NGX_HTML_ENTITY_LEN     (sizeof("&#1114111;") - 1)
 
+/* the high bits of all bytes in a machine word */
+#define NGX_HTTP_CHARSET_8BIT   ((uintptr_t) -1 / 0xff * 0x80)
+
 
 typedef struct {
     u_char                    **tables;
@@ -26,6 +29,7 @@ typedef struct {
 
     unsigned                    length:16;
     unsigned                    utf8:1;
+    unsigned                    ascii_map:1;
 } ngx_http_charset_t;
 
 
@@ -75,6 +79,7 @@ typedef struct {
     unsigned                    length:16;
     unsigned                    from_utf8:1;
     unsigned                    to_utf8:1;
+    unsigned                    ascii:1;
 } ngx_http_charset_ctx_t;
 
 
@@ -97,6 +102,8 @@ static ngx_inline void ngx_http_set_charset(ngx_http_request_t *r,
 static ngx_int_t ngx_http_charset_ctx(ngx_http_request_t *r,
     ngx_http_charset_t *charsets, ngx_int_t charset, ngx_int_t source_charset);
 static ngx_uint_t ngx_http_charset_recode(ngx_buf_t *b, u_char *table);
+static ngx_inline u_char *ngx_http_charset_skip_ascii(u_char *p,
+    u_char *last);
 static ngx_chain_t *ngx_http_charset_recode_from_utf8(ngx_pool_t *pool,
     ngx_buf_t *buf, ngx_http_charset_ctx_t *ctx);
 static ngx_chain_t *ngx_http_charset_recode_to_utf8(ngx_pool_t *pool,
@@ -529,6 +536,7 @@ ngx_http_charset_ctx(ngx_http_request_t *r, ngx_http_charset_t *charsets,
     ctx->length = charsets[charset].length;
     ctx->from_utf8 = charsets[source_charset].utf8;
     ctx->to_utf8 = charsets[charset].utf8;
+    ctx->ascii = !charsets[source_charset].ascii_map;
 
     r->filter_need_in_memory = 1;
 
@@ -681,6 +689,31 @@ recode:
 }
 
 
+static ngx_inline u_char *
+ngx_http_charset_skip_ascii(u_char *p, u_char *last)
+{
+    uintptr_t  w[2];
+
+    /* test two machine words at once */
+
+    while ((size_t) (last - p) >= sizeof(w)) {
+        ngx_memcpy(w, p, sizeof(w));
+
+        if ((w[0] | w[1]) & NGX_HTTP_CHARSET_8BIT) {
+            break;
+        }
+
+        p += sizeof(w);
+    }
+
+    while (p < last && *p < 0x80) {
+        p++;
+    }
+
+    return p;
+}
+
+
 static ngx_chain_t *
 ngx_http_charset_recode_from_utf8(ngx_pool_t *pool, ngx_buf_t *buf,
     ngx_http_charset_ctx_t *ctx)
@@ -696,11 +729,9 @@ ngx_http_charset_recode_from_utf8(ngx_pool_t *pool, ngx_buf_t *buf,
 
     if (ctx->saved_len == 0) {
 
-        for ( /* void */ ; src < buf->last; src++) {
+        src = ngx_http_charset_skip_ascii(src, buf->last);
 
-            if (*src < 0x80) {
-                continue;
-            }
+        if (src < buf->last) {
 
             len = src - buf->pos;
 
@@ -896,7 +927,12 @@ recode:
         }
 
         if (*src < 0x80) {
-            *dst++ = *src++;
+            len = ngx_http_charset_skip_ascii(src, buf->last) - src;
+            len = ngx_min(len, (size_t) (b->end - dst));
+
+            dst = ngx_cpymem(dst, src, len);
+            src += len;
+
             continue;
         }
 
@@ -974,6 +1010,15 @@ ngx_http_charset_recode_to_utf8(ngx_pool_t *pool, ngx_buf_t *buf,
     table = ctx->table;
 
     for (src = buf->pos; src < buf->last; src++) {
+
+        if (*src < 0x80 && ctx->ascii) {
+            src = ngx_http_charset_skip_ascii(src, buf->last);
+
+            if (src == buf->last) {
+                break;
+            }
+        }
+
         if (table[*src * NGX_UTF_LEN] == '\1') {
             continue;
         }
@@ -1050,6 +1095,18 @@ recode:
 
     while (src < buf->last) {
 
+        if (*src < 0x80 && ctx->ascii) {
+            len = ngx_http_charset_skip_ascii(src, buf->last) - src;
+            len = ngx_min(len, (size_t) (b->end - dst));
+
+            if (len) {
+                dst = ngx_cpymem(dst, src, len);
+                src += len;
+
+                continue;
+            }
+        }
+
         p = &table[*src++ * NGX_UTF_LEN];
         len = *p++;
 
@@ -1306,11 +1363,14 @@ ngx_http_charset_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static char *
 ngx_http_charset_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
 {
+    ngx_http_charset_main_conf_t  *mcf = conf;
+
     u_char                       *p, *dst2src, **pp;
     uint32_t                      n;
     ngx_int_t                     src, dst;
     ngx_str_t                    *value;
     ngx_uint_t                    i;
+    ngx_http_charset_t           *charset;
     ngx_http_charset_tables_t    *table;
     ngx_http_charset_conf_ctx_t  *ctx;
 
@@ -1338,6 +1398,14 @@ ngx_http_charset_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
             return NGX_CONF_ERROR;
         }
 
+        if (src < 0x80
+            && (value[1].len != 2 || ngx_hextoi(value[1].data, 2) != src))
+        {
+            /* ASCII is not passed as is */
+            charset = mcf->charsets.elts;
+            charset[table->src].ascii_map = 1;
+        }
+
         p = &table->src2dst[src * NGX_UTF_LEN];
 
         *p++ = (u_char) (value[1].len / 2);
@@ -1480,6 +1548,7 @@ ngx_http_add_charset(ngx_array_t *charsets, ngx_str_t *name)
     c->tables = NULL;
     c->name = *name;
     c->length = 0;
+    c->ascii_map = 0;
 
     if (ngx_strcasecmp(name->data, (u_char *) "utf-8") == 0) {
         c->utf8 = 1;
@@ -23,9 +23,15 @@ typedef struct {
     ngx_uint_t  access;
     ngx_uint_t  min_delete_depth;
     ngx_flag_t  create_full_put_path;
+    ngx_flag_t  direct_put;
 } ngx_http_dav_loc_conf_t;
 
 
+typedef struct {
+    ngx_str_t   path;
+} ngx_http_dav_ctx_t;
+
+
 typedef struct {
     ngx_str_t   path;
     size_t      len;
@@ -34,6 +40,9 @@ typedef struct {
 
 static ngx_int_t ngx_http_dav_handler(ngx_http_request_t *r);
 
+static ngx_int_t ngx_http_dav_direct_put(ngx_http_request_t *r);
+static ngx_int_t ngx_http_dav_request_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
 static void ngx_http_dav_put_handler(ngx_http_request_t *r);
 
 static ngx_int_t ngx_http_dav_delete_handler(ngx_http_request_t *r);
@@ -90,6 +99,13 @@ static ngx_command_t  ngx_http_dav_commands[] = {
       offsetof(ngx_http_dav_loc_conf_t, create_full_put_path),
       NULL },
 
+    { ngx_string("dav_direct_put"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_dav_loc_conf_t, direct_put),
+      NULL },
+
     { ngx_string("min_delete_depth"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -139,6 +155,12 @@ ngx_module_t  ngx_http_dav_module = {
 };
 
 
+static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
+
+/* request bodies written next to the destination file use no levels */
+static ngx_path_t                        ngx_http_dav_direct_path;
+
+
 static ngx_int_t
 ngx_http_dav_handler(ngx_http_request_t *r)
 {
@@ -173,6 +195,10 @@ ngx_http_dav_handler(ngx_http_request_t *r)
         r->request_body_file_group_access = 1;
         r->request_body_file_log_level = 0;
 
+        if (dlcf->direct_put && ngx_http_dav_direct_put(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
         rc = ngx_http_read_client_request_body(r, ngx_http_dav_put_handler);
 
         if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
@@ -202,6 +228,113 @@ ngx_http_dav_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_dav_direct_put(ngx_http_request_t *r)
+{
+    u_char              *p;
+    size_t               root;
+    ngx_str_t            path;
+    ngx_uint_t           dir;
+    ngx_file_info_t      fi;
+    ngx_http_dav_ctx_t  *ctx;
+
+    if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL) {
+        return NGX_ERROR;
+    }
+
+    path.len--;
+
+    /*
+     * the body is written to a temporary file in the directory
+     * of the destination, so it is not copied from another file system;
+     * the directory may not exist yet with "create_full_put_path"
+     */
+
+    for (p = path.data + path.len; p > path.data; p--) {
+        if (*p == '/') {
+            break;
+        }
+    }
+
+    if (p == path.data) {
+        return NGX_OK;
+    }
+
+    *p = '\0';
+
+    dir = (ngx_file_info(path.data, &fi) != NGX_FILE_ERROR
+           && ngx_is_dir(&fi));
+
+    *p = '/';
+
+    if (!dir) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http put no directory for \"%s\"", path.data);
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_dav_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->path = path;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_dav_module);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dav_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_temp_file_t          *tf;
+    ngx_http_dav_ctx_t       *ctx;
+    ngx_http_request_body_t  *rb;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_dav_module);
+    rb = r->request_body;
+
+    if (ctx == NULL || rb == NULL || rb->temp_file) {
+        return ngx_http_next_request_body_filter(r, in);
+    }
+
+    /*
+     * the temporary file is created by ngx_http_write_request_body()
+     * as "<destination>.<number>", or without a name if supported,
+     * and is moved into place with ngx_ext_rename_temp_file()
+     */
+
+    tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+    if (tf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tf->file.fd = NGX_INVALID_FILE;
+    tf->file.name = ctx->path;
+    tf->file.unnamed = 1;
+    tf->file.log = r->connection->log;
+    tf->path = &ngx_http_dav_direct_path;
+    tf->pool = r->pool;
+    tf->warn = "a client request body is buffered to a temporary file";
+    tf->log_level = r->request_body_file_log_level;
+    tf->persistent = r->request_body_in_persistent_file;
+    tf->clean = r->request_body_in_clean_file;
+
+    if (r->request_body_file_group_access) {
+        tf->access = 0660;
+    }
+
+    rb->temp_file = tf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http put direct to \"%V\"", &ctx->path);
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
+
 static void
 ngx_http_dav_put_handler(ngx_http_request_t *r)
 {
@@ -210,6 +343,7 @@ ngx_http_dav_put_handler(ngx_http_request_t *r)
     ngx_str_t                *temp, path;
     ngx_uint_t                status;
     ngx_file_info_t           fi;
+    ngx_temp_file_t          *tf;
     ngx_ext_rename_file_t     ext;
     ngx_http_dav_loc_conf_t  *dlcf;
 
@@ -237,7 +371,22 @@ ngx_http_dav_put_handler(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http put filename: \"%s\"", path.data);
 
-    temp = &r->request_body->temp_file->file.name;
+    tf = r->request_body->temp_file;
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+
+        /* an empty body with the temporary file set by the body filter */
+
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    temp = &tf->file.name;
 
     if (ngx_file_info(path.data, &fi) == NGX_FILE_ERROR) {
         status = NGX_HTTP_CREATED;
@@ -249,7 +398,9 @@ ngx_http_dav_put_handler(ngx_http_request_t *r)
             ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_EISDIR,
                           "\"%s\" could not be created", path.data);
 
-            if (ngx_delete_file(temp->data) == NGX_FILE_ERROR) {
+            if (!tf->file.unnamed
+                && ngx_delete_file(temp->data) == NGX_FILE_ERROR)
+            {
                 ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
                               ngx_delete_file_n " \"%s\" failed",
                               temp->data);
@@ -275,11 +426,11 @@ ngx_http_dav_put_handler(ngx_http_request_t *r)
 
         if (date != NGX_ERROR) {
             ext.time = date;
-            ext.fd = r->request_body->temp_file->file.fd;
+            ext.fd = tf->file.fd;
         }
     }
 
-    if (ngx_ext_rename_file(temp, &path, &ext) != NGX_OK) {
+    if (ngx_ext_rename_temp_file(tf, &path, &ext) != NGX_OK) {
         ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
@@ -1128,6 +1279,7 @@ ngx_http_dav_create_loc_conf(ngx_conf_t *cf)
     conf->min_delete_depth = NGX_CONF_UNSET_UINT;
     conf->access = NGX_CONF_UNSET_UINT;
     conf->create_full_put_path = NGX_CONF_UNSET;
+    conf->direct_put = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -1150,6 +1302,8 @@ ngx_http_dav_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->create_full_put_path,
                          prev->create_full_put_path, 0);
 
+    ngx_conf_merge_value(conf->direct_put, prev->direct_put, 0);
+
     return NGX_CONF_OK;
 }
 
@@ -1169,5 +1323,8 @@ ngx_http_dav_init(ngx_conf_t *cf)
 
     *h = ngx_http_dav_handler;
 
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_dav_request_body_filter;
+
     return NGX_OK;
 }
@@ -8,10 +8,39 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 #include <zlib.h>
 
 
+#define NGX_HTTP_GZIP_CACHE_KEY_LEN  16
+
+
+typedef struct {
+    ngx_rbtree_node_t    node;
+    ngx_queue_t          queue;
+    u_char               key[NGX_HTTP_GZIP_CACHE_KEY_LEN
+                             - sizeof(ngx_rbtree_key_t)];
+    size_t               len;
+    size_t               zin;
+    u_char               data[1];
+} ngx_http_gzip_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t         rbtree;
+    ngx_rbtree_node_t    sentinel;
+    ngx_queue_t          queue;
+} ngx_http_gzip_cache_shctx_t;
+
+
+typedef struct {
+    ngx_http_gzip_cache_shctx_t  *sh;
+    ngx_slab_pool_t              *shpool;
+    size_t                        max_entry_size;
+} ngx_http_gzip_cache_t;
+
+
 typedef struct {
     ngx_flag_t           enable;
     ngx_flag_t           no_buffer;
@@ -26,6 +55,12 @@ typedef struct {
     size_t               memlevel;
     ssize_t              min_length;
 
+    ngx_shm_zone_t      *cache;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t   *thread_pool;
+#endif
+
     ngx_array_t         *types_keys;
 } ngx_http_gzip_conf_t;
 
@@ -44,10 +79,18 @@ typedef struct {
     ngx_buf_t           *out_buf;
     ngx_int_t            bufs;
 
+    ngx_buf_t           *cached;
+    ngx_buf_t           *store;
+    u_char               key[NGX_HTTP_GZIP_CACHE_KEY_LEN];
+
     void                *preallocated;
     char                *free_mem;
     ngx_uint_t           allocated;
 
+#if (NGX_THREADS)
+    ngx_thread_task_t   *thread_task;
+#endif
+
     int                  wbits;
     int                  memlevel;
 
@@ -58,6 +101,10 @@ typedef struct {
     unsigned             buffering:1;
     unsigned             zlib_ng:1;
     unsigned             state_allocated:1;
+    unsigned             cache:1;
+    unsigned             cache_hit:1;
+    unsigned             deflating:1;
+    unsigned             deflated:1;
 
     size_t               zin;
     size_t               zout;
@@ -67,6 +114,18 @@ typedef struct {
 } ngx_http_gzip_ctx_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    z_stream            *zstream;
+    int                  flush;
+    int                  rc;
+} ngx_http_gzip_thread_ctx_t;
+
+#endif
+
+
+static ngx_int_t ngx_http_gzip_filter_test(ngx_http_request_t *r);
 static void ngx_http_gzip_filter_memory(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_buffer(ngx_http_gzip_ctx_t *ctx,
@@ -81,6 +140,12 @@ static ngx_int_t ngx_http_gzip_filter_deflate(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_gzip_filter_deflate_thread(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_gzip_thread_event_handler(ngx_event_t *ev);
+#endif
 
 static void *ngx_http_gzip_filter_alloc(void *opaque, u_int items,
     u_int size);
@@ -88,6 +153,22 @@ static void ngx_http_gzip_filter_free(void *opaque, void *address);
 static void ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 
+static ngx_int_t ngx_http_gzip_cache_cacheable(ngx_http_request_t *r);
+static ngx_int_t ngx_http_gzip_cache_lookup(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static ngx_int_t ngx_http_gzip_cache_send(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx, ngx_chain_t *in);
+static void ngx_http_gzip_cache_copy(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_cache_store(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static ngx_http_gzip_cache_node_t *ngx_http_gzip_cache_find(
+    ngx_http_gzip_cache_t *cache, u_char *key);
+static void ngx_http_gzip_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_gzip_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static ngx_int_t ngx_http_gzip_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -98,6 +179,14 @@ static char *ngx_http_gzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
 static char *ngx_http_gzip_window(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_gzip_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_gzip_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#if (NGX_THREADS)
+static char *ngx_http_gzip_threads(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
 
 
 static ngx_conf_num_bounds_t  ngx_http_gzip_comp_level_bounds = {
@@ -174,6 +263,31 @@ static ngx_command_t  ngx_http_gzip_filter_commands[] = {
       offsetof(ngx_http_gzip_conf_t, min_length),
       NULL },
 
+    { ngx_string("gzip_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_gzip_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("gzip_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_gzip_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+#if (NGX_THREADS)
+
+    { ngx_string("gzip_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_gzip_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -209,6 +323,7 @@ ngx_module_t  ngx_http_gzip_filter_module = {
 };
 
 
+static ngx_str_t  ngx_http_gzip_encoding = ngx_string("gzip");
 static ngx_str_t  ngx_http_gzip_ratio = ngx_string("gzip_ratio");
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
@@ -218,10 +333,8 @@ static ngx_uint_t  ngx_http_gzip_assume_zlib_ng;
 
 
 static ngx_int_t
-ngx_http_gzip_header_filter(ngx_http_request_t *r)
+ngx_http_gzip_filter_test(ngx_http_request_t *r)
 {
-    ngx_table_elt_t       *h;
-    ngx_http_gzip_ctx_t   *ctx;
     ngx_http_gzip_conf_t  *conf;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
@@ -237,7 +350,7 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
         || ngx_http_test_content_type(r, &conf->types) == NULL
         || r->header_only)
     {
-        return ngx_http_next_header_filter(r);
+        return NGX_DECLINED;
     }
 
     r->gzip_vary = 1;
@@ -249,20 +362,39 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (clcf->gzip_disable_degradation && ngx_http_degraded(r)) {
-        return ngx_http_next_header_filter(r);
+        return NGX_DECLINED;
     }
     }
 #endif
 
     if (!r->gzip_tested) {
         if (ngx_http_gzip_ok(r) != NGX_OK) {
-            return ngx_http_next_header_filter(r);
+            return NGX_DECLINED;
         }
 
     } else if (!r->gzip_ok) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_header_filter(ngx_http_request_t *r)
+{
+    ngx_table_elt_t       *h;
+    ngx_http_gzip_ctx_t   *ctx;
+    ngx_http_gzip_conf_t  *conf;
+
+    if (ngx_http_gzip_filter_test(r) != NGX_OK
+        || ngx_http_encoding_preferred(r, &ngx_http_gzip_encoding) != NGX_OK)
+    {
         return ngx_http_next_header_filter(r);
     }
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_gzip_ctx_t));
     if (ctx == NULL) {
         return NGX_ERROR;
@@ -275,6 +407,12 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
 
     ngx_http_gzip_filter_memory(r, ctx);
 
+    if (conf->cache) {
+        if (ngx_http_gzip_cache_lookup(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     h = ngx_list_push(&r->headers_out.headers);
     if (h == NULL) {
         return NGX_ERROR;
@@ -286,12 +424,17 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     ngx_str_set(&h->value, "gzip");
     r->headers_out.content_encoding = h;
 
-    r->main_filter_need_in_memory = 1;
-
     ngx_http_clear_content_length(r);
     ngx_http_clear_accept_ranges(r);
     ngx_http_weak_etag(r);
 
+    if (ctx->cache_hit) {
+        r->headers_out.content_length_n = ctx->zout;
+
+    } else {
+        r->main_filter_need_in_memory = 1;
+    }
+
     return ngx_http_next_header_filter(r);
 }
 
@@ -313,6 +456,29 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http gzip filter");
 
+    if (ctx->cache_hit) {
+        return ngx_http_gzip_cache_send(r, ctx, in);
+    }
+
+#if (NGX_THREADS)
+
+    if (ctx->deflating) {
+
+        /* zlib state and buffers are used by a thread */
+
+        if (in) {
+            if (ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+        }
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     if (ctx->buffering) {
 
         /*
@@ -410,7 +576,7 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             rc = ngx_http_gzip_filter_deflate(r, ctx);
 
-            if (rc == NGX_OK) {
+            if (rc == NGX_OK || rc == NGX_BUSY) {
                 break;
             }
 
@@ -424,7 +590,11 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         if (ctx->out == NULL && !flush) {
             ngx_http_gzip_filter_free_copy_buf(r, ctx);
 
-            return ctx->busy ? NGX_AGAIN : NGX_OK;
+            return (ctx->busy || ctx->deflating) ? NGX_AGAIN : NGX_OK;
+        }
+
+        if (ctx->cache) {
+            ngx_http_gzip_cache_copy(r, ctx);
         }
 
         rc = ngx_http_next_body_filter(r, ctx->out);
@@ -442,7 +612,15 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         ctx->nomem = 0;
         flush = 0;
 
+        if (ctx->deflating) {
+            return NGX_AGAIN;
+        }
+
         if (ctx->done) {
+            if (ctx->cache) {
+                ngx_http_gzip_cache_store(r, ctx);
+            }
+
             return rc;
         }
     }
@@ -644,7 +822,9 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
     ngx_chain_t  *cl;
 
-    if (ctx->zstream.avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
+    if (ctx->zstream.avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo
+        || ctx->deflated)
+    {
         return NGX_OK;
     }
 
@@ -707,7 +887,7 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
     ngx_chain_t           *cl;
     ngx_http_gzip_conf_t  *conf;
 
-    if (ctx->zstream.avail_out) {
+    if (ctx->zstream.avail_out || ctx->deflated) {
         return NGX_OK;
     }
 
@@ -758,8 +938,33 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
                  ctx->zstream.avail_in, ctx->zstream.avail_out,
                  ctx->flush, ctx->redo);
 
+#if (NGX_THREADS)
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    if (conf->thread_pool) {
+
+        if (!ctx->deflated) {
+            if (ngx_http_gzip_filter_deflate_thread(r, ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_BUSY;
+        }
+
+        ctx->deflated = 0;
+        rc = ((ngx_http_gzip_thread_ctx_t *) ctx->thread_task->ctx)->rc;
+
+    } else {
+        rc = deflate(&ctx->zstream, ctx->flush);
+    }
+
+#else
+
     rc = deflate(&ctx->zstream, ctx->flush);
 
+#endif
+
     if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
         ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
                       "deflate() failed: %d, %d", ctx->flush, rc);
@@ -921,6 +1126,126 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_gzip_filter_deflate_thread(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
+{
+    ngx_thread_task_t           *task;
+    ngx_http_gzip_conf_t        *conf;
+    ngx_http_gzip_thread_ctx_t  *tctx;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    task = ctx->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_gzip_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->event.log = r->connection->log;
+        task->handler = ngx_http_gzip_thread_handler;
+
+        ctx->thread_task = task;
+    }
+
+    tctx = task->ctx;
+
+    tctx->zstream = &ctx->zstream;
+    tctx->flush = ctx->flush;
+
+    task->event.data = r;
+    task->event.handler = ngx_http_gzip_thread_event_handler;
+
+    if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&task->event, 60000);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    ctx->deflating = 1;
+
+    r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_gzip_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_gzip_thread_ctx_t  *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "gzip thread handler");
+
+    /* deflate() does not allocate memory, it is done by deflateInit2() */
+
+    ctx->rc = deflate(ctx->zstream, ctx->flush);
+}
+
+
+static void
+ngx_http_gzip_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_gzip_ctx_t  *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http gzip thread: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "thread operation took too long");
+        ev->timedout = 0;
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_gzip_filter_module);
+
+    ctx->deflating = 0;
+    ctx->deflated = 1;
+
+#if (NGX_HTTP_V2)
+
+    if (r->stream) {
+        c->write->ready = 1;
+        c->write->active = 0;
+    }
+
+#endif
+
+    if (r->done || r->main->terminated) {
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
 static void *
 ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
 {
@@ -1002,87 +1327,601 @@ ngx_http_gzip_filter_free_copy_buf(ngx_http_request_t *r,
 
 
 static ngx_int_t
-ngx_http_gzip_add_variables(ngx_conf_t *cf)
+ngx_http_gzip_cache_cacheable(ngx_http_request_t *r)
 {
-    ngx_http_variable_t  *var;
+    u_char           *p, *last, *token;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
 
-    var = ngx_http_add_variable(cf, &ngx_http_gzip_ratio, NGX_HTTP_VAR_NOHASH);
-    if (var == NULL) {
-        return NGX_ERROR;
-    }
+    /*
+     * responses which are private to a client or which depend on
+     * request headers other than Accept-Encoding are not cached
+     */
 
-    var->get_handler = ngx_http_gzip_ratio_variable;
+    part = &r->headers_out.headers.part;
+    h = part->elts;
 
-    return NGX_OK;
-}
+    for (i = 0; /* void */; i++) {
 
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
 
-static ngx_int_t
-ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t data)
-{
-    ngx_uint_t            zint, zfrac;
-    ngx_http_gzip_ctx_t  *ctx;
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_gzip_filter_module);
+        if (h[i].hash == 0) {
+            continue;
+        }
 
-    if (ctx == NULL || ctx->zout == 0) {
-        v->not_found = 1;
-        return NGX_OK;
-    }
+        if (h[i].key.len == sizeof("Set-Cookie") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Set-Cookie",
+                               sizeof("Set-Cookie") - 1)
+               == 0)
+        {
+            return NGX_DECLINED;
+        }
 
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
+        p = h[i].value.data;
+        last = p + h[i].value.len;
+
+        if (h[i].key.len == sizeof("Cache-Control") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "Cache-Control",
+                               sizeof("Cache-Control") - 1)
+               == 0)
+        {
+            if (ngx_strlcasestrn(p, last, (u_char *) "no-store", 8 - 1)
+                || ngx_strlcasestrn(p, last, (u_char *) "private", 7 - 1))
+            {
+                return NGX_DECLINED;
+            }
 
-    v->data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 3);
-    if (v->data == NULL) {
-        return NGX_ERROR;
-    }
+            continue;
+        }
 
-    zint = (ngx_uint_t) (ctx->zin / ctx->zout);
-    zfrac = (ngx_uint_t) ((ctx->zin * 100 / ctx->zout) % 100);
+        if (h[i].key.len != sizeof("Vary") - 1
+            || ngx_strncasecmp(h[i].key.data, (u_char *) "Vary",
+                               sizeof("Vary") - 1)
+               != 0)
+        {
+            continue;
+        }
 
-    if ((ctx->zin * 1000 / ctx->zout) % 10 > 4) {
+        while (p < last) {
 
-        /* the rounding, e.g., 2.125 to 2.13 */
+            while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+                p++;
+            }
 
-        zfrac++;
+            token = p;
 
-        if (zfrac > 99) {
-            zint++;
-            zfrac = 0;
+            while (p < last && *p != ' ' && *p != '\t' && *p != ',') {
+                p++;
+            }
+
+            if (p == token) {
+                break;
+            }
+
+            if ((size_t) (p - token) != sizeof("Accept-Encoding") - 1
+                || ngx_strncasecmp(token, (u_char *) "Accept-Encoding",
+                                   sizeof("Accept-Encoding") - 1)
+                   != 0)
+            {
+                return NGX_DECLINED;
+            }
         }
     }
 
-    v->len = ngx_sprintf(v->data, "%ui.%02ui", zint, zfrac) - v->data;
-
     return NGX_OK;
 }
 
 
-static void *
-ngx_http_gzip_create_conf(ngx_conf_t *cf)
+static ngx_int_t
+ngx_http_gzip_cache_lookup(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
-    ngx_http_gzip_conf_t  *conf;
+    u_char                       buf[NGX_OFF_T_LEN + NGX_TIME_T_LEN + 3];
+    size_t                       size;
+    ngx_md5_t                    md5;
+    ngx_http_gzip_conf_t        *conf;
+    ngx_http_gzip_cache_t       *cache;
+    ngx_http_gzip_cache_node_t  *node;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_gzip_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    cache = conf->cache->data;
 
     /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->bufs.num = 0;
-     *     conf->types = { NULL };
-     *     conf->types_keys = NULL;
+     * only responses with a known length and validators are cached,
+     * as they identify the response, e.g., a static file
      */
 
-    conf->enable = NGX_CONF_UNSET;
-    conf->no_buffer = NGX_CONF_UNSET;
+    if (r->headers_out.content_length_n <= 0
+        || r->headers_out.content_length_n > (off_t) cache->max_entry_size
+        || (r->headers_out.etag == NULL
+            && r->headers_out.last_modified_time == -1))
+    {
+        return NGX_DECLINED;
+    }
 
-    conf->postpone_gzipping = NGX_CONF_UNSET_SIZE;
+    if (ngx_http_gzip_cache_cacheable(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_md5_init(&md5);
+
+    if (r->headers_in.server.len) {
+        ngx_md5_update(&md5, r->headers_in.server.data,
+                       r->headers_in.server.len);
+    }
+
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+
+    if (r->args.len) {
+        ngx_md5_update(&md5, "?", 1);
+        ngx_md5_update(&md5, r->args.data, r->args.len);
+    }
+
+    if (r->headers_out.etag) {
+        ngx_md5_update(&md5, r->headers_out.etag->value.data,
+                       r->headers_out.etag->value.len);
+    }
+
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %O %T", r->headers_out.content_length_n,
+                               r->headers_out.last_modified_time)
+                   - buf);
+
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %i %d %d", conf->level, ctx->wbits,
+                               ctx->memlevel)
+                   - buf);
+
+    ngx_md5_final(ctx->key, &md5);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_gzip_cache_find(cache, ctx->key);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "gzip cache miss");
+
+        /* the deflate bound plus the gzip header and trailer */
+
+        size = (size_t) r->headers_out.content_length_n;
+        size += (size >> 12) + (size >> 14) + (size >> 25) + 13 + 18;
+
+        ctx->store = ngx_create_temp_buf(r->pool, size);
+        if (ctx->store == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->cache = 1;
+
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    /* the entry may be evicted once the lock is released */
+
+    ctx->cached = ngx_create_temp_buf(r->pool, node->len);
+
+    if (ctx->cached == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ctx->cached->last = ngx_cpymem(ctx->cached->pos, node->data, node->len);
+
+    ctx->zin = node->zin;
+    ctx->zout = node->len;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "gzip cache hit: %uz", ctx->zout);
+
+    ctx->cache_hit = 1;
+    ctx->buffering = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_send(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx,
+    ngx_chain_t *in)
+{
+    ngx_buf_t    *b;
+    ngx_uint_t    last;
+    ngx_chain_t  *cl, out;
+
+    /* the original response is not needed, it is consumed as is */
+
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->last_buf) {
+            last = 1;
+        }
+
+        b->pos = b->last;
+        b->file_pos = b->file_last;
+    }
+
+    if (ctx->cached) {
+        b = ctx->cached;
+        ctx->cached = NULL;
+
+    } else if (last) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else if (in == NULL) {
+        return ngx_http_next_body_filter(r, NULL);
+
+    } else {
+        return NGX_OK;
+    }
+
+    b->last_buf = last;
+
+    if (last) {
+        ctx->done = 1;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_next_body_filter(r, &out);
+}
+
+
+static void
+ngx_http_gzip_cache_copy(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t        size;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    for (cl = ctx->out; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (!ngx_buf_in_memory(b)) {
+            continue;
+        }
+
+        size = b->last - b->pos;
+
+        if (size > (size_t) (ctx->store->end - ctx->store->last)) {
+            ngx_pfree(r->pool, ctx->store->start);
+            ctx->store = NULL;
+            ctx->cache = 0;
+            return;
+        }
+
+        ctx->store->last = ngx_cpymem(ctx->store->last, b->pos, size);
+    }
+}
+
+
+static void
+ngx_http_gzip_cache_store(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
+{
+    size_t                       len;
+    ngx_queue_t                 *q;
+    ngx_http_gzip_conf_t        *conf;
+    ngx_http_gzip_cache_t       *cache;
+    ngx_http_gzip_cache_node_t  *node, *old;
+
+    ctx->cache = 0;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    cache = conf->cache->data;
+
+    len = ctx->store->last - ctx->store->pos;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_gzip_cache_find(cache, ctx->key)) {
+        goto done;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool,
+                                     offsetof(ngx_http_gzip_cache_node_t, data)
+                                     + len);
+        if (node) {
+            break;
+        }
+
+        /* free the least recently used entries */
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "could not allocate gzip cache entry of %uz bytes",
+                          len);
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        old = ngx_queue_data(q, ngx_http_gzip_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, ctx->key,
+               sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &ctx->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_GZIP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->len = len;
+    node->zin = ctx->zin;
+    ngx_memcpy(node->data, ctx->store->pos, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "gzip cache store: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_pfree(r->pool, ctx->store->start);
+    ctx->store = NULL;
+}
+
+
+static ngx_http_gzip_cache_node_t *
+ngx_http_gzip_cache_find(ngx_http_gzip_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_gzip_cache_node_t  *gcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        gcn = (ngx_http_gzip_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], gcn->key,
+                        NGX_HTTP_GZIP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return gcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_gzip_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_gzip_cache_node_t   *gcn, *gcnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            gcn = (ngx_http_gzip_cache_node_t *) node;
+            gcnt = (ngx_http_gzip_cache_node_t *) temp;
+
+            p = (ngx_memcmp(gcn->key, gcnt->key,
+                            NGX_HTTP_GZIP_CACHE_KEY_LEN
+                            - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_gzip_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_gzip_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_gzip_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_gzip_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_gzip_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in gzip cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in gzip cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var;
+
+    var = ngx_http_add_variable(cf, &ngx_http_gzip_ratio, NGX_HTTP_VAR_NOHASH);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_gzip_ratio_variable;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_uint_t            zint, zfrac;
+    ngx_http_gzip_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_gzip_filter_module);
+
+    if (ctx == NULL || ctx->zout == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    v->data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 3);
+    if (v->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    zint = (ngx_uint_t) (ctx->zin / ctx->zout);
+    zfrac = (ngx_uint_t) ((ctx->zin * 100 / ctx->zout) % 100);
+
+    if ((ctx->zin * 1000 / ctx->zout) % 10 > 4) {
+
+        /* the rounding, e.g., 2.125 to 2.13 */
+
+        zfrac++;
+
+        if (zfrac > 99) {
+            zint++;
+            zfrac = 0;
+        }
+    }
+
+    v->len = ngx_sprintf(v->data, "%ui.%02ui", zint, zfrac) - v->data;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_gzip_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_gzip_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_gzip_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bufs.num = 0;
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->no_buffer = NGX_CONF_UNSET;
+
+    conf->cache = NGX_CONF_UNSET_PTR;
+
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
+    conf->postpone_gzipping = NGX_CONF_UNSET_SIZE;
     conf->level = NGX_CONF_UNSET;
     conf->wbits = NGX_CONF_UNSET_SIZE;
     conf->memlevel = NGX_CONF_UNSET_SIZE;
@@ -1112,6 +1951,12 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
                               MAX_MEM_LEVEL - 1);
     ngx_conf_merge_value(conf->min_length, prev->min_length, 20);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -1133,6 +1978,13 @@ ngx_http_gzip_filter_init(ngx_conf_t *cf)
     ngx_http_next_body_filter = ngx_http_top_body_filter;
     ngx_http_top_body_filter = ngx_http_gzip_body_filter;
 
+    if (ngx_http_add_encoding(cf, &ngx_http_gzip_encoding,
+                              ngx_http_gzip_filter_test)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
 
@@ -1183,3 +2035,170 @@ ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data)
 
     return "must be 512, 1k, 2k, 4k, 8k, 16k, 32k, 64k, or 128k";
 }
+
+
+static char *
+ngx_http_gzip_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                 *p;
+    ssize_t                 size;
+    ngx_str_t              *value, name, s;
+    ngx_uint_t              i;
+    ngx_shm_zone_t         *shm_zone;
+    ngx_http_gzip_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_gzip_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->max_entry_size = 1024 * 1024;
+
+    size = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_entry_size=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            cache->max_entry_size = ngx_parse_size(&s);
+
+            if (cache->max_entry_size == (size_t) NGX_ERROR
+                || cache->max_entry_size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_entry_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_gzip_filter_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_gzip_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_gzip_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_gzip_conf_t *gcf = conf;
+
+    ngx_str_t  *value;
+
+    if (gcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        gcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    gcf->cache = ngx_shared_memory_add(cf, &value[1], 0,
+                                       &ngx_http_gzip_filter_module);
+    if (gcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static char *
+ngx_http_gzip_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_gzip_conf_t *gcf = conf;
+
+    ngx_str_t  *value;
+
+    if (gcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        gcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    gcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (gcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
@@ -16,14 +16,25 @@
 
 
 typedef struct {
-    ngx_uint_t  enable;
+    ngx_str_t     name;
+    ngx_str_t     exten;
+} ngx_http_gzip_static_encoding_t;
+
+
+typedef struct {
+    ngx_uint_t    enable;
+    ngx_array_t  *encodings;
 } ngx_http_gzip_static_conf_t;
 
 
 static ngx_int_t ngx_http_gzip_static_handler(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_gzip_static_order(ngx_http_request_t *r,
+    ngx_http_gzip_static_conf_t *gzcf, ngx_http_gzip_static_encoding_t **enc);
 static void *ngx_http_gzip_static_create_conf(ngx_conf_t *cf);
 static char *ngx_http_gzip_static_merge_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static char *ngx_http_gzip_static_encodings(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_gzip_static_init(ngx_conf_t *cf);
 
 
@@ -35,6 +46,19 @@ static ngx_conf_enum_t  ngx_http_gzip_static[] = {
 };
 
 
+static ngx_http_gzip_static_encoding_t  ngx_http_gzip_static_codings[] = {
+    { ngx_string("gzip"), ngx_string(".gz") },
+    { ngx_string("br"), ngx_string(".br") },
+    { ngx_string("zstd"), ngx_string(".zst") },
+    { ngx_null_string, ngx_null_string }
+};
+
+#define NGX_HTTP_GZIP_STATIC_MAX_EXTEN  (sizeof(".zst") - 1)
+#define NGX_HTTP_GZIP_STATIC_MAX_ENCODINGS                                    \
+    (sizeof(ngx_http_gzip_static_codings)                              \
+     / sizeof(ngx_http_gzip_static_encoding_t) - 1)
+
+
 static ngx_command_t  ngx_http_gzip_static_commands[] = {
 
     { ngx_string("gzip_static"),
@@ -44,6 +68,13 @@ static ngx_command_t  ngx_http_gzip_static_commands[] = {
       offsetof(ngx_http_gzip_static_conf_t, enable),
       &ngx_http_gzip_static },
 
+    { ngx_string("gzip_static_encodings"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_gzip_static_encodings,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -82,18 +113,19 @@ ngx_module_t  ngx_http_gzip_static_module = {
 static ngx_int_t
 ngx_http_gzip_static_handler(ngx_http_request_t *r)
 {
-    u_char                       *p;
-    size_t                        root;
-    ngx_str_t                     path;
-    ngx_int_t                     rc;
-    ngx_uint_t                    level;
-    ngx_log_t                    *log;
-    ngx_buf_t                    *b;
-    ngx_chain_t                   out;
-    ngx_table_elt_t              *h;
-    ngx_open_file_info_t          of;
-    ngx_http_core_loc_conf_t     *clcf;
-    ngx_http_gzip_static_conf_t  *gzcf;
+    u_char                           *p;
+    size_t                            root;
+    ngx_str_t                         path;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, n, last, level;
+    ngx_log_t                        *log;
+    ngx_buf_t                        *b;
+    ngx_chain_t                       out;
+    ngx_table_elt_t                  *h;
+    ngx_open_file_info_t              of;
+    ngx_http_core_loc_conf_t         *clcf;
+    ngx_http_gzip_static_conf_t      *gzcf;
+    ngx_http_gzip_static_encoding_t  *enc[NGX_HTTP_GZIP_STATIC_MAX_ENCODINGS];
 
     if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_DECLINED;
@@ -109,53 +141,83 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /*
+     * the variants accepted by the client go first; the rest are
+     * only looked for if "Vary" should be added, or with "always"
+     */
+
+    n = ngx_http_gzip_static_order(r, gzcf, enc);
+
     if (gzcf->enable == NGX_HTTP_GZIP_STATIC_ON) {
-        rc = ngx_http_gzip_ok(r);
+
+        if (n == 0) {
+            rc = NGX_DECLINED;
+
+        } else if (enc[0] == &ngx_http_gzip_static_codings[0]) {
+            rc = ngx_http_gzip_ok(r);
+
+        } else {
+            /* the checks besides Accept-Encoding do not depend on coding */
+            rc = ngx_http_encoding_ok(r, &enc[0]->name);
+        }
+
+        if (rc != NGX_OK) {
+            n = 0;
+        }
+
+        last = clcf->gzip_vary ? gzcf->encodings->nelts : n;
 
     } else {
         /* always */
-        rc = NGX_OK;
+        last = gzcf->encodings->nelts;
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-    if (!clcf->gzip_vary && rc != NGX_OK) {
+    if (last == 0) {
         return NGX_DECLINED;
     }
 
     log = r->connection->log;
 
-    p = ngx_http_map_uri_to_path(r, &path, &root, sizeof(".gz") - 1);
+    p = ngx_http_map_uri_to_path(r, &path, &root,
+                                 NGX_HTTP_GZIP_STATIC_MAX_EXTEN);
     if (p == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    *p++ = '.';
-    *p++ = 'g';
-    *p++ = 'z';
-    *p = '\0';
+    for (i = 0; /* void */ ; i++) {
 
-    path.len = p - path.data;
+        if (i == last) {
+            return NGX_DECLINED;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                   "http filename: \"%s\"", path.data);
+        path.len = ngx_cpymem(p, enc[i]->exten.data, enc[i]->exten.len)
+                   - path.data;
+        path.data[path.len] = '\0';
 
-    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http filename: \"%s\"", path.data);
 
-    of.read_ahead = clcf->read_ahead;
-    of.directio = clcf->directio;
-    of.valid = clcf->open_file_cache_valid;
-    of.min_uses = clcf->open_file_cache_min_uses;
-    of.errors = clcf->open_file_cache_errors;
-    of.events = clcf->open_file_cache_events;
+        ngx_memzero(&of, sizeof(ngx_open_file_info_t));
 
-    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+        of.read_ahead = clcf->read_ahead;
+        of.directio = clcf->directio;
+        of.valid = clcf->open_file_cache_valid;
+        of.min_uses = clcf->open_file_cache_min_uses;
+        of.errors = clcf->open_file_cache_errors;
+        of.events = clcf->open_file_cache_events;
+
+        if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+            == NGX_OK)
+        {
+            break;
+        }
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
-        != NGX_OK)
-    {
         switch (of.err) {
 
         case 0:
@@ -165,7 +227,7 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
         case NGX_ENOTDIR:
         case NGX_ENAMETOOLONG:
 
-            return NGX_DECLINED;
+            continue;
 
         case NGX_EACCES:
 #if (NGX_HAVE_OPENAT)
@@ -191,7 +253,7 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
     if (gzcf->enable == NGX_HTTP_GZIP_STATIC_ON) {
         r->gzip_vary = 1;
 
-        if (rc != NGX_OK) {
+        if (i >= n) {
             return NGX_DECLINED;
         }
     }
@@ -244,7 +306,7 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
     h->hash = 1;
     h->next = NULL;
     ngx_str_set(&h->key, "Content-Encoding");
-    ngx_str_set(&h->value, "gzip");
+    h->value = enc[i]->name;
     r->headers_out.content_encoding = h;
 
     r->allow_ranges = 1;
@@ -287,6 +349,59 @@ ngx_http_gzip_static_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_uint_t
+ngx_http_gzip_static_order(ngx_http_request_t *r,
+    ngx_http_gzip_static_conf_t *gzcf, ngx_http_gzip_static_encoding_t **enc)
+{
+    ngx_uint_t                         i, j, k, n, qv;
+    ngx_uint_t                         q[NGX_HTTP_GZIP_STATIC_MAX_ENCODINGS];
+    ngx_http_gzip_static_encoding_t  **elts;
+
+    /*
+     * sort the accepted encodings by the quantity, preserving
+     * the configured order for the same quantities, and place
+     * the rest after them; the number of accepted ones is returned
+     */
+
+    elts = gzcf->encodings->elts;
+    n = 0;
+
+    for (i = 0; i < gzcf->encodings->nelts; i++) {
+
+        qv = ngx_http_encoding_quantity(r, &elts[i]->name);
+
+        if (qv == 0) {
+            continue;
+        }
+
+        for (j = n; j > 0 && q[j - 1] < qv; j--) {
+            q[j] = q[j - 1];
+            enc[j] = enc[j - 1];
+        }
+
+        q[j] = qv;
+        enc[j] = elts[i];
+
+        n++;
+    }
+
+    for (i = 0, k = n; i < gzcf->encodings->nelts; i++) {
+
+        for (j = 0; j < n; j++) {
+            if (enc[j] == elts[i]) {
+                break;
+            }
+        }
+
+        if (j == n) {
+            enc[k++] = elts[i];
+        }
+    }
+
+    return n;
+}
+
+
 static void *
 ngx_http_gzip_static_create_conf(ngx_conf_t *cf)
 {
@@ -298,6 +413,7 @@ ngx_http_gzip_static_create_conf(ngx_conf_t *cf)
     }
 
     conf->enable = NGX_CONF_UNSET_UINT;
+    conf->encodings = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -309,9 +425,90 @@ ngx_http_gzip_static_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_gzip_static_conf_t *prev = parent;
     ngx_http_gzip_static_conf_t *conf = child;
 
+    ngx_http_gzip_static_encoding_t  **enc;
+
     ngx_conf_merge_uint_value(conf->enable, prev->enable,
                               NGX_HTTP_GZIP_STATIC_OFF);
 
+    ngx_conf_merge_ptr_value(conf->encodings, prev->encodings, NULL);
+
+    if (conf->encodings == NULL) {
+        conf->encodings = ngx_array_create(cf->pool, 1,
+                                    sizeof(ngx_http_gzip_static_encoding_t *));
+        if (conf->encodings == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        enc = ngx_array_push(conf->encodings);
+        if (enc == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *enc = &ngx_http_gzip_static_codings[0];
+
+        prev->encodings = conf->encodings;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_gzip_static_encodings(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_gzip_static_conf_t *gzcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         i, j, k;
+    ngx_http_gzip_static_encoding_t  **enc;
+
+    if (gzcf->encodings != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    gzcf->encodings = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                    sizeof(ngx_http_gzip_static_encoding_t *));
+    if (gzcf->encodings == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        for (j = 0; ngx_http_gzip_static_codings[j].name.len; j++) {
+            if (ngx_strcmp(value[i].data,
+                           ngx_http_gzip_static_codings[j].name.data)
+                == 0)
+            {
+                break;
+            }
+        }
+
+        if (ngx_http_gzip_static_codings[j].name.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown encoding \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        enc = gzcf->encodings->elts;
+
+        for (k = 0; k < gzcf->encodings->nelts; k++) {
+            if (enc[k] == &ngx_http_gzip_static_codings[j]) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate encoding \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        enc = ngx_array_push(gzcf->encodings);
+        if (enc == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *enc = &ngx_http_gzip_static_codings[j];
+    }
+
     return NGX_CONF_OK;
 }
 
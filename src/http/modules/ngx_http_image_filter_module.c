@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 #include <gd.h>
 
@@ -23,8 +24,10 @@
 #define NGX_HTTP_IMAGE_START     0
 #define NGX_HTTP_IMAGE_READ      1
 #define NGX_HTTP_IMAGE_PROCESS   2
-#define NGX_HTTP_IMAGE_PASS      3
-#define NGX_HTTP_IMAGE_DONE      4
+#define NGX_HTTP_IMAGE_THREAD    3
+#define NGX_HTTP_IMAGE_CACHED    4
+#define NGX_HTTP_IMAGE_PASS      5
+#define NGX_HTTP_IMAGE_DONE      6
 
 
 #define NGX_HTTP_IMAGE_NONE      0
@@ -37,6 +40,35 @@
 #define NGX_HTTP_IMAGE_BUFFERED  0x08
 
 
+#define NGX_HTTP_IMAGE_CACHE_KEY_LEN  16
+
+
+typedef struct {
+    ngx_rbtree_node_t            node;
+    ngx_queue_t                  queue;
+    u_char                       key[NGX_HTTP_IMAGE_CACHE_KEY_LEN
+                                     - sizeof(ngx_rbtree_key_t)];
+    ngx_uint_t                   type;
+    ngx_uint_t                   asis;
+    size_t                       len;
+    u_char                       data[1];
+} ngx_http_image_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_http_image_cache_shctx_t;
+
+
+typedef struct {
+    ngx_http_image_cache_shctx_t  *sh;
+    ngx_slab_pool_t               *shpool;
+    size_t                         max_entry_size;
+} ngx_http_image_cache_t;
+
+
 typedef struct {
     ngx_uint_t                   filter;
     ngx_uint_t                   width;
@@ -57,6 +89,12 @@ typedef struct {
     ngx_http_complex_value_t    *shcv;
 
     size_t                       buffer_size;
+
+    ngx_shm_zone_t              *cache;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t           *thread_pool;
+#endif
 } ngx_http_image_filter_conf_t;
 
 
@@ -72,12 +110,42 @@ typedef struct {
     ngx_uint_t                   max_height;
     ngx_uint_t                   angle;
 
+    ngx_int_t                    quality;
+    ngx_int_t                    sharpen;
+
     ngx_uint_t                   phase;
     ngx_uint_t                   type;
     ngx_uint_t                   force;
+
+    u_char                      *out;
+    int                          size;
+    char                        *failed;
+    ngx_pool_cleanup_t          *cleanup;
+
+#if (NGX_THREADS)
+    ngx_thread_task_t           *thread_task;
+#endif
+
+    ngx_buf_t                   *cached;
+    u_char                       key[NGX_HTTP_IMAGE_CACHE_KEY_LEN];
+
+    unsigned                     asis:1;
+    unsigned                     cache:1;
+    unsigned                     processing:1;
 } ngx_http_image_filter_ctx_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_image_filter_ctx_t   *ctx;
+    ngx_http_image_filter_conf_t  *conf;
+    ngx_int_t                      rc;
+} ngx_http_image_thread_ctx_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_image_send(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx, ngx_chain_t *in);
 static ngx_uint_t ngx_http_image_test(ngx_http_request_t *r, ngx_chain_t *in);
@@ -93,13 +161,36 @@ static ngx_int_t ngx_http_image_size(ngx_http_request_t *r,
 
 static ngx_buf_t *ngx_http_image_resize(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx);
-static gdImagePtr ngx_http_image_source(ngx_http_request_t *r,
+static ngx_int_t ngx_http_image_transform(ngx_http_image_filter_ctx_t *ctx,
+    ngx_http_image_filter_conf_t *conf, ngx_log_t *log);
+static ngx_buf_t *ngx_http_image_result(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx, ngx_int_t rc);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_image_thread(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx);
-static gdImagePtr ngx_http_image_new(ngx_http_request_t *r, int w, int h,
-    int colors);
-static u_char *ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type,
-    gdImagePtr img, int *size);
+static void ngx_http_image_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_image_thread_event_handler(ngx_event_t *ev);
+#endif
+static gdImagePtr ngx_http_image_source(ngx_http_image_filter_ctx_t *ctx);
+static gdImagePtr ngx_http_image_new(ngx_http_image_filter_ctx_t *ctx, int w,
+    int h, int colors);
+static u_char *ngx_http_image_out(ngx_http_image_filter_ctx_t *ctx,
+    gdImagePtr img);
 static void ngx_http_image_cleanup(void *data);
+
+static ngx_int_t ngx_http_image_cache_lookup(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
+static ngx_int_t ngx_http_image_cache_send(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx, ngx_chain_t *in);
+static void ngx_http_image_cache_store(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx, ngx_buf_t *b);
+static ngx_http_image_cache_node_t *ngx_http_image_cache_find(
+    ngx_http_image_cache_t *cache, u_char *key);
+static void ngx_http_image_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_image_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static ngx_uint_t ngx_http_image_filter_get_value(ngx_http_request_t *r,
     ngx_http_complex_value_t *cv, ngx_uint_t v);
 static ngx_uint_t ngx_http_image_filter_value(ngx_str_t *value);
@@ -116,6 +207,14 @@ static char *ngx_http_image_filter_webp_quality(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_image_filter_sharpen(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_image_filter_cache_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_image_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#if (NGX_THREADS)
+static char *ngx_http_image_filter_threads(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
 static ngx_int_t ngx_http_image_filter_init(ngx_conf_t *cf);
 
 
@@ -170,6 +269,31 @@ static ngx_command_t  ngx_http_image_filter_commands[] = {
       offsetof(ngx_http_image_filter_conf_t, buffer_size),
       NULL },
 
+    { ngx_string("image_filter_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_image_filter_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("image_filter_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_image_filter_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+#if (NGX_THREADS)
+
+    { ngx_string("image_filter_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_image_filter_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -221,6 +345,8 @@ static ngx_int_t
 ngx_http_image_header_filter(ngx_http_request_t *r)
 {
     off_t                          len;
+    ngx_int_t                      rc;
+    ngx_str_t                     *ct;
     ngx_http_image_filter_ctx_t   *ctx;
     ngx_http_image_filter_conf_t  *conf;
 
@@ -281,9 +407,35 @@ ngx_http_image_header_filter(ngx_http_request_t *r)
         r->headers_out.refresh->hash = 0;
     }
 
-    r->main_filter_need_in_memory = 1;
     r->allow_ranges = 0;
 
+    if (conf->cache) {
+        rc = ngx_http_image_cache_lookup(r, ctx);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            ct = &ngx_http_image_types[ctx->type - 1];
+            r->headers_out.content_type_len = ct->len;
+            r->headers_out.content_type = *ct;
+            r->headers_out.content_type_lowcase = NULL;
+
+            ngx_http_image_length(r, ctx->cached);
+
+            if (!ctx->asis) {
+                ngx_http_weak_etag(r);
+            }
+
+            ctx->phase = NGX_HTTP_IMAGE_CACHED;
+
+            return ngx_http_next_header_filter(r);
+        }
+    }
+
+    r->main_filter_need_in_memory = 1;
+
     return NGX_OK;
 }
 
@@ -296,16 +448,17 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_chain_t                    out;
     ngx_http_image_filter_ctx_t   *ctx;
     ngx_http_image_filter_conf_t  *conf;
+#if (NGX_THREADS)
+    ngx_http_image_thread_ctx_t   *tctx;
+#endif
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "image filter");
 
-    if (in == NULL) {
-        return ngx_http_next_body_filter(r, in);
-    }
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_image_filter_module);
 
-    if (ctx == NULL) {
+    if (ctx == NULL
+        || (in == NULL && ctx->phase != NGX_HTTP_IMAGE_THREAD))
+    {
         return ngx_http_next_body_filter(r, in);
     }
 
@@ -371,17 +524,28 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     case NGX_HTTP_IMAGE_PROCESS:
 
         out.buf = ngx_http_image_process(r);
+        break;
 
-        if (out.buf == NULL) {
-            return ngx_http_filter_finalize_request(r,
-                                              &ngx_http_image_filter_module,
-                                              NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+#if (NGX_THREADS)
+
+    case NGX_HTTP_IMAGE_THREAD:
+
+        if (ctx->processing) {
+            return NGX_AGAIN;
         }
 
-        out.next = NULL;
-        ctx->phase = NGX_HTTP_IMAGE_PASS;
+        r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+        tctx = ctx->thread_task->ctx;
+
+        out.buf = ngx_http_image_result(r, ctx, tctx->rc);
+        break;
+
+#endif
+
+    case NGX_HTTP_IMAGE_CACHED:
 
-        return ngx_http_image_send(r, ctx, &out);
+        return ngx_http_image_cache_send(r, ctx, in);
 
     case NGX_HTTP_IMAGE_PASS:
 
@@ -394,6 +558,25 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         /* NGX_ERROR resets any pending data */
         return (rc == NGX_OK) ? NGX_ERROR : rc;
     }
+
+    if (ctx->processing) {
+        return NGX_AGAIN;
+    }
+
+    if (out.buf == NULL) {
+        return ngx_http_filter_finalize_request(r,
+                                              &ngx_http_image_filter_module,
+                                              NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+    }
+
+    if (ctx->cache) {
+        ngx_http_image_cache_store(r, ctx, out.buf);
+    }
+
+    out.next = NULL;
+    ctx->phase = NGX_HTTP_IMAGE_PASS;
+
+    return ngx_http_image_send(r, ctx, &out);
 }
 
 
@@ -645,6 +828,8 @@ ngx_http_image_asis(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 
     ngx_http_image_length(r, b);
 
+    ctx->asis = 1;
+
     return b;
 }
 
@@ -819,34 +1004,91 @@ ngx_http_image_size(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 static ngx_buf_t *
 ngx_http_image_resize(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 {
-    int                            sx, sy, dx, dy, ox, oy, ax, ay, size,
-                                   colors, palette, transparent, sharpen,
+    ngx_int_t                      rc;
+    ngx_http_image_filter_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    ctx->sharpen = ngx_http_image_filter_get_value(r, conf->shcv,
+                                                   conf->sharpen);
+
+    switch (ctx->type) {
+
+    case NGX_HTTP_IMAGE_JPEG:
+        ctx->quality = ngx_http_image_filter_get_value(r, conf->jqcv,
+                                                       conf->jpeg_quality);
+        break;
+
+    case NGX_HTTP_IMAGE_WEBP:
+        ctx->quality = ngx_http_image_filter_get_value(r, conf->wqcv,
+                                                       conf->webp_quality);
+        break;
+
+    default:
+        ctx->quality = 0;
+        break;
+    }
+
+    ctx->cleanup = ngx_pool_cleanup_add(r->pool, 0);
+    if (ctx->cleanup == NULL) {
+        return NULL;
+    }
+
+    ctx->cleanup->handler = ngx_http_image_cleanup;
+
+#if (NGX_THREADS)
+
+    if (conf->thread_pool) {
+        if (ngx_http_image_thread(r, ctx) != NGX_OK) {
+            return NULL;
+        }
+
+        /* the result is sent once the thread task is completed */
+
+        return NULL;
+    }
+
+#endif
+
+    rc = ngx_http_image_transform(ctx, conf, r->connection->log);
+
+    ctx->cleanup->data = ctx->out;
+
+    return ngx_http_image_result(r, ctx, rc);
+}
+
+
+static ngx_int_t
+ngx_http_image_transform(ngx_http_image_filter_ctx_t *ctx,
+    ngx_http_image_filter_conf_t *conf, ngx_log_t *log)
+{
+    int                            sx, sy, dx, dy, ox, oy, ax, ay,
+                                   colors, palette, transparent,
                                    red, green, blue, t;
-    u_char                        *out;
-    ngx_buf_t                     *b;
     ngx_uint_t                     resize;
     gdImagePtr                     src, dst;
-    ngx_pool_cleanup_t            *cln;
-    ngx_http_image_filter_conf_t  *conf;
 
-    src = ngx_http_image_source(r, ctx);
+    /*
+     * this function may run in a thread, so it uses neither the request
+     * nor its pool; errors are reported via ctx->failed
+     */
+
+    src = ngx_http_image_source(ctx);
 
     if (src == NULL) {
-        return NULL;
+        return NGX_ERROR;
     }
 
     sx = gdImageSX(src);
     sy = gdImageSY(src);
 
-    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
-
     if (!ctx->force
         && ctx->angle == 0
         && (ngx_uint_t) sx <= ctx->max_width
         && (ngx_uint_t) sy <= ctx->max_height)
     {
         gdImageDestroy(src);
-        return ngx_http_image_asis(r, ctx);
+        return NGX_DECLINED;
     }
 
     colors = gdImageColorsTotal(src);
@@ -920,10 +1162,10 @@ transparent:
     }
 
     if (resize) {
-        dst = ngx_http_image_new(r, dx, dy, palette);
+        dst = ngx_http_image_new(ctx, dx, dy, palette);
         if (dst == NULL) {
             gdImageDestroy(src);
-            return NULL;
+            return NGX_ERROR;
         }
 
         if (colors == 0) {
@@ -953,10 +1195,10 @@ transparent:
 
         case 90:
         case 270:
-            dst = ngx_http_image_new(r, dy, dx, palette);
+            dst = ngx_http_image_new(ctx, dy, dx, palette);
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
             if (ctx->angle == 90) {
                 ox = dy / 2 + ay;
@@ -977,10 +1219,10 @@ transparent:
             break;
 
         case 180:
-            dst = ngx_http_image_new(r, dx, dy, palette);
+            dst = ngx_http_image_new(ctx, dx, dy, palette);
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
             gdImageCopyRotated(dst, src, dx / 2 - ax, dy / 2 - ay, 0, 0,
                                dx + ax, dy + ay, ctx->angle);
@@ -1009,17 +1251,17 @@ transparent:
 
         if (ox || oy) {
 
-            dst = ngx_http_image_new(r, dx - ox, dy - oy, colors);
+            dst = ngx_http_image_new(ctx, dx - ox, dy - oy, colors);
 
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
 
             ox /= 2;
             oy /= 2;
 
-            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
                            "image crop: %d x %d @ %d x %d",
                            dx, dy, ox, oy);
 
@@ -1042,42 +1284,54 @@ transparent:
         gdImageColorTransparent(dst, gdImageColorExact(dst, red, green, blue));
     }
 
-    sharpen = ngx_http_image_filter_get_value(r, conf->shcv, conf->sharpen);
-    if (sharpen > 0) {
-        gdImageSharpen(dst, sharpen);
+    if (ctx->sharpen > 0) {
+        gdImageSharpen(dst, (int) ctx->sharpen);
     }
 
     gdImageInterlace(dst, (int) conf->interlace);
 
-    out = ngx_http_image_out(r, ctx->type, dst, &size);
+    ctx->out = ngx_http_image_out(ctx, dst);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
                    "image: %d x %d %d", sx, sy, colors);
 
     gdImageDestroy(dst);
-    ngx_pfree(r->pool, ctx->image);
 
-    if (out == NULL) {
-        return NULL;
+    if (ctx->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_buf_t *
+ngx_http_image_result(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_buf_t  *b;
+
+    if (ctx->failed) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, ctx->failed);
+    }
+
+    if (rc == NGX_DECLINED) {
+        return ngx_http_image_asis(r, ctx);
     }
 
-    cln = ngx_pool_cleanup_add(r->pool, 0);
-    if (cln == NULL) {
-        gdFree(out);
+    if (rc != NGX_OK) {
         return NULL;
     }
 
+    ngx_pfree(r->pool, ctx->image);
+
     b = ngx_calloc_buf(r->pool);
     if (b == NULL) {
-        gdFree(out);
         return NULL;
     }
 
-    cln->handler = ngx_http_image_cleanup;
-    cln->data = out;
-
-    b->pos = out;
-    b->last = out + size;
+    b->pos = ctx->out;
+    b->last = ctx->out + ctx->size;
     b->memory = 1;
     b->last_buf = 1;
 
@@ -1088,8 +1342,120 @@ transparent:
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_image_thread(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_image_thread_ctx_t   *tctx;
+    ngx_http_image_filter_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_image_thread_ctx_t));
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    tctx = task->ctx;
+
+    tctx->ctx = ctx;
+    tctx->conf = conf;
+    tctx->rc = NGX_ERROR;
+
+    task->handler = ngx_http_image_thread_handler;
+    task->event.data = r;
+    task->event.handler = ngx_http_image_thread_event_handler;
+    task->event.log = r->connection->log;
+
+    if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&task->event, 60000);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    ctx->thread_task = task;
+    ctx->phase = NGX_HTTP_IMAGE_THREAD;
+    ctx->processing = 1;
+
+    r->connection->buffered |= NGX_HTTP_IMAGE_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_image_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_image_thread_ctx_t  *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "image thread handler");
+
+    ctx->rc = ngx_http_image_transform(ctx->ctx, ctx->conf, log);
+}
+
+
+static void
+ngx_http_image_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t             *c;
+    ngx_http_request_t           *r;
+    ngx_http_image_filter_ctx_t  *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http image thread: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "thread operation took too long");
+        ev->timedout = 0;
+        return;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_image_filter_module);
+
+    ctx->processing = 0;
+    ctx->cleanup->data = ctx->out;
+
+#if (NGX_HTTP_V2)
+
+    if (r->stream) {
+        c->write->ready = 1;
+        c->write->active = 0;
+    }
+
+#endif
+
+    if (r->done || r->main->terminated) {
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
 static gdImagePtr
-ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
+ngx_http_image_source(ngx_http_image_filter_ctx_t *ctx)
 {
     char        *failed;
     gdImagePtr   img;
@@ -1128,7 +1494,7 @@ ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
     }
 
     if (img == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, failed);
+        ctx->failed = failed;
     }
 
     return img;
@@ -1136,7 +1502,7 @@ ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 
 
 static gdImagePtr
-ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
+ngx_http_image_new(ngx_http_image_filter_ctx_t *ctx, int w, int h, int colors)
 {
     gdImagePtr  img;
 
@@ -1144,8 +1510,7 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
         img = gdImageCreateTrueColor(w, h);
 
         if (img == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "gdImageCreateTrueColor() failed");
+            ctx->failed = "gdImageCreateTrueColor() failed";
             return NULL;
         }
 
@@ -1153,8 +1518,7 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
         img = gdImageCreate(w, h);
 
         if (img == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "gdImageCreate() failed");
+            ctx->failed = "gdImageCreate() failed";
             return NULL;
         }
     }
@@ -1164,50 +1528,41 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
 
 
 static u_char *
-ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type, gdImagePtr img,
-    int *size)
+ngx_http_image_out(ngx_http_image_filter_ctx_t *ctx, gdImagePtr img)
 {
-    char                          *failed;
-    u_char                        *out;
-    ngx_int_t                      q;
-    ngx_http_image_filter_conf_t  *conf;
+    char    *failed;
+    u_char  *out;
 
     out = NULL;
 
-    switch (type) {
+    switch (ctx->type) {
 
     case NGX_HTTP_IMAGE_JPEG:
-        conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
-
-        q = ngx_http_image_filter_get_value(r, conf->jqcv, conf->jpeg_quality);
-        if (q <= 0) {
+        if (ctx->quality <= 0) {
             return NULL;
         }
 
-        out = gdImageJpegPtr(img, size, q);
+        out = gdImageJpegPtr(img, &ctx->size, (int) ctx->quality);
         failed = "gdImageJpegPtr() failed";
         break;
 
     case NGX_HTTP_IMAGE_GIF:
-        out = gdImageGifPtr(img, size);
+        out = gdImageGifPtr(img, &ctx->size);
         failed = "gdImageGifPtr() failed";
         break;
 
     case NGX_HTTP_IMAGE_PNG:
-        out = gdImagePngPtr(img, size);
+        out = gdImagePngPtr(img, &ctx->size);
         failed = "gdImagePngPtr() failed";
         break;
 
     case NGX_HTTP_IMAGE_WEBP:
 #if (NGX_HAVE_GD_WEBP)
-        conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
-
-        q = ngx_http_image_filter_get_value(r, conf->wqcv, conf->webp_quality);
-        if (q <= 0) {
+        if (ctx->quality <= 0) {
             return NULL;
         }
 
-        out = gdImageWebpPtrEx(img, size, q);
+        out = gdImageWebpPtrEx(img, &ctx->size, (int) ctx->quality);
         failed = "gdImageWebpPtrEx() failed";
 #else
         failed = "nginx was built without GD WebP support";
@@ -1220,7 +1575,7 @@ ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type, gdImagePtr img,
     }
 
     if (out == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, failed);
+        ctx->failed = failed;
     }
 
     return out;
@@ -1234,17 +1589,410 @@ ngx_http_image_cleanup(void *data)
 }
 
 
-static ngx_uint_t
-ngx_http_image_filter_get_value(ngx_http_request_t *r,
-    ngx_http_complex_value_t *cv, ngx_uint_t v)
+static ngx_int_t
+ngx_http_image_cache_lookup(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx)
 {
-    ngx_str_t  val;
+    u_char                         buf[9 * (NGX_INT_T_LEN + 1)];
+    ngx_md5_t                      md5;
+    ngx_uint_t                     width, height, angle, jpeg_quality,
+                                   webp_quality, sharpen;
+    ngx_http_image_cache_t        *cache;
+    ngx_http_image_cache_node_t   *node;
+    ngx_http_image_filter_conf_t  *conf;
 
-    if (cv == NULL) {
-        return v;
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    if (conf->filter != NGX_HTTP_IMAGE_RESIZE
+        && conf->filter != NGX_HTTP_IMAGE_CROP
+        && conf->filter != NGX_HTTP_IMAGE_ROTATE)
+    {
+        return NGX_DECLINED;
     }
 
-    if (ngx_http_complex_value(r, cv, &val) != NGX_OK) {
+    /*
+     * only responses with a known length and validators are cached,
+     * as they identify the source image, e.g., a static file
+     */
+
+    if (r->headers_out.content_length_n <= 0
+        || (r->headers_out.etag == NULL
+            && r->headers_out.last_modified_time == -1))
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = conf->cache->data;
+
+    ngx_md5_init(&md5);
+
+    if (r->headers_in.server.len) {
+        ngx_md5_update(&md5, r->headers_in.server.data,
+                       r->headers_in.server.len);
+    }
+
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+
+    /* arguments select variants, e.g., with "image_filter resize $arg_w" */
+
+    ngx_md5_update(&md5, "?", 1);
+    ngx_md5_update(&md5, r->args.data, r->args.len);
+
+    if (r->headers_out.etag) {
+        ngx_md5_update(&md5, r->headers_out.etag->value.data,
+                       r->headers_out.etag->value.len);
+    }
+
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %O %T", r->headers_out.content_length_n,
+                               r->headers_out.last_modified_time)
+                   - buf);
+
+    /* the operation, with values of variables as used for processing */
+
+    width = ngx_http_image_filter_get_value(r, conf->wcv, conf->width);
+    height = ngx_http_image_filter_get_value(r, conf->hcv, conf->height);
+    angle = ngx_http_image_filter_get_value(r, conf->acv, conf->angle);
+
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %ui %ui %ui %ui",
+                               conf->filter, width, height, angle)
+                   - buf);
+
+    jpeg_quality = ngx_http_image_filter_get_value(r, conf->jqcv,
+                                                   conf->jpeg_quality);
+    webp_quality = ngx_http_image_filter_get_value(r, conf->wqcv,
+                                                   conf->webp_quality);
+    sharpen = ngx_http_image_filter_get_value(r, conf->shcv, conf->sharpen);
+
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %ui %ui %ui %i %i",
+                               jpeg_quality, webp_quality, sharpen,
+                               conf->transparency, conf->interlace)
+                   - buf);
+
+    ngx_md5_final(ctx->key, &md5);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_image_cache_find(cache, ctx->key);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "image cache miss");
+
+        ctx->cache = 1;
+
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    /* the entry may be evicted once the lock is released */
+
+    ctx->cached = ngx_create_temp_buf(r->pool, node->len);
+
+    if (ctx->cached == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ctx->cached->last = ngx_cpymem(ctx->cached->pos, node->data, node->len);
+
+    ctx->type = node->type;
+    ctx->asis = node->asis;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "image cache hit: %uz",
+                   (size_t) (ctx->cached->last - ctx->cached->pos));
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_image_cache_send(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_buf_t    *b;
+    ngx_uint_t    last;
+    ngx_chain_t  *cl, out;
+
+    /* the source image is not needed, it is consumed as is */
+
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->last_buf) {
+            last = 1;
+        }
+
+        b->pos = b->last;
+        b->file_pos = b->file_last;
+    }
+
+    if (ctx->cached) {
+        b = ctx->cached;
+        ctx->cached = NULL;
+
+    } else if (last) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        return ngx_http_next_body_filter(r, NULL);
+    }
+
+    b->last_buf = last;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_next_body_filter(r, &out);
+}
+
+
+static void
+ngx_http_image_cache_store(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx, ngx_buf_t *b)
+{
+    size_t                         len;
+    ngx_queue_t                   *q;
+    ngx_http_image_cache_t        *cache;
+    ngx_http_image_cache_node_t   *node, *old;
+    ngx_http_image_filter_conf_t  *conf;
+
+    ctx->cache = 0;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    cache = conf->cache->data;
+
+    len = b->last - b->pos;
+
+    if (len > cache->max_entry_size) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_image_cache_find(cache, ctx->key)) {
+        goto done;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool,
+                                     offsetof(ngx_http_image_cache_node_t,
+                                              data)
+                                     + len);
+        if (node) {
+            break;
+        }
+
+        /* free the least recently used entries */
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "could not allocate image cache entry "
+                          "of %uz bytes", len);
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        old = ngx_queue_data(q, ngx_http_image_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, ctx->key,
+               sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &ctx->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_IMAGE_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->type = ctx->type;
+    node->asis = ctx->asis;
+    node->len = len;
+    ngx_memcpy(node->data, b->pos, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "image cache store: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_http_image_cache_node_t *
+ngx_http_image_cache_find(ngx_http_image_cache_t *cache, u_char *key)
+{
+    ngx_int_t                     rc;
+    ngx_rbtree_key_t              node_key;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_image_cache_node_t  *icn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        icn = (ngx_http_image_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], icn->key,
+                        NGX_HTTP_IMAGE_CACHE_KEY_LEN
+                        - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return icn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_image_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t            **p;
+    ngx_http_image_cache_node_t   *icn, *icnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            icn = (ngx_http_image_cache_node_t *) node;
+            icnt = (ngx_http_image_cache_node_t *) temp;
+
+            p = (ngx_memcmp(icn->key, icnt->key,
+                            NGX_HTTP_IMAGE_CACHE_KEY_LEN
+                            - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_image_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_image_cache_t  *ocache = data;
+
+    size_t                   len;
+    ngx_http_image_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_image_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_image_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in image filter cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in image filter cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_image_filter_get_value(ngx_http_request_t *r,
+    ngx_http_complex_value_t *cv, ngx_uint_t v)
+{
+    ngx_str_t  val;
+
+    if (cv == NULL) {
+        return v;
+    }
+
+    if (ngx_http_complex_value(r, cv, &val) != NGX_OK) {
         return 0;
     }
 
@@ -1302,6 +2050,11 @@ ngx_http_image_filter_create_conf(ngx_conf_t *cf)
     conf->transparency = NGX_CONF_UNSET;
     conf->interlace = NGX_CONF_UNSET;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->cache = NGX_CONF_UNSET_PTR;
+
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return conf;
 }
@@ -1364,6 +2117,12 @@ ngx_http_image_filter_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
                               1 * 1024 * 1024);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
     return NGX_CONF_OK;
 }
 
@@ -1662,6 +2421,174 @@ ngx_http_image_filter_sharpen(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+static char *
+ngx_http_image_filter_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    u_char                  *p;
+    ssize_t                  size;
+    ngx_str_t               *value, name, s;
+    ngx_uint_t               i;
+    ngx_shm_zone_t          *shm_zone;
+    ngx_http_image_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_image_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->max_entry_size = 1024 * 1024;
+
+    size = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_entry_size=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            cache->max_entry_size = ngx_parse_size(&s);
+
+            if (cache->max_entry_size == (size_t) NGX_ERROR
+                || cache->max_entry_size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_entry_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_image_filter_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_image_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_image_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_image_filter_conf_t *imcf = conf;
+
+    ngx_str_t  *value;
+
+    if (imcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        imcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    imcf->cache = ngx_shared_memory_add(cf, &value[1], 0,
+                                        &ngx_http_image_filter_module);
+    if (imcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static char *
+ngx_http_image_filter_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_image_filter_conf_t *imcf = conf;
+
+    ngx_str_t  *value;
+
+    if (imcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        imcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    imcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (imcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_image_filter_init(ngx_conf_t *cf)
 {
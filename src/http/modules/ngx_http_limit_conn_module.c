@@ -238,11 +238,21 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
                 ngx_http_limit_conn_cleanup_all(r->pool);
 
                 if (lccf->dry_run) {
+#if (NGX_HTTP_METRICS)
+                    ngx_http_metrics_zone(r, limits[i].shm_zone,
+                                        NGX_HTTP_LIMIT_CONN_REJECTED_DRY_RUN);
+#endif
+
                     r->main->limit_conn_status =
                                           NGX_HTTP_LIMIT_CONN_REJECTED_DRY_RUN;
                     return NGX_DECLINED;
                 }
 
+#if (NGX_HTTP_METRICS)
+                ngx_http_metrics_zone(r, limits[i].shm_zone,
+                                      NGX_HTTP_LIMIT_CONN_REJECTED);
+#endif
+
                 r->main->limit_conn_status = NGX_HTTP_LIMIT_CONN_REJECTED;
 
                 return lccf->status_code;
@@ -273,11 +283,21 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
                 ngx_http_limit_conn_cleanup_all(r->pool);
 
                 if (lccf->dry_run) {
+#if (NGX_HTTP_METRICS)
+                    ngx_http_metrics_zone(r, limits[i].shm_zone,
+                                        NGX_HTTP_LIMIT_CONN_REJECTED_DRY_RUN);
+#endif
+
                     r->main->limit_conn_status =
                                           NGX_HTTP_LIMIT_CONN_REJECTED_DRY_RUN;
                     return NGX_DECLINED;
                 }
 
+#if (NGX_HTTP_METRICS)
+                ngx_http_metrics_zone(r, limits[i].shm_zone,
+                                      NGX_HTTP_LIMIT_CONN_REJECTED);
+#endif
+
                 r->main->limit_conn_status = NGX_HTTP_LIMIT_CONN_REJECTED;
 
                 return lccf->status_code;
@@ -291,6 +311,11 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         ngx_shmtx_unlock(&ctx->shpool->mutex);
 
+#if (NGX_HTTP_METRICS)
+        ngx_http_metrics_zone(r, limits[i].shm_zone,
+                              NGX_HTTP_LIMIT_CONN_PASSED);
+#endif
+
         cln = ngx_pool_cleanup_add(r->pool,
                                    sizeof(ngx_http_limit_conn_cleanup_t));
         if (cln == NULL) {
@@ -655,6 +680,14 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_conn_init_zone;
     shm_zone->data = ctx;
 
+#if (NGX_HTTP_METRICS)
+    if (ngx_http_metrics_add_zone(cf, shm_zone, NGX_HTTP_METRICS_LIMIT_CONN)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     return NGX_CONF_OK;
 }
 
@@ -67,8 +67,13 @@ typedef struct {
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
     ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
-static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
-    ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
+static ngx_msec_t ngx_http_limit_req_account(ngx_http_request_t *r,
+    ngx_http_limit_req_limit_t *limits, ngx_uint_t n, ngx_uint_t *ep,
+    ngx_http_limit_req_limit_t **limit);
+#if (NGX_HTTP_METRICS)
+static void ngx_http_limit_req_metrics(ngx_http_request_t *r,
+    ngx_http_limit_req_limit_t *limit, ngx_msec_t delay);
+#endif
 static void ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
@@ -276,10 +281,19 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
         ngx_http_limit_req_unlock(limits, n);
 
         if (lrcf->dry_run) {
+#if (NGX_HTTP_METRICS)
+            ngx_http_metrics_zone(r, limit->shm_zone,
+                                  NGX_HTTP_LIMIT_REQ_REJECTED_DRY_RUN);
+#endif
+
             r->main->limit_req_status = NGX_HTTP_LIMIT_REQ_REJECTED_DRY_RUN;
             return NGX_DECLINED;
         }
 
+#if (NGX_HTTP_METRICS)
+        ngx_http_metrics_zone(r, limit->shm_zone, NGX_HTTP_LIMIT_REQ_REJECTED);
+#endif
+
         r->main->limit_req_status = NGX_HTTP_LIMIT_REQ_REJECTED;
 
         return lrcf->status_code;
@@ -291,7 +305,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
         excess = 0;
     }
 
-    delay = ngx_http_limit_req_account(limits, n, &excess, &limit);
+    delay = ngx_http_limit_req_account(r, limits, n, &excess, &limit);
 
     if (!delay) {
         r->main->limit_req_status = NGX_HTTP_LIMIT_REQ_PASSED;
@@ -533,8 +547,9 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
 
 static ngx_msec_t
-ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
-    ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit)
+ngx_http_limit_req_account(ngx_http_request_t *r,
+    ngx_http_limit_req_limit_t *limits, ngx_uint_t n, ngx_uint_t *ep,
+    ngx_http_limit_req_limit_t **limit)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now, delay, max_delay;
@@ -552,6 +567,16 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         max_delay = (excess - (*limit)->delay) * 1000 / ctx->rate;
     }
 
+#if (NGX_HTTP_METRICS)
+
+    /* the limit is not the last one checked if its key was empty */
+
+    if (*limit == &limits[n]) {
+        ngx_http_limit_req_metrics(r, *limit, max_delay);
+    }
+
+#endif
+
     while (n--) {
         ctx = limits[n].shm_zone->data;
         lr = ctx->node;
@@ -590,10 +615,15 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         ctx->node = NULL;
 
         if ((ngx_uint_t) excess <= limits[n].delay) {
-            continue;
+            delay = 0;
+
+        } else {
+            delay = (excess - limits[n].delay) * 1000 / ctx->rate;
         }
 
-        delay = (excess - limits[n].delay) * 1000 / ctx->rate;
+#if (NGX_HTTP_METRICS)
+        ngx_http_limit_req_metrics(r, &limits[n], delay);
+#endif
 
         if (delay > max_delay) {
             max_delay = delay;
@@ -606,6 +636,33 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 }
 
 
+#if (NGX_HTTP_METRICS)
+
+static void
+ngx_http_limit_req_metrics(ngx_http_request_t *r,
+    ngx_http_limit_req_limit_t *limit, ngx_msec_t delay)
+{
+    ngx_uint_t                  status;
+    ngx_http_limit_req_conf_t  *lrcf;
+
+    lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req_module);
+
+    if (delay == 0) {
+        status = NGX_HTTP_LIMIT_REQ_PASSED;
+
+    } else if (lrcf->dry_run) {
+        status = NGX_HTTP_LIMIT_REQ_DELAYED_DRY_RUN;
+
+    } else {
+        status = NGX_HTTP_LIMIT_REQ_DELAYED;
+    }
+
+    ngx_http_metrics_zone(r, limit->shm_zone, status);
+}
+
+#endif
+
+
 static void
 ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
 {
@@ -956,6 +1013,14 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
+#if (NGX_HTTP_METRICS)
+    if (ngx_http_metrics_add_zone(cf, shm_zone, NGX_HTTP_METRICS_LIMIT_REQ)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     return NGX_CONF_OK;
 }
 
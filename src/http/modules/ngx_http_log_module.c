@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_writer.h>
+#endif
+
 #if (NGX_ZLIB)
 #include <zlib.h>
 #endif
@@ -35,15 +39,67 @@ typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+    ngx_str_t                   schema;
+    ngx_uint_t                  binary;     /* unsigned  binary:1 */
 } ngx_http_log_fmt_t;
 
 
 typedef struct {
     ngx_array_t                 formats;    /* array of ngx_http_log_fmt_t */
+    ngx_array_t                 aggregates;
+                                      /* array of ngx_http_log_aggregate_t * */
     ngx_uint_t                  combined_used; /* unsigned  combined_used:1 */
 } ngx_http_log_main_conf_t;
 
 
+#define NGX_HTTP_LOG_AGGREGATE_BUCKETS  13
+
+
+typedef struct {
+    u_char                      color;
+    u_char                      dummy;
+    u_short                     len;
+    ngx_queue_t                 queue;
+    ngx_uint_t                  requests;
+    ngx_uint_t                  status[5];
+    off_t                       bytes_sent;
+    ngx_msec_t                  request_time;
+    ngx_uint_t                  buckets[NGX_HTTP_LOG_AGGREGATE_BUCKETS];
+    u_char                      data[1];
+} ngx_http_log_aggregate_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 queue;
+    time_t                      flush;
+    ngx_uint_t                  dropped;
+} ngx_http_log_aggregate_shctx_t;
+
+
+typedef struct {
+    ngx_http_log_aggregate_shctx_t  *sh;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_complex_value_t         key;
+    time_t                           interval;
+} ngx_http_log_aggregate_ctx_t;
+
+
+typedef struct {
+    ngx_shm_zone_t             *shm_zone;
+    ngx_open_file_t            *file;
+    ngx_event_t                 event;
+
+    /* counters of the worker process, merged into the zone each second */
+
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 queue;
+    ngx_pool_t                 *pool;
+} ngx_http_log_aggregate_t;
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -52,6 +108,13 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_thread_writer_t        *writer;
+    ngx_uint_t                  overflow;
+    ngx_uint_t                  sample;
+    ngx_uint_t                  sampled;
+#endif
 } ngx_http_log_buf_t;
 
 
@@ -69,6 +132,12 @@ typedef struct {
     ngx_syslog_peer_t          *syslog_peer;
     ngx_http_log_fmt_t         *format;
     ngx_http_complex_value_t   *filter;
+    ngx_fd_t                    schema_fd;
+    ngx_uint_t                  schema_generation;
+    time_t                      schema_time;
+    ngx_http_log_aggregate_t   *aggregate;
+    ngx_uint_t                  sample;
+    ngx_int_t                   sample_index;
 } ngx_http_log_t;
 
 
@@ -95,6 +164,38 @@ typedef struct {
 #define NGX_HTTP_LOG_ESCAPE_NONE     2
 
 
+/*
+ * binary records: a schema record maps a format id to the format name
+ * and the names of its fields, a data record has one typed field for
+ * each variable of the format, numbers are unsigned LEB128 varints
+ *
+ *   'S' length id[4] name-len name fields-count { name-len name } ...
+ *   'R' length id[4] fields-count { type value } ...
+ *
+ * the length of the rest of a record is always written in 4 bytes,
+ * padded with continuation bits, so readers can skip records
+ */
+
+#define NGX_HTTP_LOG_SCHEMA          'S'
+#define NGX_HTTP_LOG_RECORD          'R'
+
+#define NGX_HTTP_LOG_FIELD_NULL      0
+#define NGX_HTTP_LOG_FIELD_STRING    1
+#define NGX_HTTP_LOG_FIELD_UINT      2
+#define NGX_HTTP_LOG_FIELD_MSEC      3
+#define NGX_HTTP_LOG_FIELD_TIME      4
+
+#define NGX_HTTP_LOG_VARINT_LEN      10
+#define NGX_HTTP_LOG_LENGTH_LEN      4
+
+
+#define NGX_HTTP_LOG_OVERFLOW_BLOCK   0
+#define NGX_HTTP_LOG_OVERFLOW_DROP    1
+#define NGX_HTTP_LOG_OVERFLOW_SAMPLE  2
+
+#define NGX_HTTP_LOG_THREAD_BUFFERS   4
+
+
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -111,6 +212,27 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+static void ngx_http_log_aggregate(ngx_http_request_t *r,
+    ngx_http_log_aggregate_t *aggregate);
+static ngx_http_log_aggregate_node_t *ngx_http_log_aggregate_lookup(
+    ngx_rbtree_t *rbtree, uint32_t hash, u_char *data, size_t len);
+static void ngx_http_log_aggregate_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static void ngx_http_log_aggregate_merge(ngx_http_log_aggregate_t *aggregate);
+static void ngx_http_log_aggregate_flush(ngx_http_log_aggregate_t *aggregate,
+    ngx_log_t *log);
+static void ngx_http_log_aggregate_flush_handler(ngx_event_t *ev);
+
+#if (NGX_THREADS)
+static ngx_uint_t ngx_http_log_thread_drop(ngx_http_log_buf_t *buffer,
+    size_t len, ngx_log_t *log);
+static ngx_int_t ngx_http_log_thread_post(ngx_http_log_buf_t *buffer,
+    ngx_uint_t queue, ngx_log_t *log);
+static ssize_t ngx_http_log_thread_write(ngx_fd_t fd, u_char *buf, size_t len,
+    void *data, ngx_log_t *log);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -130,6 +252,30 @@ static u_char *ngx_http_log_body_bytes_sent(ngx_http_request_t *r,
 static u_char *ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 
+static ngx_uint_t ngx_http_log_status_code(ngx_http_request_t *r);
+static ngx_msec_int_t ngx_http_log_request_msec(ngx_http_request_t *r);
+
+static u_char *ngx_http_log_varint(u_char *p, uint64_t n);
+static void ngx_http_log_binary_length(u_char *start, u_char *last);
+static u_char *ngx_http_log_binary_pipe(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_time(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static u_char *ngx_http_log_binary_request_length(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+static size_t ngx_http_log_binary_variable_getlen(ngx_http_request_t *r,
+    uintptr_t data);
+static u_char *ngx_http_log_binary_variable(ngx_http_request_t *r,
+    u_char *buf, ngx_http_log_op_t *op);
+
 static ngx_int_t ngx_http_log_variable_compile(ngx_conf_t *cf,
     ngx_http_log_op_t *op, ngx_str_t *value, ngx_uint_t escape);
 static size_t ngx_http_log_variable_getlen(ngx_http_request_t *r,
@@ -157,9 +303,17 @@ static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
     ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+static char *ngx_http_log_compile_binary(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_log_aggregate_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_log_aggregate_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_log_init_worker(ngx_cycle_t *cycle);
+static void ngx_http_log_exit_worker(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_log_commands[] = {
@@ -186,6 +340,13 @@ static ngx_command_t  ngx_http_log_commands[] = {
       0,
       NULL },
 
+    { ngx_string("log_aggregate_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+      ngx_http_log_aggregate_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -212,10 +373,10 @@ ngx_module_t  ngx_http_log_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_log_init_worker,              /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_log_exit_worker,              /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -224,6 +385,9 @@ ngx_module_t  ngx_http_log_module = {
 static ngx_str_t  ngx_http_access_log = ngx_string(NGX_HTTP_LOG_PATH);
 
 
+static ngx_str_t  ngx_http_log_request_id = ngx_string("request_id");
+
+
 static ngx_str_t  ngx_http_combined_fmt =
     ngx_string("$remote_addr - $remote_user [$time_local] "
                "\"$request\" $status $body_bytes_sent "
@@ -250,18 +414,43 @@ static ngx_http_log_var_t  ngx_http_log_vars[] = {
 };
 
 
+static ngx_http_log_var_t  ngx_http_log_binary_vars[] = {
+    { ngx_string("pipe"), 3, ngx_http_log_binary_pipe },
+    { ngx_string("time_local"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_time },
+    { ngx_string("time_iso8601"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_time },
+    { ngx_string("msec"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_time },
+    { ngx_string("request_time"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_request_time },
+    { ngx_string("status"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_status },
+    { ngx_string("bytes_sent"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_bytes_sent },
+    { ngx_string("body_bytes_sent"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_body_bytes_sent },
+    { ngx_string("request_length"), 1 + NGX_HTTP_LOG_VARINT_LEN,
+                          ngx_http_log_binary_request_length },
+
+    { ngx_null_string, 0, NULL }
+};
+
+
 static ngx_int_t
 ngx_http_log_handler(ngx_http_request_t *r)
 {
-    u_char                   *line, *p;
-    size_t                    len, size;
-    ssize_t                   n;
-    ngx_str_t                 val;
-    ngx_uint_t                i, l;
-    ngx_http_log_t           *log;
-    ngx_http_log_op_t        *op;
-    ngx_http_log_buf_t       *buffer;
-    ngx_http_log_loc_conf_t  *lcf;
+    u_char                     *line, *p, *record;
+    size_t                      len, size;
+    time_t                      now;
+    ssize_t                     n;
+    ngx_str_t                   val, *schema;
+    ngx_uint_t                  i, l;
+    ngx_http_log_t             *log;
+    ngx_http_log_op_t          *op;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_loc_conf_t    *lcf;
+    ngx_http_variable_value_t  *vv;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http log handler");
@@ -285,6 +474,25 @@ ngx_http_log_handler(ngx_http_request_t *r)
             }
         }
 
+        if (log[l].sample) {
+
+            /* the same requests are sampled by the hash of $request_id */
+
+            vv = ngx_http_get_indexed_variable(r, log[l].sample_index);
+
+            if (vv == NULL || vv->not_found
+                || ngx_murmur_hash2(vv->data, vv->len) % 10000
+                   >= log[l].sample)
+            {
+                continue;
+            }
+        }
+
+        if (log[l].aggregate) {
+            ngx_http_log_aggregate(r, log[l].aggregate);
+            continue;
+        }
+
         if (ngx_time() == log[l].disk_full_time) {
 
             /*
@@ -309,6 +517,8 @@ ngx_http_log_handler(ngx_http_request_t *r)
             }
         }
 
+        schema = NULL;
+
         if (log[l].syslog_peer) {
 
             /* length of syslog's PRI and HEADER message parts */
@@ -319,12 +529,49 @@ ngx_http_log_handler(ngx_http_request_t *r)
             goto alloc_line;
         }
 
-        len += NGX_LINEFEED_SIZE;
+        if (log[l].format->binary) {
+
+            /*
+             * the schema record precedes the data records in each file,
+             * so it is written again once the file is reopened, and is
+             * repeated once a minute for files appended by several
+             * processes or formats
+             */
+
+            now = ngx_time();
+
+            if (log[l].file->fd != log[l].schema_fd
+                || log[l].file->generation != log[l].schema_generation
+                || now - log[l].schema_time > 59)
+            {
+                schema = &log[l].format->schema;
+                len += schema->len;
+
+                log[l].schema_fd = log[l].file->fd;
+                log[l].schema_generation = log[l].file->generation;
+                log[l].schema_time = now;
+            }
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
 
         buffer = log[l].file ? log[l].file->data : NULL;
 
         if (buffer) {
 
+#if (NGX_THREADS)
+            if (buffer->writer
+                && ngx_http_log_thread_drop(buffer, len, r->connection->log))
+            {
+                if (schema) {
+                    log[l].schema_fd = NGX_INVALID_FILE;
+                }
+
+                continue;
+            }
+#endif
+
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
                 ngx_http_log_write(r, &log[l], buffer->start,
@@ -341,11 +588,22 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
+                if (schema) {
+                    p = ngx_cpymem(p, schema->data, schema->len);
+                }
+
+                record = p;
+
                 for (i = 0; i < log[l].format->ops->nelts; i++) {
                     p = op[i].run(r, p, &op[i]);
                 }
 
-                ngx_linefeed(p);
+                if (log[l].format->binary) {
+                    ngx_http_log_binary_length(record, p);
+
+                } else {
+                    ngx_linefeed(p);
+                }
 
                 buffer->pos = p;
 
@@ -370,10 +628,20 @@ ngx_http_log_handler(ngx_http_request_t *r)
             p = ngx_syslog_add_header(log[l].syslog_peer, line);
         }
 
+        if (schema) {
+            p = ngx_cpymem(p, schema->data, schema->len);
+        }
+
+        record = p;
+
         for (i = 0; i < log[l].format->ops->nelts; i++) {
             p = op[i].run(r, p, &op[i]);
         }
 
+        if (log[l].format->binary) {
+            ngx_http_log_binary_length(record, p);
+        }
+
         if (log[l].syslog_peer) {
 
             size = p - line;
@@ -393,7 +661,9 @@ ngx_http_log_handler(ngx_http_request_t *r)
             continue;
         }
 
-        ngx_linefeed(p);
+        if (!log[l].format->binary) {
+            ngx_linefeed(p);
+        }
 
         ngx_http_log_write(r, &log[l], line, p - line);
     }
@@ -724,6 +994,19 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 
     buffer = file->data;
 
+#if (NGX_THREADS)
+    if (buffer->writer) {
+
+        /*
+         * the buffer is queued to be written to the file being reopened
+         * or closed, even if all buffers are busy
+         */
+
+        (void) ngx_http_log_thread_post(buffer, 1, log);
+        return;
+    }
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -762,159 +1045,887 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "http log buffer flush handler");
 
+#if (NGX_THREADS)
+    file = ev->data;
+    buffer = file->data;
+
+    if (buffer->writer) {
+
+        if (ngx_http_log_thread_post(buffer,
+                               buffer->overflow == NGX_HTTP_LOG_OVERFLOW_BLOCK,
+                               ev->log)
+            != NGX_OK)
+        {
+            /* all buffers are busy, the flush is retried later */
+            ngx_add_timer(ev, buffer->flush);
+        }
+
+        return;
+    }
+#endif
+
     ngx_http_log_flush(ev->data, ev->log);
 }
 
 
-static u_char *
-ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
+#if (NGX_THREADS)
+
+static ngx_uint_t
+ngx_http_log_thread_drop(ngx_http_log_buf_t *buffer, size_t len,
+    ngx_log_t *log)
 {
-    size_t     len;
-    uintptr_t  data;
+    ngx_int_t             rc;
+    ngx_thread_writer_t  *tw;
 
-    len = op->len;
-    data = op->data;
+    tw = buffer->writer;
 
-    while (len--) {
-        *buf++ = (u_char) (data & 0xff);
-        data >>= 8;
+    if (tw->free == NULL
+        && buffer->overflow == NGX_HTTP_LOG_OVERFLOW_SAMPLE
+        && buffer->sampled++ % buffer->sample)
+    {
+        goto drop;
     }
 
-    return buf;
-}
+    if (len <= (size_t) (buffer->last - buffer->pos)) {
+        return 0;
+    }
 
+    /*
+     * with overflow=block, buffers are added while all of them are busy,
+     * otherwise the line is dropped
+     */
 
-static u_char *
-ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+    rc = ngx_http_log_thread_post(buffer,
+                               buffer->overflow == NGX_HTTP_LOG_OVERFLOW_BLOCK,
+                               log);
+
+    if (rc == NGX_OK) {
+        return 0;
+    }
+
+drop:
+
+    tw->dropped++;
+
+    return 1;
 }
 
 
-static u_char *
-ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+static ngx_int_t
+ngx_http_log_thread_post(ngx_http_log_buf_t *buffer, ngx_uint_t queue,
+    ngx_log_t *log)
 {
-    if (r->pipeline) {
-        *buf = 'p';
-    } else {
-        *buf = '.';
+    u_char     *p;
+    ngx_int_t   rc;
+
+    if (buffer->pos == buffer->start) {
+        return NGX_OK;
     }
 
-    return buf + 1;
-}
+    rc = ngx_thread_writer_post(buffer->writer, buffer->start,
+                                buffer->pos - buffer->start, &p, queue, log);
 
+    if (rc != NGX_OK) {
+        return rc;
+    }
 
-static u_char *
-ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
-                      ngx_cached_http_log_time.len);
-}
+    buffer->last = p + (buffer->last - buffer->start);
+    buffer->start = p;
+    buffer->pos = p;
 
-static u_char *
-ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
-                      ngx_cached_http_log_iso8601.len);
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    return NGX_OK;
 }
 
-static u_char *
-ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+
+static ssize_t
+ngx_http_log_thread_write(ngx_fd_t fd, u_char *buf, size_t len, void *data,
+    ngx_log_t *log)
 {
-    ngx_time_t  *tp;
+#if (NGX_ZLIB)
+    ngx_http_log_buf_t *buffer = data;
 
-    tp = ngx_timeofday();
+    if (buffer->gzip) {
+        return ngx_http_log_gzip(fd, buf, len, buffer->gzip, log);
+    }
+#endif
 
-    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+    return ngx_write_fd(fd, buf, len);
 }
 
+#endif
 
-static u_char *
-ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    ngx_time_t      *tp;
-    ngx_msec_int_t   ms;
 
-    tp = ngx_timeofday();
+static ngx_msec_t  ngx_http_log_aggregate_bounds[] = {
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
 
-    ms = (ngx_msec_int_t)
-             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
-    ms = ngx_max(ms, 0);
 
-    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
-}
+static char  *ngx_http_log_aggregate_labels[] = {
+    "0.001", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5",
+    "1", "2.5", "5", "10", "+Inf"
+};
 
 
-static u_char *
-ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+static void
+ngx_http_log_aggregate(ngx_http_request_t *r,
+    ngx_http_log_aggregate_t *aggregate)
 {
-    ngx_uint_t  status;
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    ngx_uint_t                      i, status;
+    ngx_msec_int_t                  ms;
+    ngx_rbtree_node_t              *node;
+    ngx_http_log_aggregate_ctx_t   *ctx;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    ctx = aggregate->shm_zone->data;
+
+    if (ngx_http_complex_value(r, &ctx->key, &key) != NGX_OK) {
+        return;
+    }
 
-    if (r->err_status) {
-        status = r->err_status;
+    if (key.len == 0) {
+        return;
+    }
 
-    } else if (r->headers_out.status) {
-        status = r->headers_out.status;
+    if (key.len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the value of the \"%V\" key "
+                      "is more than 65535 bytes: \"%V\"",
+                      &ctx->key.value, &key);
+        return;
+    }
 
-    } else if (r->http_version == NGX_HTTP_VERSION_9) {
-        status = 9;
+    hash = ngx_crc32_short(key.data, key.len);
 
-    } else {
-        status = 0;
-    }
+    ms = ngx_http_log_request_msec(r);
+    status = ngx_http_log_status_code(r) / 100;
 
-    return ngx_sprintf(buf, "%03ui", status);
-}
+    /* the requests are counted without locking, in the worker process */
 
+    lan = ngx_http_log_aggregate_lookup(&aggregate->rbtree, hash,
+                                        key.data, key.len);
 
-static u_char *
-ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_sprintf(buf, "%O", r->connection->sent);
-}
+    if (lan == NULL) {
+
+        if (aggregate->pool == NULL) {
+            aggregate->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE,
+                                              ngx_cycle->log);
+            if (aggregate->pool == NULL) {
+                return;
+            }
+        }
 
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_log_aggregate_node_t, data)
+               + key.len;
 
-/*
- * although there is a real $body_bytes_sent variable,
- * this log operation code function is more optimized for logging
- */
+        node = ngx_pcalloc(aggregate->pool, size);
+        if (node == NULL) {
+            return;
+        }
 
-static u_char *
-ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    off_t  length;
+        node->key = hash;
 
-    length = r->connection->sent - r->header_size;
+        lan = (ngx_http_log_aggregate_node_t *) &node->color;
 
-    if (length > 0) {
-        return ngx_sprintf(buf, "%O", length);
+        lan->len = (u_short) key.len;
+        ngx_memcpy(lan->data, key.data, key.len);
+
+        ngx_rbtree_insert(&aggregate->rbtree, node);
+        ngx_queue_insert_tail(&aggregate->queue, &lan->queue);
     }
 
-    *buf = '0';
+    lan->requests++;
 
-    return buf + 1;
-}
+    if (status >= 1 && status <= 5) {
+        lan->status[status - 1]++;
+    }
 
+    lan->bytes_sent += r->connection->sent;
+    lan->request_time += ms;
 
-static u_char *
-ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_sprintf(buf, "%O", r->request_length);
+    for (i = 0; i < NGX_HTTP_LOG_AGGREGATE_BUCKETS - 1; i++) {
+        if ((ngx_msec_t) ms <= ngx_http_log_aggregate_bounds[i]) {
+            break;
+        }
+    }
+
+    lan->buckets[i]++;
 }
 
 
-static ngx_int_t
-ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
-    ngx_str_t *value, ngx_uint_t escape)
+static ngx_http_log_aggregate_node_t *
+ngx_http_log_aggregate_lookup(ngx_rbtree_t *rbtree, uint32_t hash,
+    u_char *data, size_t len)
+{
+    ngx_int_t                       rc;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lan = (ngx_http_log_aggregate_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lan->data, len, (size_t) lan->len);
+
+        if (rc == 0) {
+            return lan;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_log_aggregate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_log_aggregate_node_t   *lann, *lant;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lann = (ngx_http_log_aggregate_node_t *) &node->color;
+            lant = (ngx_http_log_aggregate_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lann->data, lant->data, lann->len, lant->len)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_log_aggregate_merge(ngx_http_log_aggregate_t *aggregate)
+{
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_uint_t                      i;
+    ngx_queue_t                    *q;
+    ngx_rbtree_node_t              *node;
+    ngx_http_log_aggregate_ctx_t   *ctx;
+    ngx_http_log_aggregate_node_t  *lan, *san;
+
+    if (aggregate->pool == NULL) {
+        return;
+    }
+
+    ctx = aggregate->shm_zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for (q = ngx_queue_head(&aggregate->queue);
+         q != ngx_queue_sentinel(&aggregate->queue);
+         q = ngx_queue_next(q))
+    {
+        lan = ngx_queue_data(q, ngx_http_log_aggregate_node_t, queue);
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lan - offsetof(ngx_rbtree_node_t, color));
+
+        hash = node->key;
+
+        san = ngx_http_log_aggregate_lookup(&ctx->sh->rbtree, hash,
+                                            lan->data, lan->len);
+
+        if (san == NULL) {
+            size = offsetof(ngx_rbtree_node_t, color)
+                   + offsetof(ngx_http_log_aggregate_node_t, data)
+                   + lan->len;
+
+            node = ngx_slab_calloc_locked(ctx->shpool, size);
+
+            if (node == NULL) {
+                ctx->sh->dropped += lan->requests;
+                continue;
+            }
+
+            node->key = hash;
+
+            san = (ngx_http_log_aggregate_node_t *) &node->color;
+
+            san->len = lan->len;
+            ngx_memcpy(san->data, lan->data, lan->len);
+
+            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            ngx_queue_insert_tail(&ctx->sh->queue, &san->queue);
+        }
+
+        san->requests += lan->requests;
+
+        for (i = 0; i < 5; i++) {
+            san->status[i] += lan->status[i];
+        }
+
+        san->bytes_sent += lan->bytes_sent;
+        san->request_time += lan->request_time;
+
+        for (i = 0; i < NGX_HTTP_LOG_AGGREGATE_BUCKETS; i++) {
+            san->buckets[i] += lan->buckets[i];
+        }
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_destroy_pool(aggregate->pool);
+    aggregate->pool = NULL;
+
+    ngx_rbtree_init(&aggregate->rbtree, &aggregate->sentinel,
+                    ngx_http_log_aggregate_rbtree_insert_value);
+    ngx_queue_init(&aggregate->queue);
+}
+
+
+static void
+ngx_http_log_aggregate_flush(ngx_http_log_aggregate_t *aggregate,
+    ngx_log_t *log)
+{
+    u_char                         *buf, *copy, *last, *p;
+    size_t                          size, len;
+    time_t                          now;
+    ssize_t                         n;
+    ngx_uint_t                      i, dropped;
+    ngx_queue_t                    *q;
+    ngx_rbtree_node_t              *node;
+    ngx_http_log_aggregate_ctx_t   *ctx;
+    ngx_http_log_aggregate_node_t  *lan;
+
+    ctx = aggregate->shm_zone->data;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    /* summaries are written by the first worker which finds them due */
+
+    if (ctx->sh->flush == 0) {
+        ctx->sh->flush = now + ctx->interval;
+    }
+
+    if (now < ctx->sh->flush) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return;
+    }
+
+    /*
+     * the counters are copied under the lock, and formatted afterwards
+     * into the same memory, which is sized for both
+     */
+
+    len = 0;
+    size = 0;
+
+    for (q = ngx_queue_head(&ctx->sh->queue);
+         q != ngx_queue_sentinel(&ctx->sh->queue);
+         q = ngx_queue_next(q))
+    {
+        lan = ngx_queue_data(q, ngx_http_log_aggregate_node_t, queue);
+
+        len += ngx_align(offsetof(ngx_http_log_aggregate_node_t, data)
+                         + lan->len, NGX_ALIGNMENT);
+
+        size += sizeof("{\"time\":\"\",\"zone\":\"\",\"key\":\"\","
+                       "\"requests\":,\"1xx\":,\"2xx\":,\"3xx\":,"
+                       "\"4xx\":,\"5xx\":,\"bytes_sent\":,"
+                       "\"request_time\":.,\"buckets\":{}}") - 1
+                + NGX_LINEFEED_SIZE
+                + ngx_cached_http_log_iso8601.len
+                + aggregate->shm_zone->shm.name.len
+                + lan->len + ngx_escape_json(NULL, lan->data, lan->len)
+                + 6 * NGX_INT_T_LEN + NGX_OFF_T_LEN + NGX_TIME_T_LEN + 3
+                + NGX_HTTP_LOG_AGGREGATE_BUCKETS
+                  * (sizeof(",\"+Inf\":") - 1 + NGX_INT_T_LEN);
+    }
+
+    copy = NULL;
+
+    if (len) {
+        copy = ngx_alloc(len + size, log);
+
+        if (copy == NULL) {
+
+            /* the counters are kept to be written next time */
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return;
+        }
+    }
+
+    ctx->sh->flush = now + ctx->interval;
+
+    dropped = ctx->sh->dropped;
+    ctx->sh->dropped = 0;
+
+    p = copy;
+
+    while (!ngx_queue_empty(&ctx->sh->queue)) {
+
+        q = ngx_queue_head(&ctx->sh->queue);
+        lan = ngx_queue_data(q, ngx_http_log_aggregate_node_t, queue);
+
+        n = offsetof(ngx_http_log_aggregate_node_t, data) + lan->len;
+
+        ngx_memcpy(p, lan, n);
+        p += ngx_align(n, NGX_ALIGNMENT);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lan - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (dropped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%ui requests were not counted in "
+                      "log_aggregate_zone \"%V\", the zone is too small",
+                      dropped, &aggregate->shm_zone->shm.name);
+    }
+
+    if (copy == NULL) {
+        return;
+    }
+
+    last = copy + len;
+    buf = last;
+    p = buf;
+
+    for (lan = (ngx_http_log_aggregate_node_t *) copy;
+         (u_char *) lan < last;
+         lan = (ngx_http_log_aggregate_node_t *) ((u_char *) lan
+                   + ngx_align(offsetof(ngx_http_log_aggregate_node_t, data)
+                               + lan->len, NGX_ALIGNMENT)))
+    {
+        p = ngx_sprintf(p, "{\"time\":\"%V\",\"zone\":\"%V\",\"key\":\"",
+                        &ngx_cached_http_log_iso8601,
+                        &aggregate->shm_zone->shm.name);
+
+        p = (u_char *) ngx_escape_json(p, lan->data, lan->len);
+
+        p = ngx_sprintf(p, "\",\"requests\":%ui,\"1xx\":%ui,"
+                        "\"2xx\":%ui,\"3xx\":%ui,\"4xx\":%ui,"
+                        "\"5xx\":%ui,\"bytes_sent\":%O,"
+                        "\"request_time\":%T.%03M,\"buckets\":{",
+                        lan->requests, lan->status[0], lan->status[1],
+                        lan->status[2], lan->status[3], lan->status[4],
+                        lan->bytes_sent,
+                        (time_t) (lan->request_time / 1000),
+                        lan->request_time % 1000);
+
+        for (i = 0; i < NGX_HTTP_LOG_AGGREGATE_BUCKETS; i++) {
+            p = ngx_sprintf(p, "%s\"%s\":%ui", i ? "," : "",
+                            ngx_http_log_aggregate_labels[i],
+                            lan->buckets[i]);
+        }
+
+        *p++ = '}';
+        *p++ = '}';
+        ngx_linefeed(p);
+    }
+
+    n = ngx_write_fd(aggregate->file->fd, buf, p - buf);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      aggregate->file->name.data);
+
+    } else if (n != p - buf) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      aggregate->file->name.data, n, (size_t) (p - buf));
+    }
+
+    ngx_free(copy);
+}
+
+
+static void
+ngx_http_log_aggregate_flush_handler(ngx_event_t *ev)
+{
+    ngx_http_log_aggregate_t  *aggregate;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "http log aggregate flush handler");
+
+    aggregate = ev->data;
+
+    ngx_http_log_aggregate_merge(aggregate);
+
+    /*
+     * a process of the previous configuration only merges its counters,
+     * the summaries are written to the file configured by the current one
+     */
+
+    if (!ngx_exiting) {
+        ngx_http_log_aggregate_flush(aggregate, ev->log);
+    }
+
+    ngx_add_timer(ev, 1000);
+}
+
+
+static u_char *
+ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    size_t     len;
+    uintptr_t  data;
+
+    len = op->len;
+    data = op->data;
+
+    while (len--) {
+        *buf++ = (u_char) (data & 0xff);
+        data >>= 8;
+    }
+
+    return buf;
+}
+
+
+static u_char *
+ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static u_char *
+ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    if (r->pipeline) {
+        *buf = 'p';
+    } else {
+        *buf = '.';
+    }
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
+                      ngx_cached_http_log_time.len);
+}
+
+static u_char *
+ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
+                      ngx_cached_http_log_iso8601.len);
+}
+
+static u_char *
+ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_msec_int_t  ms;
+
+    ms = ngx_http_log_request_msec(r);
+
+    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+}
+
+
+static ngx_msec_int_t
+ngx_http_log_request_msec(ngx_http_request_t *r)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+    return ngx_max(ms, 0);
+}
+
+
+static u_char *
+ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%03ui", ngx_http_log_status_code(r));
+}
+
+
+static ngx_uint_t
+ngx_http_log_status_code(ngx_http_request_t *r)
+{
+    if (r->err_status) {
+        return r->err_status;
+    }
+
+    if (r->headers_out.status) {
+        return r->headers_out.status;
+    }
+
+    if (r->http_version == NGX_HTTP_VERSION_9) {
+        return 9;
+    }
+
+    return 0;
+}
+
+
+static u_char *
+ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->connection->sent);
+}
+
+
+/*
+ * although there is a real $body_bytes_sent variable,
+ * this log operation code function is more optimized for logging
+ */
+
+static u_char *
+ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    if (length > 0) {
+        return ngx_sprintf(buf, "%O", length);
+    }
+
+    *buf = '0';
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->request_length);
+}
+
+
+static u_char *
+ngx_http_log_varint(u_char *p, uint64_t n)
+{
+    while (n >= 0x80) {
+        *p++ = (u_char) (n | 0x80);
+        n >>= 7;
+    }
+
+    *p++ = (u_char) n;
+
+    return p;
+}
+
+
+static void
+ngx_http_log_binary_length(u_char *start, u_char *last)
+{
+    size_t  len;
+
+    len = last - start - 1 - NGX_HTTP_LOG_LENGTH_LEN;
+
+    start[1] = (u_char) (len | 0x80);
+    start[2] = (u_char) ((len >> 7) | 0x80);
+    start[3] = (u_char) ((len >> 14) | 0x80);
+    start[4] = (u_char) ((len >> 21) & 0x7f);
+}
+
+
+static u_char *
+ngx_http_log_binary_pipe(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    *buf++ = NGX_HTTP_LOG_FIELD_STRING;
+    *buf++ = 1;
+    *buf++ = r->pipeline ? 'p' : '.';
+
+    return buf;
+}
+
+
+static u_char *
+ngx_http_log_binary_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    *buf++ = NGX_HTTP_LOG_FIELD_TIME;
+
+    return ngx_http_log_varint(buf, (uint64_t) tp->sec * 1000 + tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_binary_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    *buf++ = NGX_HTTP_LOG_FIELD_MSEC;
+
+    return ngx_http_log_varint(buf, ngx_http_log_request_msec(r));
+}
+
+
+static u_char *
+ngx_http_log_binary_status(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    *buf++ = NGX_HTTP_LOG_FIELD_UINT;
+
+    return ngx_http_log_varint(buf, ngx_http_log_status_code(r));
+}
+
+
+static u_char *
+ngx_http_log_binary_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    *buf++ = NGX_HTTP_LOG_FIELD_UINT;
+
+    return ngx_http_log_varint(buf, r->connection->sent);
+}
+
+
+static u_char *
+ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    *buf++ = NGX_HTTP_LOG_FIELD_UINT;
+
+    return ngx_http_log_varint(buf, length > 0 ? length : 0);
+}
+
+
+static u_char *
+ngx_http_log_binary_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    *buf++ = NGX_HTTP_LOG_FIELD_UINT;
+
+    return ngx_http_log_varint(buf, r->request_length);
+}
+
+
+static size_t
+ngx_http_log_binary_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 1;
+    }
+
+    return 1 + NGX_HTTP_LOG_VARINT_LEN + value->len;
+}
+
+
+static u_char *
+ngx_http_log_binary_variable(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, op->data);
+
+    if (value == NULL || value->not_found) {
+        *buf = NGX_HTTP_LOG_FIELD_NULL;
+        return buf + 1;
+    }
+
+    *buf++ = NGX_HTTP_LOG_FIELD_STRING;
+    buf = ngx_http_log_varint(buf, value->len);
+
+    return ngx_cpymem(buf, value->data, value->len);
+}
+
+
+static ngx_int_t
+ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
+    ngx_str_t *value, ngx_uint_t escape)
 {
     ngx_int_t  index;
 
@@ -1140,6 +2151,13 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    if (ngx_array_init(&conf->aggregates, cf->pool, 1,
+                       sizeof(ngx_http_log_aggregate_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
     fmt = ngx_array_push(&conf->formats);
     if (fmt == NULL) {
         return NULL;
@@ -1148,6 +2166,8 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
     ngx_str_set(&fmt->name, "combined");
 
     fmt->flushes = NULL;
+    ngx_str_null(&fmt->schema);
+    fmt->binary = 0;
 
     fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_http_log_op_t));
     if (fmt->ops == NULL) {
@@ -1240,7 +2260,7 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_loc_conf_t *llcf = conf;
 
     ssize_t                            size;
-    ngx_int_t                          gzip;
+    ngx_int_t                          gzip, rate;
     ngx_uint_t                         i, n;
     ngx_msec_t                         flush;
     ngx_str_t                         *value, name, s;
@@ -1249,8 +2269,15 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_buf_t                *buffer;
     ngx_http_log_fmt_t                *fmt;
     ngx_http_log_main_conf_t          *lmcf;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_log_aggregate_t         **aggregate;
     ngx_http_script_compile_t          sc;
     ngx_http_compile_complex_value_t   ccv;
+#if (NGX_THREADS)
+    ngx_int_t                          sample;
+    ngx_uint_t                         overflow;
+    ngx_thread_pool_t                 *tp;
+#endif
 
     value = cf->args->elts;
 
@@ -1333,6 +2360,65 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 process_formats:
 
+    log->schema_fd = NGX_INVALID_FILE;
+
+    if (cf->args->nelts >= 3
+        && ngx_strncmp(value[2].data, "aggregate=", 10) == 0)
+    {
+        if (log->file == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "aggregated logs can only be written "
+                               "to files without variables in name");
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 10;
+        s.data = value[2].data + 10;
+
+        shm_zone = ngx_shared_memory_add(cf, &s, 0, &ngx_http_log_module);
+        if (shm_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        aggregate = lmcf->aggregates.elts;
+        for (i = 0; i < lmcf->aggregates.nelts; i++) {
+            if (aggregate[i]->shm_zone != shm_zone) {
+                continue;
+            }
+
+            if (aggregate[i]->file != log->file) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "log_aggregate_zone \"%V\" is already "
+                                   "written to \"%V\"",
+                                   &s, &aggregate[i]->file->name);
+                return NGX_CONF_ERROR;
+            }
+
+            log->aggregate = aggregate[i];
+            break;
+        }
+
+        if (log->aggregate == NULL) {
+            aggregate = ngx_array_push(&lmcf->aggregates);
+            if (aggregate == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *aggregate = ngx_pcalloc(cf->pool,
+                                     sizeof(ngx_http_log_aggregate_t));
+            if (*aggregate == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            (*aggregate)->shm_zone = shm_zone;
+            (*aggregate)->file = log->file;
+
+            log->aggregate = *aggregate;
+        }
+
+        goto process_params;
+    }
+
     if (cf->args->nelts >= 3) {
         name = value[2];
 
@@ -1361,10 +2447,26 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->binary && (log->script || log->syslog_peer)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format \"%V\" can only be used "
+                           "with log files without variables in name",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+process_params:
+
     size = 0;
     flush = 0;
     gzip = 0;
 
+#if (NGX_THREADS)
+    tp = NULL;
+    overflow = NGX_HTTP_LOG_OVERFLOW_BLOCK;
+    sample = 0;
+#endif
+
     for (i = 3; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
@@ -1430,6 +2532,109 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "thread", 6) == 0
+            && (value[i].len == 6 || value[i].data[6] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 6) {
+                tp = ngx_thread_pool_add(cf, NULL);
+
+            } else {
+                s.len = value[i].len - 7;
+                s.data = value[i].data + 7;
+
+                tp = ngx_thread_pool_add(cf, &s);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "overflow=", 9) == 0) {
+#if (NGX_THREADS)
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            if (ngx_strcmp(s.data, "block") == 0) {
+                overflow = NGX_HTTP_LOG_OVERFLOW_BLOCK;
+                continue;
+            }
+
+            if (ngx_strcmp(s.data, "drop") == 0) {
+                overflow = NGX_HTTP_LOG_OVERFLOW_DROP;
+                continue;
+            }
+
+            if (ngx_strcmp(s.data, "sample") == 0) {
+                overflow = NGX_HTTP_LOG_OVERFLOW_SAMPLE;
+                sample = 10;
+                continue;
+            }
+
+            if (ngx_strncmp(s.data, "sample:", 7) == 0) {
+                overflow = NGX_HTTP_LOG_OVERFLOW_SAMPLE;
+                sample = ngx_atoi(s.data + 7, s.len - 7);
+
+                if (sample > 0) {
+                    continue;
+                }
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid overflow policy \"%V\"", &s);
+            return NGX_CONF_ERROR;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "sample=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len < 2 || s.data[s.len - 1] != '%') {
+                goto invalid_sample;
+            }
+
+            rate = ngx_atofp(s.data, s.len - 1, 2);
+
+            if (rate <= 0 || rate > 10000) {
+                goto invalid_sample;
+            }
+
+            log->sample = rate;
+
+            log->sample_index = ngx_http_get_variable_index(cf,
+                                                   &ngx_http_log_request_id);
+            if (log->sample_index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+        invalid_sample:
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid sample rate \"%V\"", &s);
+            return NGX_CONF_ERROR;
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1465,6 +2670,27 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->aggregate && size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "aggregated logs cannot be buffered");
+        return NGX_CONF_ERROR;
+    }
+
+    if (log->aggregate && log->sample) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "aggregated logs cannot be sampled");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if (overflow != NGX_HTTP_LOG_OVERFLOW_BLOCK && tp == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "overflow policy requires \"thread\" "
+                           "for access_log \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     if (size) {
 
         if (log->script) {
@@ -1484,7 +2710,13 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+#if (NGX_THREADS)
+                || (buffer->writer ? buffer->writer->thread_pool : NULL) != tp
+                || buffer->overflow != overflow
+                || buffer->sample != (ngx_uint_t) sample
+#endif
+                )
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1525,6 +2757,22 @@ process_formats:
 
         buffer->gzip = gzip;
 
+#if (NGX_THREADS)
+        if (tp) {
+            buffer->writer = ngx_thread_writer_create(cf, log->file, tp, size,
+                                                NGX_HTTP_LOG_THREAD_BUFFERS);
+            if (buffer->writer == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->writer->write = ngx_http_log_thread_write;
+            buffer->writer->data = buffer;
+
+            buffer->overflow = overflow;
+            buffer->sample = sample;
+        }
+#endif
+
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
     }
@@ -1538,8 +2786,9 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_log_main_conf_t *lmcf = conf;
 
+    char                *rv;
     ngx_str_t           *value;
-    ngx_uint_t           i;
+    ngx_uint_t           i, s;
     ngx_http_log_fmt_t  *fmt;
 
     value = cf->args->elts;
@@ -1563,17 +2812,44 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     fmt->name = value[1];
 
-    fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
-    if (fmt->flushes == NULL) {
-        return NGX_CONF_ERROR;
+    fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
+    if (fmt->flushes == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_http_log_op_t));
+    if (fmt->ops == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&fmt->schema);
+    fmt->binary = 0;
+
+    s = 2;
+
+    if (s < cf->args->nelts
+        && ngx_strncmp(value[s].data, "encoding=", 9) == 0)
+    {
+        if (ngx_strcmp(&value[s].data[9], "binary") == 0) {
+            fmt->binary = 1;
+
+        } else if (ngx_strcmp(&value[s].data[9], "text") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown log format encoding \"%s\"",
+                               &value[s].data[9]);
+            return NGX_CONF_ERROR;
+        }
+
+        s++;
     }
 
-    fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_http_log_op_t));
-    if (fmt->ops == NULL) {
-        return NGX_CONF_ERROR;
+    rv = ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, s);
+
+    if (rv != NGX_CONF_OK || !fmt->binary) {
+        return rv;
     }
 
-    return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
+    return ngx_http_log_compile_binary(cf, fmt);
 }
 
 
@@ -1756,6 +3032,156 @@ invalid:
 }
 
 
+static char *
+ngx_http_log_compile_binary(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt)
+{
+    u_char                     *p, *start;
+    size_t                      size;
+    uint32_t                    id;
+    ngx_str_t                  *name;
+    ngx_uint_t                  i, n;
+    ngx_array_t                *ops, names;
+    ngx_http_log_op_t          *op, *bop, *header;
+    ngx_http_log_var_t         *v, *bv;
+    ngx_http_variable_t        *var;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    /*
+     * text between variables is not logged, variables become typed
+     * fields, and numeric ones are written natively
+     */
+
+    ops = ngx_array_create(cf->pool, fmt->ops->nelts + 1,
+                           sizeof(ngx_http_log_op_t));
+    if (ops == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&names, cf->temp_pool, 8, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    header = ngx_array_push(ops);
+    if (header == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    var = cmcf->variables.elts;
+
+    size = 1 + NGX_HTTP_LOG_LENGTH_LEN + 4
+           + NGX_HTTP_LOG_VARINT_LEN + fmt->name.len
+           + NGX_HTTP_LOG_VARINT_LEN;
+
+    op = fmt->ops->elts;
+
+    for (i = 0; i < fmt->ops->nelts; i++) {
+
+        if (op[i].run == ngx_http_log_copy_short
+            || op[i].run == ngx_http_log_copy_long)
+        {
+            continue;
+        }
+
+        bop = ngx_array_push(ops);
+        if (bop == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        name = ngx_array_push(&names);
+        if (name == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (op[i].getlen) {
+            *name = var[op[i].data].name;
+
+            bop->len = 0;
+            bop->getlen = ngx_http_log_binary_variable_getlen;
+            bop->run = ngx_http_log_binary_variable;
+            bop->data = op[i].data;
+
+        } else {
+            for (v = ngx_http_log_vars; v->run != op[i].run; v++) {
+                /* void */
+            }
+
+            for (bv = ngx_http_log_binary_vars; bv->name.len; bv++) {
+                if (bv->name.len == v->name.len
+                    && ngx_strcmp(bv->name.data, v->name.data) == 0)
+                {
+                    break;
+                }
+            }
+
+            *name = v->name;
+
+            bop->len = bv->len;
+            bop->getlen = NULL;
+            bop->run = bv->run;
+            bop->data = 0;
+        }
+
+        size += NGX_HTTP_LOG_VARINT_LEN + name->len;
+    }
+
+    start = ngx_pnalloc(cf->pool, size);
+    if (start == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = start + 1 + NGX_HTTP_LOG_LENGTH_LEN + 4;
+
+    p = ngx_http_log_varint(p, fmt->name.len);
+    p = ngx_cpymem(p, fmt->name.data, fmt->name.len);
+    p = ngx_http_log_varint(p, names.nelts);
+
+    name = names.elts;
+
+    for (n = 0; n < names.nelts; n++) {
+        p = ngx_http_log_varint(p, name[n].len);
+        p = ngx_cpymem(p, name[n].data, name[n].len);
+    }
+
+    fmt->schema.data = start;
+    fmt->schema.len = p - start;
+
+    ngx_http_log_binary_length(start, p);
+
+    size = 1 + NGX_HTTP_LOG_LENGTH_LEN;
+
+    id = ngx_crc32_short(start + size + 4, fmt->schema.len - size - 4);
+
+    start[0] = NGX_HTTP_LOG_SCHEMA;
+    start[size] = (u_char) (id >> 24);
+    start[size + 1] = (u_char) (id >> 16);
+    start[size + 2] = (u_char) (id >> 8);
+    start[size + 3] = (u_char) id;
+
+    /* the data record header, the length is set when it is written */
+
+    p = ngx_pnalloc(cf->pool, size + 4 + NGX_HTTP_LOG_VARINT_LEN);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    header->getlen = NULL;
+    header->run = ngx_http_log_copy_long;
+    header->data = (uintptr_t) p;
+
+    *p = NGX_HTTP_LOG_RECORD;
+    ngx_memcpy(p + size, start + size, 4);
+
+    header->len = ngx_http_log_varint(p + size + 4, names.nelts) - p;
+
+    fmt->ops = ops;
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1864,13 +3290,201 @@ ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_log_aggregate_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                            *p;
+    ssize_t                            size;
+    ngx_str_t                         *value, name, s;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_log_aggregate_ctx_t      *ctx;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_aggregate_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &ctx->key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    name.len = 0;
+    ctx->interval = 60;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ctx->interval = ngx_parse_time(&s, 1);
+
+            if (ctx->interval == (time_t) NGX_ERROR || ctx->interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_log_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ctx = shm_zone->data;
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is already bound to key \"%V\"",
+                           &cmd->name, &name, &ctx->key.value);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_log_aggregate_init_zone;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_aggregate_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_log_aggregate_ctx_t  *octx = data;
+
+    size_t                         len;
+    ngx_http_log_aggregate_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if (ctx->key.value.len != octx->key.value.len
+            || ngx_strncmp(ctx->key.value.data, octx->key.value.data,
+                           ctx->key.value.len)
+               != 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "log_aggregate_zone \"%V\" uses the \"%V\" key "
+                          "while previously it used the \"%V\" key",
+                          &shm_zone->shm.name, &ctx->key.value,
+                          &octx->key.value);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              sizeof(ngx_http_log_aggregate_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_log_aggregate_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in log_aggregate_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in log_aggregate_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* running out of memory is reported on flush */
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_log_init(ngx_conf_t *cf)
 {
     ngx_str_t                  *value;
+    ngx_uint_t                  i;
     ngx_array_t                 a;
     ngx_http_handler_pt        *h;
     ngx_http_log_fmt_t         *fmt;
+    ngx_http_log_aggregate_t  **aggregate;
     ngx_http_log_main_conf_t   *lmcf;
     ngx_http_core_main_conf_t  *cmcf;
 
@@ -1896,6 +3510,16 @@ ngx_http_log_init(ngx_conf_t *cf)
         }
     }
 
+    aggregate = lmcf->aggregates.elts;
+    for (i = 0; i < lmcf->aggregates.nelts; i++) {
+        if (aggregate[i]->shm_zone->data == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown log_aggregate_zone \"%V\"",
+                               &aggregate[i]->shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+    }
+
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
@@ -1907,3 +3531,111 @@ ngx_http_log_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_log_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i;
+    ngx_http_log_aggregate_t  **aggregate;
+    ngx_http_log_main_conf_t   *lmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_log_module);
+
+    if (lmcf == NULL) {
+        return NGX_OK;
+    }
+
+    aggregate = lmcf->aggregates.elts;
+    for (i = 0; i < lmcf->aggregates.nelts; i++) {
+        ngx_rbtree_init(&aggregate[i]->rbtree, &aggregate[i]->sentinel,
+                        ngx_http_log_aggregate_rbtree_insert_value);
+        ngx_queue_init(&aggregate[i]->queue);
+
+        aggregate[i]->event.handler = ngx_http_log_aggregate_flush_handler;
+        aggregate[i]->event.data = aggregate[i];
+        aggregate[i]->event.log = cycle->log;
+        aggregate[i]->event.cancelable = 1;
+
+        ngx_add_timer(&aggregate[i]->event, 1000);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_exit_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i;
+    ngx_http_log_aggregate_t  **aggregate;
+    ngx_http_log_main_conf_t   *lmcf;
+#if (NGX_THREADS)
+    ngx_list_part_t            *part;
+    ngx_open_file_t            *file;
+    ngx_http_log_buf_t         *buffer;
+#endif
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    /* the counters of the worker are left to be written by others */
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_log_module);
+
+    if (lmcf) {
+        aggregate = lmcf->aggregates.elts;
+        for (i = 0; i < lmcf->aggregates.nelts; i++) {
+            ngx_http_log_aggregate_merge(aggregate[i]);
+        }
+    }
+
+#if (NGX_THREADS)
+
+    /*
+     * the thread pools are destroyed by now, so the buffers left
+     * are written here
+     */
+
+    part = &cycle->open_files.part;
+    file = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            file = part->elts;
+            i = 0;
+        }
+
+        if (file[i].flush != ngx_http_log_flush) {
+            continue;
+        }
+
+        buffer = file[i].data;
+
+        if (buffer->writer == NULL) {
+            continue;
+        }
+
+        ngx_thread_writer_exit(buffer->writer, cycle->log);
+
+        buffer->writer = NULL;
+
+        ngx_http_log_flush(&file[i], cycle->log);
+    }
+
+#endif
+}
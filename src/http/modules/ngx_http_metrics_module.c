@@ -0,0 +1,2079 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_METRICS_SERVER         0
+#define NGX_HTTP_METRICS_LOCATION       1
+#define NGX_HTTP_METRICS_UPSTREAM       2
+#define NGX_HTTP_METRICS_PEER           3
+
+#define NGX_HTTP_METRICS_COUNTERS       16
+
+#define NGX_HTTP_METRICS_REQUESTS       0
+#define NGX_HTTP_METRICS_RESPONSES      1
+#define NGX_HTTP_METRICS_DISCARDED      6
+#define NGX_HTTP_METRICS_FAILS          6
+#define NGX_HTTP_METRICS_RECEIVED       7
+#define NGX_HTTP_METRICS_SENT           8
+#define NGX_HTTP_METRICS_REQUEST_TIME   9
+#define NGX_HTTP_METRICS_CPU_TIME       10
+#define NGX_HTTP_METRICS_POOL_BYTES     11
+#define NGX_HTTP_METRICS_CONNECT_TIME   9
+#define NGX_HTTP_METRICS_HEADER_TIME    10
+#define NGX_HTTP_METRICS_RESPONSE_TIME  11
+
+/* units of counters */
+#define NGX_HTTP_METRICS_NUMBER         0
+#define NGX_HTTP_METRICS_MSEC           1
+#define NGX_HTTP_METRICS_USEC           2
+
+#define NGX_HTTP_METRICS_HIST_REQUEST         0
+#define NGX_HTTP_METRICS_HIST_REQUEST_HEADER  1
+#define NGX_HTTP_METRICS_HIST_FIRST_BYTE      2
+#define NGX_HTTP_METRICS_HIST_HANDSHAKE       3
+#define NGX_HTTP_METRICS_HIST_CONNECT         0
+#define NGX_HTTP_METRICS_HIST_HEADER          1
+#define NGX_HTTP_METRICS_HIST_RESPONSE        2
+
+/*
+ * log-linear buckets of microseconds: values below 32 usec are exact,
+ * each following power of two is split into 16 buckets, so a bucket is
+ * at most 6.25% wide; this gives 32 + 27 * 16 = 464 buckets up to 2^32
+ * usec (about 71 minutes), larger values fall into the last bucket
+ */
+
+#define NGX_HTTP_METRICS_BUCKETS        464
+
+
+typedef struct {
+    uint64_t                     counters[NGX_HTTP_METRICS_COUNTERS];
+} ngx_http_metrics_slot_t;
+
+
+typedef struct {
+    uint64_t                     sum;
+    uint64_t                     buckets[NGX_HTTP_METRICS_BUCKETS];
+} ngx_http_metrics_histogram_t;
+
+
+typedef struct ngx_http_metrics_gen_s  ngx_http_metrics_gen_t;
+
+/* an area of a configuration, the slots and histograms follow it */
+
+struct ngx_http_metrics_gen_s {
+    ngx_http_metrics_gen_t      *next;
+
+    /* the number of worker processes using the area */
+    ngx_uint_t                   refs;
+};
+
+
+typedef struct {
+    ngx_http_metrics_slot_t     *area;
+
+    /* the areas in use, the area of the last configuration goes first */
+    ngx_http_metrics_gen_t      *gens;
+} ngx_http_metrics_shctx_t;
+
+
+typedef struct {
+    ngx_uint_t                   type;
+    ngx_str_t                    name;
+    ngx_str_t                    peer;
+
+    /* JSON escaped name and peer */
+    ngx_str_t                    label;
+    ngx_str_t                    peer_label;
+
+    /* index of the first histogram of the object */
+    ngx_uint_t                   hist;
+
+    ngx_shm_zone_t              *shm_zone;
+} ngx_http_metrics_object_t;
+
+
+typedef struct {
+    ngx_array_t                    objects;  /* ngx_http_metrics_object_t */
+    ngx_array_t                    zones;    /* ngx_uint_t */
+
+    ngx_shm_zone_t                *shm_zone;
+    ngx_http_metrics_shctx_t      *sh;
+    ngx_slab_pool_t               *shpool;
+
+    /*
+     * a row of slots per worker process, the last row
+     * keeps counters carried over from the previous configuration
+     */
+    ngx_http_metrics_slot_t       *area;
+    ngx_http_metrics_gen_t        *gen;
+    ngx_uint_t                     workers;
+
+    /* rows of histograms, laid out the same way after the slots */
+    ngx_http_metrics_histogram_t  *hists;
+    ngx_uint_t                     nhists;
+
+    ngx_cycle_t                   *cycle;
+} ngx_http_metrics_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                   zone;
+    ngx_uint_t                   upstream;
+    ngx_hash_t                   peers;
+} ngx_http_metrics_srv_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                   zone;
+} ngx_http_metrics_loc_conf_t;
+
+
+typedef struct {
+    ngx_str_t                    metric;
+    ngx_str_t                    label;
+    ngx_str_t                    key;
+    ngx_uint_t                   unit;
+} ngx_http_metrics_counter_t;
+
+
+typedef struct {
+    ngx_str_t                    metric;
+    ngx_str_t                    key;
+} ngx_http_metrics_summary_t;
+
+
+typedef struct {
+    ngx_str_t                    name;
+    ngx_str_t                    key;
+    ngx_str_t                    label;
+    ngx_http_metrics_counter_t  *counters;
+    ngx_http_metrics_summary_t  *summaries;
+} ngx_http_metrics_type_t;
+
+
+static ngx_int_t ngx_http_metrics_handler(ngx_http_request_t *r);
+static u_char *ngx_http_metrics_prometheus(u_char *p,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_http_metrics_slot_t *totals,
+    ngx_http_metrics_histogram_t *htotals);
+static u_char *ngx_http_metrics_prometheus_name(u_char *p,
+    ngx_http_metrics_type_t *type, ngx_str_t *metric, char *suffix,
+    ngx_http_metrics_object_t *obj);
+static u_char *ngx_http_metrics_json(u_char *p,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_http_metrics_slot_t *totals,
+    ngx_http_metrics_histogram_t *htotals);
+static u_char *ngx_http_metrics_json_counters(u_char *p,
+    ngx_http_metrics_type_t *type, ngx_http_metrics_slot_t *slot,
+    ngx_http_metrics_histogram_t *hist);
+static u_char *ngx_http_metrics_value(u_char *p, uint64_t value,
+    ngx_uint_t unit);
+static u_char *ngx_http_metrics_usec(u_char *p, uint64_t usec);
+static u_char *ngx_http_metrics_quantile_label(u_char *p, ngx_uint_t q);
+static uint64_t ngx_http_metrics_count(ngx_http_metrics_histogram_t *hist);
+static uint64_t ngx_http_metrics_quantile(ngx_http_metrics_histogram_t *hist,
+    uint64_t count, ngx_uint_t q);
+static ngx_int_t ngx_http_metrics_log_handler(ngx_http_request_t *r);
+static void ngx_http_metrics_request(ngx_http_request_t *r,
+    ngx_http_metrics_slot_t *slot, ngx_http_metrics_histogram_t *hist,
+    ngx_uint_t status, ngx_msec_int_t ms);
+static void ngx_http_metrics_upstream(ngx_http_request_t *r,
+    ngx_http_metrics_main_conf_t *mmcf);
+static void ngx_http_metrics_state(ngx_http_metrics_slot_t *slot,
+    ngx_http_metrics_histogram_t *hist, ngx_http_upstream_state_t *state);
+static void ngx_http_metrics_record(ngx_http_metrics_histogram_t *hist,
+    uint64_t usec);
+static ngx_uint_t ngx_http_metrics_nhists(ngx_uint_t type);
+static ngx_uint_t ngx_http_metrics_find_zone(
+    ngx_http_metrics_main_conf_t *mmcf, ngx_shm_zone_t *shm_zone);
+
+static ngx_int_t ngx_http_metrics_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_metrics_free_gens(ngx_http_metrics_main_conf_t *mmcf);
+static void ngx_http_metrics_carry_over(ngx_http_metrics_main_conf_t *mmcf,
+    ngx_http_metrics_main_conf_t *omcf, ngx_http_metrics_slot_t *oarea);
+static ngx_int_t ngx_http_metrics_add_object(ngx_conf_t *cf,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_uint_t type, ngx_str_t *name,
+    ngx_str_t *peer);
+static ngx_int_t ngx_http_metrics_add_upstream(ngx_conf_t *cf,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_metrics_escape(ngx_conf_t *cf, ngx_str_t *dst,
+    ngx_str_t *src);
+
+static void *ngx_http_metrics_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_metrics_create_srv_conf(ngx_conf_t *cf);
+static void *ngx_http_metrics_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_metrics_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_metrics_zone_directive(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_metrics_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_metrics_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_metrics_init_process(ngx_cycle_t *cycle);
+static void ngx_http_metrics_exit_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_metrics_commands[] = {
+
+    { ngx_string("metrics_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_metrics_zone_directive,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_metrics_status_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("metrics"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_metrics,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_metrics_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_metrics_init,                 /* postconfiguration */
+
+    ngx_http_metrics_create_main_conf,     /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_metrics_create_srv_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_metrics_create_loc_conf,      /* create location configuration */
+    ngx_http_metrics_merge_loc_conf        /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_metrics_module = {
+    NGX_MODULE_V1,
+    &ngx_http_metrics_module_ctx,          /* module context */
+    ngx_http_metrics_commands,             /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_metrics_init_process,         /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_http_metrics_exit_process,         /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_metrics_counter_t  ngx_http_metrics_zone_counters[] = {
+    { ngx_string("requests_total"), ngx_null_string,
+      ngx_string("requests"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"1xx\""),
+      ngx_string("responses_1xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"2xx\""),
+      ngx_string("responses_2xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"3xx\""),
+      ngx_string("responses_3xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"4xx\""),
+      ngx_string("responses_4xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"5xx\""),
+      ngx_string("responses_5xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("discarded_total"), ngx_null_string,
+      ngx_string("discarded"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("received_bytes_total"), ngx_null_string,
+      ngx_string("received"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("sent_bytes_total"), ngx_null_string,
+      ngx_string("sent"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("request_time_seconds_total"), ngx_null_string,
+      ngx_string("request_time"), NGX_HTTP_METRICS_MSEC },
+    { ngx_string("cpu_time_seconds_total"), ngx_null_string,
+      ngx_string("cpu_time"), NGX_HTTP_METRICS_USEC },
+    { ngx_string("pool_allocated_bytes_total"), ngx_null_string,
+      ngx_string("pool_bytes"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_null_string, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+static ngx_http_metrics_counter_t  ngx_http_metrics_upstream_counters[] = {
+    { ngx_string("requests_total"), ngx_null_string,
+      ngx_string("requests"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"1xx\""),
+      ngx_string("responses_1xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"2xx\""),
+      ngx_string("responses_2xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"3xx\""),
+      ngx_string("responses_3xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"4xx\""),
+      ngx_string("responses_4xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("code=\"5xx\""),
+      ngx_string("responses_5xx"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("fails_total"), ngx_null_string,
+      ngx_string("fails"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("received_bytes_total"), ngx_null_string,
+      ngx_string("received"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("sent_bytes_total"), ngx_null_string,
+      ngx_string("sent"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("connect_time_seconds_total"), ngx_null_string,
+      ngx_string("connect_time"), NGX_HTTP_METRICS_MSEC },
+    { ngx_string("header_time_seconds_total"), ngx_null_string,
+      ngx_string("header_time"), NGX_HTTP_METRICS_MSEC },
+    { ngx_string("response_time_seconds_total"), ngx_null_string,
+      ngx_string("response_time"), NGX_HTTP_METRICS_MSEC },
+    { ngx_null_string, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+static ngx_http_metrics_summary_t  ngx_http_metrics_server_summaries[] = {
+    { ngx_string("request_time_seconds"), ngx_string("request_time") },
+    { ngx_string("request_header_time_seconds"),
+      ngx_string("request_header_time") },
+    { ngx_string("first_byte_time_seconds"), ngx_string("first_byte_time") },
+#if (NGX_HTTP_SSL)
+    { ngx_string("ssl_handshake_time_seconds"),
+      ngx_string("ssl_handshake_time") },
+#endif
+    { ngx_null_string, ngx_null_string }
+};
+
+
+static ngx_http_metrics_summary_t  ngx_http_metrics_location_summaries[] = {
+    { ngx_string("request_time_seconds"), ngx_string("request_time") },
+    { ngx_string("request_header_time_seconds"),
+      ngx_string("request_header_time") },
+    { ngx_string("first_byte_time_seconds"), ngx_string("first_byte_time") },
+    { ngx_null_string, ngx_null_string }
+};
+
+
+static ngx_http_metrics_summary_t  ngx_http_metrics_upstream_summaries[] = {
+    { ngx_string("connect_time_seconds"), ngx_string("connect_time") },
+    { ngx_string("header_time_seconds"), ngx_string("header_time") },
+    { ngx_string("response_time_seconds"), ngx_string("response_time") },
+    { ngx_null_string, ngx_null_string }
+};
+
+
+/* quantiles reported for histograms, in thousandths */
+
+static ngx_uint_t  ngx_http_metrics_quantiles[] = { 500, 900, 990, 999, 0 };
+
+
+/* indexed by the cache status minus one */
+
+static ngx_http_metrics_counter_t  ngx_http_metrics_cache_counters[] = {
+    { ngx_string("responses_total"), ngx_string("status=\"miss\""),
+      ngx_string("miss"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"bypass\""),
+      ngx_string("bypass"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"expired\""),
+      ngx_string("expired"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"stale\""),
+      ngx_string("stale"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"updating\""),
+      ngx_string("updating"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"revalidated\""),
+      ngx_string("revalidated"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"hit\""),
+      ngx_string("hit"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("responses_total"), ngx_string("status=\"scarce\""),
+      ngx_string("scarce"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_null_string, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+/* indexed by $limit_req_status and $limit_conn_status values minus one */
+
+static ngx_http_metrics_counter_t  ngx_http_metrics_limit_req_counters[] = {
+    { ngx_string("requests_total"), ngx_string("status=\"passed\""),
+      ngx_string("passed"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"delayed\""),
+      ngx_string("delayed"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"rejected\""),
+      ngx_string("rejected"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"delayed_dry_run\""),
+      ngx_string("delayed_dry_run"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"rejected_dry_run\""),
+      ngx_string("rejected_dry_run"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_null_string, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+static ngx_http_metrics_counter_t  ngx_http_metrics_limit_conn_counters[] = {
+    { ngx_string("requests_total"), ngx_string("status=\"passed\""),
+      ngx_string("passed"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"rejected\""),
+      ngx_string("rejected"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_string("requests_total"), ngx_string("status=\"rejected_dry_run\""),
+      ngx_string("rejected_dry_run"), NGX_HTTP_METRICS_NUMBER },
+    { ngx_null_string, ngx_null_string, ngx_null_string, 0 }
+};
+
+
+/* indexed by object types */
+
+static ngx_http_metrics_type_t  ngx_http_metrics_types[] = {
+    { ngx_string("server_zone"), ngx_string("server_zones"),
+      ngx_string("zone"), ngx_http_metrics_zone_counters,
+      ngx_http_metrics_server_summaries },
+    { ngx_string("location_zone"), ngx_string("location_zones"),
+      ngx_string("zone"), ngx_http_metrics_zone_counters,
+      ngx_http_metrics_location_summaries },
+    { ngx_string("upstream"), ngx_string("upstreams"),
+      ngx_string("upstream"), ngx_http_metrics_upstream_counters,
+      ngx_http_metrics_upstream_summaries },
+    { ngx_string("upstream_peer"), ngx_string("peers"),
+      ngx_string("upstream"), ngx_http_metrics_upstream_counters,
+      ngx_http_metrics_upstream_summaries },
+    { ngx_string("cache"), ngx_string("caches"),
+      ngx_string("zone"), ngx_http_metrics_cache_counters, NULL },
+    { ngx_string("limit_req"), ngx_string("limit_reqs"),
+      ngx_string("zone"), ngx_http_metrics_limit_req_counters, NULL },
+    { ngx_string("limit_conn"), ngx_string("limit_conns"),
+      ngx_string("zone"), ngx_http_metrics_limit_conn_counters, NULL },
+    { ngx_null_string, ngx_null_string, ngx_null_string, NULL, NULL }
+};
+
+
+static ngx_inline ngx_http_metrics_slot_t *
+ngx_http_metrics_row(ngx_http_metrics_main_conf_t *mmcf)
+{
+    if (mmcf->area == NULL || ngx_worker >= mmcf->workers) {
+        return NULL;
+    }
+
+    return mmcf->area + ngx_worker * mmcf->objects.nelts;
+}
+
+
+static ngx_inline ngx_http_metrics_histogram_t *
+ngx_http_metrics_hists(ngx_http_metrics_main_conf_t *mmcf)
+{
+    return mmcf->hists + ngx_worker * mmcf->nhists;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_handler(ngx_http_request_t *r)
+{
+    size_t                         size;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_str_t                      format;
+    ngx_uint_t                     i, j, k, n, json;
+    ngx_chain_t                    out;
+    ngx_http_metrics_slot_t       *totals, *row;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_histogram_t  *htotals, *hrow;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    json = 0;
+
+    if (ngx_http_arg(r, (u_char *) "format", 6, &format) == NGX_OK) {
+
+        if (format.len == 4 && ngx_strncmp(format.data, "json", 4) == 0) {
+            json = 1;
+
+        } else if (format.len != 10
+                   || ngx_strncmp(format.data, "prometheus", 10) != 0)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_metrics_module);
+
+    totals = NULL;
+    htotals = NULL;
+    n = 0;
+    size = 1024;
+
+    if (mmcf->area && mmcf->objects.nelts) {
+        n = mmcf->objects.nelts;
+
+        totals = ngx_pcalloc(r->pool, n * sizeof(ngx_http_metrics_slot_t));
+        if (totals == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* the rows are written without locks, a sum may be slightly behind */
+
+        for (row = mmcf->area;
+             row <= mmcf->area + mmcf->workers * n;
+             row += n)
+        {
+            for (i = 0; i < n; i++) {
+                for (j = 0; j < NGX_HTTP_METRICS_COUNTERS; j++) {
+                    totals[i].counters[j] += row[i].counters[j];
+                }
+            }
+        }
+
+        if (mmcf->nhists) {
+            htotals = ngx_pcalloc(r->pool,
+                          mmcf->nhists * sizeof(ngx_http_metrics_histogram_t));
+            if (htotals == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            for (hrow = mmcf->hists;
+                 hrow <= mmcf->hists + mmcf->workers * mmcf->nhists;
+                 hrow += mmcf->nhists)
+            {
+                for (i = 0; i < mmcf->nhists; i++) {
+                    htotals[i].sum += hrow[i].sum;
+
+                    for (k = 0; k < NGX_HTTP_METRICS_BUCKETS; k++) {
+                        htotals[i].buckets[k] += hrow[i].buckets[k];
+                    }
+                }
+            }
+        }
+
+        obj = mmcf->objects.elts;
+
+        for (i = 0; i < n; i++) {
+            size += (NGX_HTTP_METRICS_COUNTERS
+                     + 8 * ngx_http_metrics_nhists(obj[i].type))
+                    * (128 + NGX_INT64_LEN + obj[i].label.len
+                       + obj[i].peer_label.len);
+        }
+
+        for (i = 0; ngx_http_metrics_types[i].counters; i++) {
+            size += NGX_HTTP_METRICS_COUNTERS * 128;
+        }
+    }
+
+    if (json) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len = sizeof("text/plain") - 1;
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (json) {
+        b->last = ngx_http_metrics_json(b->last, mmcf, totals, htotals);
+
+    } else {
+        b->last = ngx_http_metrics_prometheus(b->last, mmcf, totals, htotals);
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_metrics_prometheus(u_char *p, ngx_http_metrics_main_conf_t *mmcf,
+    ngx_http_metrics_slot_t *totals, ngx_http_metrics_histogram_t *htotals)
+{
+    uint64_t                       count;
+    ngx_uint_t                     i, j, q, t;
+    ngx_http_metrics_type_t       *type;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_counter_t    *counter;
+    ngx_http_metrics_summary_t    *summary;
+    ngx_http_metrics_histogram_t  *hist;
+
+#if (NGX_STAT_STUB)
+
+    p = ngx_sprintf(p, "# TYPE nginx_connections_accepted_total counter\n"
+                       "nginx_connections_accepted_total %uA\n"
+                       "# TYPE nginx_connections_handled_total counter\n"
+                       "nginx_connections_handled_total %uA\n"
+                       "# TYPE nginx_connections gauge\n"
+                       "nginx_connections{state=\"active\"} %uA\n"
+                       "nginx_connections{state=\"reading\"} %uA\n"
+                       "nginx_connections{state=\"writing\"} %uA\n"
+                       "nginx_connections{state=\"waiting\"} %uA\n"
+                       "# TYPE nginx_http_requests_total counter\n"
+                       "nginx_http_requests_total %uA\n",
+                    *ngx_stat_accepted, *ngx_stat_handled, *ngx_stat_active,
+                    *ngx_stat_reading, *ngx_stat_writing, *ngx_stat_waiting,
+                    *ngx_stat_requests);
+
+#endif
+
+    if (totals == NULL) {
+        return p;
+    }
+
+    obj = mmcf->objects.elts;
+
+    for (t = 0; ngx_http_metrics_types[t].counters; t++) {
+        type = &ngx_http_metrics_types[t];
+
+        for (i = 0; i < mmcf->objects.nelts; i++) {
+            if (obj[i].type == t) {
+                break;
+            }
+        }
+
+        if (i == mmcf->objects.nelts) {
+            continue;
+        }
+
+        counter = type->counters;
+
+        for (j = 0; counter[j].metric.len; j++) {
+
+            if (j == 0
+                || counter[j].metric.len != counter[j - 1].metric.len
+                || ngx_strncmp(counter[j].metric.data,
+                               counter[j - 1].metric.data,
+                               counter[j].metric.len)
+                   != 0)
+            {
+                p = ngx_sprintf(p, "# TYPE nginx_%V_%V counter\n",
+                                &type->name, &counter[j].metric);
+            }
+
+            for (i = 0; i < mmcf->objects.nelts; i++) {
+                if (obj[i].type != t) {
+                    continue;
+                }
+
+                p = ngx_http_metrics_prometheus_name(p, type,
+                                                     &counter[j].metric, "",
+                                                     &obj[i]);
+
+                if (counter[j].label.len) {
+                    p = ngx_sprintf(p, ",%V", &counter[j].label);
+                }
+
+                *p++ = '}';
+                *p++ = ' ';
+
+                p = ngx_http_metrics_value(p, totals[i].counters[j],
+                                           counter[j].unit);
+                *p++ = LF;
+            }
+        }
+
+        summary = type->summaries;
+
+        for (j = 0; summary && summary[j].metric.len; j++) {
+
+            p = ngx_sprintf(p, "# TYPE nginx_%V_%V summary\n",
+                            &type->name, &summary[j].metric);
+
+            for (i = 0; i < mmcf->objects.nelts; i++) {
+                if (obj[i].type != t) {
+                    continue;
+                }
+
+                hist = &htotals[obj[i].hist + j];
+                count = ngx_http_metrics_count(hist);
+
+                for (q = 0; ngx_http_metrics_quantiles[q]; q++) {
+                    p = ngx_http_metrics_prometheus_name(p, type,
+                                                         &summary[j].metric,
+                                                         "", &obj[i]);
+
+                    p = ngx_cpymem(p, ",quantile=\"",
+                                   sizeof(",quantile=\"") - 1);
+                    p = ngx_http_metrics_quantile_label(p,
+                                                ngx_http_metrics_quantiles[q]);
+                    *p++ = '"';
+                    *p++ = '}';
+                    *p++ = ' ';
+
+                    p = ngx_http_metrics_usec(p,
+                                    ngx_http_metrics_quantile(hist, count,
+                                                ngx_http_metrics_quantiles[q]));
+                    *p++ = LF;
+                }
+
+                p = ngx_http_metrics_prometheus_name(p, type,
+                                                     &summary[j].metric,
+                                                     "_sum", &obj[i]);
+                *p++ = '}';
+                *p++ = ' ';
+
+                p = ngx_http_metrics_usec(p, hist->sum);
+                *p++ = LF;
+
+                p = ngx_http_metrics_prometheus_name(p, type,
+                                                     &summary[j].metric,
+                                                     "_count", &obj[i]);
+
+                p = ngx_sprintf(p, "} %uL\n", count);
+            }
+        }
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_prometheus_name(u_char *p, ngx_http_metrics_type_t *type,
+    ngx_str_t *metric, char *suffix, ngx_http_metrics_object_t *obj)
+{
+    p = ngx_sprintf(p, "nginx_%V_%V%s{%V=\"%V\"",
+                    &type->name, metric, suffix, &type->label, &obj->label);
+
+    if (obj->peer.len) {
+        p = ngx_sprintf(p, ",peer=\"%V\"", &obj->peer_label);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_json(u_char *p, ngx_http_metrics_main_conf_t *mmcf,
+    ngx_http_metrics_slot_t *totals, ngx_http_metrics_histogram_t *htotals)
+{
+    ngx_uint_t                  i, k, t, first;
+    ngx_http_metrics_type_t    *type;
+    ngx_http_metrics_object_t  *obj;
+
+    *p++ = '{';
+
+#if (NGX_STAT_STUB)
+
+    p = ngx_sprintf(p, "\"connections\":{\"accepted\":%uA,\"handled\":%uA,"
+                       "\"active\":%uA,\"reading\":%uA,\"writing\":%uA,"
+                       "\"waiting\":%uA},\"http_requests\":%uA",
+                    *ngx_stat_accepted, *ngx_stat_handled, *ngx_stat_active,
+                    *ngx_stat_reading, *ngx_stat_writing, *ngx_stat_waiting,
+                    *ngx_stat_requests);
+
+    first = 0;
+
+#else
+
+    first = 1;
+
+#endif
+
+    if (totals == NULL) {
+        *p++ = '}';
+        return p;
+    }
+
+    obj = mmcf->objects.elts;
+
+    for (t = 0; ngx_http_metrics_types[t].counters; t++) {
+
+        if (t == NGX_HTTP_METRICS_PEER) {
+            /* peers are nested into upstreams */
+            continue;
+        }
+
+        type = &ngx_http_metrics_types[t];
+
+        if (!first) {
+            *p++ = ',';
+        }
+
+        first = 0;
+
+        p = ngx_sprintf(p, "\"%V\":{", &type->key);
+
+        for (i = 0, k = 0; i < mmcf->objects.nelts; i++) {
+            if (obj[i].type != t) {
+                continue;
+            }
+
+            if (k++) {
+                *p++ = ',';
+            }
+
+            p = ngx_sprintf(p, "\"%V\":{", &obj[i].label);
+            p = ngx_http_metrics_json_counters(p, type, &totals[i],
+                                               &htotals[obj[i].hist]);
+
+            if (t != NGX_HTTP_METRICS_UPSTREAM) {
+                *p++ = '}';
+                continue;
+            }
+
+            /* peers follow their upstream */
+
+            p = ngx_cpymem(p, ",\"peers\":{", sizeof(",\"peers\":{") - 1);
+
+            while (i + 1 < mmcf->objects.nelts
+                   && obj[i + 1].type == NGX_HTTP_METRICS_PEER)
+            {
+                i++;
+
+                if (*(p - 1) != '{') {
+                    *p++ = ',';
+                }
+
+                p = ngx_sprintf(p, "\"%V\":{", &obj[i].peer_label);
+                p = ngx_http_metrics_json_counters(p, type, &totals[i],
+                                                   &htotals[obj[i].hist]);
+                *p++ = '}';
+            }
+
+            *p++ = '}';
+            *p++ = '}';
+        }
+
+        *p++ = '}';
+    }
+
+    *p++ = '}';
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_json_counters(u_char *p, ngx_http_metrics_type_t *type,
+    ngx_http_metrics_slot_t *slot, ngx_http_metrics_histogram_t *hist)
+{
+    uint64_t                     count;
+    ngx_uint_t                   i, q;
+    ngx_http_metrics_counter_t  *counter;
+    ngx_http_metrics_summary_t  *summary;
+
+    counter = type->counters;
+
+    for (i = 0; counter[i].key.len; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        p = ngx_sprintf(p, "\"%V\":", &counter[i].key);
+        p = ngx_http_metrics_value(p, slot->counters[i], counter[i].unit);
+    }
+
+    summary = type->summaries;
+
+    if (summary == NULL) {
+        return p;
+    }
+
+    p = ngx_cpymem(p, ",\"histograms\":{", sizeof(",\"histograms\":{") - 1);
+
+    for (i = 0; summary[i].key.len; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        count = ngx_http_metrics_count(&hist[i]);
+
+        p = ngx_sprintf(p, "\"%V\":{\"count\":%uL,\"sum\":",
+                        &summary[i].key, count);
+        p = ngx_http_metrics_usec(p, hist[i].sum);
+
+        p = ngx_cpymem(p, ",\"quantiles\":{", sizeof(",\"quantiles\":{") - 1);
+
+        for (q = 0; ngx_http_metrics_quantiles[q]; q++) {
+            if (q) {
+                *p++ = ',';
+            }
+
+            *p++ = '"';
+            p = ngx_http_metrics_quantile_label(p,
+                                                ngx_http_metrics_quantiles[q]);
+            *p++ = '"';
+            *p++ = ':';
+
+            p = ngx_http_metrics_usec(p,
+                                      ngx_http_metrics_quantile(&hist[i],
+                                               count,
+                                               ngx_http_metrics_quantiles[q]));
+        }
+
+        *p++ = '}';
+        *p++ = '}';
+    }
+
+    *p++ = '}';
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_metrics_value(u_char *p, uint64_t value, ngx_uint_t unit)
+{
+    switch (unit) {
+
+    case NGX_HTTP_METRICS_MSEC:
+        return ngx_sprintf(p, "%uL.%03uL", value / 1000, value % 1000);
+
+    case NGX_HTTP_METRICS_USEC:
+        return ngx_http_metrics_usec(p, value);
+
+    default: /* NGX_HTTP_METRICS_NUMBER */
+        return ngx_sprintf(p, "%uL", value);
+    }
+}
+
+
+static u_char *
+ngx_http_metrics_usec(u_char *p, uint64_t usec)
+{
+    return ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000);
+}
+
+
+static u_char *
+ngx_http_metrics_quantile_label(u_char *p, ngx_uint_t q)
+{
+    /* thousandths as a decimal fraction without trailing zeros */
+
+    p = ngx_sprintf(p, "0.%03ui", q);
+
+    while (*(p - 1) == '0') {
+        p--;
+    }
+
+    return p;
+}
+
+
+static uint64_t
+ngx_http_metrics_count(ngx_http_metrics_histogram_t *hist)
+{
+    uint64_t    count;
+    ngx_uint_t  i;
+
+    count = 0;
+
+    for (i = 0; i < NGX_HTTP_METRICS_BUCKETS; i++) {
+        count += hist->buckets[i];
+    }
+
+    return count;
+}
+
+
+static uint64_t
+ngx_http_metrics_quantile(ngx_http_metrics_histogram_t *hist, uint64_t count,
+    ngx_uint_t q)
+{
+    uint64_t    rank, n;
+    ngx_uint_t  i, shift;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    rank = (count * q + 999) / 1000;
+
+    n = 0;
+
+    for (i = 0; i < NGX_HTTP_METRICS_BUCKETS - 1; i++) {
+        n += hist->buckets[i];
+
+        if (n >= rank) {
+            break;
+        }
+    }
+
+    /* the highest value of the bucket */
+
+    if (i < 32) {
+        return i;
+    }
+
+    shift = i / 16 - 1;
+
+    return ((i % 16 + 17) << shift) - 1;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_log_handler(ngx_http_request_t *r)
+{
+    ngx_uint_t                     status;
+    ngx_time_t                    *tp;
+    ngx_msec_int_t                 ms;
+    ngx_http_metrics_slot_t       *row;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_histogram_t  *hists;
+    ngx_http_metrics_srv_conf_t   *mscf;
+    ngx_http_metrics_loc_conf_t   *mlcf;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_metrics_module);
+
+    row = ngx_http_metrics_row(mmcf);
+    if (row == NULL) {
+        return NGX_OK;
+    }
+
+    if (r == r->main) {
+        mscf = ngx_http_get_module_srv_conf(r, ngx_http_metrics_module);
+        mlcf = ngx_http_get_module_loc_conf(r, ngx_http_metrics_module);
+
+        if (mscf->zone != NGX_CONF_UNSET_UINT
+            || mlcf->zone != NGX_CONF_UNSET_UINT)
+        {
+            if (r->err_status) {
+                status = r->err_status;
+
+            } else {
+                status = r->headers_out.status;
+            }
+
+            tp = ngx_timeofday();
+
+            ms = (ngx_msec_int_t)
+                     ((tp->sec - r->start_sec) * 1000
+                      + (tp->msec - r->start_msec));
+            ms = ngx_max(ms, 0);
+
+            obj = mmcf->objects.elts;
+            hists = ngx_http_metrics_hists(mmcf);
+
+            if (mscf->zone != NGX_CONF_UNSET_UINT) {
+                ngx_http_metrics_request(r, &row[mscf->zone],
+                                         &hists[obj[mscf->zone].hist],
+                                         status, ms);
+            }
+
+            if (mlcf->zone != NGX_CONF_UNSET_UINT) {
+                ngx_http_metrics_request(r, &row[mlcf->zone],
+                                         &hists[obj[mlcf->zone].hist],
+                                         status, ms);
+            }
+        }
+    }
+
+    if (r->upstream == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_metrics_upstream(r, mmcf);
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->upstream->cache_status) {
+        ngx_http_metrics_zone(r, r->cache->file_cache->shm_zone,
+                              r->upstream->cache_status);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_metrics_request(ngx_http_request_t *r, ngx_http_metrics_slot_t *slot,
+    ngx_http_metrics_histogram_t *hist, ngx_uint_t status, ngx_msec_int_t ms)
+{
+    uint64_t  *c, *timing;
+
+    c = slot->counters;
+
+    c[NGX_HTTP_METRICS_REQUESTS]++;
+
+    if (status >= 100 && status < 600) {
+        c[NGX_HTTP_METRICS_RESPONSES + status / 100 - 1]++;
+
+    } else {
+        c[NGX_HTTP_METRICS_DISCARDED]++;
+    }
+
+    c[NGX_HTTP_METRICS_RECEIVED] += r->request_length;
+    c[NGX_HTTP_METRICS_SENT] += r->connection->sent;
+    c[NGX_HTTP_METRICS_REQUEST_TIME] += ms;
+    c[NGX_HTTP_METRICS_CPU_TIME] += ngx_http_cpu_time(r) / 1000;
+    c[NGX_HTTP_METRICS_POOL_BYTES] += r->pool->allocated;
+
+    timing = r->timing;
+
+    if (timing == NULL) {
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_REQUEST],
+                                (uint64_t) ms * 1000);
+        return;
+    }
+
+    /* precise times with "request_timing" */
+
+    ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_REQUEST],
+                            ngx_monotonic_usec()
+                            - timing[NGX_HTTP_TIMING_START]);
+
+    if (timing[NGX_HTTP_TIMING_HEADER]) {
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_REQUEST_HEADER],
+                                timing[NGX_HTTP_TIMING_HEADER]
+                                - timing[NGX_HTTP_TIMING_START]);
+    }
+
+    if (timing[NGX_HTTP_TIMING_FIRST_BYTE]) {
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_FIRST_BYTE],
+                                timing[NGX_HTTP_TIMING_FIRST_BYTE]
+                                - timing[NGX_HTTP_TIMING_START]);
+    }
+}
+
+
+static void
+ngx_http_metrics_upstream(ngx_http_request_t *r,
+    ngx_http_metrics_main_conf_t *mmcf)
+{
+    ngx_uint_t                     i, *slot;
+    ngx_http_metrics_slot_t       *row;
+    ngx_http_upstream_state_t     *state;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_histogram_t  *hists;
+    ngx_http_metrics_srv_conf_t   *mscf;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = r->upstream->upstream;
+
+    if (uscf == NULL || uscf->srv_conf == NULL
+        || r->upstream_states == NULL)
+    {
+        return;
+    }
+
+    mscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_metrics_module);
+
+    if (mscf->upstream == NGX_CONF_UNSET_UINT) {
+        return;
+    }
+
+    row = ngx_http_metrics_row(mmcf);
+    hists = ngx_http_metrics_hists(mmcf);
+    obj = mmcf->objects.elts;
+
+    state = r->upstream_states->elts;
+
+    /*
+     * states of previously used upstreams are separated
+     * by a state without peer, see ngx_http_upstream_init_request()
+     */
+
+    for (i = r->upstream_states->nelts; i > 0; i--) {
+        if (state[i - 1].peer == NULL) {
+            break;
+        }
+    }
+
+    for ( /* void */ ; i < r->upstream_states->nelts; i++) {
+
+        ngx_http_metrics_state(&row[mscf->upstream],
+                               &hists[obj[mscf->upstream].hist], &state[i]);
+
+        if (mscf->peers.buckets == NULL) {
+            continue;
+        }
+
+        slot = ngx_hash_find(&mscf->peers,
+                             ngx_hash_key(state[i].peer->data,
+                                          state[i].peer->len),
+                             state[i].peer->data, state[i].peer->len);
+
+        if (slot) {
+            ngx_http_metrics_state(&row[*slot], &hists[obj[*slot].hist],
+                                   &state[i]);
+        }
+    }
+}
+
+
+static void
+ngx_http_metrics_state(ngx_http_metrics_slot_t *slot,
+    ngx_http_metrics_histogram_t *hist, ngx_http_upstream_state_t *state)
+{
+    uint64_t  *c;
+
+    c = slot->counters;
+
+    c[NGX_HTTP_METRICS_REQUESTS]++;
+
+    if (state->header_time != (ngx_msec_t) -1
+        && state->status >= 100 && state->status < 600)
+    {
+        c[NGX_HTTP_METRICS_RESPONSES + state->status / 100 - 1]++;
+
+    } else {
+        c[NGX_HTTP_METRICS_FAILS]++;
+    }
+
+    c[NGX_HTTP_METRICS_RECEIVED] += state->bytes_received;
+    c[NGX_HTTP_METRICS_SENT] += state->bytes_sent;
+
+    if (state->connect_time != (ngx_msec_t) -1) {
+        c[NGX_HTTP_METRICS_CONNECT_TIME] += state->connect_time;
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_CONNECT],
+                                (uint64_t) state->connect_time * 1000);
+    }
+
+    if (state->header_time != (ngx_msec_t) -1) {
+        c[NGX_HTTP_METRICS_HEADER_TIME] += state->header_time;
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_HEADER],
+                                (uint64_t) state->header_time * 1000);
+    }
+
+    if (state->response_time != (ngx_msec_t) -1) {
+        c[NGX_HTTP_METRICS_RESPONSE_TIME] += state->response_time;
+        ngx_http_metrics_record(&hist[NGX_HTTP_METRICS_HIST_RESPONSE],
+                                (uint64_t) state->response_time * 1000);
+    }
+}
+
+
+static void
+ngx_http_metrics_record(ngx_http_metrics_histogram_t *hist, uint64_t usec)
+{
+    ngx_uint_t  shift;
+
+    hist->sum += usec;
+
+    if (usec >= ((uint64_t) 1 << 32)) {
+        hist->buckets[NGX_HTTP_METRICS_BUCKETS - 1]++;
+        return;
+    }
+
+    for (shift = 0; (usec >> shift) >= 32; shift++) { /* void */ }
+
+    hist->buckets[shift * 16 + (usec >> shift)]++;
+}
+
+
+static ngx_uint_t
+ngx_http_metrics_nhists(ngx_uint_t type)
+{
+    ngx_uint_t                   n;
+    ngx_http_metrics_summary_t  *summary;
+
+    summary = ngx_http_metrics_types[type].summaries;
+
+    if (summary == NULL) {
+        return 0;
+    }
+
+    for (n = 0; summary[n].metric.len; n++) { /* void */ }
+
+    return n;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+void
+ngx_http_metrics_handshake(ngx_connection_t *c)
+{
+    ngx_msec_int_t                 ms;
+    ngx_http_connection_t         *hc;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_histogram_t  *hists;
+    ngx_http_metrics_srv_conf_t   *mscf;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    hc = c->data;
+
+    mmcf = ngx_http_get_module_main_conf(hc->conf_ctx,
+                                         ngx_http_metrics_module);
+
+    if (ngx_http_metrics_row(mmcf) == NULL) {
+        return;
+    }
+
+    /* the server is already selected by SNI */
+
+    mscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_metrics_module);
+
+    if (mscf->zone == NGX_CONF_UNSET_UINT) {
+        return;
+    }
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - c->start_time);
+    ms = ngx_max(ms, 0);
+
+    obj = mmcf->objects.elts;
+    hists = ngx_http_metrics_hists(mmcf);
+
+    ngx_http_metrics_record(&hists[obj[mscf->zone].hist
+                                   + NGX_HTTP_METRICS_HIST_HANDSHAKE],
+                            (uint64_t) ms * 1000);
+}
+
+#endif
+
+
+void
+ngx_http_metrics_zone(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t status)
+{
+    ngx_uint_t                     n;
+    ngx_http_metrics_slot_t       *row;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_get_module_main_conf(r, ngx_http_metrics_module);
+
+    row = ngx_http_metrics_row(mmcf);
+    if (row == NULL) {
+        return;
+    }
+
+    n = ngx_http_metrics_find_zone(mmcf, shm_zone);
+
+    if (n != NGX_CONF_UNSET_UINT) {
+        row[n].counters[status - 1]++;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_metrics_find_zone(ngx_http_metrics_main_conf_t *mmcf,
+    ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t                  i, *zones;
+    ngx_http_metrics_object_t  *obj;
+
+    obj = mmcf->objects.elts;
+    zones = mmcf->zones.elts;
+
+    for (i = 0; i < mmcf->zones.nelts; i++) {
+        if (obj[zones[i]].shm_zone == shm_zone) {
+            return zones[i];
+        }
+    }
+
+    return NGX_CONF_UNSET_UINT;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_metrics_main_conf_t  *omcf = data;
+
+    size_t                         size;
+    ngx_core_conf_t               *ccf;
+    ngx_http_metrics_gen_t        *gen;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = shm_zone->data;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(mmcf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    mmcf->workers = ccf->worker_processes;
+
+    if (omcf) {
+        mmcf->sh = omcf->sh;
+        mmcf->shpool = omcf->shpool;
+
+    } else {
+        mmcf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        if (shm_zone->shm.exists) {
+            mmcf->sh = mmcf->shpool->data;
+            mmcf->area = mmcf->sh->area;
+            mmcf->hists = (ngx_http_metrics_histogram_t *)
+                              (mmcf->area + (mmcf->workers + 1)
+                                            * mmcf->objects.nelts);
+
+            return NGX_OK;
+        }
+
+        mmcf->sh = ngx_slab_calloc(mmcf->shpool,
+                                   sizeof(ngx_http_metrics_shctx_t));
+        if (mmcf->sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        mmcf->shpool->data = mmcf->sh;
+    }
+
+    /*
+     * Each configuration gets its own area, as the set of objects and
+     * the number of workers may change.  An area is freed when the last
+     * worker process using it exits, or here if no worker process uses
+     * it; the area of the last configuration is always kept, as its
+     * worker processes may not have started yet.
+     */
+
+    size = sizeof(ngx_http_metrics_gen_t)
+           + (mmcf->workers + 1)
+             * (mmcf->objects.nelts * sizeof(ngx_http_metrics_slot_t)
+                + mmcf->nhists * sizeof(ngx_http_metrics_histogram_t));
+
+    ngx_shmtx_lock(&mmcf->shpool->mutex);
+
+    ngx_http_metrics_free_gens(mmcf);
+
+    gen = ngx_slab_calloc_locked(mmcf->shpool, size);
+
+    if (gen == NULL) {
+        ngx_shmtx_unlock(&mmcf->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "metrics_zone is too small, %uz bytes required",
+                      2 * size + 8 * ngx_pagesize);
+        return NGX_ERROR;
+    }
+
+    gen->next = mmcf->sh->gens;
+    mmcf->sh->gens = gen;
+
+    ngx_shmtx_unlock(&mmcf->shpool->mutex);
+
+    mmcf->gen = gen;
+    mmcf->area = (ngx_http_metrics_slot_t *) (gen + 1);
+    mmcf->hists = (ngx_http_metrics_histogram_t *)
+                      (mmcf->area + (mmcf->workers + 1) * mmcf->objects.nelts);
+
+    if (omcf && omcf->objects.nelts && omcf->area) {
+        ngx_http_metrics_carry_over(mmcf, omcf, omcf->area);
+    }
+
+    mmcf->sh->area = mmcf->area;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_metrics_free_gens(ngx_http_metrics_main_conf_t *mmcf)
+{
+    ngx_http_metrics_gen_t  *gen, **prev;
+
+    /* the zone is locked; the area of the last configuration is kept */
+
+    if (mmcf->sh->gens == NULL) {
+        return;
+    }
+
+    prev = &mmcf->sh->gens->next;
+
+    for (gen = *prev; gen; gen = *prev) {
+
+        if (gen->refs) {
+            prev = &gen->next;
+            continue;
+        }
+
+        *prev = gen->next;
+
+        ngx_slab_free_locked(mmcf->shpool, gen);
+    }
+}
+
+
+static void
+ngx_http_metrics_carry_over(ngx_http_metrics_main_conf_t *mmcf,
+    ngx_http_metrics_main_conf_t *omcf, ngx_http_metrics_slot_t *oarea)
+{
+    ngx_uint_t                     i, j, k, b, h, n, on;
+    ngx_http_metrics_slot_t       *base, *row;
+    ngx_http_metrics_object_t     *obj, *oobj;
+    ngx_http_metrics_histogram_t  *hbase, *hrow;
+
+    n = mmcf->objects.nelts;
+    on = omcf->objects.nelts;
+
+    obj = mmcf->objects.elts;
+    oobj = omcf->objects.elts;
+
+    base = mmcf->area + mmcf->workers * n;
+    hbase = mmcf->hists + mmcf->workers * mmcf->nhists;
+
+    for (i = 0; i < n; i++) {
+
+        /* objects are usually in the same order */
+
+        j = (i < on) ? i : 0;
+
+        for (k = 0; k < on; k++, j = (j + 1) % on) {
+            if (obj[i].type == oobj[j].type
+                && obj[i].name.len == oobj[j].name.len
+                && obj[i].peer.len == oobj[j].peer.len
+                && ngx_strncmp(obj[i].name.data, oobj[j].name.data,
+                               obj[i].name.len)
+                   == 0
+                && ngx_strncmp(obj[i].peer.data, oobj[j].peer.data,
+                               obj[i].peer.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (k == on) {
+            continue;
+        }
+
+        for (row = oarea; row <= oarea + omcf->workers * on; row += on) {
+            for (k = 0; k < NGX_HTTP_METRICS_COUNTERS; k++) {
+                base[i].counters[k] += row[j].counters[k];
+            }
+        }
+
+        h = ngx_http_metrics_nhists(obj[i].type);
+
+        if (h == 0) {
+            continue;
+        }
+
+        for (hrow = omcf->hists;
+             hrow <= omcf->hists + omcf->workers * omcf->nhists;
+             hrow += omcf->nhists)
+        {
+            for (k = 0; k < h; k++) {
+                hbase[obj[i].hist + k].sum += hrow[oobj[j].hist + k].sum;
+
+                for (b = 0; b < NGX_HTTP_METRICS_BUCKETS; b++) {
+                    hbase[obj[i].hist + k].buckets[b] +=
+                                          hrow[oobj[j].hist + k].buckets[b];
+                }
+            }
+        }
+    }
+}
+
+
+ngx_int_t
+ngx_http_metrics_add_zone(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t type)
+{
+    ngx_int_t                      n;
+    ngx_uint_t                    *zone;
+    ngx_http_metrics_object_t     *obj;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_metrics_module);
+
+    n = ngx_http_metrics_add_object(cf, mmcf, type, &shm_zone->shm.name, NULL);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    obj = mmcf->objects.elts;
+
+    if (obj[n].shm_zone) {
+        return NGX_OK;
+    }
+
+    obj[n].shm_zone = shm_zone;
+
+    zone = ngx_array_push(&mmcf->zones);
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    *zone = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_add_object(ngx_conf_t *cf,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_uint_t type, ngx_str_t *name,
+    ngx_str_t *peer)
+{
+    ngx_str_t                   empty;
+    ngx_uint_t                  i;
+    ngx_http_metrics_object_t  *obj;
+
+    ngx_str_null(&empty);
+
+    if (peer == NULL) {
+        peer = &empty;
+    }
+
+    obj = mmcf->objects.elts;
+
+    for (i = 0; i < mmcf->objects.nelts; i++) {
+        if (obj[i].type == type
+            && obj[i].name.len == name->len
+            && obj[i].peer.len == peer->len
+            && ngx_strncmp(obj[i].name.data, name->data, name->len) == 0
+            && ngx_strncmp(obj[i].peer.data, peer->data, peer->len) == 0)
+        {
+            return i;
+        }
+    }
+
+    obj = ngx_array_push(&mmcf->objects);
+    if (obj == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(obj, sizeof(ngx_http_metrics_object_t));
+
+    obj->type = type;
+    obj->name = *name;
+    obj->peer = *peer;
+
+    return mmcf->objects.nelts - 1;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_add_upstream(ngx_conf_t *cf,
+    ngx_http_metrics_main_conf_t *mmcf, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                     n;
+    ngx_uint_t                    i, j, *slot;
+    ngx_hash_init_t               hash;
+    ngx_hash_keys_arrays_t        keys;
+    ngx_http_upstream_server_t   *server;
+    ngx_http_metrics_srv_conf_t  *mscf;
+
+    mscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_metrics_module);
+
+    n = ngx_http_metrics_add_object(cf, mmcf, NGX_HTTP_METRICS_UPSTREAM,
+                                    &uscf->host, NULL);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    mscf->upstream = n;
+
+    if (uscf->servers == NULL) {
+        return NGX_OK;
+    }
+
+    keys.pool = cf->pool;
+    keys.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&keys, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    server = uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+
+        /* peers of servers resolved at run time count in upstream only */
+
+        for (j = 0; j < server[i].naddrs; j++) {
+
+            n = ngx_http_metrics_add_object(cf, mmcf, NGX_HTTP_METRICS_PEER,
+                                            &uscf->host,
+                                            &server[i].addrs[j].name);
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            slot = ngx_palloc(cf->pool, sizeof(ngx_uint_t));
+            if (slot == NULL) {
+                return NGX_ERROR;
+            }
+
+            *slot = n;
+
+            if (ngx_hash_add_key(&keys, &server[i].addrs[j].name, slot,
+                                 NGX_HASH_READONLY_KEY)
+                == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (keys.keys.nelts == 0) {
+        return NGX_OK;
+    }
+
+    hash.hash = &mscf->peers;
+    hash.key = ngx_hash_key;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "metrics_peers_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    return ngx_hash_init(&hash, keys.keys.elts, keys.keys.nelts);
+}
+
+
+static ngx_int_t
+ngx_http_metrics_escape(ngx_conf_t *cf, ngx_str_t *dst, ngx_str_t *src)
+{
+    size_t  len;
+
+    len = ngx_escape_json(NULL, src->data, src->len);
+
+    if (len == 0) {
+        *dst = *src;
+        return NGX_OK;
+    }
+
+    dst->len = src->len + len;
+
+    dst->data = ngx_pnalloc(cf->pool, dst->len);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_escape_json(dst->data, src->data, src->len);
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_metrics_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    mmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_main_conf_t));
+    if (mmcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     mmcf->shm_zone = NULL;
+     *     mmcf->sh = NULL;
+     *     mmcf->shpool = NULL;
+     *     mmcf->area = NULL;
+     *     mmcf->workers = 0;
+     *     mmcf->hists = NULL;
+     *     mmcf->nhists = 0;
+     */
+
+    if (ngx_array_init(&mmcf->objects, cf->pool, 16,
+                       sizeof(ngx_http_metrics_object_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&mmcf->zones, cf->pool, 4, sizeof(ngx_uint_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    mmcf->cycle = cf->cycle;
+
+    return mmcf;
+}
+
+
+static void *
+ngx_http_metrics_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_metrics_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->peers = { NULL, 0 };
+     */
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+    conf->upstream = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static void *
+ngx_http_metrics_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_metrics_loc_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_metrics_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_metrics_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_metrics_loc_conf_t *prev = parent;
+    ngx_http_metrics_loc_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics_zone_directive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_metrics_main_conf_t *mmcf = conf;
+
+    ssize_t      size;
+    ngx_str_t   *value, name;
+
+    if (mmcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "metrics_zone is too small");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&name, "http_metrics");
+
+    mmcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_metrics_module);
+    if (mmcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf->shm_zone->init = ngx_http_metrics_init_zone;
+    mmcf->shm_zone->data = mmcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_metrics_loc_conf_t *mlcf = conf;
+
+    ngx_int_t                      n;
+    ngx_str_t                     *value;
+    ngx_uint_t                    *zone;
+    ngx_http_metrics_srv_conf_t   *mscf;
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid status zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_metrics_module);
+
+    if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        mscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_metrics_module);
+        zone = &mscf->zone;
+
+        n = ngx_http_metrics_add_object(cf, mmcf, NGX_HTTP_METRICS_SERVER,
+                                        &value[1], NULL);
+
+    } else {
+        zone = &mlcf->zone;
+
+        n = ngx_http_metrics_add_object(cf, mmcf, NGX_HTTP_METRICS_LOCATION,
+                                        &value[1], NULL);
+    }
+
+    if (*zone != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    if (n == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = n;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_metrics_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                      i;
+    ngx_http_handler_pt            *h;
+    ngx_http_metrics_object_t      *obj;
+    ngx_http_core_main_conf_t      *cmcf;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_metrics_main_conf_t   *mmcf;
+
+    mmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_metrics_module);
+
+    if (mmcf->shm_zone == NULL) {
+
+        if (mmcf->objects.nelts != mmcf->zones.nelts) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"status_zone\" requires \"metrics_zone\"");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        /* implicit upstreams of proxy_pass and so on are not tracked */
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        if (ngx_http_metrics_add_upstream(cf, mmcf, uscfp[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    obj = mmcf->objects.elts;
+
+    for (i = 0; i < mmcf->objects.nelts; i++) {
+        obj[i].hist = mmcf->nhists;
+        mmcf->nhists += ngx_http_metrics_nhists(obj[i].type);
+
+        if (ngx_http_metrics_escape(cf, &obj[i].label, &obj[i].name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_metrics_escape(cf, &obj[i].peer_label, &obj[i].peer)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_metrics_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_metrics_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_metrics_module);
+
+    if (mmcf == NULL || mmcf->gen == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_shmtx_lock(&mmcf->shpool->mutex);
+
+    mmcf->gen->refs++;
+
+    ngx_shmtx_unlock(&mmcf->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_metrics_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_metrics_main_conf_t  *mmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    mmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_metrics_module);
+
+    if (mmcf == NULL || mmcf->gen == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&mmcf->shpool->mutex);
+
+    if (--mmcf->gen->refs == 0) {
+        ngx_http_metrics_free_gens(mmcf);
+    }
+
+    ngx_shmtx_unlock(&mmcf->shpool->mutex);
+}
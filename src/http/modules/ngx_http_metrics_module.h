@@ -0,0 +1,33 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_METRICS_H_INCLUDED_
+#define _NGX_HTTP_METRICS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_METRICS_CACHE       4
+#define NGX_HTTP_METRICS_LIMIT_REQ   5
+#define NGX_HTTP_METRICS_LIMIT_CONN  6
+
+
+ngx_int_t ngx_http_metrics_add_zone(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t type);
+void ngx_http_metrics_zone(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t status);
+#if (NGX_HTTP_SSL)
+void ngx_http_metrics_handshake(ngx_connection_t *c);
+#endif
+
+
+extern ngx_module_t  ngx_http_metrics_module;
+
+
+#endif /* _NGX_HTTP_METRICS_H_INCLUDED_ */
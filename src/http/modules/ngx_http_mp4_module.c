@@ -7,6 +7,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 
 #define NGX_HTTP_MP4_TRAK_ATOM     0
@@ -42,13 +43,55 @@
 #define NGX_HTTP_MP4_LAST_ATOM    NGX_HTTP_MP4_CO64_DATA
 
 
+#define NGX_HTTP_MP4_CACHE_KEY_LEN  16
+
+
+#define NGX_HTTP_MP4_HLS_PLAYLIST   1
+#define NGX_HTTP_MP4_HLS_INIT       2
+#define NGX_HTTP_MP4_HLS_SEGMENT    3
+
+#define NGX_HTTP_MP4_HLS_NO_SEGMENT  (ngx_uint_t) -1
+
+
 typedef struct {
     size_t                buffer_size;
     size_t                max_buffer_size;
     ngx_flag_t            start_key_frame;
+    ngx_shm_zone_t       *cache;
+    ngx_flag_t            hls;
+    ngx_msec_t            hls_fragment;
 } ngx_http_mp4_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t     node;
+    ngx_queue_t           queue;
+    u_char                key[NGX_HTTP_MP4_CACHE_KEY_LEN
+                              - sizeof(ngx_rbtree_key_t)];
+    uint32_t              timescale;
+    ngx_uint_t            segments;
+    ngx_uint_t            traks;
+
+    /* segments + 1 times, followed by segments * traks marks */
+
+    uint64_t              times[1];
+} ngx_http_mp4_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t          rbtree;
+    ngx_rbtree_node_t     sentinel;
+    ngx_queue_t           queue;
+} ngx_http_mp4_cache_shctx_t;
+
+
+typedef struct {
+    ngx_http_mp4_cache_shctx_t  *sh;
+    ngx_slab_pool_t             *shpool;
+    size_t                       max_entry_size;
+} ngx_http_mp4_cache_t;
+
+
 typedef struct {
     u_char                chunk[4];
     u_char                samples[4];
@@ -182,9 +225,87 @@ typedef struct {
 
     u_char                moov_atom_header[8];
     u_char                mdat_atom_header[16];
+
+    ngx_file_uniq_t       uniq;
+    time_t                mtime;
+
+    unsigned              hls:1;
 } ngx_http_mp4_file_t;
 
 
+typedef struct {
+    ngx_http_mp4_trak_t  *trak;
+
+    uint32_t              sample;
+    uint32_t              samples;
+
+    uint64_t              time;
+    off_t                 offset;
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              composition_offset;
+    ngx_uint_t            key;
+
+    u_char               *stts;
+    u_char               *stts_end;
+    uint32_t              stts_left;
+
+    u_char               *ctts;
+    u_char               *ctts_end;
+    uint32_t              ctts_left;
+
+    u_char               *stss;
+    u_char               *stss_end;
+
+    u_char               *stsc;
+    u_char               *stsc_end;
+    uint32_t              chunk_samples;
+    uint32_t              chunk_left;
+    uint32_t              chunk;
+
+    u_char               *stsz;
+    uint32_t              uniform_size;
+
+    u_char               *chunks;
+    ngx_uint_t            co64;
+} ngx_http_mp4_hls_cursor_t;
+
+
+/* a position of a cursor, with offsets into the sample tables */
+
+typedef struct {
+    uint64_t              time;
+    off_t                 offset;
+    uint32_t              sample;
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              composition_offset;
+    uint32_t              key;
+
+    uint32_t              stts;
+    uint32_t              stts_left;
+    uint32_t              ctts;
+    uint32_t              ctts_left;
+    uint32_t              stss;
+    uint32_t              stsc;
+    uint32_t              chunk_samples;
+    uint32_t              chunk_left;
+    uint32_t              chunk;
+} ngx_http_mp4_hls_mark_t;
+
+
+typedef struct {
+    uint64_t                 *times;
+    ngx_uint_t                segments;
+    uint32_t                  timescale;
+
+    /* positions of the tracks at the start of the segment requested */
+
+    ngx_http_mp4_hls_mark_t  *marks;
+    ngx_uint_t                traks;
+} ngx_http_mp4_hls_index_t;
+
+
 typedef struct {
     char                 *name;
     ngx_int_t           (*handler)(ngx_http_mp4_file_t *mp4,
@@ -263,6 +384,7 @@ static ngx_int_t ngx_http_mp4_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_mp4_atofp(u_char *line, size_t n, size_t point);
 
 static ngx_int_t ngx_http_mp4_process(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_parse(ngx_http_mp4_file_t *mp4);
 static ngx_int_t ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size);
@@ -355,7 +477,49 @@ static ngx_int_t ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
 static void ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak, off_t adjustment);
 
+static ngx_uint_t ngx_http_mp4_hls_type(ngx_str_t *uri, size_t *suffix,
+    ngx_uint_t *n);
+static ngx_int_t ngx_http_mp4_hls_handler(ngx_http_request_t *r,
+    ngx_str_t *path, ngx_open_file_info_t *of, ngx_uint_t type, ngx_uint_t n,
+    size_t suffix);
+static ngx_int_t ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_mp4_hls_init(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_hls_segment(ngx_http_mp4_file_t *mp4,
+    ngx_uint_t n);
+static ngx_int_t ngx_http_mp4_hls_index(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_index_t *index, ngx_uint_t n);
+static ngx_int_t ngx_http_mp4_hls_marks(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_index_t *index);
+static ngx_int_t ngx_http_mp4_hls_cursor_init(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur, ngx_http_mp4_trak_t *trak);
+static ngx_int_t ngx_http_mp4_hls_cursor_next(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur);
+static ngx_int_t ngx_http_mp4_hls_cursor_sample(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur);
+static void ngx_http_mp4_hls_cursor_mark(ngx_http_mp4_hls_cursor_t *cur,
+    ngx_http_mp4_hls_mark_t *mark);
+static ngx_int_t ngx_http_mp4_hls_cursor_seek(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur, ngx_http_mp4_hls_mark_t *mark);
+static uint32_t ngx_http_mp4_hls_track_id(ngx_http_mp4_trak_t *trak);
+
+static void ngx_http_mp4_cache_key(ngx_http_mp4_file_t *mp4, u_char *key);
+static ngx_int_t ngx_http_mp4_cache_lookup(ngx_http_mp4_file_t *mp4,
+    u_char *key, ngx_http_mp4_hls_index_t *index, ngx_uint_t n);
+static void ngx_http_mp4_cache_store(ngx_http_mp4_file_t *mp4, u_char *key,
+    ngx_http_mp4_hls_index_t *index);
+static ngx_http_mp4_cache_node_t *ngx_http_mp4_cache_find(
+    ngx_http_mp4_cache_t *cache, u_char *key);
+static void ngx_http_mp4_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_mp4_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static char *ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_mp4_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_mp4_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static void *ngx_http_mp4_create_conf(ngx_conf_t *cf);
 static char *ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child);
 
@@ -390,6 +554,34 @@ static ngx_command_t  ngx_http_mp4_commands[] = {
       offsetof(ngx_http_mp4_conf_t, start_key_frame),
       NULL },
 
+    { ngx_string("mp4_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_mp4_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("mp4_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_mp4_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mp4_hls"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, hls),
+      NULL },
+
+    { ngx_string("mp4_hls_fragment"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, hls_fragment),
+      NULL },
+
       ngx_null_command
 };
 
@@ -477,13 +669,14 @@ static ngx_int_t
 ngx_http_mp4_handler(ngx_http_request_t *r)
 {
     u_char                    *last;
-    size_t                     root;
+    size_t                     root, suffix;
     ngx_int_t                  rc, start, end;
-    ngx_uint_t                 level, length;
+    ngx_uint_t                 level, length, hls, n;
     ngx_str_t                  path, value;
     ngx_log_t                 *log;
     ngx_buf_t                 *b;
     ngx_chain_t                out;
+    ngx_http_mp4_conf_t       *conf;
     ngx_http_mp4_file_t       *mp4;
     ngx_open_file_info_t       of;
     ngx_http_core_loc_conf_t  *clcf;
@@ -511,6 +704,21 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
 
     path.len = last - path.data;
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_mp4_module);
+
+    hls = 0;
+    suffix = 0;
+    n = 0;
+
+    if (conf->hls) {
+        hls = ngx_http_mp4_hls_type(&r->uri, &suffix, &n);
+
+        if (hls && path.len > suffix) {
+            path.len -= suffix;
+            path.data[path.len] = '\0';
+        }
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                    "http mp4 filename: \"%V\"", &path);
 
@@ -577,6 +785,10 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
     r->root_tested = !r->error_page;
     r->allow_ranges = 1;
 
+    if (hls) {
+        return ngx_http_mp4_hls_handler(r, &path, &of, hls, n, suffix);
+    }
+
     start = -1;
     length = 0;
     r->headers_out.content_length_n = of.size;
@@ -792,34 +1004,15 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
     ngx_uint_t             i, j;
     ngx_chain_t          **prev;
     ngx_http_mp4_trak_t   *trak;
-    ngx_http_mp4_conf_t   *conf;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
                    "mp4 start:%ui, length:%ui", mp4->start, mp4->length);
 
-    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
-
-    mp4->buffer_size = conf->buffer_size;
-
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
+    rc = ngx_http_mp4_parse(mp4);
     if (rc != NGX_OK) {
         return rc;
     }
 
-    if (mp4->trak.nelts == 0) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 trak atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
-
-    if (mp4->mdat_atom.buf == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 mdat atom was found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
-
     prev = &mp4->out;
 
     if (mp4->ftyp_atom.buf) {
@@ -939,6 +1132,39 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
 }
 
 
+static ngx_int_t
+ngx_http_mp4_parse(ngx_http_mp4_file_t *mp4)
+{
+    ngx_int_t             rc;
+    ngx_http_mp4_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    mp4->buffer_size = conf->buffer_size;
+
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (mp4->trak.nelts == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 trak atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mp4->mdat_atom.buf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 mdat atom was found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 typedef struct {
     u_char    size[4];
     u_char    name[4];
@@ -1178,7 +1404,7 @@ ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
     no_mdat = (mp4->mdat_atom.buf == NULL);
 
-    if (no_mdat && mp4->start == 0 && mp4->length == 0) {
+    if (no_mdat && mp4->start == 0 && mp4->length == 0 && !mp4->hls) {
         /*
          * send original file if moov atom resides before
          * mdat atom and client requests integral file
@@ -3927,46 +4153,1733 @@ ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
 }
 
 
-static char *
-ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_uint_t
+ngx_http_mp4_hls_type(ngx_str_t *uri, size_t *suffix, ngx_uint_t *n)
 {
-    ngx_http_core_loc_conf_t  *clcf;
+    u_char     *p, *q, *end;
+    ngx_int_t   num;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_mp4_handler;
+    /*
+     * "name.mp4.m3u8" is a playlist, "name.mp4.init.m4s" is
+     * an initialization segment, "name.mp4.N.m4s" is a media segment
+     */
 
-    return NGX_CONF_OK;
+    end = uri->data + uri->len;
+
+    if (uri->len > 5 && ngx_strncmp(end - 5, ".m3u8", 5) == 0) {
+        *suffix = 5;
+        return NGX_HTTP_MP4_HLS_PLAYLIST;
+    }
+
+    if (uri->len <= 4 || ngx_strncmp(end - 4, ".m4s", 4) != 0) {
+        return 0;
+    }
+
+    p = end - 4;
+
+    if (p - uri->data > 5 && ngx_strncmp(p - 5, ".init", 5) == 0) {
+        *suffix = 9;
+        return NGX_HTTP_MP4_HLS_INIT;
+    }
+
+    for (q = p; q > uri->data && q[-1] >= '0' && q[-1] <= '9'; q--) {
+        /* void */
+    }
+
+    if (q == p || q - 1 == uri->data || q[-1] != '.') {
+        return 0;
+    }
+
+    num = ngx_atoi(q, p - q);
+    if (num == NGX_ERROR) {
+        return 0;
+    }
+
+    *n = num;
+    *suffix = end - (q - 1);
+
+    return NGX_HTTP_MP4_HLS_SEGMENT;
 }
 
 
-static void *
-ngx_http_mp4_create_conf(ngx_conf_t *cf)
+static ngx_int_t
+ngx_http_mp4_hls_handler(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_open_file_info_t *of, ngx_uint_t type, ngx_uint_t n, size_t suffix)
 {
-    ngx_http_mp4_conf_t  *conf;
+    u_char                    *p, *last;
+    uintptr_t                  escape;
+    ngx_int_t                  rc;
+    ngx_str_t                  name;
+    ngx_log_t                 *log;
+    ngx_http_mp4_file_t       *mp4;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    conf = ngx_palloc(cf->pool, sizeof(ngx_http_mp4_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    log = r->connection->log;
+
+    r->single_range = 1;
+
+    mp4 = ngx_pcalloc(r->pool, sizeof(ngx_http_mp4_file_t));
+    if (mp4 == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    conf->buffer_size = NGX_CONF_UNSET_SIZE;
-    conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
-    conf->start_key_frame = NGX_CONF_UNSET;
+    mp4->file.fd = of->fd;
+    mp4->file.name = *path;
+    mp4->file.log = log;
+    mp4->end = of->size;
+    mp4->request = r;
+    mp4->uniq = of->uniq;
+    mp4->mtime = of->mtime;
+    mp4->hls = 1;
 
-    return conf;
+    /* a playlist is built from the cached index without parsing the file */
+
+    if (type == NGX_HTTP_MP4_HLS_PLAYLIST) {
+        rc = NGX_OK;
+
+    } else {
+        rc = ngx_http_mp4_parse(mp4);
+    }
+
+    if (rc == NGX_OK) {
+
+        switch (type) {
+
+        case NGX_HTTP_MP4_HLS_PLAYLIST:
+
+            /* segments are referenced relative to the playlist */
+
+            last = r->uri.data + r->uri.len - suffix;
+
+            for (p = last; p > r->uri.data && p[-1] != '/'; p--) {
+                /* void */
+            }
+
+            escape = 2 * ngx_escape_uri(NULL, p, last - p,
+                                        NGX_ESCAPE_URI_COMPONENT);
+
+            name.len = last - p + escape;
+            name.data = ngx_pnalloc(r->pool, name.len);
+            if (name.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            if (escape) {
+                ngx_escape_uri(name.data, p, last - p,
+                               NGX_ESCAPE_URI_COMPONENT);
+
+            } else {
+                ngx_memcpy(name.data, p, last - p);
+            }
+
+            rc = ngx_http_mp4_hls_playlist(mp4, &name);
+            break;
+
+        case NGX_HTTP_MP4_HLS_INIT:
+            rc = ngx_http_mp4_hls_init(mp4);
+            break;
+
+        default: /* NGX_HTTP_MP4_HLS_SEGMENT */
+            rc = ngx_http_mp4_hls_segment(mp4, n);
+        }
+    }
+
+    if (rc == NGX_DECLINED) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    log->action = "sending mp4 to client";
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (type == NGX_HTTP_MP4_HLS_SEGMENT && clcf->directio <= of->size) {
+
+        if (ngx_directio_on(of->fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_directio_on_n " \"%s\" failed", path->data);
+        }
+
+        of->is_directio = 1;
+        mp4->file.directio = 1;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = mp4->content_length;
+    r->headers_out.last_modified_time = of->mtime;
+
+    if (ngx_http_set_etag(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (type == NGX_HTTP_MP4_HLS_PLAYLIST) {
+        ngx_str_set(&r->headers_out.content_type,
+                    "application/vnd.apple.mpegurl");
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "video/mp4");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, mp4->out);
 }
 
 
-static char *
-ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+static ngx_int_t
+ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4, ngx_str_t *name)
 {
-    ngx_http_mp4_conf_t *prev = parent;
-    ngx_http_mp4_conf_t *conf = child;
+    size_t                    len;
+    uint64_t                  duration, target;
+    ngx_int_t                 rc;
+    ngx_buf_t                *b;
+    ngx_uint_t                i;
+    ngx_http_mp4_hls_index_t  index;
+
+    rc = ngx_http_mp4_hls_index(mp4, &index, NGX_HTTP_MP4_HLS_NO_SEGMENT);
+    if (rc != NGX_OK) {
+        return rc;
+    }
 
-    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 512 * 1024);
-    ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
-                              10 * 1024 * 1024);
-    ngx_conf_merge_value(conf->start_key_frame, prev->start_key_frame, 0);
+    target = 1;
+
+    for (i = 0; i < index.segments; i++) {
+        duration = index.times[i + 1] - index.times[i];
+        duration = (duration + index.timescale - 1) / index.timescale;
+
+        if (target < duration) {
+            target = duration;
+        }
+    }
+
+    len = sizeof("#EXTM3U\n") - 1
+          + sizeof("#EXT-X-VERSION:7\n") - 1
+          + sizeof("#EXT-X-TARGETDURATION:\n") - 1 + NGX_INT64_LEN
+          + sizeof("#EXT-X-PLAYLIST-TYPE:VOD\n") - 1
+          + sizeof("#EXT-X-INDEPENDENT-SEGMENTS\n") - 1
+          + sizeof("#EXT-X-MAP:URI=\".init.m4s\"\n") - 1 + name->len
+          + index.segments
+            * (sizeof("#EXTINF:.000,\n") - 1 + NGX_INT64_LEN
+               + name->len + sizeof("..m4s\n") - 1 + NGX_INT_T_LEN)
+          + sizeof("#EXT-X-ENDLIST\n") - 1;
+
+    b = ngx_create_temp_buf(mp4->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last,
+                          "#EXTM3U\n"
+                          "#EXT-X-VERSION:7\n"
+                          "#EXT-X-TARGETDURATION:%uL\n"
+                          "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                          "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                          "#EXT-X-MAP:URI=\"%V.init.m4s\"\n",
+                          target, name);
+
+    for (i = 0; i < index.segments; i++) {
+        duration = index.times[i + 1] - index.times[i];
+
+        b->last = ngx_sprintf(b->last, "#EXTINF:%.3f,\n%V.%ui.m4s\n",
+                              (double) duration / index.timescale, name, i);
+    }
+
+    b->last = ngx_cpymem(b->last, "#EXT-X-ENDLIST\n",
+                         sizeof("#EXT-X-ENDLIST\n") - 1);
+
+    b->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    mp4->out = ngx_alloc_chain_link(mp4->request->pool);
+    if (mp4->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    mp4->out->buf = b;
+    mp4->out->next = NULL;
+
+    mp4->content_length = b->last - b->pos;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_init(ngx_http_mp4_file_t *mp4)
+{
+    u_char               *p, *moov, *trak_atom, *mdia, *minf, *stbl;
+    size_t                len;
+    ngx_buf_t            *b, *atom;
+    ngx_uint_t            i, j;
+    ngx_http_mp4_trak_t  *trak;
+
+    static ngx_uint_t     copy[] = {
+        NGX_HTTP_MP4_VMHD_ATOM,
+        NGX_HTTP_MP4_SMHD_ATOM,
+        NGX_HTTP_MP4_DINF_ATOM
+    };
+
+    /*
+     * the initialization segment contains the original track headers
+     * and sample descriptions with empty sample tables, followed by
+     * the mvex atom announcing movie fragments
+     */
+
+    trak = mp4->trak.elts;
+
+    if (mp4->mvhd_atom.buf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 mvhd atom was found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    len = 24 + 8 + (mp4->mvhd_atom_buf.last - mp4->mvhd_atom_buf.pos) + 8;
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+
+        if (trak[i].out[NGX_HTTP_MP4_TKHD_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_MDHD_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_HDLR_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_STSD_ATOM].buf == NULL)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "incomplete mp4 trak atom in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        len += 8 + 8 + 8 + 8 + 16 + 16 + 20 + 16 + 32;
+
+        for (j = NGX_HTTP_MP4_TKHD_ATOM; j <= NGX_HTTP_MP4_STSD_ATOM; j++) {
+            atom = trak[i].out[j].buf;
+
+            if (atom && j != NGX_HTTP_MP4_MDIA_ATOM
+                && j != NGX_HTTP_MP4_MINF_ATOM && j != NGX_HTTP_MP4_STBL_ATOM)
+            {
+                len += atom->last - atom->pos;
+            }
+        }
+    }
+
+    b = ngx_create_temp_buf(mp4->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = b->last;
+
+    ngx_mp4_set_32value(p, 24);
+    ngx_mp4_set_atom_name(p, 'f', 't', 'y', 'p');
+    ngx_mp4_set_atom_name(p + 4, 'i', 's', 'o', '6');
+    ngx_mp4_set_32value(p + 8, 0);
+    ngx_mp4_set_atom_name(p + 12, 'i', 's', 'o', '6');
+    ngx_mp4_set_atom_name(p + 16, 'm', 'p', '4', '1');
+    p += 24;
+
+    moov = p;
+    ngx_mp4_set_atom_name(moov, 'm', 'o', 'o', 'v');
+    p += 8;
+
+    p = ngx_cpymem(p, mp4->mvhd_atom_buf.pos,
+                   mp4->mvhd_atom_buf.last - mp4->mvhd_atom_buf.pos);
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+
+        trak_atom = p;
+        ngx_mp4_set_atom_name(trak_atom, 't', 'r', 'a', 'k');
+        p += 8;
+
+        atom = trak[i].out[NGX_HTTP_MP4_TKHD_ATOM].buf;
+        p = ngx_cpymem(p, atom->pos, atom->last - atom->pos);
+
+        mdia = p;
+        ngx_mp4_set_atom_name(mdia, 'm', 'd', 'i', 'a');
+        p += 8;
+
+        atom = trak[i].out[NGX_HTTP_MP4_MDHD_ATOM].buf;
+        p = ngx_cpymem(p, atom->pos, atom->last - atom->pos);
+
+        atom = trak[i].out[NGX_HTTP_MP4_HDLR_ATOM].buf;
+        p = ngx_cpymem(p, atom->pos, atom->last - atom->pos);
+
+        minf = p;
+        ngx_mp4_set_atom_name(minf, 'm', 'i', 'n', 'f');
+        p += 8;
+
+        for (j = 0; j < sizeof(copy) / sizeof(ngx_uint_t); j++) {
+            atom = trak[i].out[copy[j]].buf;
+
+            if (atom) {
+                p = ngx_cpymem(p, atom->pos, atom->last - atom->pos);
+            }
+        }
+
+        stbl = p;
+        ngx_mp4_set_atom_name(stbl, 's', 't', 'b', 'l');
+        p += 8;
+
+        atom = trak[i].out[NGX_HTTP_MP4_STSD_ATOM].buf;
+        p = ngx_cpymem(p, atom->pos, atom->last - atom->pos);
+
+        /* empty stts, stsc, stsz, and stco atoms */
+
+        ngx_memzero(p, 16 + 16 + 20 + 16);
+
+        ngx_mp4_set_32value(p, 16);
+        ngx_mp4_set_atom_name(p, 's', 't', 't', 's');
+        p += 16;
+
+        ngx_mp4_set_32value(p, 16);
+        ngx_mp4_set_atom_name(p, 's', 't', 's', 'c');
+        p += 16;
+
+        ngx_mp4_set_32value(p, 20);
+        ngx_mp4_set_atom_name(p, 's', 't', 's', 'z');
+        p += 20;
+
+        ngx_mp4_set_32value(p, 16);
+        ngx_mp4_set_atom_name(p, 's', 't', 'c', 'o');
+        p += 16;
+
+        ngx_mp4_set_32value(stbl, p - stbl);
+        ngx_mp4_set_32value(minf, p - minf);
+        ngx_mp4_set_32value(mdia, p - mdia);
+        ngx_mp4_set_32value(trak_atom, p - trak_atom);
+    }
+
+    ngx_mp4_set_32value(p, 8 + 32 * mp4->trak.nelts);
+    ngx_mp4_set_atom_name(p, 'm', 'v', 'e', 'x');
+    p += 8;
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        ngx_memzero(p, 32);
+
+        ngx_mp4_set_32value(p, 32);
+        ngx_mp4_set_atom_name(p, 't', 'r', 'e', 'x');
+        ngx_mp4_set_32value(p + 12, ngx_http_mp4_hls_track_id(&trak[i]));
+        ngx_mp4_set_32value(p + 16, 1);
+        p += 32;
+    }
+
+    ngx_mp4_set_32value(moov, p - moov);
+
+    b->last = p;
+    b->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    mp4->out = ngx_alloc_chain_link(mp4->request->pool);
+    if (mp4->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    mp4->out->buf = b;
+    mp4->out->next = NULL;
+
+    mp4->content_length = b->last - b->pos;
+
+    return NGX_OK;
+}
+
+
+typedef struct {
+    u_char    duration[4];
+    u_char    size[4];
+    u_char    flags[4];
+    u_char    composition_offset[4];
+} ngx_mp4_trun_entry_t;
+
+
+typedef struct {
+    ngx_http_mp4_trak_t  *trak;
+    uint64_t              base;
+    ngx_array_t           entries;
+    ngx_uint_t            version;
+    off_t                 size;
+} ngx_http_mp4_hls_traf_t;
+
+
+static ngx_int_t
+ngx_http_mp4_hls_segment(ngx_http_mp4_file_t *mp4, ngx_uint_t n)
+{
+    u_char                     *p, *traf_atom;
+    off_t                       data_size, data_offset;
+    size_t                      len;
+    uint64_t                    start, end;
+    ngx_buf_t                  *b, *data;
+    ngx_uint_t                  i, last;
+    ngx_chain_t                *cl, **ll;
+    ngx_array_t                 trafs;
+    ngx_pool_t                 *pool;
+    ngx_mp4_trun_entry_t       *entry;
+    ngx_http_mp4_trak_t        *trak;
+    ngx_http_mp4_hls_traf_t    *traf;
+    ngx_http_mp4_hls_index_t    index;
+    ngx_http_mp4_hls_cursor_t   cur;
+
+    if (ngx_http_mp4_hls_index(mp4, &index, n) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (n >= index.segments) {
+        return NGX_DECLINED;
+    }
+
+    start = index.times[n];
+    end = index.times[n + 1];
+    last = (n + 1 == index.segments);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 hls segment:%ui %uL-%uL", n, start, end);
+
+    pool = mp4->request->pool;
+
+    if (ngx_array_init(&trafs, pool, mp4->trak.nelts,
+                       sizeof(ngx_http_mp4_hls_traf_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* sample data are sent from the file, ranges are merged if adjacent */
+
+    data = NULL;
+    data_size = 0;
+    cl = NULL;
+    ll = &cl;
+
+    trak = mp4->trak.elts;
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+
+        if (ngx_http_mp4_hls_cursor_init(mp4, &cur, &trak[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /* the track is positioned at the segment start directly */
+
+        if (ngx_http_mp4_hls_cursor_seek(mp4, &cur, &index.marks[i])
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        traf = NULL;
+
+        while (cur.sample < cur.samples
+               && (last
+                   || cur.time * index.timescale / trak[i].timescale < end))
+        {
+            if (traf == NULL) {
+                traf = ngx_array_push(&trafs);
+                if (traf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                traf->trak = &trak[i];
+                traf->base = cur.time;
+                traf->size = 0;
+                traf->version = 0;
+
+                if (trak[i].out[NGX_HTTP_MP4_CTTS_ATOM].buf) {
+                    traf->version =
+                        trak[i].out[NGX_HTTP_MP4_CTTS_ATOM].buf->pos[8];
+                }
+
+                if (ngx_array_init(&traf->entries, pool, 64,
+                                   sizeof(ngx_mp4_trun_entry_t))
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            entry = ngx_array_push(&traf->entries);
+            if (entry == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_mp4_set_32value(entry->duration, cur.duration);
+            ngx_mp4_set_32value(entry->size, cur.size);
+            ngx_mp4_set_32value(entry->flags,
+                                cur.key ? 0x02000000 : 0x01010000);
+            ngx_mp4_set_32value(entry->composition_offset,
+                                cur.composition_offset);
+
+            if (data && data->file_last == cur.offset) {
+                data->file_last += cur.size;
+
+            } else if (cur.size) {
+                data = ngx_calloc_buf(pool);
+                if (data == NULL) {
+                    return NGX_ERROR;
+                }
+
+                data->file = &mp4->file;
+                data->in_file = 1;
+                data->file_pos = cur.offset;
+                data->file_last = cur.offset + cur.size;
+
+                *ll = ngx_alloc_chain_link(pool);
+                if (*ll == NULL) {
+                    return NGX_ERROR;
+                }
+
+                (*ll)->buf = data;
+                ll = &(*ll)->next;
+            }
+
+            traf->size += cur.size;
+
+            if (ngx_http_mp4_hls_cursor_next(mp4, &cur) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (traf) {
+            data_size += traf->size;
+        }
+    }
+
+    *ll = NULL;
+
+    len = 8 + 16;
+    traf = trafs.elts;
+
+    for (i = 0; i < trafs.nelts; i++) {
+        len += 8 + 16 + 20 + 20
+               + traf[i].entries.nelts * sizeof(ngx_mp4_trun_entry_t);
+    }
+
+    if (data_size > NGX_MAX_INT32_VALUE - (off_t) len - 8) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 hls segment %ui is too large",
+                      mp4->file.name.data, n);
+        return NGX_ERROR;
+    }
+
+    b = ngx_create_temp_buf(pool, len + 8);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = b->last;
+
+    ngx_mp4_set_32value(p, len);
+    ngx_mp4_set_atom_name(p, 'm', 'o', 'o', 'f');
+    p += 8;
+
+    ngx_mp4_set_32value(p, 16);
+    ngx_mp4_set_atom_name(p, 'm', 'f', 'h', 'd');
+    ngx_mp4_set_32value(p + 8, 0);
+    ngx_mp4_set_32value(p + 12, n + 1);
+    p += 16;
+
+    data_offset = len + 8;
+
+    for (i = 0; i < trafs.nelts; i++) {
+
+        traf_atom = p;
+        ngx_mp4_set_atom_name(traf_atom, 't', 'r', 'a', 'f');
+        p += 8;
+
+        /* default-base-is-moof */
+
+        ngx_mp4_set_32value(p, 16);
+        ngx_mp4_set_atom_name(p, 't', 'f', 'h', 'd');
+        ngx_mp4_set_32value(p + 8, 0x00020000);
+        ngx_mp4_set_32value(p + 12, ngx_http_mp4_hls_track_id(traf[i].trak));
+        p += 16;
+
+        ngx_mp4_set_32value(p, 20);
+        ngx_mp4_set_atom_name(p, 't', 'f', 'd', 't');
+        ngx_mp4_set_32value(p + 8, 0x01000000);
+        ngx_mp4_set_64value(p + 12, traf[i].base);
+        p += 20;
+
+        /*
+         * data-offset, sample-duration, sample-size, sample-flags,
+         * and sample-composition-time-offsets are present
+         */
+
+        ngx_mp4_set_32value(p, 20 + traf[i].entries.nelts
+                                    * sizeof(ngx_mp4_trun_entry_t));
+        ngx_mp4_set_atom_name(p, 't', 'r', 'u', 'n');
+        ngx_mp4_set_32value(p + 8, (traf[i].version << 24) | 0x000f01);
+        ngx_mp4_set_32value(p + 12, traf[i].entries.nelts);
+        ngx_mp4_set_32value(p + 16, data_offset);
+        p += 20;
+
+        p = ngx_cpymem(p, traf[i].entries.elts,
+                       traf[i].entries.nelts * sizeof(ngx_mp4_trun_entry_t));
+
+        ngx_mp4_set_32value(traf_atom, p - traf_atom);
+
+        data_offset += traf[i].size;
+    }
+
+    ngx_mp4_set_32value(p, 8 + data_size);
+    ngx_mp4_set_atom_name(p, 'm', 'd', 'a', 't');
+    p += 8;
+
+    b->last = p;
+
+    mp4->out = ngx_alloc_chain_link(pool);
+    if (mp4->out == NULL) {
+        return NGX_ERROR;
+    }
+
+    mp4->out->buf = b;
+    mp4->out->next = cl;
+
+    if (data == NULL) {
+        data = b;
+    }
+
+    data->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    data->last_in_chain = 1;
+
+    mp4->content_length = len + 8 + data_size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_index(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_index_t *index, ngx_uint_t n)
+{
+    u_char                      key[NGX_HTTP_MP4_CACHE_KEY_LEN];
+    uint64_t                    fragment, next, *time;
+    ngx_int_t                   rc;
+    ngx_uint_t                  i;
+    ngx_array_t                 times;
+    ngx_http_mp4_conf_t        *conf;
+    ngx_http_mp4_trak_t        *trak, *main;
+    ngx_http_mp4_hls_cursor_t   cur;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    if (conf->cache) {
+        ngx_http_mp4_cache_key(mp4, key);
+
+        rc = ngx_http_mp4_cache_lookup(mp4, key, index, n);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    if (mp4->moov_atom.buf == NULL) {
+        rc = ngx_http_mp4_parse(mp4);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    /*
+     * segments are cut at key frames of the first video track,
+     * or of the first track if there are no sync samples tables
+     */
+
+    trak = mp4->trak.elts;
+    main = &trak[0];
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        if (trak[i].out[NGX_HTTP_MP4_STSS_DATA].buf) {
+            main = &trak[i];
+            break;
+        }
+    }
+
+    if (ngx_http_mp4_hls_cursor_init(mp4, &cur, main) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (cur.samples == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no samples in mp4 trak atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&times, mp4->request->pool, 64, sizeof(uint64_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    fragment = (uint64_t) conf->hls_fragment * main->timescale / 1000;
+
+    if (fragment == 0) {
+        fragment = 1;
+    }
+
+    time = ngx_array_push(&times);
+    if (time == NULL) {
+        return NGX_ERROR;
+    }
+
+    *time = 0;
+    next = fragment;
+
+    while (cur.sample < cur.samples) {
+
+        if (cur.time >= next && cur.key) {
+            time = ngx_array_push(&times);
+            if (time == NULL) {
+                return NGX_ERROR;
+            }
+
+            *time = cur.time;
+            next = (cur.time / fragment + 1) * fragment;
+        }
+
+        if (ngx_http_mp4_hls_cursor_next(mp4, &cur) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    time = ngx_array_push(&times);
+    if (time == NULL) {
+        return NGX_ERROR;
+    }
+
+    *time = cur.time;
+
+    index->times = times.elts;
+    index->segments = times.nelts - 1;
+    index->timescale = main->timescale;
+    index->marks = NULL;
+    index->traks = mp4->trak.nelts;
+
+    if (n == NGX_HTTP_MP4_HLS_NO_SEGMENT && conf->cache == NULL) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_mp4_hls_marks(mp4, index) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (conf->cache) {
+        ngx_http_mp4_cache_store(mp4, key, index);
+    }
+
+    if (n < index->segments) {
+        index->marks += n * index->traks;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_marks(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_index_t *index)
+{
+    ngx_uint_t                  i, n;
+    ngx_http_mp4_trak_t        *trak;
+    ngx_http_mp4_hls_mark_t    *marks;
+    ngx_http_mp4_hls_cursor_t   cur;
+
+    /*
+     * the position of each track at the start of each segment
+     * is found in a single pass over its samples
+     */
+
+    marks = ngx_palloc(mp4->request->pool, index->segments * index->traks
+                                           * sizeof(ngx_http_mp4_hls_mark_t));
+    if (marks == NULL) {
+        return NGX_ERROR;
+    }
+
+    trak = mp4->trak.elts;
+
+    for (i = 0; i < index->traks; i++) {
+
+        if (ngx_http_mp4_hls_cursor_init(mp4, &cur, &trak[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        for (n = 0; n < index->segments; n++) {
+
+            while (cur.sample < cur.samples
+                   && cur.time * index->timescale / trak[i].timescale
+                      < index->times[n])
+            {
+                if (ngx_http_mp4_hls_cursor_next(mp4, &cur) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+            ngx_http_mp4_hls_cursor_mark(&cur, &marks[n * index->traks + i]);
+        }
+    }
+
+    index->marks = marks;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_cursor_init(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur, ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t            *data;
+    ngx_mp4_stsz_atom_t  *stsz_atom;
+
+    if (trak->timescale == 0
+        || trak->out[NGX_HTTP_MP4_STTS_DATA].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STSC_DATA].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf == NULL
+        || (trak->out[NGX_HTTP_MP4_STCO_DATA].buf == NULL
+            && trak->out[NGX_HTTP_MP4_CO64_DATA].buf == NULL))
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "incomplete mp4 trak atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(cur, sizeof(ngx_http_mp4_hls_cursor_t));
+
+    cur->trak = trak;
+    cur->samples = trak->sample_sizes_entries;
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+    cur->stts = data->pos;
+    cur->stts_end = data->last;
+
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+    if (data) {
+        cur->ctts = data->pos;
+        cur->ctts_end = data->last;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    if (data) {
+        cur->stss = data->pos;
+        cur->stss_end = data->last;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    cur->stsc = data->pos;
+    cur->stsc_end = data->last;
+
+    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
+
+    if (data) {
+        cur->stsz = data->pos;
+
+    } else {
+        stsz_atom = (ngx_mp4_stsz_atom_t *)
+                                   trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf->pos;
+        cur->uniform_size = ngx_mp4_get_32value(stsz_atom->uniform_size);
+    }
+
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+
+    if (data) {
+        cur->chunks = data->pos;
+        cur->co64 = 1;
+
+    } else {
+        cur->chunks = trak->out[NGX_HTTP_MP4_STCO_DATA].buf->pos;
+    }
+
+    return ngx_http_mp4_hls_cursor_sample(mp4, cur);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_cursor_next(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur)
+{
+    cur->time += cur->duration;
+    cur->offset += cur->size;
+    cur->sample++;
+
+    return ngx_http_mp4_hls_cursor_sample(mp4, cur);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_cursor_sample(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur)
+{
+    u_char                *p;
+    ngx_mp4_stts_entry_t  *stts;
+    ngx_mp4_ctts_entry_t  *ctts;
+    ngx_mp4_stsc_entry_t  *stsc;
+
+    if (cur->sample >= cur->samples) {
+        return NGX_OK;
+    }
+
+    /* tables positions are advanced along with the sample number */
+
+    while (cur->stts_left == 0) {
+
+        if (cur->stts + sizeof(ngx_mp4_stts_entry_t) > cur->stts_end) {
+            goto truncated;
+        }
+
+        stts = (ngx_mp4_stts_entry_t *) cur->stts;
+        cur->stts_left = ngx_mp4_get_32value(stts->count);
+        cur->duration = ngx_mp4_get_32value(stts->duration);
+        cur->stts += sizeof(ngx_mp4_stts_entry_t);
+    }
+
+    cur->stts_left--;
+
+    cur->composition_offset = 0;
+
+    if (cur->ctts) {
+
+        while (cur->ctts_left == 0
+               && cur->ctts + sizeof(ngx_mp4_ctts_entry_t) <= cur->ctts_end)
+        {
+            ctts = (ngx_mp4_ctts_entry_t *) cur->ctts;
+            cur->ctts_left = ngx_mp4_get_32value(ctts->count);
+            cur->ctts += sizeof(ngx_mp4_ctts_entry_t);
+        }
+
+        if (cur->ctts_left) {
+            ctts = (ngx_mp4_ctts_entry_t *)
+                                   (cur->ctts - sizeof(ngx_mp4_ctts_entry_t));
+            cur->composition_offset = ngx_mp4_get_32value(ctts->offset);
+            cur->ctts_left--;
+        }
+    }
+
+    if (cur->stss) {
+
+        while (cur->stss + sizeof(uint32_t) <= cur->stss_end
+               && ngx_mp4_get_32value(cur->stss) < cur->sample + 1)
+        {
+            cur->stss += sizeof(uint32_t);
+        }
+
+        cur->key = (cur->stss + sizeof(uint32_t) <= cur->stss_end
+                    && ngx_mp4_get_32value(cur->stss) == cur->sample + 1);
+
+    } else {
+        cur->key = 1;
+    }
+
+    while (cur->chunk_left == 0) {
+
+        if (cur->chunk++ == cur->trak->chunks) {
+            goto truncated;
+        }
+
+        while (cur->stsc + sizeof(ngx_mp4_stsc_entry_t) <= cur->stsc_end) {
+            stsc = (ngx_mp4_stsc_entry_t *) cur->stsc;
+
+            if (ngx_mp4_get_32value(stsc->chunk) > cur->chunk) {
+                break;
+            }
+
+            cur->chunk_samples = ngx_mp4_get_32value(stsc->samples);
+            cur->stsc += sizeof(ngx_mp4_stsc_entry_t);
+        }
+
+        cur->chunk_left = cur->chunk_samples;
+
+        if (cur->co64) {
+            p = cur->chunks + (cur->chunk - 1) * sizeof(uint64_t);
+            cur->offset = ngx_mp4_get_64value(p);
+
+        } else {
+            p = cur->chunks + (cur->chunk - 1) * sizeof(uint32_t);
+            cur->offset = ngx_mp4_get_32value(p);
+        }
+    }
+
+    cur->chunk_left--;
+
+    if (cur->stsz) {
+        cur->size = ngx_mp4_get_32value(cur->stsz
+                                        + cur->sample * sizeof(uint32_t));
+
+    } else {
+        cur->size = cur->uniform_size;
+    }
+
+    if (cur->offset + cur->size > mp4->end) {
+        goto truncated;
+    }
+
+    return NGX_OK;
+
+truncated:
+
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 sample tables are inconsistent at sample %uD",
+                  mp4->file.name.data, cur->sample + 1);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_mp4_hls_cursor_mark(ngx_http_mp4_hls_cursor_t *cur,
+    ngx_http_mp4_hls_mark_t *mark)
+{
+    ngx_http_mp4_trak_t  *trak;
+
+    trak = cur->trak;
+
+    mark->time = cur->time;
+    mark->offset = cur->offset;
+    mark->sample = cur->sample;
+    mark->duration = cur->duration;
+    mark->size = cur->size;
+    mark->composition_offset = cur->composition_offset;
+    mark->key = cur->key;
+
+    mark->stts = cur->stts - trak->out[NGX_HTTP_MP4_STTS_DATA].buf->pos;
+    mark->stts_left = cur->stts_left;
+
+    if (cur->ctts) {
+        mark->ctts = cur->ctts - trak->out[NGX_HTTP_MP4_CTTS_DATA].buf->pos;
+        mark->ctts_left = cur->ctts_left;
+
+    } else {
+        mark->ctts = 0;
+        mark->ctts_left = 0;
+    }
+
+    if (cur->stss) {
+        mark->stss = cur->stss - trak->out[NGX_HTTP_MP4_STSS_DATA].buf->pos;
+
+    } else {
+        mark->stss = 0;
+    }
+
+    mark->stsc = cur->stsc - trak->out[NGX_HTTP_MP4_STSC_DATA].buf->pos;
+    mark->chunk_samples = cur->chunk_samples;
+    mark->chunk_left = cur->chunk_left;
+    mark->chunk = cur->chunk;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_cursor_seek(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_cursor_t *cur, ngx_http_mp4_hls_mark_t *mark)
+{
+    ngx_buf_t            *data;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* the cursor is initialized, the mark was taken on the same tables */
+
+    trak = cur->trak;
+
+    if (mark->sample > cur->samples || mark->chunk > trak->chunks) {
+        goto invalid;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+
+    if (mark->stts > (size_t) (data->last - data->pos)) {
+        goto invalid;
+    }
+
+    cur->stts = data->pos + mark->stts;
+    cur->stts_left = mark->stts_left;
+
+    if (cur->ctts) {
+        data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+        if (mark->ctts > (size_t) (data->last - data->pos)) {
+            goto invalid;
+        }
+
+        cur->ctts = data->pos + mark->ctts;
+        cur->ctts_left = mark->ctts_left;
+    }
+
+    if (cur->stss) {
+        data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+        if (mark->stss > (size_t) (data->last - data->pos)) {
+            goto invalid;
+        }
+
+        cur->stss = data->pos + mark->stss;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+
+    if (mark->stsc > (size_t) (data->last - data->pos)) {
+        goto invalid;
+    }
+
+    cur->stsc = data->pos + mark->stsc;
+    cur->chunk_samples = mark->chunk_samples;
+    cur->chunk_left = mark->chunk_left;
+    cur->chunk = mark->chunk;
+
+    cur->time = mark->time;
+    cur->offset = mark->offset;
+    cur->sample = mark->sample;
+    cur->duration = mark->duration;
+    cur->size = mark->size;
+    cur->composition_offset = mark->composition_offset;
+    cur->key = mark->key;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 hls index does not match sample tables",
+                  mp4->file.name.data);
+
+    return NGX_ERROR;
+}
+
+
+static uint32_t
+ngx_http_mp4_hls_track_id(ngx_http_mp4_trak_t *trak)
+{
+    ngx_mp4_tkhd_atom_t    *tkhd_atom;
+    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
+
+    tkhd_atom = (ngx_mp4_tkhd_atom_t *)
+                                     trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf->pos;
+
+    if (tkhd_atom->version[0] == 0) {
+        return ngx_mp4_get_32value(tkhd_atom->track_id);
+    }
+
+    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) tkhd_atom;
+
+    return ngx_mp4_get_32value(tkhd64_atom->track_id);
+}
+
+static void
+ngx_http_mp4_cache_key(ngx_http_mp4_file_t *mp4, u_char *key)
+{
+    u_char                buf[4 * (NGX_INT64_LEN + 1)];
+    ngx_md5_t             md5;
+    ngx_http_mp4_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    /*
+     * the file is identified by its name, inode, mtime, and size;
+     * the index also depends on the fragment duration
+     */
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, mp4->file.name.data, mp4->file.name.len);
+    ngx_md5_update(&md5, buf,
+                   ngx_sprintf(buf, " %uL %T %O %M",
+                               (uint64_t) mp4->uniq, mp4->mtime, mp4->end,
+                               conf->hls_fragment)
+                   - buf);
+    ngx_md5_final(key, &md5);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_cache_lookup(ngx_http_mp4_file_t *mp4, u_char *key,
+    ngx_http_mp4_hls_index_t *index, ngx_uint_t n)
+{
+    size_t                      len;
+    ngx_http_mp4_hls_mark_t    *marks;
+    ngx_http_mp4_conf_t        *conf;
+    ngx_http_mp4_cache_t       *cache;
+    ngx_http_mp4_cache_node_t  *node;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    cache = conf->cache->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_mp4_cache_find(cache, key);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 cache miss");
+
+        return NGX_DECLINED;
+    }
+
+    if (n != NGX_HTTP_MP4_HLS_NO_SEGMENT && node->traks != mp4->trak.nelts) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 hls index does not match sample tables",
+                      mp4->file.name.data);
+
+        return NGX_ERROR;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    /*
+     * the entry may be evicted once the lock is released, so the times
+     * and the marks of the segment requested are copied
+     */
+
+    len = (node->segments + 1) * sizeof(uint64_t);
+
+    index->times = ngx_palloc(mp4->request->pool, len);
+    if (index->times == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(index->times, node->times, len);
+
+    index->segments = node->segments;
+    index->timescale = node->timescale;
+    index->traks = node->traks;
+    index->marks = NULL;
+
+    if (n < node->segments) {
+        marks = (ngx_http_mp4_hls_mark_t *) &node->times[node->segments + 1];
+
+        len = node->traks * sizeof(ngx_http_mp4_hls_mark_t);
+
+        index->marks = ngx_palloc(mp4->request->pool, len);
+        if (index->marks == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(index->marks, &marks[n * node->traks], len);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 cache hit: %ui segments", index->segments);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_cache_store(ngx_http_mp4_file_t *mp4, u_char *key,
+    ngx_http_mp4_hls_index_t *index)
+{
+    size_t                      len;
+    ngx_queue_t                *q;
+    ngx_http_mp4_conf_t        *conf;
+    ngx_http_mp4_cache_t       *cache;
+    ngx_http_mp4_cache_node_t  *node, *old;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    cache = conf->cache->data;
+
+    len = offsetof(ngx_http_mp4_cache_node_t, times)
+          + (index->segments + 1) * sizeof(uint64_t)
+          + index->segments * index->traks * sizeof(ngx_http_mp4_hls_mark_t);
+
+    if (len > cache->max_entry_size) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_mp4_cache_find(cache, key)) {
+        goto done;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool, len);
+        if (node) {
+            break;
+        }
+
+        /* free the least recently used entries */
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_log_error(NGX_LOG_WARN, mp4->file.log, 0,
+                          "could not allocate mp4 cache entry "
+                          "of %uz bytes", len);
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        old = ngx_queue_data(q, ngx_http_mp4_cache_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &old->node);
+
+        ngx_slab_free_locked(cache->shpool, old);
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_MP4_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->timescale = index->timescale;
+    node->segments = index->segments;
+    node->traks = index->traks;
+
+    ngx_memcpy(ngx_cpymem(node->times, index->times,
+                          (index->segments + 1) * sizeof(uint64_t)),
+               index->marks,
+               index->segments * index->traks
+               * sizeof(ngx_http_mp4_hls_mark_t));
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 cache store: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_http_mp4_cache_node_t *
+ngx_http_mp4_cache_find(ngx_http_mp4_cache_t *cache, u_char *key)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_key_t            node_key;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_mp4_cache_node_t  *mcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        mcn = (ngx_http_mp4_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], mcn->key,
+                        NGX_HTTP_MP4_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return mcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_mp4_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_mp4_cache_node_t   *mcn, *mcnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            mcn = (ngx_http_mp4_cache_node_t *) node;
+            mcnt = (ngx_http_mp4_cache_node_t *) temp;
+
+            p = (ngx_memcmp(mcn->key, mcnt->key,
+                            NGX_HTTP_MP4_CACHE_KEY_LEN
+                            - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_mp4_cache_t  *ocache = data;
+
+    size_t                 len;
+    ngx_http_mp4_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_mp4_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_mp4_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in mp4 cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in mp4 cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mp4_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_mp4_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_mp4_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_mp4_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->start_key_frame = NGX_CONF_UNSET;
+    conf->cache = NGX_CONF_UNSET_PTR;
+    conf->hls = NGX_CONF_UNSET;
+    conf->hls_fragment = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_mp4_conf_t *prev = parent;
+    ngx_http_mp4_conf_t *conf = child;
+
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 512 * 1024);
+    ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
+                              10 * 1024 * 1024);
+    ngx_conf_merge_value(conf->start_key_frame, prev->start_key_frame, 0);
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_value(conf->hls, prev->hls, 0);
+    ngx_conf_merge_msec_value(conf->hls_fragment, prev->hls_fragment, 5000);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_mp4_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                *p;
+    ssize_t                size;
+    ngx_str_t             *value, name, s;
+    ngx_uint_t             i;
+    ngx_shm_zone_t        *shm_zone;
+    ngx_http_mp4_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_mp4_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->max_entry_size = 10 * 1024 * 1024;
+
+    size = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_entry_size=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            cache->max_entry_size = ngx_parse_size(&s);
+
+            if (cache->max_entry_size == (size_t) NGX_ERROR
+                || cache->max_entry_size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_entry_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_mp4_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_mp4_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_mp4_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_mp4_conf_t *mcf = conf;
+
+    ngx_str_t  *value;
+
+    if (mcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    mcf->cache = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_mp4_module);
+    if (mcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -297,6 +297,24 @@ static ngx_conf_enum_t  ngx_http_proxy_http_version[] = {
 };
 
 
+#if (NGX_HTTP_CACHE)
+
+static ngx_conf_enum_t  ngx_http_proxy_cache_compress[] = {
+    { ngx_string("off"), 0 },
+#if (NGX_HTTP_GUNZIP)
+    { ngx_string("gzip"), NGX_HTTP_CACHE_ENCODING_GZIP },
+#endif
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_num_bounds_t  ngx_http_proxy_cache_compress_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 9
+};
+
+#endif
+
+
 ngx_module_t  ngx_http_proxy_module;
 
 
@@ -626,6 +644,34 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_background_update),
       NULL },
 
+    { ngx_string("proxy_cache_peers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_cache_peers_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_peers),
+      NULL },
+
+    { ngx_string("proxy_cache_compress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_compress),
+      &ngx_http_proxy_cache_compress },
+
+    { ngx_string("proxy_cache_compress_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_compress_level),
+      &ngx_http_proxy_cache_compress_level_bounds },
+
+    { ngx_string("proxy_cache_compress_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_compress_types_keys),
+      &ngx_http_html_default_types[0] },
+
 #endif
 
     { ngx_string("proxy_temp_path"),
@@ -1409,11 +1455,33 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
                 continue;
             }
 
+#if (NGX_HTTP_CACHE)
+            /* the header is set for cache peers only */
+
+            if (u->conf->cache_peers
+                && header[i].key.len == sizeof("x-cache-peer") - 1
+                && ngx_strncmp(header[i].lowcase_key, "x-cache-peer",
+                               sizeof("x-cache-peer") - 1)
+                   == 0)
+            {
+                continue;
+            }
+#endif
+
             len += header[i].key.len + sizeof(": ") - 1
                 + header[i].value.len + sizeof(CRLF) - 1;
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (u->cache_peer) {
+        len += sizeof("X-Cache-Peer: ") - 1 + u->conf->cache_peers->name.len
+               + sizeof(CRLF) - 1;
+    }
+
+#endif
+
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -1545,6 +1613,19 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
                 continue;
             }
 
+#if (NGX_HTTP_CACHE)
+            /* the header is set for cache peers only */
+
+            if (u->conf->cache_peers
+                && header[i].key.len == sizeof("x-cache-peer") - 1
+                && ngx_strncmp(header[i].lowcase_key, "x-cache-peer",
+                               sizeof("x-cache-peer") - 1)
+                   == 0)
+            {
+                continue;
+            }
+#endif
+
             b->last = ngx_copy(b->last, header[i].key.data, header[i].key.len);
 
             *b->last++ = ':'; *b->last++ = ' ';
@@ -1560,6 +1641,18 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (u->cache_peer) {
+        b->last = ngx_cpymem(b->last, "X-Cache-Peer: ",
+                             sizeof("X-Cache-Peer: ") - 1);
+        b->last = ngx_copy(b->last, u->conf->cache_peers->name.data,
+                           u->conf->cache_peers->name.len);
+        *b->last++ = CR; *b->last++ = LF;
+    }
+
+#endif
+
 
     /* add "\r\n" at the header end */
     *b->last++ = CR; *b->last++ = LF;
@@ -3543,6 +3636,8 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.cache_zone = NULL;
      *     conf->upstream.cache_use_stale = 0;
      *     conf->upstream.cache_methods = 0;
+     *     conf->upstream.cache_compress_types_keys = NULL;
+     *     conf->upstream.cache_compress_types = { NULL, 0 };
      *     conf->upstream.temp_path = NULL;
      *     conf->upstream.hide_headers_hash = { NULL, 0 };
      *     conf->upstream.store_lengths = NULL;
@@ -3608,6 +3703,9 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache_revalidate = NGX_CONF_UNSET;
     conf->upstream.cache_convert_head = NGX_CONF_UNSET;
     conf->upstream.cache_background_update = NGX_CONF_UNSET;
+    conf->upstream.cache_peers = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_compress = NGX_CONF_UNSET_UINT;
+    conf->upstream.cache_compress_level = NGX_CONF_UNSET;
 #endif
 
     conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
@@ -3930,6 +4028,33 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.cache_background_update,
                               prev->upstream.cache_background_update, 0);
 
+    ngx_conf_merge_ptr_value(conf->upstream.cache_peers,
+                              prev->upstream.cache_peers, NULL);
+
+    if (conf->upstream.cache_peers
+        && conf->upstream.cache_peers->points == NULL
+        && ngx_http_upstream_init_cache_peers(cf, conf->upstream.cache_peers)
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_uint_value(conf->upstream.cache_compress,
+                              prev->upstream.cache_compress, 0);
+
+    ngx_conf_merge_value(conf->upstream.cache_compress_level,
+                              prev->upstream.cache_compress_level, 1);
+
+    if (ngx_http_merge_types(cf, &conf->upstream.cache_compress_types_keys,
+                             &conf->upstream.cache_compress_types,
+                             &prev->upstream.cache_compress_types_keys,
+                             &prev->upstream.cache_compress_types,
+                             ngx_http_html_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
 #endif
 
     ngx_conf_merge_value(conf->upstream.pass_request_headers,
@@ -16,19 +16,75 @@
 #define NGX_HTTP_SSI_ADD_PREFIX     1
 #define NGX_HTTP_SSI_ADD_ZERO       2
 
+#define NGX_HTTP_SSI_NODE_TEXT      0
+#define NGX_HTTP_SSI_NODE_COMMAND   1
+#define NGX_HTTP_SSI_NODE_ERROR     2
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 expire_queue;
+
+    ngx_uint_t                  current;
+    ngx_uint_t                  max;
+    time_t                      inactive;
+    size_t                      max_size;
+} ngx_http_ssi_cache_t;
+
+
+typedef struct {
+    ngx_uint_t                  type;
+    ngx_str_t                   data;
+    ngx_uint_t                  key;
+    ngx_uint_t                  nparams;
+    ngx_table_elt_t            *params;
+} ngx_http_ssi_node_t;
+
+
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_queue_t                 queue;
+
+    time_t                      accessed;
+    ngx_uint_t                  count;
+
+    ngx_str_t                   text;
+    ngx_uint_t                  nnodes;
+    ngx_http_ssi_node_t        *nodes;
+
+    unsigned                    close:1;
+} ngx_http_ssi_document_t;
+
+
+typedef struct {
+    ngx_http_ssi_cache_t       *cache;
+    ngx_http_ssi_document_t    *document;
+    ngx_uint_t                  node;
+
+    ngx_str_t                   name;
+    ngx_array_t                 nodes;
+    ngx_buf_t                  *text;
+    size_t                      size;
+
+    unsigned                    started:1;
+} ngx_http_ssi_cache_ctx_t;
+
 
 typedef struct {
-    ngx_flag_t    enable;
-    ngx_flag_t    silent_errors;
-    ngx_flag_t    ignore_recycled_buffers;
-    ngx_flag_t    last_modified;
+    ngx_flag_t              enable;
+    ngx_flag_t              silent_errors;
+    ngx_flag_t              ignore_recycled_buffers;
+    ngx_flag_t              last_modified;
+
+    ngx_hash_t              types;
 
-    ngx_hash_t    types;
+    size_t                  min_file_chunk;
+    size_t                  value_len;
 
-    size_t        min_file_chunk;
-    size_t        value_len;
+    ngx_http_ssi_cache_t   *cache;
 
-    ngx_array_t  *types_keys;
+    ngx_array_t            *types_keys;
 } ngx_http_ssi_loc_conf_t;
 
 
@@ -76,6 +132,22 @@ static void ngx_http_ssi_buffered(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx);
 static ngx_int_t ngx_http_ssi_parse(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx);
+static ngx_int_t ngx_http_ssi_cache_lookup(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, ngx_http_ssi_cache_t *cache);
+static void ngx_http_ssi_cache_release(void *data);
+static ngx_buf_t *ngx_http_ssi_cache_buf(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, ngx_buf_t *in);
+static ngx_int_t ngx_http_ssi_cache_parse(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static void ngx_http_ssi_cache_text(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static ngx_int_t ngx_http_ssi_cache_node(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, ngx_int_t rc);
+static void ngx_http_ssi_cache_store(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static void ngx_http_ssi_cache_expire(ngx_http_ssi_cache_t *cache,
+    ngx_uint_t n, ngx_log_t *log);
+static void ngx_http_ssi_cache_cleanup(void *data);
 static ngx_str_t *ngx_http_ssi_get_variable(ngx_http_request_t *r,
     ngx_str_t *name, ngx_uint_t key);
 static ngx_int_t ngx_http_ssi_evaluate_string(ngx_http_request_t *r,
@@ -109,6 +181,9 @@ static ngx_int_t ngx_http_ssi_endblock(ngx_http_request_t *r,
 static ngx_int_t ngx_http_ssi_date_gmt_local_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t gmt);
 
+static char *ngx_http_ssi_cache_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
 static ngx_int_t ngx_http_ssi_preconfiguration(ngx_conf_t *cf);
 static void *ngx_http_ssi_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_ssi_init_main_conf(ngx_conf_t *cf, void *conf);
@@ -170,6 +245,13 @@ static ngx_command_t  ngx_http_ssi_filter_commands[] = {
       offsetof(ngx_http_ssi_loc_conf_t, last_modified),
       NULL },
 
+    { ngx_string("ssi_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_ssi_cache_conf,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ssi_loc_conf_t, cache),
+      NULL },
+
       ngx_null_command
 };
 
@@ -366,7 +448,22 @@ ngx_http_ssi_header_filter(ngx_http_request_t *r)
     ngx_str_set(&ctx->errmsg,
                 "[an error occurred while processing the directive]");
 
-    r->filter_need_in_memory = 1;
+    if (slcf->cache) {
+        if (ngx_http_ssi_cache_lookup(r, ctx, slcf->cache) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    /*
+     * if the document is cached, the response body is not used,
+     * so a file is not read unless sendfile is disabled
+     */
+
+    if (ctx->cache == NULL
+        || ((ngx_http_ssi_cache_ctx_t *) ctx->cache)->document == NULL)
+    {
+        r->filter_need_in_memory = 1;
+    }
 
     if (r == r->main) {
 
@@ -489,6 +586,17 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ctx->pos = ctx->buf->pos;
 
             ngx_free_chain(r->pool, cl);
+
+            if (ctx->cache
+                && ((ngx_http_ssi_cache_ctx_t *) ctx->cache)->document)
+            {
+                ctx->buf = ngx_http_ssi_cache_buf(r, ctx, ctx->buf);
+                if (ctx->buf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ctx->pos = ctx->buf->pos;
+            }
         }
 
         if (ctx->state == ssi_start_state) {
@@ -503,7 +611,14 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "saved: %uz state: %ui", ctx->saved, ctx->state);
 
-            rc = ngx_http_ssi_parse(r, ctx);
+            if (ctx->cache
+                && ((ngx_http_ssi_cache_ctx_t *) ctx->cache)->document)
+            {
+                rc = ngx_http_ssi_cache_parse(r, ctx);
+
+            } else {
+                rc = ngx_http_ssi_parse(r, ctx);
+            }
 
             ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "parse: %i, looked: %uz %p-%p",
@@ -515,6 +630,10 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             if (ctx->copy_start != ctx->copy_end) {
 
+                if (ctx->cache) {
+                    ngx_http_ssi_cache_text(r, ctx);
+                }
+
                 if (ctx->output) {
 
                     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -654,6 +773,10 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
                 continue;
             }
 
+            if (ctx->cache && ngx_http_ssi_cache_node(r, ctx, rc) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
 
             b = NULL;
 
@@ -929,6 +1052,10 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             }
         }
 
+        if (ctx->cache && (ctx->buf->last_buf || ctx->buf->last_in_chain)) {
+            ngx_http_ssi_cache_store(r, ctx);
+        }
+
         ctx->buf = NULL;
 
         ctx->saved = ctx->looked;
@@ -1583,6 +1710,566 @@ ngx_http_ssi_parse(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
 }
 
 
+static ngx_int_t
+ngx_http_ssi_cache_lookup(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    ngx_http_ssi_cache_t *cache)
+{
+    u_char                    *p;
+    size_t                     len, root;
+    uint32_t                   hash;
+    ngx_str_t                  name, path;
+    ngx_table_elt_t           *etag;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_ssi_document_t   *doc;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    etag = r->headers_out.etag;
+
+    if (r->headers_out.status != NGX_HTTP_OK
+        || r->headers_out.content_length_n <= 0
+        || r->headers_out.content_length_n > (off_t) cache->max_size
+        || r->headers_out.last_modified_time == -1
+        || etag == NULL)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * a document is identified by the location, the virtual host,
+     * the file the URI is mapped to, the URI, and the validators
+     * of the response; the host and the file distinguish sites
+     * with a common location or with "root" set by variables
+     */
+
+    p = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    path.len = p - path.data;
+
+    len = 2 * NGX_PTR_SIZE + 1 + r->headers_in.server.len + 1 + path.len + 1
+          + r->uri.len + 1 + etag->value.len + 1
+          + NGX_TIME_T_LEN + 1 + NGX_OFF_T_LEN;
+
+    name.data = ngx_pnalloc(r->pool, len);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(name.data, "%p %V %V %V %V %T %O", r->loc_conf,
+                    &r->headers_in.server, &path, &r->uri, &etag->value,
+                    r->headers_out.last_modified_time,
+                    r->headers_out.content_length_n);
+
+    name.len = p - name.data;
+
+    cctx = ngx_pcalloc(r->pool, sizeof(ngx_http_ssi_cache_ctx_t));
+    if (cctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    cctx->cache = cache;
+    cctx->name = name;
+
+    ctx->cache = cctx;
+
+    hash = ngx_crc32_long(name.data, name.len);
+
+    doc = (ngx_http_ssi_document_t *)
+              ngx_str_rbtree_lookup(&cache->rbtree, &name, hash);
+
+    if (doc) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http ssi cache hit: \"%V\"", &name);
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_ssi_cache_release;
+        cln->data = doc;
+
+        ngx_queue_remove(&doc->queue);
+        ngx_queue_insert_head(&cache->expire_queue, &doc->queue);
+
+        doc->accessed = ngx_time();
+        doc->count++;
+
+        cctx->document = doc;
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http ssi cache miss: \"%V\"", &name);
+
+    /* the document will be recorded while being parsed */
+
+    if (ngx_array_init(&cctx->nodes, r->pool, 16, sizeof(ngx_http_ssi_node_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    cctx->text = ngx_create_temp_buf(r->pool,
+                                     (size_t) r->headers_out.content_length_n);
+    if (cctx->text == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ssi_cache_release(void *data)
+{
+    ngx_http_ssi_document_t  *doc = data;
+
+    if (--doc->count == 0 && doc->close) {
+        ngx_free(doc);
+    }
+}
+
+
+static ngx_buf_t *
+ngx_http_ssi_cache_buf(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    ngx_buf_t *in)
+{
+    ngx_buf_t                 *b;
+    ngx_http_ssi_document_t   *doc;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    cctx = ctx->cache;
+    doc = cctx->document;
+
+    /*
+     * the response body is replaced with the cached document:
+     * the first buffer carries the whole document, and other
+     * buffers are consumed as is, passing only their flags
+     */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->memory = 1;
+    b->flush = in->flush;
+    b->last_buf = in->last_buf;
+    b->last_in_chain = in->last_in_chain;
+    b->recycled = in->recycled;
+
+    if (!cctx->started) {
+        cctx->started = 1;
+
+        /* the extra byte allows to reach commands after the last text */
+
+        b->pos = doc->text.data;
+        b->last = doc->text.data + doc->text.len + 1;
+    }
+
+    in->pos = in->last;
+
+    if (in->in_file) {
+        in->file_pos = in->file_last;
+    }
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_cache_parse(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_uint_t                 i;
+    ngx_table_elt_t           *param;
+    ngx_http_ssi_node_t       *node;
+    ngx_http_ssi_document_t   *doc;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    cctx = ctx->cache;
+    doc = cctx->document;
+
+    if (cctx->node == doc->nnodes) {
+        ctx->pos = ctx->buf->last;
+        return NGX_AGAIN;
+    }
+
+    node = &doc->nodes[cctx->node++];
+
+    switch (node->type) {
+
+    case NGX_HTTP_SSI_NODE_TEXT:
+        ctx->copy_start = node->data.data;
+        ctx->copy_end = node->data.data + node->data.len;
+        ctx->pos = ctx->copy_end;
+
+        return NGX_AGAIN;
+
+    case NGX_HTTP_SSI_NODE_COMMAND:
+
+        /* commands may change parameters in place, hence the copies */
+
+        ctx->key = node->key;
+        ctx->command.len = node->data.len;
+        ctx->command.data = ngx_pstrdup(r->pool, &node->data);
+        if (ctx->command.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->params.nelts = 0;
+
+        for (i = 0; i < node->nparams; i++) {
+            param = ngx_array_push(&ctx->params);
+            if (param == NULL) {
+                return NGX_ERROR;
+            }
+
+            param->key.len = node->params[i].key.len;
+            param->key.data = ngx_pstrdup(r->pool, &node->params[i].key);
+            if (param->key.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            param->value.len = node->params[i].value.len;
+            param->value.data = ngx_pnalloc(r->pool, param->value.len + 1);
+            if (param->value.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(param->value.data, node->params[i].value.data,
+                       param->value.len);
+        }
+
+        return NGX_OK;
+
+    default: /* NGX_HTTP_SSI_NODE_ERROR */
+        return NGX_HTTP_SSI_ERROR;
+    }
+}
+
+
+static void
+ngx_http_ssi_cache_text(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    size_t                     len;
+    ngx_buf_t                 *b;
+    ngx_http_ssi_node_t       *node;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    cctx = ctx->cache;
+    b = cctx->text;
+
+    if (b == NULL) {
+        return;
+    }
+
+    len = ctx->saved + (ctx->copy_end - ctx->copy_start);
+
+    if (!ngx_buf_in_memory(ctx->buf) || (size_t) (b->end - b->last) < len) {
+        cctx->text = NULL;
+        return;
+    }
+
+    node = cctx->nodes.nelts
+           ? (ngx_http_ssi_node_t *) cctx->nodes.elts + cctx->nodes.nelts - 1
+           : NULL;
+
+    if (node == NULL || node->type != NGX_HTTP_SSI_NODE_TEXT) {
+        node = ngx_array_push(&cctx->nodes);
+        if (node == NULL) {
+            cctx->text = NULL;
+            return;
+        }
+
+        ngx_memzero(node, sizeof(ngx_http_ssi_node_t));
+
+        node->type = NGX_HTTP_SSI_NODE_TEXT;
+        node->data.data = b->last;
+    }
+
+    b->last = ngx_cpymem(b->last, ngx_http_ssi_string, ctx->saved);
+    b->last = ngx_cpymem(b->last, ctx->copy_start,
+                         ctx->copy_end - ctx->copy_start);
+
+    node->data.len += len;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_cache_node(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_uint_t                 i;
+    ngx_table_elt_t           *param;
+    ngx_http_ssi_node_t       *node;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    cctx = ctx->cache;
+
+    if (cctx->text == NULL) {
+        return NGX_OK;
+    }
+
+    node = ngx_array_push(&cctx->nodes);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(node, sizeof(ngx_http_ssi_node_t));
+
+    if (rc != NGX_OK) {
+        node->type = NGX_HTTP_SSI_NODE_ERROR;
+        return NGX_OK;
+    }
+
+    node->type = NGX_HTTP_SSI_NODE_COMMAND;
+    node->key = ctx->key;
+
+    node->data.len = ctx->command.len;
+    node->data.data = ngx_pstrdup(r->pool, &ctx->command);
+    if (node->data.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    cctx->size += node->data.len;
+
+    if (ctx->params.nelts == 0) {
+        return NGX_OK;
+    }
+
+    node->params = ngx_palloc(r->pool,
+                              ctx->params.nelts * sizeof(ngx_table_elt_t));
+    if (node->params == NULL) {
+        return NGX_ERROR;
+    }
+
+    param = ctx->params.elts;
+
+    for (i = 0; i < ctx->params.nelts; i++) {
+        node->params[i].key.len = param[i].key.len;
+        node->params[i].key.data = ngx_pstrdup(r->pool, &param[i].key);
+        if (node->params[i].key.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        node->params[i].value.len = param[i].value.len;
+        node->params[i].value.data = ngx_pstrdup(r->pool, &param[i].value);
+        if (node->params[i].value.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        cctx->size += sizeof(ngx_table_elt_t)
+                      + param[i].key.len + param[i].value.len;
+    }
+
+    node->nparams = ctx->params.nelts;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ssi_cache_store(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    u_char                    *p;
+    size_t                     size;
+    uint32_t                   hash;
+    ngx_uint_t                 i, j;
+    ngx_table_elt_t           *params;
+    ngx_http_ssi_node_t       *node, *nodes;
+    ngx_http_ssi_cache_t      *cache;
+    ngx_http_ssi_document_t   *doc;
+    ngx_http_ssi_cache_ctx_t  *cctx;
+
+    cctx = ctx->cache;
+
+    if (cctx->text == NULL
+        || ctx->state != ssi_start_state
+        || ctx->looked)
+    {
+        return;
+    }
+
+    cache = cctx->cache;
+
+    hash = ngx_crc32_long(cctx->name.data, cctx->name.len);
+
+    if (ngx_str_rbtree_lookup(&cache->rbtree, &cctx->name, hash)) {
+        /* the document was cached by another request */
+        cctx->text = NULL;
+        return;
+    }
+
+    node = cctx->nodes.elts;
+
+    size = sizeof(ngx_http_ssi_document_t)
+           + cctx->nodes.nelts * sizeof(ngx_http_ssi_node_t)
+           + cctx->name.len + cctx->size
+           + (cctx->text->last - cctx->text->pos) + 1;
+
+    doc = ngx_alloc(size, r->connection->log);
+    if (doc == NULL) {
+        cctx->text = NULL;
+        return;
+    }
+
+    nodes = (ngx_http_ssi_node_t *) &doc[1];
+    params = (ngx_table_elt_t *) &nodes[cctx->nodes.nelts];
+
+    for (i = 0; i < cctx->nodes.nelts; i++) {
+        params += node[i].nparams;
+    }
+
+    p = (u_char *) params;
+
+    doc->sn.node.key = hash;
+    doc->sn.str.len = cctx->name.len;
+    doc->sn.str.data = p;
+    p = ngx_cpymem(p, cctx->name.data, cctx->name.len);
+
+    doc->text.len = cctx->text->last - cctx->text->pos;
+    doc->text.data = p;
+    p = ngx_cpymem(p, cctx->text->pos, doc->text.len);
+    *p++ = '\0';
+
+    params = (ngx_table_elt_t *) &nodes[cctx->nodes.nelts];
+
+    for (i = 0; i < cctx->nodes.nelts; i++) {
+        nodes[i] = node[i];
+
+        if (node[i].type == NGX_HTTP_SSI_NODE_TEXT) {
+            nodes[i].data.data = doc->text.data
+                                 + (node[i].data.data - cctx->text->pos);
+            continue;
+        }
+
+        nodes[i].data.data = p;
+        p = ngx_cpymem(p, node[i].data.data, node[i].data.len);
+
+        nodes[i].params = params;
+
+        for (j = 0; j < node[i].nparams; j++) {
+            params[j].key.len = node[i].params[j].key.len;
+            params[j].key.data = p;
+            p = ngx_cpymem(p, node[i].params[j].key.data,
+                           node[i].params[j].key.len);
+
+            params[j].value.len = node[i].params[j].value.len;
+            params[j].value.data = p;
+            p = ngx_cpymem(p, node[i].params[j].value.data,
+                           node[i].params[j].value.len);
+        }
+
+        params += node[i].nparams;
+    }
+
+    doc->accessed = ngx_time();
+    doc->count = 0;
+    doc->nnodes = cctx->nodes.nelts;
+    doc->nodes = nodes;
+    doc->close = 0;
+
+    /* inactive documents are only deleted when a document is added */
+
+    ngx_http_ssi_cache_expire(cache, cache->current >= cache->max ? 0 : 1,
+                              r->connection->log);
+
+    ngx_rbtree_insert(&cache->rbtree, &doc->sn.node);
+    ngx_queue_insert_head(&cache->expire_queue, &doc->queue);
+
+    cache->current++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http ssi cache store: \"%V\", %ui nodes",
+                   &doc->sn.str, doc->nnodes);
+
+    cctx->text = NULL;
+}
+
+
+static void
+ngx_http_ssi_cache_expire(ngx_http_ssi_cache_t *cache, ngx_uint_t n,
+    ngx_log_t *log)
+{
+    time_t                    now;
+    ngx_queue_t              *q;
+    ngx_http_ssi_document_t  *doc;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two inactive documents
+     * n == 0 deletes least recently used document by force
+     *        and one or two inactive documents
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+
+        doc = ngx_queue_data(q, ngx_http_ssi_document_t, queue);
+
+        if (n++ != 0 && now - doc->accessed <= cache->inactive) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&cache->rbtree, &doc->sn.node);
+
+        cache->current--;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http ssi cache expire: \"%V\"", &doc->sn.str);
+
+        if (doc->count) {
+            doc->close = 1;
+
+        } else {
+            ngx_free(doc);
+        }
+    }
+}
+
+
+static void
+ngx_http_ssi_cache_cleanup(void *data)
+{
+    ngx_http_ssi_cache_t  *cache = data;
+
+    ngx_queue_t              *q;
+    ngx_http_ssi_document_t  *doc;
+
+    while (!ngx_queue_empty(&cache->expire_queue)) {
+
+        q = ngx_queue_last(&cache->expire_queue);
+
+        doc = ngx_queue_data(q, ngx_http_ssi_document_t, queue);
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&cache->rbtree, &doc->sn.node);
+
+        if (doc->count) {
+            doc->close = 1;
+
+        } else {
+            ngx_free(doc);
+        }
+    }
+
+    cache->current = 0;
+}
+
+
 static ngx_str_t *
 ngx_http_ssi_get_variable(ngx_http_request_t *r, ngx_str_t *name,
     ngx_uint_t key)
@@ -2808,6 +3495,126 @@ ngx_http_ssi_date_gmt_local_variable(ngx_http_request_t *r,
 }
 
 
+static char *
+ngx_http_ssi_cache_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ssi_loc_conf_t *slcf = conf;
+
+    time_t                 inactive;
+    size_t                 max_size;
+    ngx_str_t             *value, s;
+    ngx_int_t              max;
+    ngx_uint_t             i;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_ssi_cache_t  *cache;
+
+    if (slcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 60;
+    max_size = 1024 * 1024;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            max_size = ngx_parse_size(&s);
+            if (max_size == (size_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+
+            slcf->cache = NULL;
+
+            continue;
+        }
+
+    failed:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"ssi_cache\" parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (slcf->cache == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssi_cache\" must have the \"max\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * the documents are kept while the configuration cycle exists,
+     * and ones still used by requests are freed once released
+     */
+
+    cache = ngx_palloc(cf->cycle->pool, sizeof(ngx_http_ssi_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    cache->current = 0;
+    cache->max = max;
+    cache->inactive = inactive;
+    cache->max_size = max_size;
+
+    cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_ssi_cache_cleanup;
+    cln->data = cache;
+
+    slcf->cache = cache;
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_http_ssi_preconfiguration(ngx_conf_t *cf)
 {
@@ -2920,6 +3727,8 @@ ngx_http_ssi_create_loc_conf(ngx_conf_t *cf)
     slcf->min_file_chunk = NGX_CONF_UNSET_SIZE;
     slcf->value_len = NGX_CONF_UNSET_SIZE;
 
+    slcf->cache = NGX_CONF_UNSET_PTR;
+
     return slcf;
 }
 
@@ -2939,6 +3748,8 @@ ngx_http_ssi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->min_file_chunk, prev->min_file_chunk, 1024);
     ngx_conf_merge_size_value(conf->value_len, prev->value_len, 255);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -80,6 +80,7 @@ typedef struct {
 
     ngx_http_request_t       *wait;
     void                     *value_buf;
+    void                     *cache;
     ngx_str_t                 timefmt;
     ngx_str_t                 errmsg;
 } ngx_http_ssi_ctx_t;
@@ -22,12 +22,32 @@ typedef struct {
 } ngx_http_sub_match_t;
 
 
+/*
+ * Search patterns are compiled into an Aho-Corasick automaton: a trie
+ * of the lowercased patterns with failure links, in which node 0 is
+ * the root.  Children of a node are kept in a sibling list, except for
+ * the root children which are looked up directly in tables->root.
+ */
+
+typedef struct {
+    uint32_t                   next;    /* the first child */
+    uint32_t                   sibling;
+    uint32_t                   fail;
+    uint32_t                   output;  /* the nearest terminal node */
+    uint32_t                   match;   /* pattern index + 1, or 0 */
+    uint32_t                   prio;    /* minimal pattern index below */
+    uint32_t                   depth;
+    u_char                     ch;
+} ngx_http_sub_node_t;
+
+
 typedef struct {
-    ngx_uint_t                 min_match_len;
     ngx_uint_t                 max_match_len;
 
-    u_char                     index[257];
-    u_char                     shift[256];
+    ngx_http_sub_node_t       *nodes;
+
+    uint32_t                   root[256];
+    u_char                     first[256];
 } ngx_http_sub_tables_t;
 
 
@@ -71,30 +91,29 @@ typedef struct {
 
     ngx_int_t                  offset;
     ngx_uint_t                 index;
+    ngx_int_t                  start;
+    ngx_uint_t                 state;
+    ngx_uint_t                 matched;  /* unsigned  matched:1 */
 
     ngx_http_sub_tables_t     *tables;
     ngx_array_t               *matches;
 } ngx_http_sub_ctx_t;
 
 
-static ngx_uint_t ngx_http_sub_cmp_index;
-
-
 static ngx_int_t ngx_http_sub_output(ngx_http_request_t *r,
     ngx_http_sub_ctx_t *ctx);
 static ngx_int_t ngx_http_sub_parse(ngx_http_request_t *r,
-    ngx_http_sub_ctx_t *ctx, ngx_uint_t flush);
-static ngx_int_t ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start,
-    ngx_str_t *m);
+    ngx_http_sub_ctx_t *ctx);
 
 static char * ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static void *ngx_http_sub_create_conf(ngx_conf_t *cf);
 static char *ngx_http_sub_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
-static void ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
-    ngx_http_sub_match_t *match, ngx_uint_t n);
-static ngx_int_t ngx_http_sub_cmp_matches(const void *one, const void *two);
+static ngx_int_t ngx_http_sub_init_tables(ngx_pool_t *pool,
+    ngx_http_sub_tables_t *tables, ngx_http_sub_match_t *match, ngx_uint_t n);
+static ngx_inline ngx_uint_t ngx_http_sub_next_state(
+    ngx_http_sub_tables_t *tables, ngx_uint_t state, u_char c);
 static ngx_int_t ngx_http_sub_filter_init(ngx_conf_t *cf);
 
 
@@ -244,23 +263,26 @@ ngx_http_sub_header_filter(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        ngx_http_sub_init_tables(ctx->tables, ctx->matches->elts,
-                                 ctx->matches->nelts);
+        if (ngx_http_sub_init_tables(r->pool, ctx->tables, ctx->matches->elts,
+                                     ctx->matches->nelts)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
-    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->saved.data == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->looked.data == NULL) {
         return NGX_ERROR;
     }
 
     ngx_http_set_ctx(r, ctx, ngx_http_sub_filter_module);
 
-    ctx->offset = ctx->tables->min_match_len - 1;
     ctx->last_out = &ctx->out;
 
     r->filter_need_in_memory = 1;
@@ -287,7 +309,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_int_t                  rc;
     ngx_buf_t                 *b;
     ngx_str_t                 *sub;
-    ngx_uint_t                 flush, last;
     ngx_chain_t               *cl;
     ngx_http_sub_ctx_t        *ctx;
     ngx_http_sub_match_t      *match;
@@ -329,9 +350,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http sub filter \"%V\"", &r->uri);
 
-    flush = 0;
-    last = 0;
-
     while (ctx->in || ctx->buf) {
 
         if (ctx->buf == NULL) {
@@ -344,19 +362,11 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ngx_free_chain(r->pool, cl);
         }
 
-        if (ctx->buf->flush || ctx->buf->recycled) {
-            flush = 1;
-        }
-
-        if (ctx->in == NULL) {
-            last = flush;
-        }
-
         b = NULL;
 
         while (ctx->pos < ctx->buf->last) {
 
-            rc = ngx_http_sub_parse(r, ctx, last);
+            rc = ngx_http_sub_parse(r, ctx);
 
             ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "parse: %i, looked: \"%V\" %p-%p",
@@ -608,110 +618,115 @@ ngx_http_sub_output(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 
 
 static ngx_int_t
-ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx,
-    ngx_uint_t flush)
+ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 {
-    u_char                   *p, c;
-    ngx_str_t                *m;
+    u_char                   *p, *last, c;
     ngx_int_t                 offset, start, next, end, len, rc;
-    ngx_uint_t                shift, i, j;
+    ngx_uint_t                state, i, o;
+    ngx_http_sub_node_t      *nodes;
     ngx_http_sub_match_t     *match;
     ngx_http_sub_tables_t    *tables;
     ngx_http_sub_loc_conf_t  *slcf;
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
     tables = ctx->tables;
+    nodes = tables->nodes;
     match = ctx->matches->elts;
 
     offset = ctx->offset;
+    state = ctx->state;
     end = ctx->buf->last - ctx->pos;
 
     if (ctx->once) {
         /* sets start and next to end */
-        offset = end + (ngx_int_t) tables->min_match_len - 1;
+        offset = end;
         goto again;
     }
 
     while (offset < end) {
 
-        c = offset < 0 ? ctx->looked.data[ctx->looked.len + offset]
-                       : ctx->pos[offset];
+        if (state == 0 && offset >= 0) {
 
-        c = ngx_tolower(c);
+            /* skip bytes which cannot start a match */
 
-        shift = tables->shift[c];
-        if (shift > 0) {
-            offset += shift;
-            continue;
-        }
+            p = ctx->pos + offset;
+            last = ctx->buf->last;
 
-        /* a potential match */
+            while (p < last && !tables->first[*p]) {
+                p++;
+            }
 
-        start = offset - (ngx_int_t) tables->min_match_len + 1;
+            offset = p - ctx->pos;
 
-        i = ngx_max((ngx_uint_t) tables->index[c], ctx->index);
-        j = tables->index[c + 1];
+            if (offset == end) {
+                break;
+            }
+        }
 
-        while (i != j) {
+        c = offset < 0 ? ctx->looked.data[ctx->looked.len + offset]
+                       : ctx->pos[offset];
 
-            if (slcf->once && ctx->sub && ctx->sub[i].data) {
-                goto next;
-            }
+        state = ngx_http_sub_next_state(tables, state, ngx_tolower(c));
+        offset++;
 
-            m = &match[i].match;
+        /*
+         * among the patterns found, the leftmost one wins;
+         * at the same position the one configured first wins
+         */
 
-            rc = ngx_http_sub_match(ctx, start, m);
+        for (o = nodes[state].output; o; o = nodes[nodes[o].fail].output) {
+            i = nodes[o].match - 1;
 
-            if (rc == NGX_DECLINED) {
-                goto next;
+            if (slcf->once && ctx->sub && ctx->sub[i].data) {
+                continue;
             }
 
-            ctx->index = i;
+            start = offset - (ngx_int_t) nodes[o].depth;
 
-            if (rc == NGX_AGAIN) {
-                goto again;
+            if (!ctx->matched
+                || start < ctx->start
+                || (start == ctx->start && i < ctx->index))
+            {
+                ctx->matched = 1;
+                ctx->index = i;
+                ctx->start = start;
             }
+        }
 
-            ctx->offset = offset + (ngx_int_t) m->len;
-            next = start + (ngx_int_t) m->len;
-            end = ngx_max(next, 0);
-            rc = NGX_OK;
+        if (!ctx->matched) {
+            continue;
+        }
 
-            goto done;
+        /* wait while a better match is still possible */
 
-        next:
+        start = offset - (ngx_int_t) nodes[state].depth;
 
-            i++;
+        if (start < ctx->start
+            || (start == ctx->start && nodes[state].prio < ctx->index))
+        {
+            continue;
         }
 
-        offset++;
-        ctx->index = 0;
-    }
-
-    if (flush) {
-        for ( ;; ) {
-            start = offset - (ngx_int_t) tables->min_match_len + 1;
+        start = ctx->start;
+        next = start + (ngx_int_t) match[ctx->index].match.len;
 
-            if (start >= end) {
-                break;
-            }
-
-            for (i = 0; i < ctx->matches->nelts; i++) {
-                m = &match[i].match;
+        ctx->offset = next;
+        ctx->state = 0;
+        ctx->matched = 0;
 
-                if (ngx_http_sub_match(ctx, start, m) == NGX_AGAIN) {
-                    goto again;
-                }
-            }
+        end = ngx_max(next, 0);
+        rc = NGX_OK;
 
-            offset++;
-        }
+        goto done;
     }
 
 again:
 
+    /* keep the longest prefix of a pattern seen */
+
     ctx->offset = offset;
-    start = offset - (ngx_int_t) tables->min_match_len + 1;
+    ctx->state = state;
+    start = offset - (ngx_int_t) nodes[state].depth;
     next = start;
     rc = NGX_AGAIN;
 
@@ -739,53 +754,33 @@ done:
 
     ctx->pos += end;
     ctx->offset -= end;
+    ctx->start -= end;
 
     return rc;
 }
 
 
-static ngx_int_t
-ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start, ngx_str_t *m)
+static ngx_inline ngx_uint_t
+ngx_http_sub_next_state(ngx_http_sub_tables_t *tables, ngx_uint_t state,
+    u_char c)
 {
-    u_char  *p, *last, *pat, *pat_end;
+    ngx_uint_t            n;
+    ngx_http_sub_node_t  *nodes;
 
-    pat = m->data;
-    pat_end = m->data + m->len;
+    nodes = tables->nodes;
 
-    if (start >= 0) {
-        p = ctx->pos + start;
-
-    } else {
-        last = ctx->looked.data + ctx->looked.len;
-        p = last + start;
+    while (state) {
 
-        while (p < last && pat < pat_end) {
-            if (ngx_tolower(*p) != *pat) {
-                return NGX_DECLINED;
+        for (n = nodes[state].next; n; n = nodes[n].sibling) {
+            if (nodes[n].ch == c) {
+                return n;
             }
-
-            p++;
-            pat++;
         }
 
-        p = ctx->pos;
+        state = nodes[state].fail;
     }
 
-    while (p < ctx->buf->last && pat < pat_end) {
-        if (ngx_tolower(*p) != *pat) {
-            return NGX_DECLINED;
-        }
-
-        p++;
-        pat++;
-    }
-
-    if (pat != pat_end) {
-        /* partial match */
-        return NGX_AGAIN;
-    }
-
-    return NGX_OK;
+    return tables->root[c];
 }
 
 
@@ -813,12 +808,6 @@ ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    if (slcf->pairs->nelts == 255) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "number of search patterns exceeds 255");
-        return NGX_CONF_ERROR;
-    }
-
     ngx_strlow(value[1].data, value[1].data, value[1].len);
 
     pair = ngx_array_push(slcf->pairs);
@@ -940,72 +929,126 @@ ngx_http_sub_merge_conf(ngx_conf_t *cf, void *parent, void *child)
             return NGX_CONF_ERROR;
         }
 
-        ngx_http_sub_init_tables(conf->tables, conf->matches->elts,
-                                 conf->matches->nelts);
+        if (ngx_http_sub_init_tables(cf->pool, conf->tables,
+                                     conf->matches->elts, conf->matches->nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
     }
 
     return NGX_CONF_OK;
 }
 
 
-static void
-ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
+static ngx_int_t
+ngx_http_sub_init_tables(ngx_pool_t *pool, ngx_http_sub_tables_t *tables,
     ngx_http_sub_match_t *match, ngx_uint_t n)
 {
-    u_char      c;
-    ngx_uint_t  i, j, min, max, ch;
+    u_char               *p, *last;
+    uint32_t             *queue;
+    ngx_uint_t            i, c, s, t, size, head, tail;
+    ngx_http_sub_node_t  *nodes;
 
-    min = match[0].match.len;
-    max = match[0].match.len;
+    size = 1;
+    tables->max_match_len = 0;
 
-    for (i = 1; i < n; i++) {
-        min = ngx_min(min, match[i].match.len);
-        max = ngx_max(max, match[i].match.len);
+    for (i = 0; i < n; i++) {
+        size += match[i].match.len;
+        tables->max_match_len = ngx_max(tables->max_match_len,
+                                        match[i].match.len);
     }
 
-    tables->min_match_len = min;
-    tables->max_match_len = max;
+    nodes = ngx_pcalloc(pool, sizeof(ngx_http_sub_node_t) * size);
+    if (nodes == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_http_sub_cmp_index = tables->min_match_len - 1;
-    ngx_sort(match, n, sizeof(ngx_http_sub_match_t), ngx_http_sub_cmp_matches);
+    queue = ngx_palloc(pool, sizeof(uint32_t) * size);
+    if (queue == NULL) {
+        return NGX_ERROR;
+    }
 
-    min = ngx_min(min, 255);
-    ngx_memset(tables->shift, min, 256);
+    tables->nodes = nodes;
+    ngx_memzero(tables->root, sizeof(tables->root));
 
-    ch = 0;
+    /* the trie of patterns */
+
+    size = 1;
 
     for (i = 0; i < n; i++) {
 
-        for (j = 0; j < min; j++) {
-            c = match[i].match.data[tables->min_match_len - 1 - j];
-            tables->shift[c] = ngx_min(tables->shift[c], (u_char) j);
+        s = 0;
+        p = match[i].match.data;
+        last = p + match[i].match.len;
+
+        while (p < last) {
+
+            if (s == 0) {
+                t = tables->root[*p];
+
+            } else {
+                for (t = nodes[s].next; t; t = nodes[t].sibling) {
+                    if (nodes[t].ch == *p) {
+                        break;
+                    }
+                }
+            }
+
+            if (t == 0) {
+                t = size++;
+
+                nodes[t].ch = *p;
+                nodes[t].depth = nodes[s].depth + 1;
+                nodes[t].prio = i;
+                nodes[t].sibling = nodes[s].next;
+                nodes[s].next = t;
+
+                if (s == 0) {
+                    tables->root[*p] = t;
+                }
+            }
+
+            s = t;
+            p++;
         }
 
-        c = match[i].match.data[tables->min_match_len - 1];
-        while (ch <= (ngx_uint_t) c) {
-            tables->index[ch++] = (u_char) i;
+        if (nodes[s].match == 0) {
+            nodes[s].match = i + 1;
         }
     }
 
-    while (ch < 257) {
-        tables->index[ch++] = (u_char) n;
+    /* failure and output links, breadth-first */
+
+    head = 0;
+    tail = 0;
+
+    for (t = nodes[0].next; t; t = nodes[t].sibling) {
+        nodes[t].output = nodes[t].match ? t : 0;
+        queue[tail++] = t;
     }
-}
 
+    while (head < tail) {
+        s = queue[head++];
 
-static ngx_int_t
-ngx_http_sub_cmp_matches(const void *one, const void *two)
-{
-    ngx_int_t              c1, c2;
-    ngx_http_sub_match_t  *first, *second;
+        for (t = nodes[s].next; t; t = nodes[t].sibling) {
+            nodes[t].fail = ngx_http_sub_next_state(tables, nodes[s].fail,
+                                                    nodes[t].ch);
+            nodes[t].output = nodes[t].match ? t
+                                             : nodes[nodes[t].fail].output;
+            queue[tail++] = t;
+        }
+    }
 
-    first = (ngx_http_sub_match_t *) one;
-    second = (ngx_http_sub_match_t *) two;
+    ngx_pfree(pool, queue);
 
-    c1 = first->match.data[ngx_http_sub_cmp_index];
-    c2 = second->match.data[ngx_http_sub_cmp_index];
+    /* bytes which may start a match, in either case */
 
-    return c1 - c2;
+    for (c = 0; c < 256; c++) {
+        tables->first[c] = (tables->root[ngx_tolower(c)] != 0);
+    }
+
+    return NGX_OK;
 }
 
 
@@ -52,6 +52,9 @@ typedef u_char *(*ngx_http_log_handler_pt)(ngx_http_request_t *r,
 #if (NGX_HTTP_SSL)
 #include <ngx_http_ssl_module.h>
 #endif
+#if (NGX_HTTP_METRICS)
+#include <ngx_http_metrics_module.h>
+#endif
 
 
 struct ngx_http_log_ctx_s {
@@ -127,6 +130,9 @@ void ngx_http_process_request(ngx_http_request_t *r);
 void ngx_http_update_location_config(ngx_http_request_t *r);
 void ngx_http_handler(ngx_http_request_t *r);
 void ngx_http_run_posted_requests(ngx_connection_t *c);
+void ngx_http_cpu_time_start(ngx_http_request_t *r);
+void ngx_http_cpu_time_stop(void);
+uint64_t ngx_http_cpu_time(ngx_http_request_t *r);
 ngx_int_t ngx_http_post_request(ngx_http_request_t *r,
     ngx_http_posted_request_t *pr);
 ngx_int_t ngx_http_set_virtual_server(ngx_http_request_t *r,
@@ -27,7 +27,9 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       6
+
+#define NGX_HTTP_CACHE_ENCODING_GZIP 1
 
 
 typedef struct {
@@ -51,7 +53,8 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         renaming:1;
+                                     /* 9 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -91,6 +94,10 @@ struct ngx_http_cache_s {
     ngx_uint_t                       valid_msec;
     ngx_uint_t                       vary_tag;
 
+    ngx_uint_t                       encoding;
+    ngx_uint_t                       compress;
+    ngx_int_t                        compress_level;
+
     ngx_buf_t                       *buf;
 
     ngx_http_file_cache_t           *file_cache;
@@ -136,6 +143,7 @@ typedef struct {
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_char                           encoding;
     u_char                           etag_len;
     u_char                           etag[NGX_HTTP_CACHE_ETAG_LEN];
     u_char                           vary_len;
@@ -75,7 +75,7 @@ static char *ngx_http_core_internal(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #if (NGX_HTTP_GZIP)
-static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
+static ngx_uint_t ngx_http_accept_encoding(ngx_str_t *ae, ngx_str_t *encoding);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
 static char *ngx_http_gzip_disable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -173,6 +173,7 @@ static ngx_conf_bitmask_t  ngx_http_gzip_proxied_mask[] = {
 };
 
 
+static ngx_str_t  ngx_http_gzip_encoding = ngx_string("gzip");
 static ngx_str_t  ngx_http_gzip_no_cache = ngx_string("no-cache");
 static ngx_str_t  ngx_http_gzip_no_store = ngx_string("no-store");
 static ngx_str_t  ngx_http_gzip_private = ngx_string("private");
@@ -196,6 +197,20 @@ static ngx_command_t  ngx_http_core_commands[] = {
       offsetof(ngx_http_core_main_conf_t, variables_hash_bucket_size),
       NULL },
 
+    { ngx_string("request_timing"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_core_main_conf_t, request_timing),
+      NULL },
+
+    { ngx_string("request_accounting"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_core_main_conf_t, request_accounting),
+      NULL },
+
     { ngx_string("server_names_hash_max_size"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -879,6 +894,9 @@ ngx_http_core_run_phases(ngx_http_request_t *r)
 
     while (ph[r->phase_handler].checker) {
 
+        ngx_probe3(http_request_phase, r, r->phase_handler,
+                   (void *) ph[r->phase_handler].handler);
+
         rc = ph[r->phase_handler].checker(r, &ph[r->phase_handler]);
 
         if (rc == NGX_OK) {
@@ -966,6 +984,8 @@ ngx_http_core_find_config_phase(ngx_http_request_t *r,
 
     rc = ngx_http_core_find_location(r);
 
+    ngx_http_set_timing(r, NGX_HTTP_TIMING_LOCATION);
+
     if (rc == NGX_ERROR) {
         ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
         return NGX_OK;
@@ -1103,6 +1123,8 @@ ngx_http_core_access_phase(ngx_http_request_t *r, ngx_http_phase_handler_t *ph)
         return NGX_AGAIN;
     }
 
+    ngx_http_set_timing(r, NGX_HTTP_TIMING_ACCESS);
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "access phase: %ui", r->phase_handler);
 
@@ -1263,6 +1285,8 @@ ngx_http_core_content_phase(ngx_http_request_t *r,
     ngx_int_t  rc;
     ngx_str_t  path;
 
+    ngx_http_set_timing(r, NGX_HTTP_TIMING_CONTENT);
+
     if (r->content_handler) {
         r->write_event_handler = ngx_http_request_empty_handler;
         ngx_http_finalize_request(r, r->content_handler(r));
@@ -2029,14 +2053,27 @@ ngx_http_auth_basic_user(ngx_http_request_t *r)
 
 ngx_int_t
 ngx_http_gzip_ok(ngx_http_request_t *r)
+{
+    r->gzip_tested = 1;
+
+    if (ngx_http_encoding_ok(r, &ngx_http_gzip_encoding) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_ok = 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_encoding_ok(ngx_http_request_t *r, ngx_str_t *encoding)
 {
     time_t                     date, expires;
     ngx_uint_t                 p;
     ngx_table_elt_t           *e, *d, *ae, *cc;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r->gzip_tested = 1;
-
     if (r != r->main) {
         return NGX_DECLINED;
     }
@@ -2046,7 +2083,7 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    if (ae->value.len < sizeof("gzip") - 1) {
+    if (ae->value.len < encoding->len) {
         return NGX_DECLINED;
     }
 
@@ -2059,8 +2096,10 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
      *   Opera:   "gzip, deflate"
      */
 
-    if (ngx_memcmp(ae->value.data, "gzip,", 5) != 0
-        && ngx_http_gzip_accept_encoding(&ae->value) != NGX_OK)
+    if ((ae->value.len == encoding->len
+         || ae->value.data[encoding->len] != ','
+         || ngx_strncmp(ae->value.data, encoding->data, encoding->len) != 0)
+        && ngx_http_accept_encoding(&ae->value, encoding) == 0)
     {
         return NGX_DECLINED;
     }
@@ -2181,21 +2220,137 @@ ok:
 
 #endif
 
-    r->gzip_ok = 1;
+    return NGX_OK;
+}
+
+
+ngx_uint_t
+ngx_http_encoding_quantity(ngx_http_request_t *r, ngx_str_t *encoding)
+{
+    ngx_table_elt_t  *ae;
+
+    ae = r->headers_in.accept_encoding;
+    if (ae == NULL) {
+        return 0;
+    }
+
+    return ngx_http_accept_encoding(&ae->value, encoding);
+}
+
+
+/*
+ * the compression filters are called in a fixed order, and the first one
+ * able to compress a response does it; a filter passes the response on if
+ * the client prefers with a higher quantity an encoding of another filter
+ * which is able to compress the response, for the same quantities the
+ * order of the filters is used
+ */
+
+ngx_int_t
+ngx_http_encoding_preferred(ngx_http_request_t *r, ngx_str_t *encoding)
+{
+    ngx_uint_t                 *q, i, n, self;
+    ngx_http_encoding_t        *enc;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    if (cmcf->encodings == NULL || cmcf->encodings->nelts < 2) {
+        return NGX_OK;
+    }
+
+    enc = cmcf->encodings->elts;
+    n = cmcf->encodings->nelts;
+
+    for (self = 0; self < n; self++) {
+        if (enc[self].name.len == encoding->len
+            && ngx_strncmp(enc[self].name.data, encoding->data,
+                           encoding->len)
+               == 0)
+        {
+            break;
+        }
+    }
+
+    if (self == n) {
+        return NGX_OK;
+    }
+
+    /* the quantities are parsed once per request */
+
+    q = ngx_http_get_module_ctx(r, ngx_http_core_module);
+
+    if (q == NULL) {
+        q = ngx_palloc(r->pool, n * sizeof(ngx_uint_t));
+        if (q == NULL) {
+            return NGX_OK;
+        }
+
+        for (i = 0; i < n; i++) {
+            q[i] = ngx_http_encoding_quantity(r, &enc[i].name);
+        }
+
+        ngx_http_set_ctx(r, q, ngx_http_core_module);
+    }
+
+    for (i = 0; i < n; i++) {
+
+        if (i == self || q[i] <= q[self]) {
+            continue;
+        }
+
+        if (enc[i].test(r) == NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http encoding \"%V\" preferred to \"%V\"",
+                           &enc[i].name, encoding);
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_add_encoding(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_encoding_test_pt test)
+{
+    ngx_http_encoding_t        *enc;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    if (cmcf->encodings == NULL) {
+        cmcf->encodings = ngx_array_create(cf->pool, 4,
+                                           sizeof(ngx_http_encoding_t));
+        if (cmcf->encodings == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    enc = ngx_array_push(cmcf->encodings);
+    if (enc == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->name = *name;
+    enc->test = test;
 
     return NGX_OK;
 }
 
 
 /*
- * gzip is enabled for the following quantities:
+ * an encoding is enabled for the following quantities:
  *     "gzip; q=0.001" ... "gzip; q=1.000"
- * gzip is disabled for the following quantities:
+ * an encoding is disabled for the following quantities:
  *     "gzip; q=0" ... "gzip; q=0.000", and for any invalid cases
+ *
+ * the quantity is returned in thousandths, 0 if the encoding is disabled
  */
 
-static ngx_int_t
-ngx_http_gzip_accept_encoding(ngx_str_t *ae)
+static ngx_uint_t
+ngx_http_accept_encoding(ngx_str_t *ae, ngx_str_t *encoding)
 {
     u_char  *p, *start, *last;
 
@@ -2203,34 +2358,34 @@ ngx_http_gzip_accept_encoding(ngx_str_t *ae)
     last = start + ae->len;
 
     for ( ;; ) {
-        p = ngx_strcasestrn(start, "gzip", 4 - 1);
+        p = ngx_strcasestrn(start, (char *) encoding->data, encoding->len - 1);
         if (p == NULL) {
-            return NGX_DECLINED;
+            return 0;
         }
 
         if (p == start || (*(p - 1) == ',' || *(p - 1) == ' ')) {
             break;
         }
 
-        start = p + 4;
+        start = p + encoding->len;
     }
 
-    p += 4;
+    p += encoding->len;
 
     while (p < last) {
         switch (*p++) {
         case ',':
-            return NGX_OK;
+            return 1000;
         case ';':
             goto quantity;
         case ' ':
             continue;
         default:
-            return NGX_DECLINED;
+            return 0;
         }
     }
 
-    return NGX_OK;
+    return 1000;
 
 quantity:
 
@@ -2242,23 +2397,19 @@ quantity:
         case ' ':
             continue;
         default:
-            return NGX_DECLINED;
+            return 0;
         }
     }
 
-    return NGX_OK;
+    return 1000;
 
 equal:
 
     if (p + 2 > last || *p++ != '=') {
-        return NGX_DECLINED;
-    }
-
-    if (ngx_http_gzip_quantity(p, last) == 0) {
-        return NGX_DECLINED;
+        return 0;
     }
 
-    return NGX_OK;
+    return ngx_http_gzip_quantity(p, last);
 }
 
 
@@ -2266,7 +2417,7 @@ static ngx_uint_t
 ngx_http_gzip_quantity(u_char *p, u_char *last)
 {
     u_char      c;
-    ngx_uint_t  n, q;
+    ngx_uint_t  n, m, q;
 
     c = *p++;
 
@@ -2274,7 +2425,7 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
         return 0;
     }
 
-    q = (c - '0') * 100;
+    q = (c - '0') * 1000;
 
     if (p == last) {
         return q;
@@ -2291,6 +2442,7 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
     }
 
     n = 0;
+    m = 100;
 
     while (p < last) {
         c = *p++;
@@ -2300,7 +2452,8 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
         }
 
         if (c >= '0' && c <= '9') {
-            q += c - '0';
+            q += (c - '0') * m;
+            m /= 10;
             n++;
             continue;
         }
@@ -2308,7 +2461,7 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
         return 0;
     }
 
-    if (q > 100 || n > 3) {
+    if (q > 1000 || n > 3) {
         return 0;
     }
 
@@ -3415,6 +3568,9 @@ ngx_http_core_create_main_conf(ngx_conf_t *cf)
     cmcf->variables_hash_max_size = NGX_CONF_UNSET_UINT;
     cmcf->variables_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
+    cmcf->request_timing = NGX_CONF_UNSET;
+    cmcf->request_accounting = NGX_CONF_UNSET;
+
     return cmcf;
 }
 
@@ -3442,6 +3598,9 @@ ngx_http_core_init_main_conf(ngx_conf_t *cf, void *conf)
         cmcf->ncaptures = (cmcf->ncaptures + 1) * 3;
     }
 
+    ngx_conf_init_value(cmcf->request_timing, 0);
+    ngx_conf_init_value(cmcf->request_accounting, 0);
+
     return NGX_CONF_OK;
 }
 
@@ -10,6 +10,32 @@
 #include <ngx_http.h>
 #include <ngx_md5.h>
 
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+
+#if (NGX_ZLIB && NGX_THREADS)
+
+typedef struct {
+    ngx_http_file_cache_t           *cache;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+
+    ngx_str_t                        name;
+    ngx_file_t                       file;
+    ngx_temp_file_t                  temp;
+
+    off_t                            body_start;
+    off_t                            end;
+    ngx_int_t                        level;
+    off_t                            size;
+
+    ngx_pool_t                      *pool;
+} ngx_http_file_cache_compress_t;
+
+#endif
+
 
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
@@ -24,6 +50,7 @@ static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
 static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #endif
 #if (NGX_THREADS)
+static ngx_thread_pool_t *ngx_http_cache_thread_pool(ngx_http_request_t *r);
 static ngx_int_t ngx_http_cache_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
 static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
@@ -44,6 +71,17 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+#if (NGX_ZLIB && NGX_THREADS)
+static void ngx_http_file_cache_compress_thread(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_temp_file_t *tf, ngx_file_uniq_t uniq);
+static void ngx_http_file_cache_compress_handler(void *data, ngx_log_t *log);
+static void ngx_http_file_cache_compress_event_handler(ngx_event_t *ev);
+static off_t ngx_http_file_cache_deflate(ngx_file_t *src, ngx_file_t *dst,
+    off_t body_start, off_t end, ngx_int_t level);
+static void *ngx_http_file_cache_gzip_alloc(void *opaque, u_int items,
+    u_int size);
+static void ngx_http_file_cache_gzip_free(void *opaque, void *address);
+#endif
 static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
@@ -625,6 +663,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     c->date = h->date;
     c->valid_msec = h->valid_msec;
     c->body_start = h->body_start;
+    c->encoding = h->encoding;
     c->etag.len = h->etag_len;
     c->etag.data = h->etag;
 
@@ -787,16 +826,13 @@ ngx_http_cache_aio_event_handler(ngx_event_t *ev)
 
 #if (NGX_THREADS)
 
-static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+static ngx_thread_pool_t *
+ngx_http_cache_thread_pool(ngx_http_request_t *r)
 {
     ngx_str_t                  name;
     ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r = file->thread_ctx;
-
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     tp = clcf->thread_pool;
 
@@ -804,7 +840,7 @@ ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
         if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
             != NGX_OK)
         {
-            return NGX_ERROR;
+            return NULL;
         }
 
         tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
@@ -812,10 +848,28 @@ ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
         if (tp == NULL) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                           "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
+            return NULL;
         }
     }
 
+    return tp;
+}
+
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_thread_pool_t   *tp;
+    ngx_http_request_t  *r;
+
+    r = file->thread_ctx;
+
+    tp = ngx_http_cache_thread_pool(r);
+
+    if (tp == NULL) {
+        return NGX_ERROR;
+    }
+
     task->event.data = r;
     task->event.handler = ngx_http_cache_thread_event_handler;
 
@@ -1424,6 +1478,10 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ngx_http_cache_t        *c;
     ngx_ext_rename_file_t   ext;
     ngx_http_file_cache_t  *cache;
+    ngx_uint_t              renaming;
+#if (NGX_ZLIB && NGX_THREADS)
+    ngx_http_core_loc_conf_t  *clcf;
+#endif
 
     c = r->cache;
 
@@ -1431,6 +1489,8 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         return;
     }
 
+    c->encoding = 0;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache update");
 
@@ -1442,6 +1502,38 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     uniq = 0;
     fs_size = 0;
 
+    /*
+     * the file is not replaced while it is being replaced by
+     * another update or by its compressed copy
+     */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    renaming = c->node->renaming;
+    c->node->renaming = 1;
+
+    if (renaming) {
+        c->node->count--;
+        c->node->updating = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (renaming) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache busy: \"%s\"", c->file.name.data);
+
+        if (!tf->file.unnamed
+            && ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed",
+                          tf->file.name.data);
+        }
+
+        return;
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache rename: \"%s\" to \"%s\"",
                    tf->file.name.data, c->file.name.data);
@@ -1453,7 +1545,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ext.delete_file = 1;
     ext.log = r->connection->log;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    rc = ngx_ext_rename_temp_file(tf, &c->file.name, &ext);
 
     if (rc == NGX_OK) {
 
@@ -1484,11 +1576,462 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     }
 
     c->node->updating = 0;
+    c->node->renaming = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+#if (NGX_ZLIB && NGX_THREADS)
+
+    /*
+     * the file is compressed in a thread once it is cached, without
+     * thread pools it is stored uncompressed
+     */
+
+    if (c->compress == NGX_HTTP_CACHE_ENCODING_GZIP && rc == NGX_OK) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+            ngx_http_file_cache_compress_thread(r, c, tf, uniq);
+        }
+    }
+
+#endif
+}
+
+
+#if (NGX_ZLIB && NGX_THREADS)
+
+static void
+ngx_http_file_cache_compress_thread(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_temp_file_t *tf, ngx_file_uniq_t uniq)
+{
+    ngx_fd_t                         fd;
+    ngx_pool_t                      *pool;
+    ngx_thread_task_t               *task;
+    ngx_thread_pool_t               *tp;
+    ngx_http_file_cache_compress_t  *ctx;
+
+    if (tf->offset <= (off_t) c->body_start) {
+        return;
+    }
+
+    tp = ngx_http_cache_thread_pool(r);
+
+    if (tp == NULL) {
+        return;
+    }
+
+    /*
+     * the compression may outlive the request, so it uses its own
+     * pool and a duplicate descriptor of the cache file
+     */
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_file_cache_compress_t));
+    if (task == NULL) {
+        goto failed;
+    }
+
+    ctx = task->ctx;
+
+    ctx->cache = c->file_cache;
+    ngx_memcpy(ctx->key, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    ctx->uniq = uniq;
+    ctx->body_start = c->body_start;
+    ctx->end = tf->offset;
+    ctx->level = c->compress_level;
+    ctx->pool = pool;
+
+    ctx->name.len = c->file.name.len;
+    ctx->name.data = ngx_pnalloc(pool, c->file.name.len + 1);
+    if (ctx->name.data == NULL) {
+        goto failed;
+    }
+
+    ngx_cpystrn(ctx->name.data, c->file.name.data, c->file.name.len + 1);
+
+    ctx->temp.file.fd = NGX_INVALID_FILE;
+    ctx->temp.file.log = ngx_cycle->log;
+    ctx->temp.file.unnamed = 1;
+    ctx->temp.path = tf->path;
+    ctx->temp.pool = pool;
+    ctx->temp.persistent = 1;
+    ctx->temp.access = tf->access;
+
+    if (ngx_create_temp_file(&ctx->temp.file, ctx->temp.path, pool,
+                             ctx->temp.persistent, ctx->temp.clean,
+                             ctx->temp.access)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    fd = dup(tf->file.fd);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "dup() \"%s\" failed", c->file.name.data);
+        goto delete;
+    }
+
+    ctx->file.fd = fd;
+    ctx->file.name = ctx->name;
+    ctx->file.log = ngx_cycle->log;
+
+    task->handler = ngx_http_file_cache_compress_handler;
+    task->event.handler = ngx_http_file_cache_compress_event_handler;
+    task->event.data = ctx;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed",
+                          c->file.name.data);
+        }
+
+        goto delete;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache compress thread: \"%s\"",
+                   c->file.name.data);
+
+    return;
+
+delete:
+
+    if (!ctx->temp.file.unnamed
+        && ngx_delete_file(ctx->temp.file.name.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed",
+                      ctx->temp.file.name.data);
+    }
+
+failed:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_file_cache_compress_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_file_cache_compress_t *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http file cache compress handler");
+
+    ctx->size = ngx_http_file_cache_deflate(&ctx->file, &ctx->temp.file,
+                                            ctx->body_start, ctx->end,
+                                            ctx->level);
+}
+
+
+static void
+ngx_http_file_cache_compress_event_handler(ngx_event_t *ev)
+{
+    ngx_http_file_cache_compress_t *ctx = ev->data;
+
+    off_t                        fs_size;
+    ngx_int_t                    rc;
+    ngx_uint_t                   valid;
+    ngx_file_uniq_t              uniq;
+    ngx_file_info_t              fi;
+    ngx_ext_rename_file_t        ext;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache compress done: %O", ctx->size);
+
+    cache = ctx->cache;
+
+    if (ngx_close_file(ctx->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->name.data);
+    }
+
+    if (ctx->size <= 0) {
+        goto delete;
+    }
+
+    /*
+     * the compressed file replaces the cached one only if the latter
+     * was neither replaced nor deleted in the meantime; the node is
+     * marked as being renamed, so the file is not replaced by updates
+     * until the rename is complete, and referenced, so it is not
+     * deleted by the cache manager
+     */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, ctx->key);
+
+    valid = (fcn && fcn->exists && !fcn->updating && !fcn->renaming
+             && fcn->uniq == ctx->uniq);
+
+    if (valid) {
+        fcn->renaming = 1;
+        fcn->count++;
+    }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (!valid) {
+        goto delete;
+    }
+
+    ctx->temp.offset = ctx->size;
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = ev->log;
+
+    rc = ngx_ext_rename_temp_file(&ctx->temp, &ctx->name, &ext);
+
+    uniq = 0;
+    fs_size = 0;
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(ctx->temp.file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ev->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", ctx->name.data);
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1)
+                      / cache->bsize;
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (rc == NGX_OK) {
+        fcn->uniq = uniq;
+
+        cache->sh->size += fs_size - fcn->fs_size;
+        fcn->fs_size = fs_size;
+    }
+
+    fcn->renaming = 0;
+    fcn->count--;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    goto done;
+
+delete:
+
+    if (!ctx->temp.file.unnamed
+        && ngx_delete_file(ctx->temp.file.name.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ev->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed",
+                      ctx->temp.file.name.data);
+    }
+
+done:
+
+    ngx_destroy_pool(ctx->pool);
 }
 
 
+static off_t
+ngx_http_file_cache_deflate(ngx_file_t *src, ngx_file_t *dst,
+    off_t body_start, off_t end, ngx_int_t level)
+{
+    int                            rc, wbits, memlevel, flush;
+    off_t                          offset, length, written;
+    u_char                        *in, *out;
+    size_t                         size;
+    ssize_t                        n;
+    z_stream                       zstream;
+    ngx_uint_t                     done;
+    ngx_pool_t                    *pool;
+    ngx_http_file_cache_header_t  *h;
+
+    /*
+     * deflates the response body of the src cache file into dst,
+     * returns the size of dst, or NGX_DECLINED if it does not compress
+     */
+
+    length = end - body_start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, src->log, 0,
+                   "http file cache compress: %O, level:%i",
+                   length, level);
+
+    wbits = MAX_WBITS;
+    memlevel = MAX_MEM_LEVEL - 1;
+
+    while (length < ((1 << (wbits - 1)) - 262)) {
+        wbits--;
+        memlevel--;
+    }
+
+    if (memlevel < 1) {
+        memlevel = 1;
+    }
+
+    pool = ngx_create_pool(1024, src->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = ngx_max((size_t) body_start, 32768);
+
+    in = ngx_pnalloc(pool, size);
+    out = ngx_pnalloc(pool, size);
+
+    if (in == NULL || out == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    done = 0;
+    written = NGX_ERROR;
+
+    /* the cache header, the key, and the response header */
+
+    n = ngx_read_file(src, in, (size_t) body_start, 0);
+
+    if (n != (ssize_t) body_start) {
+        goto failed;
+    }
+
+    h = (ngx_http_file_cache_header_t *) in;
+    h->encoding = NGX_HTTP_CACHE_ENCODING_GZIP;
+
+    if (ngx_write_file(dst, in, (size_t) body_start, 0) == NGX_ERROR) {
+        goto failed;
+    }
+
+    written = body_start;
+
+    ngx_memzero(&zstream, sizeof(z_stream));
+
+    zstream.zalloc = ngx_http_file_cache_gzip_alloc;
+    zstream.zfree = ngx_http_file_cache_gzip_free;
+    zstream.opaque = pool;
+
+    rc = deflateInit2(&zstream, (int) level, Z_DEFLATED,
+                      wbits + 16, memlevel, Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, src->log, 0,
+                      "deflateInit2() failed: %d", rc);
+        written = NGX_ERROR;
+        goto failed;
+    }
+
+    offset = body_start;
+    flush = Z_NO_FLUSH;
+
+    do {
+        if (zstream.avail_in == 0 && flush == Z_NO_FLUSH) {
+            n = ngx_read_file(src, in,
+                              (size_t) ngx_min((off_t) size, end - offset),
+                              offset);
+
+            if (n == NGX_ERROR) {
+                goto finish;
+            }
+
+            offset += n;
+
+            zstream.next_in = in;
+            zstream.avail_in = n;
+
+            if (offset == end || n == 0) {
+                flush = Z_FINISH;
+            }
+        }
+
+        zstream.next_out = out;
+        zstream.avail_out = size;
+
+        rc = deflate(&zstream, flush);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, src->log, 0,
+                          "deflate() failed: %d, %d", flush, rc);
+            goto finish;
+        }
+
+        n = size - zstream.avail_out;
+
+        if (n) {
+            if (written + n >= end) {
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, src->log, 0,
+                               "http file cache compress: no gain");
+                goto finish;
+            }
+
+            if (ngx_write_file(dst, out, n, written) == NGX_ERROR) {
+                goto finish;
+            }
+
+            written += n;
+        }
+
+    } while (rc != Z_STREAM_END);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, src->log, 0,
+                   "http file cache compressed: %O of %O",
+                   written - body_start, length);
+
+    done = 1;
+
+finish:
+
+    rc = deflateEnd(&zstream);
+
+    if (rc != Z_OK && rc != Z_DATA_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, src->log, 0,
+                      "deflateEnd() failed: %d", rc);
+        done = 0;
+    }
+
+    if (!done) {
+        written = NGX_DECLINED;
+    }
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return written;
+}
+
+
+static void *
+ngx_http_file_cache_gzip_alloc(void *opaque, u_int items, u_int size)
+{
+    ngx_pool_t *pool = opaque;
+
+    return ngx_palloc(pool, items * size);
+}
+
+
+static void
+ngx_http_file_cache_gzip_free(void *opaque, void *address)
+{
+}
+
+#endif
+
+
 void
 ngx_http_file_cache_update_header(ngx_http_request_t *r)
 {
@@ -1590,6 +2133,7 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     h.valid_msec = (u_short) c->valid_msec;
     h.header_start = (u_short) c->header_start;
     h.body_start = (u_short) c->body_start;
+    h.encoding = (u_char) c->encoding;
 
     if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
         h.etag_len = (u_char) c->etag.len;
@@ -1717,7 +2261,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     c->updating = 0;
 
     if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE && !tf->file.unnamed) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                            "http file cache incomplete: \"%s\"",
                            tf->file.name.data);
@@ -2703,6 +3247,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+#if (NGX_HTTP_METRICS)
+    if (ngx_http_metrics_add_zone(cf, cache->shm_zone, NGX_HTTP_METRICS_CACHE)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
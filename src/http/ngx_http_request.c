@@ -74,6 +74,12 @@ static char *ngx_http_client_errors[] = {
 };
 
 
+/* the main request being run, see "request_accounting" */
+
+static ngx_http_request_t  *ngx_http_cpu_request;
+static uint64_t             ngx_http_cpu_start;
+
+
 ngx_http_header_t  ngx_http_headers_in[] = {
     { ngx_string("Host"), offsetof(ngx_http_headers_in_t, host),
                  ngx_http_process_host },
@@ -639,6 +645,17 @@ ngx_http_alloc_request(ngx_connection_t *c)
     r->start_sec = tp->sec;
     r->start_msec = tp->msec;
 
+    if (cmcf->request_timing) {
+        r->timing = ngx_pcalloc(r->pool,
+                                NGX_HTTP_TIMING_MAX * sizeof(uint64_t));
+        if (r->timing == NULL) {
+            ngx_destroy_pool(r->pool);
+            return NULL;
+        }
+
+        r->timing[NGX_HTTP_TIMING_START] = ngx_monotonic_usec();
+    }
+
     r->method = NGX_HTTP_UNKNOWN;
     r->http_version = NGX_HTTP_VERSION_10;
 
@@ -654,6 +671,8 @@ ngx_http_alloc_request(ngx_connection_t *c)
 
     r->log_handler = ngx_http_log_error_handler;
 
+    ngx_probe2(http_request_start, r, c->number);
+
     return r;
 }
 
@@ -825,6 +844,10 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
 
         c->ssl->no_wait_shutdown = 1;
 
+#if (NGX_HTTP_METRICS)
+        ngx_http_metrics_handshake(c);
+#endif
+
 #if (NGX_HTTP_V2                                                              \
      && defined TLSEXT_TYPE_application_layer_protocol_negotiation)
         {
@@ -2080,6 +2103,8 @@ ngx_http_process_request(ngx_http_request_t *r)
 
     c = r->connection;
 
+    ngx_http_set_timing(r, NGX_HTTP_TIMING_HEADER);
+
 #if (NGX_HTTP_SSL)
 
     if (r->http_connection->ssl) {
@@ -2161,7 +2186,11 @@ ngx_http_process_request(ngx_http_request_t *r)
     c->write->handler = ngx_http_request_handler;
     r->read_event_handler = ngx_http_block_reading;
 
+    ngx_http_cpu_time_start(r);
+
     ngx_http_handler(r);
+
+    ngx_http_cpu_time_stop();
 }
 
 
@@ -2440,10 +2469,13 @@ ngx_http_request_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http run request: \"%V?%V\"", &r->uri, &r->args);
 
+    ngx_http_cpu_time_start(r);
+
     if (c->close) {
         r->main->count++;
         ngx_http_terminate_request(r, 0);
         ngx_http_run_posted_requests(c);
+        ngx_http_cpu_time_stop();
         return;
     }
 
@@ -2460,6 +2492,8 @@ ngx_http_request_handler(ngx_event_t *ev)
     }
 
     ngx_http_run_posted_requests(c);
+
+    ngx_http_cpu_time_stop();
 }
 
 
@@ -2496,6 +2530,58 @@ ngx_http_run_posted_requests(ngx_connection_t *c)
 }
 
 
+void
+ngx_http_cpu_time_start(ngx_http_request_t *r)
+{
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    if (!cmcf->request_accounting) {
+        return;
+    }
+
+    ngx_http_cpu_time_stop();
+
+    ngx_http_cpu_request = r->main;
+    ngx_http_cpu_start = ngx_thread_cpu_nsec();
+}
+
+
+void
+ngx_http_cpu_time_stop(void)
+{
+    if (ngx_http_cpu_request == NULL) {
+        return;
+    }
+
+    ngx_http_cpu_request->cpu_time += ngx_thread_cpu_nsec()
+                                      - ngx_http_cpu_start;
+    ngx_http_cpu_request = NULL;
+}
+
+
+uint64_t
+ngx_http_cpu_time(ngx_http_request_t *r)
+{
+    uint64_t  now;
+
+    r = r->main;
+
+    if (ngx_http_cpu_request == r) {
+
+        /* the request is being run, account the time so far */
+
+        now = ngx_thread_cpu_nsec();
+
+        r->cpu_time += now - ngx_http_cpu_start;
+        ngx_http_cpu_start = now;
+    }
+
+    return r->cpu_time;
+}
+
+
 ngx_int_t
 ngx_http_post_request(ngx_http_request_t *r, ngx_http_posted_request_t *pr)
 {
@@ -3801,6 +3887,9 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
         r->headers_out.status = rc;
     }
 
+    ngx_probe3(http_request_finish, r, r->headers_out.status,
+               r->connection->sent);
+
     if (!r->logged) {
         log->action = "logging request";
 
@@ -3830,6 +3919,10 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
         }
     }
 
+    if (ngx_http_cpu_request == r) {
+        ngx_http_cpu_request = NULL;
+    }
+
     /* the various request strings were allocated from r->pool */
     ctx = log->data;
     ctx->request = NULL;
@@ -71,6 +71,16 @@
 #define NGX_HTTP_LOG_UNSAFE                1
 
 
+#define NGX_HTTP_TIMING_START              0
+#define NGX_HTTP_TIMING_HEADER             1
+#define NGX_HTTP_TIMING_LOCATION           2
+#define NGX_HTTP_TIMING_ACCESS             3
+#define NGX_HTTP_TIMING_CONTENT            4
+#define NGX_HTTP_TIMING_FIRST_BYTE         5
+#define NGX_HTTP_TIMING_LAST_BYTE          6
+#define NGX_HTTP_TIMING_MAX                7
+
+
 #define NGX_HTTP_CONTINUE                  100
 #define NGX_HTTP_SWITCHING_PROTOCOLS       101
 #define NGX_HTTP_PROCESSING                102
@@ -410,6 +420,12 @@ struct ngx_http_request_s {
     time_t                            start_sec;
     ngx_msec_t                        start_msec;
 
+    /* monotonic microseconds, see "request_timing" */
+    uint64_t                         *timing;
+
+    /* nanoseconds, see "request_accounting" */
+    uint64_t                          cpu_time;
+
     ngx_uint_t                        method;
     ngx_uint_t                        http_version;
 
@@ -507,6 +523,7 @@ struct ngx_http_request_s {
     unsigned                          gzip_tested:1;
     unsigned                          gzip_ok:1;
     unsigned                          gzip_vary:1;
+    unsigned                          gunzip:1;
 #endif
 
 #if (NGX_PCRE)
@@ -622,4 +639,14 @@ extern ngx_http_header_out_t   ngx_http_headers_out[];
     ((ngx_http_log_ctx_t *) log->data)->current_request = r
 
 
+/* a timestamp is taken once, when the request first reaches the point */
+
+#define ngx_http_set_timing(r, n)                                             \
+    do {                                                                      \
+        if ((r)->timing && (r)->timing[n] == 0) {                             \
+            (r)->timing[n] = ngx_monotonic_usec();                            \
+        }                                                                     \
+    } while (0)
+
+
 #endif /* _NGX_HTTP_REQUEST_H_INCLUDED_ */
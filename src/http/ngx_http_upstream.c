@@ -17,8 +17,20 @@ static ngx_int_t ngx_http_upstream_cache_get(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_http_file_cache_t **cache);
 static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_encoding(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
 static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
+static ngx_http_upstream_cache_peer_t *ngx_http_upstream_cache_peer(
+    ngx_http_request_t *r, ngx_http_upstream_t *u);
+static ngx_uint_t ngx_http_upstream_cache_peer_trusted(ngx_http_request_t *r,
+    ngx_http_upstream_cache_peers_t *cp);
+static void ngx_http_upstream_cache_peer_connect(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_peer_next(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static int ngx_libc_cdecl ngx_http_upstream_cache_peer_cmp_points(
+    const void *one, const void *two);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
@@ -30,6 +42,8 @@ static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
+static void ngx_http_upstream_init_balancer(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
 static void ngx_http_upstream_wr_check_broken_connection(ngx_http_request_t *r);
@@ -573,14 +587,9 @@ ngx_http_upstream_init(ngx_http_request_t *r)
 static void
 ngx_http_upstream_init_request(ngx_http_request_t *r)
 {
-    ngx_str_t                      *host;
-    ngx_uint_t                      i;
-    ngx_resolver_ctx_t             *ctx, temp;
-    ngx_http_cleanup_t             *cln;
-    ngx_http_upstream_t            *u;
-    ngx_http_core_loc_conf_t       *clcf;
-    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_cleanup_t        *cln;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
 
     if (r->aio) {
         return;
@@ -627,6 +636,13 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
             ngx_http_finalize_request(r, rc);
             return;
         }
+
+        if (u->conf->cache_peers
+            && (u->cache_status == NGX_HTTP_CACHE_MISS
+                || u->cache_status == NGX_HTTP_CACHE_EXPIRED))
+        {
+            u->cache_peer = ngx_http_upstream_cache_peer(r, u);
+        }
     }
 
 #endif
@@ -712,6 +728,29 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     cln->data = r;
     u->cleanup = &cln->handler;
 
+#if (NGX_HTTP_CACHE)
+
+    if (u->cache_peer) {
+        ngx_http_upstream_cache_peer_connect(r, u);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_init_balancer(r, u);
+}
+
+
+static void
+ngx_http_upstream_init_balancer(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t                      *host;
+    ngx_uint_t                      i;
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
     if (u->resolved == NULL) {
 
         uscf = u->conf->upstream;
@@ -776,6 +815,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
         temp.name = *host;
 
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
         ctx = ngx_resolve_start(clcf->resolver, &temp);
         if (ctx == NULL) {
             ngx_http_upstream_finalize_request(r, u,
@@ -925,6 +966,8 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http upstream cache: %i", rc);
 
+    ngx_probe2(http_cache_lookup, r, rc);
+
     switch (rc) {
 
     case NGX_HTTP_CACHE_STALE:
@@ -1068,6 +1111,232 @@ ngx_http_upstream_cache_get(ngx_http_request_t *r, ngx_http_upstream_t *u,
 }
 
 
+static ngx_http_upstream_cache_peer_t *
+ngx_http_upstream_cache_peer(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    time_t                                 now;
+    uint32_t                               hash;
+    ngx_uint_t                             i, j, k;
+    ngx_list_part_t                       *part;
+    ngx_table_elt_t                       *header;
+    ngx_http_upstream_cache_peer_t        *peer;
+    ngx_http_upstream_cache_peers_t       *cp;
+    ngx_http_upstream_cache_peer_point_t  *point;
+
+    cp = u->conf->cache_peers;
+
+    if (cp->npoints == 0) {
+        return NULL;
+    }
+
+    /*
+     * a request which already came from a peer is never passed
+     * to another peer to prevent loops; the header is only trusted
+     * if it comes from an address of a peer
+     */
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].key.len == sizeof("X-Cache-Peer") - 1
+            && ngx_strncasecmp(header[i].key.data, (u_char *) "X-Cache-Peer",
+                               sizeof("X-Cache-Peer") - 1)
+               == 0)
+        {
+            if (ngx_http_upstream_cache_peer_trusted(r, cp)) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http upstream cache peer request from \"%V\"",
+                               &header[i].value);
+                return NULL;
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http upstream cache peer header \"%V\" "
+                           "from client ignored", &header[i].value);
+            break;
+        }
+    }
+
+    /* find first point >= hash */
+
+    hash = r->cache->crc32;
+    point = cp->points;
+
+    i = 0;
+    j = cp->npoints;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > point[k].hash) {
+            i = k + 1;
+
+        } else {
+            j = k;
+        }
+    }
+
+    peer = point[i % cp->npoints].peer;
+
+    if (peer->addr == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream cache peer is self");
+        return NULL;
+    }
+
+    if (peer->max_fails && peer->fails >= peer->max_fails) {
+        now = ngx_time();
+
+        if (now - peer->accessed <= peer->fail_timeout) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http upstream cache peer \"%V\" failed",
+                           &peer->name);
+            return NULL;
+        }
+
+        peer->accessed = now;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache peer: \"%V\"", &peer->name);
+
+    return peer;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_cache_peer_trusted(ngx_http_request_t *r,
+    ngx_http_upstream_cache_peers_t *cp)
+{
+    ngx_uint_t                       i;
+    ngx_connection_t                *c;
+    ngx_http_upstream_cache_peer_t  *peer;
+
+    c = r->connection;
+    peer = cp->peer;
+
+    for (i = 0; i < cp->number; i++) {
+
+        if (peer[i].addr == NULL) {
+            continue;
+        }
+
+        if (ngx_cmp_sockaddr(c->sockaddr, c->socklen,
+                             peer[i].addr->sockaddr, peer[i].addr->socklen, 0)
+            == NGX_OK)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_upstream_cache_peer_connect(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_resolved_t    *ur;
+    ngx_http_upstream_cache_peer_t  *peer;
+
+    peer = u->cache_peer;
+
+    ur = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_resolved_t));
+    if (ur == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ur->host = peer->name;
+    ur->naddrs = 1;
+    ur->sockaddr = peer->addr->sockaddr;
+    ur->socklen = peer->addr->socklen;
+    ur->name = peer->addr->name;
+
+    if (ngx_http_upstream_create_round_robin_peer(r, ur) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /* peers are always spoken to in plain HTTP */
+
+    u->cache_peer_ssl = u->ssl;
+    u->ssl = 0;
+
+    u->peer.start_time = ngx_current_msec;
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static void
+ngx_http_upstream_cache_peer_next(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t ft_type)
+{
+    ngx_http_upstream_cache_peer_t  *peer;
+
+    peer = u->cache_peer;
+
+    if (ft_type & (NGX_HTTP_UPSTREAM_FT_ERROR
+                   |NGX_HTTP_UPSTREAM_FT_TIMEOUT
+                   |NGX_HTTP_UPSTREAM_FT_INVALID_HEADER))
+    {
+        peer->fails++;
+        peer->accessed = ngx_time();
+
+        if (peer->max_fails && peer->fails >= peer->max_fails) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "cache peer \"%V\" temporarily disabled",
+                          &peer->name);
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache peer \"%V\" failed, "
+                   "passing to upstream", &peer->name);
+
+    if (u->peer.connection) {
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    u->cache_peer = NULL;
+    u->ssl = u->cache_peer_ssl;
+    u->peer.data = NULL;
+
+    /* the request is created again, without the "X-Cache-Peer" header */
+
+    u->request_bufs = r->request_body ? r->request_body->bufs : NULL;
+
+    if (u->create_request(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_http_upstream_init_balancer(r, u);
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -1113,6 +1382,10 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->encoding && ngx_http_upstream_cache_encoding(r, c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1136,6 +1409,38 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_encoding(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_table_elt_t  *h;
+
+    /* the response body was compressed when stored in the cache */
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->next = NULL;
+    ngx_str_set(&h->key, "Content-Encoding");
+    ngx_str_set(&h->value, "gzip");
+    r->headers_out.content_encoding = h;
+
+    ngx_http_clear_content_length(r);
+    r->headers_out.content_length_n = c->length - c->body_start;
+
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
+
+#if (NGX_HTTP_GUNZIP)
+    r->gunzip = 1;
+#endif
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -1309,6 +1614,8 @@ ngx_http_upstream_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http upstream request: \"%V?%V\"", &r->uri, &r->args);
 
+    ngx_http_cpu_time_start(r);
+
     if (ev->delayed && ev->timedout) {
         ev->delayed = 0;
         ev->timedout = 0;
@@ -1322,6 +1629,8 @@ ngx_http_upstream_handler(ngx_event_t *ev)
     }
 
     ngx_http_run_posted_requests(c);
+
+    ngx_http_cpu_time_stop();
 }
 
 
@@ -1579,6 +1888,8 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http upstream connect: %i", rc);
 
+    ngx_probe3(http_upstream_connect, r, rc, u->peer.sockaddr);
+
     if (rc == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -2548,6 +2859,8 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->header_time = ngx_current_msec - u->start_time;
 
+    ngx_probe2(http_upstream_header, r, u->headers_in.status_n);
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -3208,6 +3521,17 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         break;
     }
 
+    if (u->cache_peer) {
+
+        if (u->headers_in.status_n < NGX_HTTP_INTERNAL_SERVER_ERROR) {
+            u->cache_peer->fails = 0;
+        }
+
+        if (!u->conf->cache_peers->store) {
+            u->cacheable = 0;
+        }
+    }
+
     if (u->cacheable) {
         time_t  now, valid;
 
@@ -3227,6 +3551,19 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             r->cache->date = now;
             r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
 
+            if (u->headers_in.status_n == NGX_HTTP_OK
+                && r->headers_out.content_encoding == NULL
+                && u->conf->cache_compress
+                && ngx_http_test_content_type(r, &u->conf->cache_compress_types)
+                   != NULL)
+            {
+                r->cache->compress = u->conf->cache_compress;
+                r->cache->compress_level = u->conf->cache_compress_level;
+
+            } else {
+                r->cache->compress = 0;
+            }
+
             if (u->headers_in.status_n == NGX_HTTP_OK
                 || u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT)
             {
@@ -3297,6 +3634,7 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     if (p->cacheable) {
         p->temp_file->persistent = 1;
+        p->temp_file->file.unnamed = 1;
 
 #if (NGX_HTTP_CACHE)
         if (r->cache && !r->cache->file_cache->use_temp_path) {
@@ -4308,6 +4646,7 @@ ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
         tf->path = u->conf->temp_path;
         tf->pool = r->pool;
         tf->persistent = 1;
+        tf->file.unnamed = 1;
 
         if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
                                  tf->persistent, tf->clean, tf->access)
@@ -4362,7 +4701,7 @@ ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
-    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+    (void) ngx_ext_rename_temp_file(tf, &path, &ext);
 
     u->store = 0;
 }
@@ -4474,6 +4813,13 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     {
 #if (NGX_HTTP_CACHE)
 
+        if (u->cache_peer
+            && !(u->request_sent && r->request_body_no_buffering))
+        {
+            ngx_http_upstream_cache_peer_next(r, u, ft_type);
+            return;
+        }
+
         if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
             && ((u->conf->cache_use_stale & ft_type) || r->cache->stale_error))
         {
@@ -4559,6 +4905,8 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         return;
     }
 
+    ngx_probe2(http_upstream_finish, r, rc);
+
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
@@ -4632,7 +4980,8 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     }
 
     if (u->store && u->pipe && u->pipe->temp_file
-        && u->pipe->temp_file->file.fd != NGX_INVALID_FILE)
+        && u->pipe->temp_file->file.fd != NGX_INVALID_FILE
+        && !u->pipe->temp_file->file.unnamed)
     {
         if (ngx_delete_file(u->pipe->temp_file->file.name.data)
             == NGX_FILE_ERROR)
@@ -6798,6 +7147,274 @@ ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+#if (NGX_HTTP_CACHE)
+
+char *
+ngx_http_upstream_cache_peers_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_str_t                         *value, s;
+    ngx_url_t                          u;
+    ngx_uint_t                         i;
+    ngx_http_upstream_cache_peers_t  **pcp, *cp;
+
+    pcp = (ngx_http_upstream_cache_peers_t **) (p + cmd->offset);
+
+    if (*pcp != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts != 2) {
+            return "has invalid number of arguments";
+        }
+
+        *pcp = NULL;
+        return NGX_CONF_OK;
+    }
+
+    cp = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_cache_peers_t));
+    if (cp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cp->store = 1;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    cp->upstream = ngx_http_upstream_add(cf, &u, 0);
+    if (cp->upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "self=", 5) == 0) {
+
+            cp->self.len = value[i].len - 5;
+            cp->self.data = value[i].data + 5;
+
+            if (cp->self.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "store=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            if (ngx_strcmp(s.data, "on") == 0) {
+                cp->store = 1;
+
+            } else if (ngx_strcmp(s.data, "off") == 0) {
+                cp->store = 0;
+
+            } else {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    *pcp = cp;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_upstream_init_cache_peers(ngx_conf_t *cf,
+    ngx_http_upstream_cache_peers_t *cp)
+{
+    uint32_t                               hash, base_hash;
+    ngx_uint_t                             i, j, n, npoints, self;
+    ngx_http_upstream_server_t            *server;
+    ngx_http_upstream_srv_conf_t          *uscf;
+    ngx_http_upstream_cache_peer_t        *peer;
+    ngx_http_upstream_cache_peer_point_t  *point;
+    union {
+        uint32_t                           value;
+        u_char                             byte[4];
+    } prev_hash;
+
+    uscf = cp->upstream;
+
+    if (!(uscf->flags & NGX_HTTP_UPSTREAM_CREATE) || uscf->servers == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "cache peers upstream \"%V\" is not defined",
+                           &uscf->host);
+        return NGX_ERROR;
+    }
+
+    server = uscf->servers->elts;
+
+    n = 0;
+    npoints = 0;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (server[i].backup || server[i].down) {
+            continue;
+        }
+
+        if (server[i].naddrs == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "cache peer \"%V\" in upstream \"%V\" "
+                               "must have a static address",
+                               &server[i].name, &uscf->host);
+            return NGX_ERROR;
+        }
+
+        n++;
+        npoints += server[i].weight * 160;
+    }
+
+    if (n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no cache peers in upstream \"%V\"", &uscf->host);
+        return NGX_ERROR;
+    }
+
+    peer = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_cache_peer_t) * n);
+    if (peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    point = ngx_palloc(cf->pool,
+                       sizeof(ngx_http_upstream_cache_peer_point_t) * npoints);
+    if (point == NULL) {
+        return NGX_ERROR;
+    }
+
+    cp->peer = peer;
+    cp->points = point;
+
+    self = 0;
+    n = 0;
+    npoints = 0;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (server[i].backup || server[i].down) {
+            continue;
+        }
+
+        peer[n].name = server[i].name;
+        peer[n].addr = &server[i].addrs[0];
+        peer[n].max_fails = server[i].max_fails;
+        peer[n].fail_timeout = server[i].fail_timeout;
+
+        if (cp->self.len == server[i].name.len
+            && ngx_strncasecmp(cp->self.data, server[i].name.data,
+                               cp->self.len)
+               == 0)
+        {
+            /* requests owned by this node are passed to the upstream */
+            peer[n].addr = NULL;
+            self = 1;
+        }
+
+        /*
+         * the points only depend on the server name, so all nodes
+         * which share the same upstream block agree on the owners
+         */
+
+        ngx_crc32_init(base_hash);
+        ngx_crc32_update(&base_hash, server[i].name.data, server[i].name.len);
+
+        prev_hash.value = 0;
+
+        for (j = 0; j < server[i].weight * 160; j++) {
+            hash = base_hash;
+
+            ngx_crc32_update(&hash, prev_hash.byte, 4);
+            ngx_crc32_final(hash);
+
+            point[npoints].hash = hash;
+            point[npoints].peer = &peer[n];
+            npoints++;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+            prev_hash.value = hash;
+#else
+            prev_hash.byte[0] = (u_char) (hash & 0xff);
+            prev_hash.byte[1] = (u_char) ((hash >> 8) & 0xff);
+            prev_hash.byte[2] = (u_char) ((hash >> 16) & 0xff);
+            prev_hash.byte[3] = (u_char) ((hash >> 24) & 0xff);
+#endif
+        }
+
+        n++;
+    }
+
+    if (cp->self.len && !self) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "cache peer \"%V\" not found in upstream \"%V\"",
+                           &cp->self, &uscf->host);
+        return NGX_ERROR;
+    }
+
+    /* sent to peers in the "X-Cache-Peer" request header */
+
+    cp->name = cp->self.len ? cp->self : cf->cycle->hostname;
+
+    ngx_qsort(point, npoints, sizeof(ngx_http_upstream_cache_peer_point_t),
+              ngx_http_upstream_cache_peer_cmp_points);
+
+    for (i = 0, j = 1; j < npoints; j++) {
+        if (point[i].hash != point[j].hash) {
+            point[++i] = point[j];
+        }
+    }
+
+    cp->number = n;
+    cp->npoints = i + 1;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstream_cache_peer_cmp_points(const void *one, const void *two)
+{
+    ngx_http_upstream_cache_peer_point_t *first =
+                                  (ngx_http_upstream_cache_peer_point_t *) one;
+    ngx_http_upstream_cache_peer_point_t *second =
+                                  (ngx_http_upstream_cache_peer_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+
+    } else if (first->hash > second->hash) {
+        return 1;
+
+    } else {
+        return 0;
+    }
+}
+
+#endif
+
+
 ngx_int_t
 ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
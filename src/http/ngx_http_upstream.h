@@ -114,6 +114,45 @@ typedef struct {
 } ngx_http_upstream_server_t;
 
 
+typedef struct {
+    ngx_str_t                        name;
+    ngx_addr_t                      *addr;
+
+    /*
+     * the failure state is kept by each worker process separately,
+     * as in upstream blocks without the "zone" directive, so a peer
+     * is disabled after max_fails failures seen by the same worker
+     */
+
+    ngx_uint_t                       fails;
+    time_t                           accessed;
+
+    ngx_uint_t                       max_fails;
+    time_t                           fail_timeout;
+} ngx_http_upstream_cache_peer_t;
+
+
+typedef struct {
+    uint32_t                         hash;
+    ngx_http_upstream_cache_peer_t  *peer;
+} ngx_http_upstream_cache_peer_point_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t    *upstream;
+    ngx_str_t                        self;
+    ngx_str_t                        name;
+
+    ngx_http_upstream_cache_peer_t  *peer;
+    ngx_uint_t                       number;
+
+    ngx_http_upstream_cache_peer_point_t  *points;
+    ngx_uint_t                       npoints;
+
+    ngx_flag_t                       store;
+} ngx_http_upstream_cache_peers_t;
+
+
 #define NGX_HTTP_UPSTREAM_CREATE        0x0001
 #define NGX_HTTP_UPSTREAM_WEIGHT        0x0002
 #define NGX_HTTP_UPSTREAM_MAX_FAILS     0x0004
@@ -222,6 +261,13 @@ typedef struct {
     ngx_array_t                     *cache_bypass;
     ngx_array_t                     *cache_purge;
     ngx_array_t                     *no_cache;
+
+    ngx_http_upstream_cache_peers_t *cache_peers;
+
+    ngx_uint_t                       cache_compress;
+    ngx_int_t                        cache_compress_level;
+    ngx_hash_t                       cache_compress_types;
+    ngx_array_t                     *cache_compress_types_keys;
 #endif
 
     ngx_array_t                     *store_lengths;
@@ -344,6 +390,7 @@ struct ngx_http_upstream_s {
     ngx_http_upstream_srv_conf_t    *upstream;
 #if (NGX_HTTP_CACHE)
     ngx_array_t                     *caches;
+    ngx_http_upstream_cache_peer_t  *cache_peer;
 #endif
 
     ngx_http_upstream_headers_in_t   headers_in;
@@ -397,6 +444,7 @@ struct ngx_http_upstream_s {
     unsigned                         ssl:1;
 #if (NGX_HTTP_CACHE)
     unsigned                         cache_status:3;
+    unsigned                         cache_peer_ssl:1;
 #endif
 
     unsigned                         buffering:1;
@@ -437,6 +485,12 @@ char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
+#if (NGX_HTTP_CACHE)
+char *ngx_http_upstream_cache_peers_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_upstream_init_cache_peers(ngx_conf_t *cf,
+    ngx_http_upstream_cache_peers_t *cp);
+#endif
 #if (NGX_HTTP_SSL)
 ngx_int_t ngx_http_upstream_merge_ssl_passwords(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev);
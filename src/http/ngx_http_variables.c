@@ -103,6 +103,12 @@ static ngx_int_t ngx_http_variable_request_length(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_request_time(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_variable_request_timing(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_variable_request_cpu_time(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_variable_request_pool_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_request_id(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_status(ngx_http_request_t *r,
@@ -302,6 +308,37 @@ static ngx_http_variable_t  ngx_http_core_variables[] = {
     { ngx_string("request_time"), NULL, ngx_http_variable_request_time,
       0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("request_header_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_HEADER, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_location_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_LOCATION, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_access_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_ACCESS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_content_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_CONTENT, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("first_byte_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_FIRST_BYTE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("last_byte_time"), NULL,
+      ngx_http_variable_request_timing,
+      NGX_HTTP_TIMING_LAST_BYTE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_cpu_time"), NULL,
+      ngx_http_variable_request_cpu_time, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("request_pool_bytes"), NULL,
+      ngx_http_variable_request_pool_bytes,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("request_id"), NULL,
       ngx_http_variable_request_id,
       0, 0, 0 },
@@ -2239,6 +2276,93 @@ ngx_http_variable_request_time(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_variable_request_timing(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char    *p;
+    uint64_t  *timing, usec;
+
+    timing = r->main->timing;
+
+    if (timing == NULL || timing[data] == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 7);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    usec = timing[data] - timing[NGX_HTTP_TIMING_START];
+
+    v->len = ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_variable_request_cpu_time(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                     *p;
+    uint64_t                    usec;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    if (!cmcf->request_accounting) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 7);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    usec = ngx_http_cpu_time(r) / 1000;
+
+    v->len = ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_variable_request_pool_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+    size_t   size;
+
+    size = r->main->pool->allocated;
+
+    p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uz", size) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_variable_request_id(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -306,6 +306,10 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
+    if (c->sent > sent) {
+        ngx_http_set_timing(r->main, NGX_HTTP_TIMING_FIRST_BYTE);
+    }
+
     if (r->limit_rate) {
 
         nsent = c->sent;
@@ -352,6 +356,7 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     if (last) {
         r->response_sent = 1;
+        ngx_http_set_timing(r->main, NGX_HTTP_TIMING_LAST_BYTE);
     }
 
     if ((c->buffered & NGX_LOWLEVEL_BUFFERED) && r->postponed == NULL) {
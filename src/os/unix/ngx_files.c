@@ -291,6 +291,39 @@ ngx_open_tempfile(u_char *name, ngx_uint_t persistent, ngx_uint_t access)
 }
 
 
+#if (NGX_HAVE_O_TMPFILE)
+
+ngx_fd_t
+ngx_open_unnamed_tempfile(u_char *name, ngx_uint_t access)
+{
+    u_char    *p;
+    ngx_fd_t   fd;
+
+    /* the file is created in the directory of the name given */
+
+    for (p = name + ngx_strlen(name); p > name; p--) {
+        if (*p == '/') {
+            break;
+        }
+    }
+
+    if (p == name) {
+        ngx_set_errno(NGX_EOPNOTSUPP);
+        return NGX_INVALID_FILE;
+    }
+
+    *p = '\0';
+
+    fd = open((const char *) name, O_TMPFILE|O_RDWR, access ? access : 0600);
+
+    *p = '/';
+
+    return fd;
+}
+
+#endif
+
+
 ssize_t
 ngx_write_chain_to_file(ngx_file_t *file, ngx_chain_t *cl, off_t offset,
     ngx_pool_t *pool)
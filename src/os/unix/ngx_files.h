@@ -118,6 +118,33 @@ ngx_fd_t ngx_open_tempfile(u_char *name, ngx_uint_t persistent,
     ngx_uint_t access);
 #define ngx_open_tempfile_n      "open()"
 
+#if (NGX_HAVE_O_TMPFILE)
+
+ngx_fd_t ngx_open_unnamed_tempfile(u_char *name, ngx_uint_t access);
+#define ngx_open_unnamed_tempfile_n  "open(O_TMPFILE)"
+
+#define NGX_FD_NAME_LEN          (sizeof("/proc/self/fd/") + NGX_INT32_LEN)
+#define ngx_fd_name(buf, fd)     ngx_sprintf(buf, "/proc/self/fd/%d%Z", fd)
+
+#define ngx_link_file(o, n)                                                   \
+    linkat(AT_FDCWD, (const char *) o, AT_FDCWD, (const char *) n,             \
+           AT_SYMLINK_FOLLOW)
+#define ngx_link_file_n          "linkat()"
+
+#endif
+
+
+#if (NGX_HAVE_FICLONE)
+#define ngx_clone_file(fd, nfd)  ioctl(nfd, FICLONE, fd)
+#define ngx_clone_file_n         "ioctl(FICLONE)"
+#endif
+
+#if (NGX_HAVE_COPY_FILE_RANGE)
+#define ngx_copy_file_range(fd, nfd, size)                                    \
+    copy_file_range(fd, NULL, nfd, NULL, size, 0)
+#define ngx_copy_file_range_n    "copy_file_range()"
+#endif
+
 
 ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset);
 #if (NGX_HAVE_PREAD)
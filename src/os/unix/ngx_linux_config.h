@@ -111,6 +111,10 @@ typedef struct iocb  ngx_aiocb_t;
 #include <netinet/udp.h>
 #endif
 
+#if (NGX_HAVE_FICLONE)
+#include <linux/fs.h>           /* FICLONE */
+#endif
+
 
 #define NGX_LISTEN_BACKLOG        511
 
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_stream.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_writer.h>
+#endif
+
 #if (NGX_ZLIB)
 #include <zlib.h>
 #endif
@@ -51,6 +55,13 @@ typedef struct {
     ngx_event_t                 *event;
     ngx_msec_t                   flush;
     ngx_int_t                    gzip;
+
+#if (NGX_THREADS)
+    ngx_thread_writer_t         *writer;
+    ngx_uint_t                   overflow;
+    ngx_uint_t                   sample;
+    ngx_uint_t                   sampled;
+#endif
 } ngx_stream_log_buf_t;
 
 
@@ -94,6 +105,13 @@ typedef struct {
 #define NGX_STREAM_LOG_ESCAPE_NONE     2
 
 
+#define NGX_STREAM_LOG_OVERFLOW_BLOCK   0
+#define NGX_STREAM_LOG_OVERFLOW_DROP    1
+#define NGX_STREAM_LOG_OVERFLOW_SAMPLE  2
+
+#define NGX_STREAM_LOG_THREAD_BUFFERS   4
+
+
 static void ngx_stream_log_write(ngx_stream_session_t *s, ngx_stream_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_stream_log_script_write(ngx_stream_session_t *s,
@@ -110,6 +128,16 @@ static void ngx_stream_log_gzip_free(void *opaque, void *address);
 static void ngx_stream_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_stream_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static ngx_uint_t ngx_stream_log_thread_drop(ngx_stream_log_buf_t *buffer,
+    size_t len, ngx_log_t *log);
+static ngx_int_t ngx_stream_log_thread_post(ngx_stream_log_buf_t *buffer,
+    ngx_uint_t queue, ngx_log_t *log);
+static ssize_t ngx_stream_log_thread_write(ngx_fd_t fd, u_char *buf,
+    size_t len, void *data, ngx_log_t *log);
+static void ngx_stream_log_exit_worker(ngx_cycle_t *cycle);
+#endif
+
 static ngx_int_t ngx_stream_log_variable_compile(ngx_conf_t *cf,
     ngx_stream_log_op_t *op, ngx_str_t *value, ngx_uint_t escape);
 static size_t ngx_stream_log_variable_getlen(ngx_stream_session_t *s,
@@ -191,7 +219,11 @@ ngx_module_t  ngx_stream_log_module = {
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
+#if (NGX_THREADS)
+    ngx_stream_log_exit_worker,            /* exit process */
+#else
     NULL,                                  /* exit process */
+#endif
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -273,6 +305,14 @@ ngx_stream_log_handler(ngx_stream_session_t *s)
 
         if (buffer) {
 
+#if (NGX_THREADS)
+            if (buffer->writer
+                && ngx_stream_log_thread_drop(buffer, len, s->connection->log))
+            {
+                continue;
+            }
+#endif
+
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
                 ngx_stream_log_write(s, &log[l], buffer->start,
@@ -616,6 +656,19 @@ ngx_stream_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 
     buffer = file->data;
 
+#if (NGX_THREADS)
+    if (buffer->writer) {
+
+        /*
+         * the buffer is queued to be written to the file being reopened
+         * or closed, even if all buffers are busy
+         */
+
+        (void) ngx_stream_log_thread_post(buffer, 1, log);
+        return;
+    }
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -655,13 +708,180 @@ ngx_stream_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 static void
 ngx_stream_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t       *file;
+    ngx_stream_log_buf_t  *buffer;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "stream log buffer flush handler");
 
+#if (NGX_THREADS)
+    file = ev->data;
+    buffer = file->data;
+
+    if (buffer->writer) {
+
+        if (ngx_stream_log_thread_post(buffer,
+                             buffer->overflow == NGX_STREAM_LOG_OVERFLOW_BLOCK,
+                             ev->log)
+            != NGX_OK)
+        {
+            /* all buffers are busy, the flush is retried later */
+            ngx_add_timer(ev, buffer->flush);
+        }
+
+        return;
+    }
+#endif
+
     ngx_stream_log_flush(ev->data, ev->log);
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_uint_t
+ngx_stream_log_thread_drop(ngx_stream_log_buf_t *buffer, size_t len,
+    ngx_log_t *log)
+{
+    ngx_int_t             rc;
+    ngx_thread_writer_t  *tw;
+
+    tw = buffer->writer;
+
+    if (tw->free == NULL
+        && buffer->overflow == NGX_STREAM_LOG_OVERFLOW_SAMPLE
+        && buffer->sampled++ % buffer->sample)
+    {
+        goto drop;
+    }
+
+    if (len <= (size_t) (buffer->last - buffer->pos)) {
+        return 0;
+    }
+
+    /*
+     * with overflow=block, buffers are added while all of them are busy,
+     * otherwise the line is dropped
+     */
+
+    rc = ngx_stream_log_thread_post(buffer,
+                             buffer->overflow == NGX_STREAM_LOG_OVERFLOW_BLOCK,
+                             log);
+
+    if (rc == NGX_OK) {
+        return 0;
+    }
+
+drop:
+
+    tw->dropped++;
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_stream_log_thread_post(ngx_stream_log_buf_t *buffer, ngx_uint_t queue,
+    ngx_log_t *log)
+{
+    u_char     *p;
+    ngx_int_t   rc;
+
+    if (buffer->pos == buffer->start) {
+        return NGX_OK;
+    }
+
+    rc = ngx_thread_writer_post(buffer->writer, buffer->start,
+                                buffer->pos - buffer->start, &p, queue, log);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    buffer->last = p + (buffer->last - buffer->start);
+    buffer->start = p;
+    buffer->pos = p;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_stream_log_thread_write(ngx_fd_t fd, u_char *buf, size_t len, void *data,
+    ngx_log_t *log)
+{
+#if (NGX_ZLIB)
+    ngx_stream_log_buf_t *buffer = data;
+
+    if (buffer->gzip) {
+        return ngx_stream_log_gzip(fd, buf, len, buffer->gzip, log);
+    }
+#endif
+
+    return ngx_write_fd(fd, buf, len);
+}
+
+
+static void
+ngx_stream_log_exit_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t             i;
+    ngx_list_part_t       *part;
+    ngx_open_file_t       *file;
+    ngx_stream_log_buf_t  *buffer;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    /*
+     * the thread pools are destroyed by now, so the buffers left
+     * are written here
+     */
+
+    part = &cycle->open_files.part;
+    file = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            file = part->elts;
+            i = 0;
+        }
+
+        if (file[i].flush != ngx_stream_log_flush) {
+            continue;
+        }
+
+        buffer = file[i].data;
+
+        if (buffer->writer == NULL) {
+            continue;
+        }
+
+        ngx_thread_writer_exit(buffer->writer, cycle->log);
+
+        buffer->writer = NULL;
+
+        ngx_stream_log_flush(&file[i], cycle->log);
+    }
+}
+
+#endif
+
+
 static u_char *
 ngx_stream_log_copy_short(ngx_stream_session_t *s, u_char *buf,
     ngx_stream_log_op_t *op)
@@ -983,6 +1203,11 @@ ngx_stream_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_stream_script_compile_t          sc;
     ngx_stream_log_main_conf_t          *lmcf;
     ngx_stream_compile_complex_value_t   ccv;
+#if (NGX_THREADS)
+    ngx_int_t                            sample;
+    ngx_uint_t                           overflow;
+    ngx_thread_pool_t                   *tp;
+#endif
 
     value = cf->args->elts;
 
@@ -1094,6 +1319,12 @@ process_formats:
     flush = 0;
     gzip = 0;
 
+#if (NGX_THREADS)
+    tp = NULL;
+    overflow = NGX_STREAM_LOG_OVERFLOW_BLOCK;
+    sample = 0;
+#endif
+
     for (i = 3; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
@@ -1159,6 +1390,78 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "thread", 6) == 0
+            && (value[i].len == 6 || value[i].data[6] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 6) {
+                tp = ngx_thread_pool_add(cf, NULL);
+
+            } else {
+                s.len = value[i].len - 7;
+                s.data = value[i].data + 7;
+
+                tp = ngx_thread_pool_add(cf, &s);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "overflow=", 9) == 0) {
+#if (NGX_THREADS)
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            if (ngx_strcmp(s.data, "block") == 0) {
+                overflow = NGX_STREAM_LOG_OVERFLOW_BLOCK;
+                continue;
+            }
+
+            if (ngx_strcmp(s.data, "drop") == 0) {
+                overflow = NGX_STREAM_LOG_OVERFLOW_DROP;
+                continue;
+            }
+
+            if (ngx_strcmp(s.data, "sample") == 0) {
+                overflow = NGX_STREAM_LOG_OVERFLOW_SAMPLE;
+                sample = 10;
+                continue;
+            }
+
+            if (ngx_strncmp(s.data, "sample:", 7) == 0) {
+                overflow = NGX_STREAM_LOG_OVERFLOW_SAMPLE;
+                sample = ngx_atoi(s.data + 7, s.len - 7);
+
+                if (sample > 0) {
+                    continue;
+                }
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid overflow policy \"%V\"", &s);
+            return NGX_CONF_ERROR;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1194,6 +1497,15 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_THREADS)
+    if (overflow != NGX_STREAM_LOG_OVERFLOW_BLOCK && tp == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "overflow policy requires \"thread\" "
+                           "for access_log \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     if (size) {
 
         if (log->script) {
@@ -1213,7 +1525,13 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+#if (NGX_THREADS)
+                || (buffer->writer ? buffer->writer->thread_pool : NULL) != tp
+                || buffer->overflow != overflow
+                || buffer->sample != (ngx_uint_t) sample
+#endif
+                )
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1254,6 +1572,22 @@ process_formats:
 
         buffer->gzip = gzip;
 
+#if (NGX_THREADS)
+        if (tp) {
+            buffer->writer = ngx_thread_writer_create(cf, log->file, tp, size,
+                                                NGX_STREAM_LOG_THREAD_BUFFERS);
+            if (buffer->writer == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->writer->write = ngx_stream_log_thread_write;
+            buffer->writer->data = buffer;
+
+            buffer->overflow = overflow;
+            buffer->sample = sample;
+        }
+#endif
+
         log->file->flush = ngx_stream_log_flush;
         log->file->data = buffer;
     }